@@ -182,6 +182,8 @@ struct FunctionDeclStmt : Stmt {
     std::vector<StmtPtr> params;
     StmtPtr body;
     int stack_size;
+    bool is_inline = false;   // Declared `inline`: inline wherever possible at -O1 and up
+    bool is_noinline = false; // Declared `noinline`: never inlined
 
     FunctionDeclStmt(Type rt, Token name, std::vector<StmtPtr> p, StmtPtr b, int stack);
     void accept(Visitor& visitor) const override;
@@ -0,0 +1,41 @@
+#ifndef CAPPUCCINO_BACKEND_H
+#define CAPPUCCINO_BACKEND_H
+
+#include "CompilerContext.h"
+#include "FunctionLayout.h"
+#include "IR.h"
+#include "InstructionSelector.h"
+#include "MachineIR.h"
+#include "Peephole.h"
+
+#include <map>
+#include <ostream>
+#include <string>
+
+// Turns an optimized IR module into an assembly file: instruction selection, register
+// allocation, frame lowering and peephole rewrites per function, then the functions main
+// reaches in call graph order, the module level data sections (with the profile counters
+// of an instrumented build) and the runtime routines that are called.
+class Backend {
+  public:
+    Backend(Module& p_mod, std::ostream& output, CompilerContext& p_ctx);
+
+    void generate();
+
+  private:
+    Module& mod;
+    std::ostream& out;
+    CompilerContext& ctx;
+
+    ModuleAsmData data;
+    PeepholeOptimizer peephole;
+    FunctionLayout layout;
+    std::map<std::string, std::string> function_text; // Symbol -> assembly
+
+    void emitFunction(std::ostream& os, const MachineFunction& mf);
+    void emitData();
+    // Counters of --profile-generate and the header the profile file starts with
+    void emitProfileData();
+};
+
+#endif // CAPPUCCINO_BACKEND_H
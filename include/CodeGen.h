@@ -2,16 +2,24 @@
 #define CAPPUCCINO_CODEGEN_H_
 
 #include "AbstractSyntaxTree.h"
+#include "FunctionLayout.h"
+#include "MachineIR.h"
+#include "Peephole.h"
+#include "SemanticAnalyzer.h"
 #include "Type.h"
 #include "Visitor.h"
 
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class CodeGen : public Visitor {
   public:
-    CodeGen(const Program& prog, std::ostream& output, CompilerContext& p_ctx);
+    CodeGen(const Program& prog, const SemanticInfo& p_sema, std::ostream& output,
+            CompilerContext& p_ctx);
 
     void generate();
 
@@ -39,28 +47,60 @@ class CodeGen : public Visitor {
 
   private:
     const Program& prog;
+    const SemanticInfo& sema;
 
     CompilerContext& ctx;
 
     std::ostream& out;
     int label_counter = 0;
     std::vector<std::pair<std::string, std::string>> string_literals;
+    std::unordered_map<std::string, std::string> string_labels; // Text -> label
+    // 8-byte constants loaded from __literal8, each distinct value once
+    std::vector<std::pair<std::string, uint64_t>> literals;
+    std::map<uint64_t, std::string> literal_labels;
     bool requires_bounds_panic = false;
+    bool requires_bounds_trap = false;
+    int bounds_checks = 0; // Emitted in the current function, for --bounds-report
 
-    Type current_type = TypeSystem::Int32;
     int current_func_stack_size = 0;
 
-    // State to track parameter index during function declaration
-    int current_param_index = 0;
+    // Instructions of the function being generated are parsed back into machine code and
+    // buffered here so the peephole rules can clean up the stack machine sequences
+    std::unique_ptr<MachineFunction> current_function;
+    MachineBlock* current_block = nullptr;
+    PeepholeOptimizer peephole;
+    int loop_depth = 0; // Loops around the code being generated
+
+    // Finished functions, emitted at the end in the order the call graph gives
+    FunctionLayout layout;
+    std::map<std::string, std::string> function_text; // Symbol -> assembly
 
     std::string nextLabel(const std::string& prefix);
     void emit(const std::string& instr);
     void emitLabel(const std::string& label);
+    // Sets `reg` (an x register) to `value` with moves, or loads it from the literal pool
+    // when that would take more than MAX_MOVE_STEPS instructions
+    void emitInteger(const std::string& reg, uint64_t value);
+    std::string literalLabel(uint64_t bits);
+    void flushFunction();
 
     // Helpers
     void visitAssignment(const BinaryExpr* expr);
     void genStmt(const Stmt* stmt);
     void genExpr(const Expr* expr);
+    // Evaluates the operands of a binary operator into x0 / x1 (d0 / d1)
+    void genOperands(const BinaryExpr* expr);
+    // Multiplies or divides by an integer literal with shifts and high multiplies instead
+    // of mul / sdiv / udiv, false when the operator and literal have no such sequence
+    bool genConstantOperand(const BinaryExpr* expr);
+    // Jumps to `target` when `expr` is true (`when`) or false, branching on the flags of
+    // the comparison instead of materializing it
+    void genCondBranch(const Expr* expr, const std::string& target, bool when);
+    void emitConversion(const ExprInfo& info);
+    // Emits the instruction behind a math builtin in place of a call, false for other calls
+    bool genBuiltin(const FunctionCallExpr* expr);
+    // Checks the index in x0 against `length` as selected by --bounds
+    void genBoundsCheck(int length);
 };
 
 #endif // CAPPUCCINO_CODEGEN_H_
@@ -1,6 +1,8 @@
 #ifndef COMPILERCONTEXT_H_
 #define COMPILERCONTEXT_H_
 
+#include "Profile.h"
+
 #include <string>
 #include <vector>
 
@@ -24,6 +26,14 @@ class DiagnosticEngine {
     void printDiagnostics();
 };
 
+// How array accesses are checked against their length
+enum class BoundsMode {
+    FULL,    // Check every access
+    HOISTED, // Drop checks proven in range and hoist loop-invariant ones (-O1 and up)
+    TRAP,    // Like HOISTED, failing checks trap inline instead of calling the error routine
+    OFF,     // No checks
+};
+
 struct CompilerOptions {
     // Input and Output
     std::vector<std::string> source_files;
@@ -38,7 +48,7 @@ struct CompilerOptions {
     // Debugging and Dumps
     bool show_tokens = false;
     bool show_ast = false;
-    /* bool dump_ir = false; // tentative */
+    bool dump_ir = false;
 
     // Diagnostics and Strictness
     bool warnings_as_errors = false;
@@ -50,16 +60,28 @@ struct CompilerOptions {
     std::vector<std::string> library_paths;
     */
 
-    /*
-    // Optimization (tentative)
-    int optimization_level = 0; // 0, 1, 2, 3
-    */
+    // Optimization
+    int optimization_level = 0; // 0 uses the AST code generator, 1 and up the IR pipeline
+    bool peephole = true;
+    std::vector<std::string> disabled_peepholes;
+    bool peephole_stats = false;
+    BoundsMode bounds_mode = BoundsMode::HOISTED;
+    bool bounds_report = false;
+    bool fast_math = false; // Lets float additions be reassociated, e.g. into vector sums
+    bool vectorize_report = false;
+    bool tail_call_report = false;
+    bool pure_call_report = false;
+    bool keep_frame_pointer = false; // Frame record in every function, for profilers
+    bool frame_report = false;
+    std::string profile_generate; // Profile written by the instrumented program, if set
+    std::string profile_use;      // Profile read back to guide the optimizations, if set
 };
 
 class CompilerContext {
   public:
     CompilerOptions options;
     DiagnosticEngine de;
+    ProfileData profile; // Loaded from options.profile_use
 };
 
 #endif
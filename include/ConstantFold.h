@@ -0,0 +1,26 @@
+#ifndef CAPPUCCINO_CONSTANTFOLD_H
+#define CAPPUCCINO_CONSTANTFOLD_H
+
+#include "IR.h"
+
+#include <vector>
+
+// Evaluates `inst` as if its operands were `operands`, returning the resulting constant,
+// or nullptr when the result is not known at compile time (non-constant operands, memory,
+// calls, control flow).
+//
+// Results are exactly what the generated code computes at run time: i64 arithmetic wraps,
+// SEXT / ZEXT truncate to the declared width of int8 .. uint64, division by zero gives
+// zero like sdiv / udiv, and float to int conversion saturates like fcvtzs.
+Value* fold_constant(const Instruction& inst, const std::vector<Value*>& operands,
+                     Module& mod);
+
+// Folds `inst` over its current operands
+Value* fold_constant(const Instruction& inst, Module& mod);
+
+// The operand an integer instruction passes through unchanged (`x + 0`, `x - 0`, `x * 1`,
+// `x | 0`, `x ^ 0`, `x & -1`, shifts by 0, division by 1), or nullptr. Float arithmetic is
+// left alone, `-0.0 + 0.0` is `+0.0`.
+Value* fold_identity(const Instruction& inst);
+
+#endif // CAPPUCCINO_CONSTANTFOLD_H
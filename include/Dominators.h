@@ -0,0 +1,40 @@
+#ifndef CAPPUCCINO_DOMINATORS_H
+#define CAPPUCCINO_DOMINATORS_H
+
+#include "IR.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Dominator tree over the blocks reachable from the entry (Cooper, Harvey and Kennedy's
+// iterative algorithm). Requires up to date predecessor lists.
+class DominatorTree {
+  public:
+    DominatorTree(Function& fn);
+
+    // Reverse post-order of the reachable blocks, the entry first
+    const std::vector<BasicBlock*>& rpo() const {
+        return order;
+    }
+
+    bool isReachable(BasicBlock* bb) const;
+    BasicBlock* idom(BasicBlock* bb) const;
+    const std::vector<BasicBlock*>& children(BasicBlock* bb) const;
+    bool dominates(BasicBlock* a, BasicBlock* b) const;
+    // True if `def` is available at `use` (same block: def comes first)
+    bool dominates(const Instruction* def, const Instruction* use) const;
+
+    // Dominance frontier of every reachable block
+    std::unordered_map<BasicBlock*, std::vector<BasicBlock*>> frontiers() const;
+
+  private:
+    std::vector<BasicBlock*> order;
+    std::unordered_map<BasicBlock*, int> rpo_index;
+    std::unordered_map<BasicBlock*, BasicBlock*> idoms;
+    std::unordered_map<BasicBlock*, std::vector<BasicBlock*>> tree_children;
+    std::unordered_map<BasicBlock*, std::pair<int, int>> dfs_range;
+
+    BasicBlock* intersect(BasicBlock* a, BasicBlock* b) const;
+};
+
+#endif // CAPPUCCINO_DOMINATORS_H
@@ -0,0 +1,60 @@
+#ifndef CAPPUCCINO_FRAMELOWERING_H
+#define CAPPUCCINO_FRAMELOWERING_H
+
+#include "MachineIR.h"
+
+#include <unordered_set>
+
+// Lays out the stack frame of an allocated machine function, inserts the prologue and
+// epilogues, and rewrites frame indices into legal sp-relative addressing.
+//
+// Frame objects that are never live at the same time share space.
+//
+// Frame layout, growing downwards:
+//   [x29 + 0]   saved x29, x30 (only when the function makes calls, or with --frame-pointer)
+//   [x29 - 16]  callee-saved register pairs
+//   [sp + N]    locals and spill slots, addressed from sp
+//
+// A leaf function without locals or callee-saved registers gets no frame at all. Otherwise
+// the prologue is shrink-wrapped into the part of the function that needs it.
+class FrameLowering {
+  public:
+    FrameLowering(MachineFunction& p_mf, bool p_keep_frame_pointer = false);
+
+    void run();
+
+    int frameSize() const {
+        return locals_size;
+    }
+    // Size the locals and spill slots would take without sharing space
+    int unsharedSize() const {
+        return unshared_size;
+    }
+
+  private:
+    MachineFunction& mf;
+    bool keep_frame_pointer;
+    int locals_size = 0;
+    int unshared_size = 0;
+
+    bool frame_record = false;          // Saves x29 / x30 and points x29 at them
+    MachineBlock* save_block = nullptr; // Gets the prologue, none for a frameless leaf
+    // Blocks dominated by save_block when the prologue was moved out of the entry
+    std::unordered_set<MachineBlock*> region;
+    int exit_count = 0;
+
+    void layoutObjects();
+    void placeSaves();
+    void insertPrologue();
+    void insertEpilogues();
+    void eliminateFrameIndices();
+
+    bool needsFrame(MachineBlock& mb);
+    std::vector<MachineInstr> makeEpilogue();
+
+    // Emits `dst = base + imm`, going through `scratch` when imm is not encodable
+    void emitAddImmediate(std::vector<MachineInstr>& out, const std::string& opcode, MReg dst,
+                          MReg base, int64_t imm, MReg scratch);
+};
+
+#endif // CAPPUCCINO_FRAMELOWERING_H
@@ -0,0 +1,41 @@
+#ifndef CAPPUCCINO_FUNCTIONLAYOUT_H
+#define CAPPUCCINO_FUNCTIONLAYOUT_H
+
+#include "MachineIR.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Whole-program call graph over the finished functions of a module, built from their `bl`
+// and tail call `b` instructions. Decides which functions are emitted and in which order:
+// only what `_main` can reach, with callers and callees that call each other the most
+// placed next to each other (Pettis and Hansen's closest-is-best ordering), and functions
+// a profile shows never running at the end.
+class FunctionLayout {
+  public:
+    // Records the calls made by `mf`, emitted under the symbol `_<name>`. A call site
+    // weighs as many times as the profile measured it running, or else as the loops
+    // around it are estimated to run it.
+    void addFunction(const MachineFunction& mf);
+
+    // Symbols of the functions reachable from `_main`, in emission order
+    std::vector<std::string> order() const;
+    // Symbols outside the module called from reachable functions (stdlib, libc, libm)
+    std::set<std::string> externalCallees() const;
+    // Every symbol reachable functions branch to or take the address of: string literals,
+    // pooled constants, the shared bounds check routines
+    std::set<std::string> referencedSymbols() const;
+
+  private:
+    // Caller -> callee -> estimated calls per call of the caller
+    std::map<std::string, std::map<std::string, double>> calls;
+    std::map<std::string, std::set<std::string>> references;
+    std::vector<std::string> defined; // In the order they were added
+    std::set<std::string> cold;       // Never called while the profile was taken
+
+    std::set<std::string> reachable() const;
+};
+
+#endif // CAPPUCCINO_FUNCTIONLAYOUT_H
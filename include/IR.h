@@ -0,0 +1,315 @@
+#ifndef CAPPUCCINO_IR_H
+#define CAPPUCCINO_IR_H
+
+#include "Type.h"
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Typed SSA intermediate representation.
+//
+// Integers (and pointers) always live in 64-bit values, sign or zero extended from their
+// declared width exactly like the AST code generator keeps them in x0. Narrow widths only
+// exist on memory accesses and on explicit SEXT/ZEXT re-extensions.
+//
+// V128 values only come out of the loop vectorizer: 128 bits holding 4 x 32 or 2 x 64 bit
+// lanes, with `mem` of every vector instruction giving the lane type. The integer and
+// float arithmetic opcodes also apply lane-wise to them, integer lanes keeping the low bits
+// of the i64 value they stand for.
+
+enum class IRType { VOID, I64, F32, F64, V128 };
+
+std::string ir_type_name(IRType t);
+IRType ir_type_of(const Type& t);
+
+enum class ValueKind { CONSTANT_INT, CONSTANT_FLOAT, ARGUMENT, GLOBAL_STRING, INSTRUCTION };
+
+enum class Opcode {
+    // Integer arithmetic on i64
+    ADD,
+    SUB,
+    MUL,
+    SDIV,
+    UDIV,
+    NEG,
+    ABS, // Wraps on the most negative value
+    SHL,
+    LSHR,
+    ASHR,
+    AND,
+    OR,
+    XOR,
+
+    // Floating point arithmetic on f32 / f64
+    FADD,
+    FSUB,
+    FMUL,
+    FDIV,
+    FNEG,
+    FABS,
+    FSQRT,
+    FMIN, // NaN operands are ignored, as in C's fmin / fmax
+    FMAX,
+    FFLOOR,
+    FCEIL,
+    FROUND, // Halfway cases away from zero
+
+    // Comparisons producing an i64 0 or 1
+    ICMP,
+    FCMP,
+
+    // Conversions
+    SEXT, // Re-extend the low `mem.size` bytes as signed
+    ZEXT, // Re-extend the low `mem.size` bytes as unsigned
+    SITOFP,
+    FPTOSI,
+    FPEXT,
+    FPTRUNC,
+
+    // Memory
+    FRAME_ADDR, // Address of a stack slot
+    LOAD,
+    STORE,
+    BOUNDS_CHECK, // Traps unless operand 0 (unsigned) < imm
+    PROFILE_INC,  // Adds one to the profile counter at byte offset imm
+
+    // Vectors
+    VLOAD,   // Consecutive lanes from an address
+    VSTORE,  // Operand 0 to consecutive lanes at the address in operand 1
+    VSPLAT,  // Every lane set to a scalar
+    VREDUCE, // Sum of the lanes as a scalar
+    VWIDEN,  // Adjacent pairs of 32-bit lanes added into 64-bit lanes, mem is the source lane
+
+    CALL,
+    PHI,
+
+    // Terminators
+    BR,
+    COND_BR,
+    RET,
+    UNREACHABLE,
+};
+
+const char* opcode_name(Opcode op);
+
+// Integer predicates are signed unless prefixed with U. For FCMP the predicates are ordered,
+// except NE which is also true for unordered operands (C semantics of != on NaN).
+enum class Cond { EQ, NE, LT, LE, GT, GE, ULT, ULE, UGT, UGE };
+
+const char* cond_name(Cond c);
+Cond cond_inverse(Cond c);
+Cond cond_swapped(Cond c);
+
+// Width and interpretation of a memory access or re-extension
+struct MemType {
+    int size = 8;
+    bool is_signed = true;
+    bool is_float = false;
+
+    bool operator==(const MemType& other) const = default;
+};
+
+MemType mem_type_of(const Type& t);
+std::string mem_type_name(const MemType& m);
+
+class BasicBlock;
+class Function;
+class Module;
+
+// What a function can do besides computing its result, ordered from most to least effects
+enum class Purity {
+    IMPURE,    // May write memory outside its own frame or call into I/O
+    READ_ONLY, // May read memory it was handed pointers to
+    PURE,      // Only touches its own frame and calls pure functions
+};
+
+class Value {
+  public:
+    ValueKind kind;
+    IRType type;
+
+    Value(ValueKind k, IRType t) : kind(k), type(t) {}
+    virtual ~Value() = default;
+
+    bool isConstant() const {
+        return kind == ValueKind::CONSTANT_INT || kind == ValueKind::CONSTANT_FLOAT;
+    }
+};
+
+class ConstantInt : public Value {
+  public:
+    int64_t value;
+
+    ConstantInt(int64_t v) : Value(ValueKind::CONSTANT_INT, IRType::I64), value(v) {}
+};
+
+class ConstantFloat : public Value {
+  public:
+    double value; // Already rounded to float precision for F32
+
+    ConstantFloat(double v, IRType t) : Value(ValueKind::CONSTANT_FLOAT, t), value(v) {}
+};
+
+class Argument : public Value {
+  public:
+    std::string name;
+    int index;
+    MemType mem; // Declared width, only the low bytes are meaningful on entry
+
+    Argument(IRType t, std::string n, int idx, MemType m)
+        : Value(ValueKind::ARGUMENT, t), name(std::move(n)), index(idx), mem(m) {}
+};
+
+// Address of a string literal
+class GlobalString : public Value {
+  public:
+    std::string label;
+    std::string text; // Escaped exactly as written in the source
+
+    GlobalString(std::string l, std::string t)
+        : Value(ValueKind::GLOBAL_STRING, IRType::I64), label(std::move(l)), text(std::move(t)) {}
+};
+
+// A named region of the frame: a local variable, array or object
+struct StackSlot {
+    int id;
+    std::string name;
+    int size;
+    int align;
+    Type var_type;
+    int frame_offset; // Offset assigned by the parser, used to map identifiers to slots
+};
+
+class Instruction : public Value {
+  public:
+    Opcode op;
+    std::vector<Value*> operands;
+
+    // Branch targets for BR / COND_BR (true target first), incoming blocks for PHI
+    std::vector<BasicBlock*> blocks;
+
+    Cond cond = Cond::EQ;      // ICMP / FCMP
+    MemType mem;               // LOAD / STORE / SEXT / ZEXT, lane type of vector instructions
+    StackSlot* slot = nullptr; // FRAME_ADDR
+    std::string callee;        // CALL
+    int64_t imm = 0;           // BOUNDS_CHECK length, PROFILE_INC counter offset
+    double taken = -1;         // COND_BR: measured probability of the true edge, -1 if unknown
+
+    BasicBlock* parent = nullptr;
+    int id = -1; // Assigned by Function::renumber for printing
+
+    Instruction(Opcode o, IRType t, std::vector<Value*> ops = {})
+        : Value(ValueKind::INSTRUCTION, t), op(o), operands(std::move(ops)) {}
+
+    bool isTerminator() const;
+    // True if removing the instruction could change observable behaviour
+    bool hasSideEffects() const;
+};
+
+class BasicBlock {
+  public:
+    std::string name;
+    std::list<std::unique_ptr<Instruction>> insts;
+    Function* parent = nullptr;
+
+    // Maintained by Function::rebuildCFG
+    std::vector<BasicBlock*> preds;
+
+    // Executions measured by --profile-use, -1 if unknown
+    int64_t profile_count = -1;
+
+    BasicBlock(std::string n, Function* f) : name(std::move(n)), parent(f) {}
+
+    Instruction* terminator() const;
+    std::vector<BasicBlock*> successors() const;
+
+    Instruction* append(std::unique_ptr<Instruction> inst);
+    // Inserts before the terminator, or at the end if the block is still open
+    Instruction* insertBeforeTerminator(std::unique_ptr<Instruction> inst);
+    Instruction* insertAtFront(std::unique_ptr<Instruction> inst);
+    Instruction* insertBefore(Instruction* pos, std::unique_ptr<Instruction> inst);
+    void erase(Instruction* inst);
+
+    std::list<std::unique_ptr<Instruction>>::iterator find(Instruction* inst);
+};
+
+class Function {
+  public:
+    std::string name;
+    IRType return_type;
+    Type lang_return_type;
+    std::vector<std::unique_ptr<Argument>> args;
+    std::vector<std::unique_ptr<BasicBlock>> blocks;
+    std::vector<std::unique_ptr<StackSlot>> slots;
+    Module* parent = nullptr;
+
+    bool is_inline = false;         // From the `inline` specifier
+    bool is_noinline = false;       // From the `noinline` specifier
+    Purity purity = Purity::IMPURE; // Computed by PureCallPass
+
+    Function(std::string n, IRType rt, Type lang_rt, Module* m)
+        : name(std::move(n)), return_type(rt), lang_return_type(std::move(lang_rt)), parent(m) {}
+
+    BasicBlock* entry() const {
+        return blocks.front().get();
+    }
+
+    BasicBlock* createBlock(const std::string& hint);
+    StackSlot* createSlot(const std::string& name, const Type& type, int frame_offset);
+    void removeBlock(BasicBlock* bb);
+    void removeSlot(StackSlot* slot);
+
+    // Recomputes predecessor lists from the terminators
+    void rebuildCFG();
+    // Deletes blocks not reachable from the entry and their phi inputs, returns how many
+    int removeUnreachableBlocks();
+    void replaceAllUses(Value* from, Value* to);
+    // Number of operand references to `v` across the function
+    int countUses(const Value* v) const;
+    void renumber();
+
+  private:
+    int block_counter = 0;
+    int slot_counter = 0;
+};
+
+// A function instrumented by --profile-generate and the range of counters it owns
+struct ProfiledFunction {
+    std::string name;
+    uint64_t checksum;
+    int first_counter;
+    int num_counters;
+};
+
+class Module {
+  public:
+    std::vector<std::unique_ptr<Function>> functions;
+    std::vector<std::unique_ptr<GlobalString>> strings;
+    std::vector<ProfiledFunction> profiled; // In counter order
+
+    ConstantInt* constInt(int64_t v);
+    ConstantFloat* constFloat(double v, IRType t);
+    // Zero of the given type, used for reads of never-written variables
+    Value* zero(IRType t);
+    // The literal holding `text`, each distinct text is created once
+    GlobalString* createString(const std::string& text);
+
+    Function* findFunction(const std::string& name) const;
+
+  private:
+    std::map<int64_t, std::unique_ptr<ConstantInt>> int_constants;
+    std::map<std::pair<uint64_t, IRType>, std::unique_ptr<ConstantFloat>> float_constants;
+    std::map<std::string, GlobalString*> interned_strings;
+};
+
+// Textual form used by --dump-ir
+void print_value_ref(std::ostream& os, const Value* v);
+void print_function(std::ostream& os, Function& fn);
+void print_module(std::ostream& os, Module& mod);
+
+#endif // CAPPUCCINO_IR_H
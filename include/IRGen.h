@@ -0,0 +1,74 @@
+#ifndef CAPPUCCINO_IRGEN_H
+#define CAPPUCCINO_IRGEN_H
+
+#include "AbstractSyntaxTree.h"
+#include "CompilerContext.h"
+#include "IR.h"
+#include "SemanticAnalyzer.h"
+#include "Visitor.h"
+
+#include <memory>
+#include <unordered_map>
+
+// Lowers the analyzed AST into SSA IR. Every variable starts out as a stack slot accessed
+// through explicit loads and stores, Mem2Reg later promotes the scalar ones to SSA values.
+class IRGen : public Visitor {
+  public:
+    IRGen(const SemanticInfo& p_sema, CompilerContext& p_ctx);
+
+    std::unique_ptr<Module> generate(const Program& prog);
+
+    // Visitor Implementation
+    void visitLiteralExpr(const LiteralExpr* expr) override;
+    void visitIdentifierExpr(const IdentifierExpr* expr) override;
+    void visitUnaryExpr(const UnaryExpr* expr) override;
+    void visitBinaryExpr(const BinaryExpr* expr) override;
+    void visitGroupingExpr(const GroupingExpr* expr) override;
+    void visitFunctionCallExpr(const FunctionCallExpr* expr) override;
+    void visitArrayAccessExpr(const ArrayAccessExpr* expr) override;
+    void visitArrayLiteralExpr(const ArrayLiteralExpr* expr) override;
+    void visitPropertyAccessExpr(const PropertyAccessExpr* expr) override;
+
+    void visitExprStmt(const ExprStmt* stmt) override;
+    void visitVariableDeclStmt(const VariableDeclStmt* stmt) override;
+    void visitBlockStmt(const BlockStmt* stmt) override;
+    void visitIfStmt(const IfStmt* stmt) override;
+    void visitWhileStmt(const WhileStmt* stmt) override;
+    void visitForStmt(const ForStmt* stmt) override;
+    void visitReturnStmt(const ReturnStmt* stmt) override;
+    void visitFunctionParameterStmt(const FunctionParameterStmt* stmt) override;
+    void visitFunctionDeclStmt(const FunctionDeclStmt* stmt) override;
+    void visitClassDeclStmt(const ClassDeclStmt* stmt) override;
+
+  private:
+    const SemanticInfo& sema;
+    CompilerContext& ctx;
+
+    std::unique_ptr<Module> module;
+    Function* fn = nullptr;
+    BasicBlock* block = nullptr;
+
+    // Result of the expression currently being visited
+    Value* current = nullptr;
+
+    // Stack slots of the current function, keyed by the parser's frame offset
+    std::unordered_map<int, StackSlot*> slots;
+
+    Value* genExpr(const Expr* expr);
+    void genStmt(const Stmt* stmt);
+    // Evaluates a condition into an i64 that is non-zero when true
+    Value* genCondition(const Expr* expr);
+
+    Instruction* emit(Opcode op, IRType type, std::vector<Value*> operands = {});
+    void branch(BasicBlock* target);
+    void condBranch(Value* cond, BasicBlock* if_true, BasicBlock* if_false);
+    void startBlock(BasicBlock* bb);
+
+    StackSlot* slotFor(int frame_offset);
+    Value* frameAddr(int frame_offset);
+    Value* elementAddr(int frame_offset, Value* index, int element_size);
+    Value* load(Value* addr, const Type& type);
+    void store(Value* value, Value* addr, const Type& type);
+};
+
+#endif // CAPPUCCINO_IRGEN_H
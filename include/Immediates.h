@@ -0,0 +1,42 @@
+#ifndef CAPPUCCINO_IMMEDIATES_H
+#define CAPPUCCINO_IMMEDIATES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One instruction of a sequence that builds a 64-bit integer in a register
+struct MoveStep {
+    enum class Kind {
+        MOVZ, // imm << shift
+        MOVN, // ~(imm << shift)
+        MOVK, // Replaces the 16 bits at `shift` with imm, keeping the others
+        ORR,  // orr dst, xzr, #imm with a bitmask immediate
+    };
+
+    Kind kind;
+    uint64_t imm;
+    int shift = 0;
+};
+
+// The shortest sequence building `value`: one orr for a repeating bit pattern, otherwise a
+// movz (or a movn when most 16-bit chunks are all ones) followed by a movk for every chunk
+// that is still wrong
+std::vector<MoveStep> integer_move_sequence(uint64_t value);
+
+// Longer sequences are loaded from the literal pool instead
+constexpr size_t MAX_MOVE_STEPS = 3;
+
+// Assembly text of a step writing the 64-bit register `dst`
+std::string move_step_text(const MoveStep& step, const std::string& dst);
+
+// Encodable as the immediate of add / sub / cmp (12 bits, optionally shifted by 12)
+bool is_arith_immediate(int64_t v);
+// Encodable as the bitmask immediate of and / orr / eor
+bool is_logical_immediate(uint64_t v);
+
+// Whether fmov can load `value` as an immediate, +-(16..31)/16 * 2^(-3..4) like 0.5, 1.0
+// or 2.5. Zero is not one of them, movi sets it.
+bool is_fmov_immediate(double value);
+
+#endif // CAPPUCCINO_IMMEDIATES_H
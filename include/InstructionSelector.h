@@ -0,0 +1,123 @@
+#ifndef CAPPUCCINO_INSTRUCTIONSELECTOR_H
+#define CAPPUCCINO_INSTRUCTIONSELECTOR_H
+
+#include "CompilerContext.h"
+#include "Dominators.h"
+#include "IR.h"
+#include "Immediates.h"
+#include "MachineIR.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// A constant too expensive to build with moves, loaded from a literal section
+struct PoolLiteral {
+    std::string label;
+    uint64_t bits;
+    int size; // 4 or 8
+};
+
+// Module level data collected while selecting instructions for each function
+struct ModuleAsmData {
+    // Each distinct constant once, shared by every function loading it
+    std::vector<PoolLiteral> literals;
+    std::map<std::pair<int, uint64_t>, std::string> literal_labels;
+    bool requires_bounds_panic = false;
+    bool requires_bounds_trap = false;
+};
+
+// Physical registers clobbered by a call under AAPCS64 (x18 is reserved on Darwin)
+std::vector<MReg> caller_saved_regs();
+
+// Lowers one IR function to AArch64 machine code over virtual registers. Phi nodes are
+// replaced by copies at the end of the predecessors, after splitting critical edges.
+//
+// Selection covers expression trees rather than single instructions: a pure instruction
+// with a single use later in the same block is deferred, and its user may fold it into
+// an addressing mode, a shifted operand, an immediate or a fused multiply-add. Deferred
+// instructions nobody folds are emitted on first use.
+class InstructionSelector {
+  public:
+    InstructionSelector(Function& p_fn, ModuleAsmData& p_data, const CompilerOptions& p_options);
+
+    std::unique_ptr<MachineFunction> run();
+
+  private:
+    Function& fn;
+    ModuleAsmData& data;
+    const CompilerOptions& options;
+    std::unique_ptr<MachineFunction> mf;
+    MachineBlock* mb = nullptr;
+
+    std::unordered_map<const Value*, MReg> vregs;
+    std::unordered_map<const BasicBlock*, MachineBlock*> blocks;
+    std::unordered_map<const StackSlot*, int> slot_objects;
+
+    std::unordered_map<const Value*, int> use_counts;
+    std::unordered_set<const Instruction*> deferred;
+    // Induction variable updates computed in their phi's register by the phi copies
+    std::unordered_set<const Instruction*> in_place;
+    // Register of each argument per successor region of the entry (nullptr: everywhere else)
+    std::map<std::pair<const Value*, const BasicBlock*>, MReg> arg_copies;
+    std::unordered_map<const BasicBlock*, const BasicBlock*> arg_region;
+
+    void splitCriticalEdges();
+    bool needsEdgeSplit(BasicBlock* from, BasicBlock* target, BasicBlock* other) const;
+    // True if selecting `v` at the end of its block reads a phi of `target`
+    bool readsPhisAtBranch(const Value* v, const BasicBlock* target) const;
+    void findInPlaceIncrements();
+    // Gives arguments a register of their own in each region after the entry that reads
+    // them, so a value kept across calls on one path is not copied in front of an early
+    // return on the other, which frame lowering could then leave without a frame
+    void splitArgumentRanges(const DominatorTree& dt);
+
+    bool isDeferrable(const Instruction& inst) const;
+    // The deferred instruction computing `v` if it has opcode `op`, without claiming it
+    const Instruction* peek(const Value* v, Opcode op) const;
+    // Claims a deferred instruction, its result is now computed by the folding user
+    void claim(const Instruction* inst);
+
+    MachineOperand selectAddress(const Value* addr, int size);
+    // Matches `v` against a constant shift usable as a shifted register operand
+    const Instruction* foldShift(const Value* v);
+
+    MReg vregFor(const Value* v);
+    // Returns a register holding `v`, materializing constants and string addresses
+    MReg use(const Value* v);
+    void materialize(const Value* v, MReg dst);
+    // Loads `bits` from the literal pool, adding it there on first use
+    void loadLiteral(MReg dst, char view, uint64_t bits, int size);
+
+    void emit(const std::string& opcode, std::vector<MachineOperand> ops);
+    void emitCopy(MReg dst, MReg src, IRType type);
+    void emitPhiCopies(const BasicBlock* from);
+
+    void select(const Instruction& inst);
+    void selectAddSub(const Instruction& inst);
+    void selectMultiply(const Instruction& inst);
+    void selectDivide(const Instruction& inst);
+    void selectLogical(const Instruction& inst);
+    // Emits the flag setting comparison, returns the condition to test (operands may swap)
+    Cond selectCompare(const Instruction& inst);
+    // Branches to `target` when `cond` holds, or when it does not if `negate` is set. A
+    // deferred comparison feeds b.cond directly, a test against zero becomes cbz / cbnz /
+    // tbz / tbnz.
+    void selectCondBranch(const Value* cond, bool negate, MachineBlock* target);
+    // The call ending `bb` that returns straight to the caller's caller, if any
+    const Instruction* tailCall(const BasicBlock& bb) const;
+    // A tail call branches after the epilogue instead of returning
+    void selectCall(const Instruction& inst, bool is_tail = false);
+    void selectLoad(const Instruction& inst);
+    void selectStore(const Instruction& inst);
+    // NEON lowering of the v128 instructions of the loop vectorizer
+    void selectVector(const Instruction& inst);
+};
+
+char view_of(IRType t);
+RegClass class_of(IRType t);
+
+#endif // CAPPUCCINO_INSTRUCTIONSELECTOR_H
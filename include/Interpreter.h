@@ -0,0 +1,46 @@
+#ifndef CAPPUCCINO_INTERPRETER_H
+#define CAPPUCCINO_INTERPRETER_H
+
+#include "IR.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Executes calls to pure functions at compile time. Arithmetic goes through fold_constant,
+// so every result is exactly what the generated code computes. Each call gets a zeroed
+// frame holding its stack slots, and loads and stores may only touch live frames.
+//
+// Evaluation gives up, leaving the call to run time, on anything it cannot reproduce: a
+// failing bounds check, a call to a function that is not pure or not defined in the module
+// (libm results differ between hosts), vector code, and calls running out of steps or
+// recursion depth.
+class Interpreter {
+  public:
+    explicit Interpreter(Module& p_mod) : mod(p_mod) {}
+
+    // Evaluates `fn` on constant `args`. On success `result` is the returned constant, owned
+    // by the module and wrapped to the function's return type, or nullptr for a void function.
+    bool call(Function& fn, const std::vector<Value*>& args, Value*& result);
+
+  private:
+    struct Frame {
+        int index; // Position on the interpreter's call stack
+        std::vector<uint8_t> memory;
+        std::unordered_map<const StackSlot*, int64_t> offsets;
+        std::unordered_map<const Value*, Value*> values;
+    };
+
+    Module& mod;
+    std::unique_ptr<Module> scratch; // Intermediate constants of the current evaluation
+    std::vector<std::unique_ptr<Frame>> frames;
+    long steps = 0;
+
+    bool run(Function& fn, const std::vector<Value*>& args, Value*& result);
+    bool execute(Function& fn, Frame& frame, Value*& result);
+    bool evaluate(Frame& frame, const Instruction& inst);
+    Value* get(Frame& frame, Value* v);
+    uint8_t* access(const Value* addr, int size);
+};
+
+#endif // CAPPUCCINO_INTERPRETER_H
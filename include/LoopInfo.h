@@ -0,0 +1,63 @@
+#ifndef CAPPUCCINO_LOOPINFO_H
+#define CAPPUCCINO_LOOPINFO_H
+
+#include "Dominators.h"
+#include "IR.h"
+
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// A natural loop: a header that dominates the sources of its back edges (the latches), and
+// every block that reaches a latch without going through the header
+struct Loop {
+    BasicBlock* header = nullptr;
+    std::vector<BasicBlock*> blocks; // Header first, then reverse post-order
+    std::unordered_set<BasicBlock*> block_set;
+    std::vector<BasicBlock*> latches;
+
+    Loop* parent = nullptr;
+    std::vector<Loop*> children;
+    int depth = 1;
+
+    bool contains(const BasicBlock* bb) const {
+        return block_set.count(const_cast<BasicBlock*>(bb)) > 0;
+    }
+    // True for values computed outside the loop: constants, arguments and instructions
+    // whose block is not part of it
+    bool isInvariant(const Value* v) const;
+
+    // The single predecessor of the header outside the loop if its only successor is the
+    // header, nullptr otherwise
+    BasicBlock* preheader() const;
+};
+
+// Natural loops of a function, with loops sharing a header merged. Requires up to date
+// predecessor lists.
+class LoopInfo {
+  public:
+    LoopInfo(const DominatorTree& dt);
+
+    // Every loop, outer loops before the loops nested in them
+    const std::vector<std::unique_ptr<Loop>>& loops() const {
+        return all;
+    }
+    // The innermost loop containing `bb`, nullptr outside of loops
+    Loop* loopFor(const BasicBlock* bb) const;
+
+  private:
+    std::vector<std::unique_ptr<Loop>> all;
+    std::unordered_map<const BasicBlock*, Loop*> innermost;
+};
+
+// Returns the preheader of `loop`, first inserting one in front of the header when the loop
+// is entered from several blocks or from a block that also branches elsewhere. Entry
+// values of the header phis move into the new block. Dominator trees and loop info of
+// `fn` must be recomputed when a block was inserted.
+BasicBlock* ensure_preheader(Function& fn, Loop& loop);
+
+// Moves `inst` to the end of `preheader`, right before its branch into the loop
+void hoist_to_preheader(Instruction* inst, BasicBlock* preheader);
+
+#endif // CAPPUCCINO_LOOPINFO_H
@@ -0,0 +1,180 @@
+#ifndef CAPPUCCINO_MACHINEIR_H
+#define CAPPUCCINO_MACHINEIR_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// AArch64 machine code between instruction selection and assembly emission. Operands may
+// name virtual registers until register allocation rewrites them to physical ones.
+
+enum class RegClass { GPR, FPR };
+
+// Physical register numbers: x0..x30 / d0..d31, plus the two special GPR encodings
+constexpr int REG_SP = 31;
+constexpr int REG_ZR = 32;
+constexpr int REG_FP = 29;
+constexpr int REG_LR = 30;
+
+struct MReg {
+    int id = -1;
+    bool is_virtual = false;
+    RegClass cls = RegClass::GPR;
+
+    bool valid() const {
+        return id >= 0;
+    }
+    bool operator==(const MReg& other) const = default;
+
+    static MReg phys(int id, RegClass cls = RegClass::GPR) {
+        return MReg{.id = id, .is_virtual = false, .cls = cls};
+    }
+    static MReg virt(int id, RegClass cls) {
+        return MReg{.id = id, .is_virtual = true, .cls = cls};
+    }
+};
+
+enum class AddrMode {
+    OFFSET,      // [base, #imm]
+    PRE_INDEX,   // [base, #imm]!
+    POST_INDEX,  // [base], #imm
+    REG_OFFSET,  // [base, index, lsl #shift]
+    PAGE_OFFSET, // [base, symbol@PAGEOFF]
+};
+
+class MachineBlock;
+
+struct MachineOperand {
+    enum class Kind { REG, IMM, FIMM, BLOCK, SYMBOL, TEXT, MEM, FRAME_INDEX };
+
+    Kind kind = Kind::IMM;
+
+    // REG: `view` picks the printed width, 'x' / 'w' for GPRs and 'd' / 's' / 'q' for FPRs,
+    // 'v' for a vector register whose arrangement or lane (".4s", ".d[0]") is in `text`
+    MReg reg;
+    char view = 'x';
+    bool is_def = false;
+    bool is_use = false;
+
+    int64_t imm = 0; // IMM, FRAME_INDEX addend, MEM displacement
+    double fimm = 0.0;
+    MachineBlock* block = nullptr;
+    std::string text; // SYMBOL, TEXT, PAGE_OFFSET symbol
+
+    // MEM
+    AddrMode mode = AddrMode::OFFSET;
+    MReg index;
+    int shift = 0;
+    int frame_index = -1; // Base is the frame object instead of `reg` until frame lowering
+
+    static MachineOperand def(MReg r, char view);
+    static MachineOperand use(MReg r, char view);
+    static MachineOperand defVector(MReg r, const std::string& arrangement);
+    static MachineOperand useVector(MReg r, const std::string& arrangement);
+    static MachineOperand immediate(int64_t v);
+    static MachineOperand floatImmediate(double v);
+    static MachineOperand label(MachineBlock* b);
+    static MachineOperand symbol(const std::string& s);
+    static MachineOperand raw(const std::string& s);
+    static MachineOperand frameIndex(int index, int64_t addend = 0);
+    static MachineOperand mem(MReg base, int64_t offset = 0, AddrMode mode = AddrMode::OFFSET);
+    static MachineOperand memIndex(MReg base, MReg index, int shift);
+    static MachineOperand memFrame(int index, int64_t offset = 0);
+    static MachineOperand memPage(MReg base, const std::string& symbol);
+};
+
+struct MachineInstr {
+    std::string opcode;
+    std::vector<MachineOperand> ops;
+
+    // Registers read or clobbered without appearing in the operand list (calls, returns)
+    std::vector<MReg> implicit_uses;
+    std::vector<MReg> implicit_defs;
+
+    bool is_call = false;
+    // `b` to another function in place of `bl` + `ret`, the epilogue goes in front of it
+    bool is_tail_call = false;
+
+    // Assembler text the parser could not model (directives, unknown syntax), printed back
+    // verbatim from `opcode`
+    bool is_opaque = false;
+
+    MachineInstr(std::string op, std::vector<MachineOperand> operands = {})
+        : opcode(std::move(op)), ops(std::move(operands)) {}
+
+    bool isBranch() const;
+    bool isUnconditionalBranch() const;
+    bool isReturn() const;
+    bool isTerminator() const;
+    MachineBlock* branchTarget() const;
+
+    // Visits every register operand, including registers inside memory operands.
+    // Memory bases and indices are uses, writeback bases are also defs.
+    void forEachReg(const std::function<void(MReg& reg, bool is_def, bool is_use)>& fn);
+};
+
+class MachineBlock {
+  public:
+    std::string label;
+    std::vector<MachineInstr> insts;
+    std::vector<MachineBlock*> succs;
+    std::vector<MachineBlock*> preds;
+    int loop_depth = 0;
+    int align = 0; // log2 of the alignment padded to in front of the block
+    int64_t profile_count = -1; // Executions measured by --profile-use, -1 if unknown
+
+    MachineBlock(std::string l) : label(std::move(l)) {}
+};
+
+// log2 of the alignment of innermost loop headers: 16 bytes, one fetch block
+constexpr int LOOP_ALIGNMENT = 4;
+
+struct FrameObject {
+    int size;
+    int align;
+    int offset = -1; // From sp after the prologue, assigned by frame lowering
+    bool is_spill = false;
+};
+
+class MachineFunction {
+  public:
+    std::string name;
+    std::vector<std::unique_ptr<MachineBlock>> blocks;
+    std::vector<FrameObject> frame_objects;
+    std::vector<RegClass> vreg_classes;
+    std::vector<bool> vreg_is_vector; // FPR vregs holding all 128 bits, spilled as q registers
+    // Copies into and out of phi registers as (destination, source) vregs, merged by the
+    // register allocator where their live ranges allow
+    std::vector<std::pair<int, int>> phi_copies;
+
+    bool has_calls = false;
+    std::vector<int> used_callee_saved_gpr;
+    std::vector<int> used_callee_saved_fpr;
+
+    MachineFunction(std::string n) : name(std::move(n)) {}
+
+    MachineBlock* createBlock(const std::string& label);
+    MReg createVReg(RegClass cls, bool is_vector = false);
+    int createFrameObject(int size, int align, bool is_spill = false);
+
+    // Recomputes succs / preds from the branch instructions and layout order
+    void rebuildCFG();
+};
+
+// The condition code that holds exactly when `cc` does not, e.g. "mi" -> "pl". Inverting
+// the flag test rather than the comparison keeps unordered float compares on the side of
+// the false predicate.
+std::string invert_cond_code(const std::string& cc);
+
+std::string reg_name(const MReg& r, char view);
+void print_machine_instr(std::ostream& os, const MachineInstr& mi);
+void print_machine_function(std::ostream& os, const MachineFunction& mf);
+
+// Parses one line of assembly in the syntax print_machine_instr produces. The first register
+// operand is a def unless the opcode only reads its operands (stores, compares, branches).
+MachineInstr parse_machine_instr(const std::string& text);
+
+#endif // CAPPUCCINO_MACHINEIR_H
@@ -54,6 +54,8 @@ class Parser {
     StmtPtr parseStatement();
     StmtPtr parseExpressionStatement();
     StmtPtr parseVarOrFunctionDecl();
+    // `inline` / `noinline` followed by a function declaration
+    StmtPtr parseFunctionSpecifier();
     StmtPtr parseBlock();
     StmtPtr parseIf();
     StmtPtr parseWhile();
@@ -61,6 +63,9 @@ class Parser {
     StmtPtr parseFunction();
     StmtPtr parseReturnStmt();
     StmtPtr parseClassDecl();
+
+    // Prints the frame size of the function just parsed, for --frame-report at -O0
+    void reportFrameSize(const std::string& function);
 };
 
 #endif
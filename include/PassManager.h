@@ -0,0 +1,42 @@
+#ifndef CAPPUCCINO_PASSMANAGER_H
+#define CAPPUCCINO_PASSMANAGER_H
+
+#include "CompilerContext.h"
+#include "IR.h"
+
+#include <memory>
+#include <vector>
+
+class Pass {
+  public:
+    virtual ~Pass() = default;
+
+    virtual const char* name() const = 0;
+    // Returns true if the module was changed
+    virtual bool run(Module& mod) = 0;
+};
+
+// A pass that looks at one function at a time
+class FunctionPass : public Pass {
+  public:
+    bool run(Module& mod) override;
+    virtual bool runOnFunction(Function& fn) = 0;
+};
+
+class PassManager {
+  public:
+    PassManager(CompilerContext& p_ctx);
+
+    void add(std::unique_ptr<Pass> pass);
+    // Appends the standard pipeline for an optimization level (-O1 / -O2)
+    void addStandardPipeline(int level);
+
+    // Runs every pass in order, verifying the IR after each one
+    void run(Module& mod);
+
+  private:
+    CompilerContext& ctx;
+    std::vector<std::unique_ptr<Pass>> passes;
+};
+
+#endif // CAPPUCCINO_PASSMANAGER_H
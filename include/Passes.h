@@ -0,0 +1,201 @@
+#ifndef CAPPUCCINO_PASSES_H
+#define CAPPUCCINO_PASSES_H
+
+#include "IR.h"
+#include "PassManager.h"
+
+// Promotes scalar stack slots whose address never escapes into SSA values, inserting phi
+// nodes at the iterated dominance frontier of their stores.
+class Mem2RegPass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "mem2reg";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+// Profile-guided optimization. Critical edges are split first, so that the count of each
+// block is also the count of every edge and call site in it. With --profile-generate,
+// every block gets a counter incremented each time it runs, and main writes the counters to
+// the profile file before it returns. With --profile-use, the counts of each function whose
+// CFG still has the checksum recorded in the profile are attached to its blocks and
+// branches; other functions keep the static estimates.
+class ProfilePass : public FunctionPass {
+  public:
+    ProfilePass(CompilerContext& p_ctx) : ctx(p_ctx) {}
+
+    const char* name() const override {
+        return "profile";
+    }
+    bool runOnFunction(Function& fn) override;
+
+  private:
+    CompilerContext& ctx;
+};
+
+// Sparse conditional constant propagation. Replaces values that are constant on every
+// executable path, turns branches on such values into jumps and deletes the blocks
+// (e.g. if arms) that can no longer execute.
+class SCCPPass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "sccp";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+// Inlines calls to functions defined in the module, callees before their callers. Small
+// functions, functions called from a single place and calls inside loops qualify by a
+// size/benefit estimate; `inline` and `noinline` override it, and calls within a cycle of
+// recursion are never inlined. The callee's stack slots become slots of the caller. With a
+// profile, the measured calls per call of the caller stand in for the loop nesting, and
+// call sites that never ran are left alone.
+class InlinerPass : public Pass {
+  public:
+    const char* name() const override {
+        return "inline";
+    }
+    bool run(Module& mod) override;
+};
+
+// Turns self-recursive calls in tail position into branches back to the function entry,
+// with the arguments as loop phis. A call whose result is combined with another value by an
+// associative integer operation (`return n + f(n - 1)`) still qualifies: the pending values
+// are collected in an accumulator and applied at the returns that end the recursion.
+class TailRecursionPass : public FunctionPass {
+  public:
+    TailRecursionPass(CompilerContext& p_ctx) : ctx(p_ctx) {}
+
+    const char* name() const override {
+        return "tailrec";
+    }
+    bool runOnFunction(Function& fn) override;
+
+  private:
+    CompilerContext& ctx;
+};
+
+// Classifies every function as pure, read-only or impure from the loads, stores and calls
+// in its body and its callees. Calls to pure functions with constant arguments are then
+// evaluated at compile time by the IR interpreter, and a pure call dominated by the same
+// call on the same values reuses its result.
+class PureCallPass : public Pass {
+  public:
+    PureCallPass(CompilerContext& p_ctx) : ctx(p_ctx) {}
+
+    const char* name() const override {
+        return "pure-calls";
+    }
+    bool run(Module& mod) override;
+
+  private:
+    CompilerContext& ctx;
+};
+
+// Removes array bounds checks whose index is proven in range by its definition, dominating
+// branch conditions or earlier checks, then moves checks of loop-invariant indices into the
+// loop preheader. What happens exactly depends on --bounds.
+class BoundsCheckPass : public FunctionPass {
+  public:
+    BoundsCheckPass(CompilerContext& p_ctx) : ctx(p_ctx) {}
+
+    const char* name() const override {
+        return "bounds-check";
+    }
+    bool runOnFunction(Function& fn) override;
+
+  private:
+    CompilerContext& ctx;
+};
+
+// Loop-invariant code motion. Moves arithmetic whose operands are all defined outside a
+// loop into its preheader, along with loads of frame slots that nothing in the loop can
+// write: no direct store, and no impure call or store through a pointer once the slot's address
+// has escaped.
+class LICMPass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "licm";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+// Turns innermost counted loops over arrays into NEON loops handling 16 bytes of lanes per
+// iteration, followed by the original loop for the remaining iterations. Element-wise
+// arithmetic, loads and stores of consecutive elements and sum reductions qualify; float
+// sums only with --fast-math since adding the lanes separately reassociates them.
+class LoopVectorizePass : public FunctionPass {
+  public:
+    LoopVectorizePass(CompilerContext& p_ctx) : ctx(p_ctx) {}
+
+    const char* name() const override {
+        return "loop-vectorize";
+    }
+    bool runOnFunction(Function& fn) override;
+
+  private:
+    CompilerContext& ctx;
+};
+
+// Rotates `while` and `for` loops so the exit test sits at the bottom, behind a guard in the
+// preheader. In loops counting by one towards an invariant bound, addresses indexed by the
+// counter become pointers advanced by the element size, and when nothing else needs the
+// counter it is replaced by the number of remaining iterations, counted down to zero.
+class InductionVariablePass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "indvars";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+// Deletes stores to stack slots that are overwritten, or whose frame is gone, before
+// anything reads them: loop temporaries reassigned every iteration, initializers replaced
+// before their first use. A backward liveness over the bytes of every slot follows
+// addresses through constant offsets, array indexing and pointer phis. Slots whose address
+// escapes (`&x`, the `this` of a method call) are also read by calls and by accesses
+// through pointers of unknown origin.
+class DeadStoreEliminationPass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "dse";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+// Cleans up after the other passes: deletes unreachable blocks, instructions whose results
+// never reach a side effect or branch, and stack slots nobody takes the address of any
+// more. Blocks that only branch on are bypassed and a block is merged into its single
+// predecessor, so no label is left that only falls through.
+class DeadCodeEliminationPass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "dce";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+// Unrolls single block loops that a profile shows running many iterations per entry, by
+// two: a second copy of the body follows the first, each with its own exit test.
+class LoopUnrollPass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "loop-unroll";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+// Orders the blocks of each function for the code layout. Branch probabilities come from
+// the profile where there is one, otherwise from static heuristics (loop back edges are
+// taken, loop exits, returns and calls are not, paths that end in a trap almost never run),
+// and block frequencies from them. Hot edges become fall-throughs and rarely run blocks,
+// including those the profile never saw run, move to the end of the function.
+class BlockPlacementPass : public FunctionPass {
+  public:
+    const char* name() const override {
+        return "block-placement";
+    }
+    bool runOnFunction(Function& fn) override;
+};
+
+#endif // CAPPUCCINO_PASSES_H
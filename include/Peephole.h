@@ -0,0 +1,51 @@
+#ifndef CAPPUCCINO_PEEPHOLE_H
+#define CAPPUCCINO_PEEPHOLE_H
+
+#include "CompilerContext.h"
+#include "MachineIR.h"
+
+#include <ostream>
+#include <vector>
+
+// The instructions a rule looks at: `insts[pos]` onwards in block `block_index` of `mf`
+struct PeepholeWindow {
+    MachineFunction& mf;
+    size_t block_index;
+    size_t pos;
+
+    std::vector<MachineInstr>& insts() {
+        return mf.blocks[block_index]->insts;
+    }
+};
+
+struct PeepholeRule {
+    const char* name;
+    size_t window; // How many instructions from `pos` the rule may inspect
+    bool (*apply)(PeepholeWindow& w);
+};
+
+// Every rule, in the order they are tried at each position
+const std::vector<PeepholeRule>& peephole_rules();
+
+// Rewrites short sequences of allocated machine code, whether selected by the backend or
+// parsed back from the -O0 code generator. A window slides over each block and the first
+// rule that matches rewrites it in place; scanning then resumes far enough back for the
+// rewrite to expose new matches, until the block stops changing.
+class PeepholeOptimizer {
+  public:
+    PeepholeOptimizer(CompilerContext& p_ctx);
+
+    void run(MachineFunction& mf);
+
+    // Prints how often each rule fired over every function run so far
+    void printStats(std::ostream& os) const;
+
+  private:
+    std::vector<size_t> enabled; // Indices into peephole_rules()
+    std::vector<int> hits;
+    size_t lookback = 0;
+
+    bool runOnBlock(MachineFunction& mf, size_t block_index);
+};
+
+#endif // CAPPUCCINO_PEEPHOLE_H
@@ -0,0 +1,40 @@
+#ifndef CAPPUCCINO_PROFILE_H
+#define CAPPUCCINO_PROFILE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Profile file written by a program built with --profile-generate. Integers are 64-bit
+// little endian:
+//
+//   "CAPPPROF", version, number of functions, number of counters
+//   per function: name length, name padded to 8 bytes, CFG checksum, first counter, counters
+//   the counters
+//
+// There is one counter per basic block of the IR right after SSA construction, with
+// critical edges split, so every edge and every call site has a counter of its own.
+constexpr char PROFILE_MAGIC[] = "CAPPPROF";
+constexpr uint64_t PROFILE_VERSION = 1;
+constexpr char DEFAULT_PROFILE_NAME[] = "capp.profdata";
+
+struct FunctionProfile {
+    uint64_t checksum; // Of the CFG the counts were taken on
+    std::vector<uint64_t> counts;
+};
+
+class ProfileData {
+  public:
+    // Replaces the profile with the one in `path`, false if it cannot be read or is not a
+    // profile file
+    bool read(const std::string& path);
+
+    // Null when the function was not profiled
+    const FunctionProfile* find(const std::string& name) const;
+
+  private:
+    std::map<std::string, FunctionProfile> functions;
+};
+
+#endif // CAPPUCCINO_PROFILE_H
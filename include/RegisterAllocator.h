@@ -0,0 +1,76 @@
+#ifndef CAPPUCCINO_REGISTERALLOCATOR_H
+#define CAPPUCCINO_REGISTERALLOCATOR_H
+
+#include "MachineIR.h"
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+// Scratch registers reserved for spill code and frame lowering, never allocated
+constexpr int GPR_SPILL_SCRATCH[] = {15, 16, 17};
+constexpr int FPR_SPILL_SCRATCH[] = {29, 30, 31};
+
+// Live range of a virtual register over the linear instruction numbering. Instruction k
+// reads its operands at position 2k and writes its results at 2k + 1. `ranges` holds the
+// part of each block the value is live in, in order; the holes between them, such as a
+// loop laid out between an early return and the entry, may go to other values.
+struct LiveInterval {
+    int vreg;
+    RegClass cls;
+    int start;
+    int end;
+    std::vector<std::pair<int, int>> ranges;
+    int phys = -1;
+    bool spilled = false;
+    int hint = -1; // Physical register this value is copied from or to
+};
+
+// Linear-scan register allocation (Poletto & Sarkar) over the general purpose and FP/SIMD
+// register files, following AAPCS64:
+//   - caller-saved registers are preferred for values not live across a call
+//   - values live across a call end up in callee-saved registers, which frame lowering
+//     saves in the prologue
+//   - when no register is free the interval ending furthest away is spilled
+//   - intervals whose ranges fit into each other's holes may share a register
+//   - a phi and the values copied into it are merged into one interval first when neither
+//     is written while the other is live
+class RegisterAllocator {
+  public:
+    RegisterAllocator(MachineFunction& p_mf);
+
+    void run();
+
+  private:
+    MachineFunction& mf;
+
+    std::vector<LiveInterval> intervals;
+    // Ranges where a physical register is fixed by the calling convention, keyed by
+    // (class, register number)
+    std::map<std::pair<RegClass, int>, std::vector<std::pair<int, int>>> fixed_ranges;
+    std::vector<int> block_start;
+    std::vector<int> block_end;
+    std::vector<int> spill_slots;
+    // Positions each virtual register is written at, and the source of each copy between
+    // virtual registers by the position it writes
+    std::vector<std::vector<int>> def_positions;
+    std::unordered_map<int, int> copy_sources;
+    // Virtual register whose interval a coalesced one was merged into, itself otherwise
+    std::vector<int> leader;
+
+    void numberInstructions();
+    void computeIntervals();
+    void coalesce();
+    void allocate();
+    void rewrite();
+
+    int leaderOf(int vreg);
+    bool writesWhileLive(int group, int other);
+
+    bool conflictsWithFixed(const LiveInterval& interval, RegClass cls, int phys) const;
+    int spillSlot(int vreg);
+    // Width a spilled register is saved and reloaded with
+    char spillView(int vreg, const MReg& phys) const;
+};
+
+#endif // CAPPUCCINO_REGISTERALLOCATOR_H
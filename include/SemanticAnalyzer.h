@@ -0,0 +1,104 @@
+#ifndef CAPPUCCINO_SEMANTICANALYZER_H
+#define CAPPUCCINO_SEMANTICANALYZER_H
+
+#include "AbstractSyntaxTree.h"
+#include "CompilerContext.h"
+#include "Type.h"
+#include "Visitor.h"
+
+#include <unordered_map>
+
+// Implicit conversion applied to an expression's value by the node that consumes it
+enum class ConversionKind { NONE, INT_TO_FLOAT, FLOAT_TO_INT, FLOAT_EXTEND, FLOAT_TRUNCATE };
+
+struct ExprInfo {
+    Type type; // Type of the value the expression itself produces
+
+    // Binary expressions: the type both operands are brought to before the operation.
+    // Integer math always runs on 64-bit registers, floats on s or d registers.
+    Type operand_type;
+    bool unsigned_op = false; // udiv / unsigned condition codes
+
+    ConversionKind conversion = ConversionKind::NONE;
+    Type converted_type; // Type of the value after `conversion`, equal to `type` for NONE
+
+    // Storage of identifiers and of the variable behind '&', '[]' and '.': [x29, #-frame_offset]
+    int frame_offset = 0;
+};
+
+struct DeclInfo {
+    Type type;
+    int frame_offset = 0;
+    int param_index = -1; // Register index for function parameters
+};
+
+// Facts resolved once by the SemanticAnalyzer and read by every later stage
+class SemanticInfo {
+  public:
+    const ExprInfo& expr(const Expr* e) const;
+    const DeclInfo& decl(const Stmt* s) const;
+    const Type& returnType(const FunctionDeclStmt* fn) const;
+
+  private:
+    friend class SemanticAnalyzer;
+
+    std::unordered_map<const Expr*, ExprInfo> exprs;
+    std::unordered_map<const Stmt*, DeclInfo> decls;
+    std::unordered_map<const FunctionDeclStmt*, Type> return_types;
+};
+
+class SemanticAnalyzer : public Visitor {
+  public:
+    SemanticAnalyzer(CompilerContext& p_ctx);
+
+    SemanticInfo analyze(const Program& prog);
+
+    // Visitor Implementation
+    void visitLiteralExpr(const LiteralExpr* expr) override;
+    void visitIdentifierExpr(const IdentifierExpr* expr) override;
+    void visitUnaryExpr(const UnaryExpr* expr) override;
+    void visitBinaryExpr(const BinaryExpr* expr) override;
+    void visitGroupingExpr(const GroupingExpr* expr) override;
+    void visitFunctionCallExpr(const FunctionCallExpr* expr) override;
+    void visitArrayAccessExpr(const ArrayAccessExpr* expr) override;
+    void visitArrayLiteralExpr(const ArrayLiteralExpr* expr) override;
+    void visitPropertyAccessExpr(const PropertyAccessExpr* expr) override;
+
+    void visitExprStmt(const ExprStmt* stmt) override;
+    void visitVariableDeclStmt(const VariableDeclStmt* stmt) override;
+    void visitBlockStmt(const BlockStmt* stmt) override;
+    void visitIfStmt(const IfStmt* stmt) override;
+    void visitWhileStmt(const WhileStmt* stmt) override;
+    void visitForStmt(const ForStmt* stmt) override;
+    void visitReturnStmt(const ReturnStmt* stmt) override;
+    void visitFunctionParameterStmt(const FunctionParameterStmt* stmt) override;
+    void visitFunctionDeclStmt(const FunctionDeclStmt* stmt) override;
+    void visitClassDeclStmt(const ClassDeclStmt* stmt) override;
+
+  private:
+    CompilerContext& ctx;
+    SemanticInfo info;
+
+    // The ExprInfo of the expression currently being visited
+    ExprInfo* current = nullptr;
+
+    const FunctionDeclStmt* current_function = nullptr;
+    int current_param_index = 0;
+
+    void error(const Token& tok, const std::string& msg);
+
+    // Analyzes `expr` and returns its type
+    Type analyzeExpr(const Expr* expr);
+    // Analyzes `expr` and records the conversion that brings it to `target`
+    void analyzeAs(const Expr* expr, const Type& target);
+    // Records a variable used as a memory location rather than read as a value
+    void analyzePlace(const IdentifierExpr* ident);
+    void convertTo(const Expr* expr, const Type& target);
+    void analyzeAssignment(const BinaryExpr* expr);
+
+    void analyzeStmt(const Stmt* stmt);
+};
+
+ConversionKind conversion_between(const Type& from, const Type& to);
+
+#endif // CAPPUCCINO_SEMANTICANALYZER_H
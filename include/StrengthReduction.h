@@ -0,0 +1,55 @@
+#ifndef CAPPUCCINO_STRENGTHREDUCTION_H
+#define CAPPUCCINO_STRENGTHREDUCTION_H
+
+#include <cstdint>
+#include <optional>
+
+// Multiplication of `x` by a constant as one or two shift-and-add instructions
+struct ShiftAddMultiply {
+    enum class Form {
+        SHIFT,       // x << shift
+        ADD,         // (x + (x << shift)) << post_shift
+        SUB,         // (x << shift) - x
+        REVERSE_SUB, // x - (x << shift)
+        NEGATE,      // -(x << shift)
+    };
+
+    Form form;
+    int shift;
+    int post_shift = 0;
+};
+
+// The shift-and-add form of a multiplication by `c`, if one exists. 0 and 1 have none,
+// they are left to constant folding and the register allocator.
+std::optional<ShiftAddMultiply> shift_add_multiply(int64_t c);
+
+// Signed division by a constant d (|d| > 1, not a power of two) as a multiplication by
+// `multiplier` keeping the high 64 bits, following Hacker's Delight 10-4:
+//   q = smulh(x, multiplier)
+//   q = q + x       if d > 0 and multiplier < 0
+//   q = q - x       if d < 0 and multiplier > 0
+//   q = q >> shift  (arithmetic)
+//   q = q + (q >>> 63), rounding towards zero like sdiv
+struct SignedDivisionMagic {
+    int64_t multiplier;
+    int shift;
+};
+
+SignedDivisionMagic signed_division_magic(int64_t d);
+
+// Unsigned division by a constant d (not a power of two), Hacker's Delight 10-10:
+//   t = umulh(x, multiplier)
+//   q = t >> shift                             without `add`
+//   q = (((x - t) >> 1) + t) >> (shift - 1)    with `add`, when the multiplier needs 65 bits
+struct UnsignedDivisionMagic {
+    uint64_t multiplier;
+    int shift;
+    bool add;
+};
+
+UnsignedDivisionMagic unsigned_division_magic(uint64_t d);
+
+// log2 of `v` if it is a power of two
+std::optional<int> exact_log2(uint64_t v);
+
+#endif // CAPPUCCINO_STRENGTHREDUCTION_H
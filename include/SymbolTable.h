@@ -34,7 +34,10 @@ class SymbolTable {
 
     std::optional<Symbol> lookup(const std::string& name) const;
 
+    // Peak stack height of the current function: sibling scopes share offsets
     int getMaxStackSize() const;
+    // What the locals would take if every declaration had its own offset
+    int getUnsharedStackSize() const;
 
     void reset();
     void reset_local_offset();
@@ -42,11 +45,14 @@ class SymbolTable {
   private:
     struct Scope {
         std::unordered_map<std::string, Symbol> symbols;
+        int stack_offset = 0; // Stack height when the scope was entered
     };
 
     std::vector<Scope> scopes;
 
     int current_stack_offset = 0;
+    int max_stack_offset = 0;
+    int unshared_stack_offset = 0;
 };
 
 #endif
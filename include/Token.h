@@ -56,6 +56,10 @@ enum class TokenType {
     KEYWORD_CLASS,
     PUNCTUATION_DOT,
 
+    // Function specifiers
+    KEYWORD_INLINE,
+    KEYWORD_NOINLINE,
+
     // Operators
     OPERATOR_EQUALITY,
     OPERATOR_MINUS,
@@ -0,0 +1,17 @@
+#ifndef CAPPUCCINO_VERIFIER_H
+#define CAPPUCCINO_VERIFIER_H
+
+#include "IR.h"
+
+#include <string>
+#include <vector>
+
+// Structural and SSA checks on the IR. Returns the list of problems found, empty when the
+// function is well formed.
+std::vector<std::string> verify_function(Function& fn);
+
+// Verifies every function and throws std::logic_error describing the first broken one.
+// `stage` names what produced the IR, e.g. the pass that just ran.
+void verify_module(Module& mod, const std::string& stage);
+
+#endif // CAPPUCCINO_VERIFIER_H
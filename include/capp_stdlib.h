@@ -2,15 +2,18 @@
 #define CAPPUCCINO_STDLIB_H
 
 #include <string>
+#include <vector>
 
-const std::string STDLIB_ASM = R"(
-.section __TEXT,__text,regular,pure_instructions
+// A runtime routine, emitted only when the program calls it
+struct StdlibRoutine {
+    std::string symbol;
+    std::string code;
+    std::string format; // Label and .asciz of the format string it passes to libc, if any
+};
 
-// ==========================================
-//              I/O Functions
-// ==========================================
-
-// --- print_s(string) ---
+const std::vector<StdlibRoutine> STDLIB_ROUTINES = {
+    // print_s(string)
+    {"_print_s", R"(
 .globl _print_s
 .p2align 2
 _print_s:
@@ -19,8 +22,10 @@ _print_s:
     bl _puts                ; Use puts() - safer than printf for plain strings
     ldp x29, x30, [sp], #16
     ret
-
-// --- print(int) ---
+)",
+     ""},
+    // print(int)
+    {"_print", R"(
 .globl _print
 .p2align 2
 _print:
@@ -39,8 +44,10 @@ _print:
     add sp, sp, #16         ; Cleanup stack
     ldp x29, x30, [sp], #16
     ret
-
-// --- print_f(float) ---
+)",
+     R"(l_fmt_int: .asciz "%ld\n")"},
+    // print_f(float)
+    {"_print_f", R"(
 .globl _print_f
 .p2align 2
 _print_f:
@@ -57,8 +64,10 @@ _print_f:
     add sp, sp, #16
     ldp x29, x30, [sp], #16
     ret
-
-// --- input_f() -> float ---
+)",
+     R"(l_fmt_flt: .asciz "%f\n")"},
+    // input_f() -> float
+    {"_input_f", R"(
 .globl _input_f
 .p2align 2
 _input_f:
@@ -79,8 +88,10 @@ _input_f:
     ldp x29, x30, [sp, #16]
     add sp, sp, #32
     ret
-
-// --- input_i() -> int ---
+)",
+     R"(l_fmt_scan_flt: .asciz "%lf")"},
+    // input_i() -> int
+    {"_input_i", R"(
 .globl _input_i
 .p2align 2
 _input_i:
@@ -101,35 +112,43 @@ _input_i:
     ldp x29, x30, [sp, #16]
     add sp, sp, #32
     ret
+)",
+     R"(l_fmt_scan_int: .asciz "%ld")"},
+    // capp_profile_dump(), called by main in --profile-generate builds
+    {"_capp_profile_dump", R"(
+.globl _capp_profile_dump
+.p2align 2
+_capp_profile_dump:
+    stp x29, x30, [sp, #-16]!
+    mov x29, sp
+    stp x19, x20, [sp, #-16]!
 
-// ==========================================
-//              Math Wrappers
-// ==========================================
-.globl _sqrt_f
-_sqrt_f:
-    b _sqrt
-.globl _sin_f
-_sin_f:
-    b _sin
-.globl _cos_f
-_cos_f:
-    b _cos
-.globl _tan_f
-_tan_f:
-    b _tan
-.globl _abs_f
-_abs_f:
-    fabs d0, d0
-    ret
+    // f = fopen(path, "wb"), the path and data are emitted by the compiler
+    adrp x0, l_capp_profile_path@PAGE
+    add x0, x0, l_capp_profile_path@PAGEOFF
+    adrp x1, l_fmt_write_binary@PAGE
+    add x1, x1, l_fmt_write_binary@PAGEOFF
+    bl _fopen
+    cbz x0, 1f
+    mov x19, x0
 
-// ==========================================
-//              Data Section
-// ==========================================
-.section __TEXT,__cstring,cstring_literals
-l_fmt_int:      .asciz "%ld\n"
-l_fmt_flt:      .asciz "%f\n"
-l_fmt_scan_int: .asciz "%ld"
-l_fmt_scan_flt: .asciz "%lf"
-)";
+    // fwrite(data, 1, size, f)
+    adrp x0, _capp_profile_data@PAGE
+    add x0, x0, _capp_profile_data@PAGEOFF
+    mov x1, #1
+    adrp x2, _capp_profile_size@PAGE
+    ldr x2, [x2, _capp_profile_size@PAGEOFF]
+    mov x3, x19
+    bl _fwrite
+
+    mov x0, x19
+    bl _fclose
+1:
+    ldp x19, x20, [sp], #16
+    ldp x29, x30, [sp], #16
+    ret
+)",
+     R"(l_fmt_write_binary: .asciz "wb")"},
+};
 
 #endif
@@ -6,8 +6,11 @@
 #define CAPPUCCINO_UTILS_H
 
 #include <optional>
+#include <ostream>
+#include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
 std::optional<std::string> read_file(const std::string& file_name);
 
@@ -16,4 +19,17 @@ std::pair<uint32_t, int> decode_utf8(const std::string& src, size_t pos);
 std::string to_unicode(uint32_t codepoint);
 
 std::string mangle_method(const std::string& class_name, const std::string& method_name);
+
+// Assembly symbol a call to `function_name` branches to. The transcendental math builtins
+// are libm's functions, called directly.
+std::string symbol_name(const std::string& function_name);
+
+// Emits the __cstring section for (label, text) pairs, the text escaped as in the source.
+// Each distinct text is stored once, and a text that ends a longer one gets no bytes of
+// its own: its label is defined as an offset into the longer one.
+void emit_cstrings(std::ostream& out,
+                   const std::vector<std::pair<std::string, std::string>>& literals);
+
+// Emits the runtime routines among `called` (assembly symbols), with their format strings
+void emit_stdlib(std::ostream& out, const std::set<std::string>& called);
 #endif // CAPPUCCINO_UTILS_H
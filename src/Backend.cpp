@@ -0,0 +1,162 @@
+#include "Backend.h"
+
+#include "FrameLowering.h"
+#include "RegisterAllocator.h"
+#include "utils.h"
+
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <unordered_set>
+
+Backend::Backend(Module& p_mod, std::ostream& output, CompilerContext& p_ctx)
+    : mod(p_mod), out(output), ctx(p_ctx), peephole(p_ctx) {}
+
+void Backend::generate() {
+    out << ".globl _main\n";
+    out << ".align 2\n\n";
+
+    for (auto& fn : mod.functions) {
+        InstructionSelector isel(*fn, data, ctx.options);
+        std::unique_ptr<MachineFunction> mf = isel.run();
+
+        RegisterAllocator regalloc(*mf);
+        regalloc.run();
+
+        FrameLowering frame(*mf, ctx.options.keep_frame_pointer);
+        frame.run();
+        if (ctx.options.frame_report)
+            std::cout << "frame of '" << fn->name << "': " << frame.unsharedSize() << " -> "
+                      << frame.frameSize() << " bytes\n";
+
+        peephole.run(*mf);
+
+        layout.addFunction(*mf);
+        std::ostringstream text;
+        emitFunction(text, *mf);
+        function_text["_" + mf->name] = text.str();
+    }
+
+    // Functions main cannot reach are dropped, the rest go out in call graph order
+    for (const std::string& symbol : layout.order())
+        out << function_text.at(symbol);
+
+    emitData();
+    if (!mod.profiled.empty())
+        emitProfileData();
+    emit_stdlib(out, layout.externalCallees());
+    // Every function is an atom of its own, for the linker's dead stripping and ordering
+    out << "\n.subsections_via_symbols\n";
+
+    if (ctx.options.peephole_stats)
+        peephole.printStats(std::cout);
+}
+
+void Backend::emitFunction(std::ostream& os, const MachineFunction& mf) {
+    // Blocks only entered by falling through need no label
+    std::unordered_set<const MachineBlock*> targets;
+    for (const auto& mb : mf.blocks) {
+        for (const auto& mi : mb->insts) {
+            if (const MachineBlock* target = mi.branchTarget())
+                targets.insert(target);
+        }
+    }
+
+    os << ".p2align 2\n";
+    os << "_" << mf.name << ":\n";
+    for (size_t i = 0; i < mf.blocks.size(); i++) {
+        const MachineBlock& mb = *mf.blocks[i];
+        if (mb.align)
+            os << "\t.p2align " << mb.align << "\n";
+        if (targets.count(&mb))
+            os << mb.label << ":\n";
+        for (const auto& mi : mb.insts) {
+            os << "\t";
+            print_machine_instr(os, mi);
+            os << "\n";
+        }
+    }
+    os << "\n";
+}
+
+void Backend::emitData() {
+    // Data only dropped functions referred to is dropped with them
+    std::set<std::string> used = layout.referencedSymbols();
+
+    std::vector<std::pair<std::string, std::string>> cstrings;
+    for (const auto& s : mod.strings) {
+        if (used.count(s->label))
+            cstrings.push_back({s->label, s->text});
+    }
+
+    if (data.requires_bounds_panic && used.count("L_bounds_violation_panic")) {
+        out << "L_bounds_violation_panic:\n";
+        out << "\tadrp x0, L_panic_msg@PAGE\n";
+        out << "\tadd x0, x0, L_panic_msg@PAGEOFF\n";
+        out << "\tbl _printf\n";
+        out << "\tbrk #1\n";
+
+        cstrings.push_back({"L_panic_msg", "Runtime Error: Array index out of bounds!\\n"});
+    }
+    // AArch64 has no conditional trap, checks branch to a shared one
+    if (data.requires_bounds_trap && used.count("L_bounds_trap")) {
+        out << "L_bounds_trap:\n";
+        out << "\tbrk #1\n";
+    }
+
+    emit_cstrings(out, cstrings);
+
+    for (int size : {8, 4}) {
+        bool header = false;
+        for (const auto& lit : data.literals) {
+            if (lit.size != size || !used.count(lit.label))
+                continue;
+            if (!header) {
+                if (size == 8)
+                    out << "\n.section __TEXT,__literal8,8byte_literals\n.p2align 3\n";
+                else
+                    out << "\n.section __TEXT,__literal4,4byte_literals\n.p2align 2\n";
+                header = true;
+            }
+            out << lit.label << ":\n";
+            out << (size == 8 ? "\t.quad 0x" : "\t.long 0x") << std::hex << lit.bits << std::dec
+                << "\n";
+        }
+    }
+}
+
+// Laid out exactly as the profile file, so the dump routine writes it in one piece
+void Backend::emitProfileData() {
+    int num_counters = mod.profiled.back().first_counter + mod.profiled.back().num_counters;
+    int64_t size = 32 + 8 * static_cast<int64_t>(num_counters);
+
+    out << "\n.section __DATA,__data\n.p2align 3\n";
+    out << "_capp_profile_data:\n";
+    out << "\t.ascii \"" << PROFILE_MAGIC << "\"\n";
+    out << "\t.quad " << PROFILE_VERSION << ", " << mod.profiled.size() << ", " << num_counters
+        << "\n";
+    for (const ProfiledFunction& fn : mod.profiled) {
+        size_t padded = (fn.name.size() + 7) & ~size_t(7);
+        out << "\t.quad " << fn.name.size() << "\n";
+        out << "\t.ascii \"" << fn.name << "\"\n";
+        if (padded > fn.name.size())
+            out << "\t.space " << padded - fn.name.size() << "\n";
+        out << "\t.quad 0x" << std::hex << fn.checksum << std::dec << ", " << fn.first_counter
+            << ", " << fn.num_counters << "\n";
+        size += 32 + static_cast<int64_t>(padded);
+    }
+    out << "Lcapp_profile_counters:\n";
+    out << "\t.space " << 8 * num_counters << "\n";
+    out << "_capp_profile_size:\n";
+    out << "\t.quad " << size << "\n";
+
+    std::string path;
+    for (char c : ctx.options.profile_generate) {
+        if (c == '"' || c == '\\')
+            path += '\\';
+        path += c;
+    }
+    out << "\n.section __TEXT,__cstring,cstring_literals\n";
+    out << "l_capp_profile_path:\n\t.asciz \"" << path << "\"\n";
+}
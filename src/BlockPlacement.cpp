@@ -0,0 +1,309 @@
+#include "Dominators.h"
+#include "LoopInfo.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+// Probability of taking the edge a heuristic favours (Ball and Larus, "Branch Prediction
+// for Free"; Wu and Larus, "Static Branch Frequency and Program Profile Analysis")
+static constexpr double LOOP_BRANCH_TAKEN = 0.88; // Back to the loop header
+static constexpr double LOOP_EXIT_NOT_TAKEN = 0.80;
+static constexpr double LOOP_ENTRY_TAKEN = 0.75;  // Into a loop not containing the branch
+static constexpr double RETURN_NOT_TAKEN = 0.72;
+static constexpr double CALL_NOT_TAKEN = 0.78;
+static constexpr double OPCODE_TAKEN = 0.84;       // `!=` over `==`
+static constexpr double COLD_NOT_TAKEN = 0.999;    // Towards a trap
+// Iterations assumed per entry into a loop, 1 / (1 - LOOP_BRANCH_TAKEN)
+static constexpr double LOOP_SCALE = 8.0;
+// Blocks run this rarely per call of their function go after everything else
+static constexpr double COLD_FREQUENCY = 0.01;
+
+namespace {
+
+struct Layout {
+    Function& fn;
+    DominatorTree dt;
+    LoopInfo li;
+
+    // Probability of the true edge of every conditional branch
+    std::unordered_map<const BasicBlock*, double> taken;
+    // Estimated executions per call of the function
+    std::unordered_map<const BasicBlock*, double> frequency;
+    // Blocks that can only end in a trap
+    std::unordered_set<const BasicBlock*> cold;
+
+    // Requires up to date predecessor lists
+    explicit Layout(Function& f) : fn(f), dt(f), li(dt) {}
+
+    double edgeProbability(const BasicBlock* from, const BasicBlock* to) const;
+    double edgeWeight(const BasicBlock* from, const BasicBlock* to) const {
+        auto it = frequency.find(from);
+        return it == frequency.end() ? 0.0 : it->second * edgeProbability(from, to);
+    }
+
+    void findColdBlocks();
+    void estimateBranches();
+    void estimateFrequencies();
+    std::vector<BasicBlock*> order();
+};
+
+} // namespace
+
+static bool has_op(const BasicBlock* bb, Opcode op) {
+    return std::any_of(bb->insts.begin(), bb->insts.end(),
+                       [op](const auto& inst) { return inst->op == op; });
+}
+
+// Dempster-Shafer combination of two independent estimates of the same edge
+static double combine(double a, double b) {
+    return a * b / (a * b + (1 - a) * (1 - b));
+}
+
+double Layout::edgeProbability(const BasicBlock* from, const BasicBlock* to) const {
+    Instruction* term = from->terminator();
+    if (term->op != Opcode::COND_BR)
+        return 1.0;
+    if (term->blocks[0] == term->blocks[1])
+        return 1.0;
+    double p = taken.at(from);
+    return term->blocks[0] == to ? p : 1 - p;
+}
+
+// A block is cold when every path out of it ends in `unreachable`. The array bounds panic
+// is already a shared routine after all functions, reached by a conditional branch.
+void Layout::findColdBlocks() {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (BasicBlock* bb : dt.rpo()) {
+            if (cold.count(bb))
+                continue;
+            Instruction* term = bb->terminator();
+            std::vector<BasicBlock*> succs = bb->successors();
+            bool all_cold = term->op == Opcode::UNREACHABLE ||
+                            (!succs.empty() && std::all_of(succs.begin(), succs.end(),
+                                                           [&](BasicBlock* s) {
+                                                               return cold.count(s) > 0;
+                                                           }));
+            if (all_cold && bb != fn.entry()) {
+                cold.insert(bb);
+                changed = true;
+            }
+        }
+    }
+}
+
+// Each heuristic that applies to a branch gives the probability of its true edge, and the
+// estimates are combined. Without any, both edges are equally likely.
+void Layout::estimateBranches() {
+    for (BasicBlock* bb : dt.rpo()) {
+        Instruction* term = bb->terminator();
+        if (term->op != Opcode::COND_BR)
+            continue;
+        BasicBlock* t = term->blocks[0];
+        BasicBlock* f = term->blocks[1];
+
+        if (term->taken >= 0) {
+            taken[bb] = term->taken;
+            continue;
+        }
+        if (cold.count(t) != cold.count(f)) {
+            taken[bb] = cold.count(t) ? 1 - COLD_NOT_TAKEN : COLD_NOT_TAKEN;
+            continue;
+        }
+
+        double p = 0.5;
+        // `favoured` is true when the heuristic prefers the true edge
+        auto apply = [&](double probability, bool favoured) {
+            p = combine(p, favoured ? probability : 1 - probability);
+        };
+
+        Loop* loop = li.loopFor(bb);
+        auto is_back_edge = [&](BasicBlock* to) {
+            for (Loop* l = loop; l; l = l->parent) {
+                if (l->header == to)
+                    return true;
+            }
+            return false;
+        };
+        auto leaves = [&](BasicBlock* to) { return loop && !loop->contains(to); };
+        auto enters_loop = [&](BasicBlock* to) {
+            Loop* target = li.loopFor(to);
+            if (target && target->header == to && !target->contains(bb))
+                return true;
+            // The guard of a rotated loop branches to its preheader
+            std::vector<BasicBlock*> succs = to->successors();
+            if (succs.size() != 1)
+                return false;
+            target = li.loopFor(succs[0]);
+            return target && target->header == succs[0] && !target->contains(bb);
+        };
+        auto returns = [](BasicBlock* to) { return to->terminator()->op == Opcode::RET; };
+        auto calls = [](BasicBlock* to) { return has_op(to, Opcode::CALL); };
+
+        if (is_back_edge(t) != is_back_edge(f))
+            apply(LOOP_BRANCH_TAKEN, is_back_edge(t));
+        else if (leaves(t) != leaves(f))
+            apply(LOOP_EXIT_NOT_TAKEN, leaves(f));
+        if (enters_loop(t) != enters_loop(f))
+            apply(LOOP_ENTRY_TAKEN, enters_loop(t));
+        if (returns(t) != returns(f) && !leaves(t) && !leaves(f))
+            apply(RETURN_NOT_TAKEN, returns(f));
+        if (calls(t) != calls(f))
+            apply(CALL_NOT_TAKEN, calls(f));
+
+        const Value* cond = term->operands[0];
+        if (cond->kind == ValueKind::INSTRUCTION) {
+            const auto* cmp = static_cast<const Instruction*>(cond);
+            if ((cmp->op == Opcode::ICMP || cmp->op == Opcode::FCMP) &&
+                (cmp->cond == Cond::EQ || cmp->cond == Cond::NE))
+                apply(OPCODE_TAKEN, cmp->cond == Cond::NE);
+        }
+        taken[bb] = p;
+    }
+}
+
+// Frequencies flow through the acyclic part of the CFG in reverse post-order, and every
+// loop header multiplies what enters it by LOOP_SCALE. Blocks with a measured count take
+// it relative to the entry's instead.
+void Layout::estimateFrequencies() {
+    int64_t entries = fn.entry()->profile_count;
+    for (BasicBlock* bb : dt.rpo()) {
+        if (entries > 0 && bb->profile_count >= 0) {
+            frequency[bb] = static_cast<double>(bb->profile_count) / entries;
+            continue;
+        }
+        double f = bb == fn.entry() ? 1.0 : 0.0;
+        for (BasicBlock* pred : bb->preds) {
+            if (dt.isReachable(pred) && !dt.dominates(bb, pred))
+                f += edgeWeight(pred, bb);
+        }
+        Loop* loop = li.loopFor(bb);
+        if (loop && loop->header == bb)
+            f *= LOOP_SCALE;
+        frequency[bb] = f;
+    }
+}
+
+// Pettis and Hansen's bottom-up positioning: edges are visited from the heaviest, and an
+// edge whose source ends a chain and whose target starts another one joins the two, so
+// the target becomes the fall-through. Back edges never do, a loop is laid out from its
+// header down and entered by falling through from the guard. Chains are then placed after
+// the entry chain, each time picking the one most strongly entered from what is already
+// placed. Cold chains go last.
+std::vector<BasicBlock*> Layout::order() {
+    const std::vector<BasicBlock*>& rpo = dt.rpo();
+    std::unordered_map<const BasicBlock*, int> index;
+    for (size_t i = 0; i < rpo.size(); i++)
+        index[rpo[i]] = static_cast<int>(i);
+
+    struct Edge {
+        BasicBlock* from;
+        BasicBlock* to;
+        double weight;
+    };
+    std::vector<Edge> edges;
+    for (BasicBlock* bb : rpo) {
+        for (BasicBlock* succ : bb->successors()) {
+            if (succ != fn.entry() && !dt.dominates(succ, bb))
+                edges.push_back({bb, succ, edgeWeight(bb, succ)});
+        }
+    }
+    std::stable_sort(edges.begin(), edges.end(),
+                     [](const Edge& a, const Edge& b) { return a.weight > b.weight; });
+
+    std::vector<std::vector<BasicBlock*>> chains(rpo.size());
+    std::vector<int> chain_of(rpo.size());
+    for (size_t i = 0; i < rpo.size(); i++) {
+        chains[i] = {rpo[i]};
+        chain_of[i] = static_cast<int>(i);
+    }
+    for (const Edge& e : edges) {
+        int a = chain_of[index[e.from]];
+        int b = chain_of[index[e.to]];
+        if (a == b || chains[a].back() != e.from || chains[b].front() != e.to)
+            continue;
+        for (BasicBlock* bb : chains[b])
+            chain_of[index[bb]] = a;
+        chains[a].insert(chains[a].end(), chains[b].begin(), chains[b].end());
+        chains[b].clear();
+    }
+
+    auto is_cold = [&](const std::vector<BasicBlock*>& chain) {
+        return std::all_of(chain.begin(), chain.end(), [&](BasicBlock* bb) {
+            return cold.count(bb) || frequency.at(bb) < COLD_FREQUENCY;
+        });
+    };
+
+    std::vector<BasicBlock*> result;
+    std::unordered_set<const BasicBlock*> placed;
+    auto place = [&](int c) {
+        for (BasicBlock* bb : chains[c]) {
+            result.push_back(bb);
+            placed.insert(bb);
+        }
+        chains[c].clear();
+    };
+    place(chain_of[index[fn.entry()]]);
+
+    for (bool cold_pass : {false, true}) {
+        while (true) {
+            int best = -1;
+            double best_weight = -1;
+            for (size_t c = 0; c < chains.size(); c++) {
+                if (chains[c].empty() || is_cold(chains[c]) != cold_pass)
+                    continue;
+                double w = 0;
+                for (BasicBlock* bb : chains[c]) {
+                    for (BasicBlock* pred : bb->preds) {
+                        if (placed.count(pred))
+                            w += edgeWeight(pred, bb);
+                    }
+                }
+                if (w > best_weight) {
+                    best = static_cast<int>(c);
+                    best_weight = w;
+                }
+            }
+            if (best < 0)
+                break;
+            place(best);
+        }
+    }
+    return result;
+}
+
+bool BlockPlacementPass::runOnFunction(Function& fn) {
+    if (fn.blocks.size() < 3)
+        return false;
+
+    fn.rebuildCFG();
+    Layout layout(fn);
+    layout.findColdBlocks();
+    layout.estimateBranches();
+    layout.estimateFrequencies();
+    std::vector<BasicBlock*> order = layout.order();
+
+    // Unreachable blocks keep their relative order at the end
+    std::unordered_map<const BasicBlock*, size_t> position;
+    for (size_t i = 0; i < order.size(); i++)
+        position[order[i]] = i;
+    std::vector<BasicBlock*> before;
+    for (auto& bb : fn.blocks)
+        before.push_back(bb.get());
+    std::stable_sort(fn.blocks.begin(), fn.blocks.end(), [&](const auto& a, const auto& b) {
+        auto pa = position.find(a.get());
+        auto pb = position.find(b.get());
+        size_t ia = pa == position.end() ? order.size() : pa->second;
+        size_t ib = pb == position.end() ? order.size() : pb->second;
+        return ia < ib;
+    });
+
+    for (size_t i = 0; i < before.size(); i++) {
+        if (fn.blocks[i].get() != before[i])
+            return true;
+    }
+    return false;
+}
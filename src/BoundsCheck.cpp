@@ -0,0 +1,421 @@
+#include "ConstantFold.h"
+#include "Dominators.h"
+#include "LoopInfo.h"
+#include "Passes.h"
+
+#include <climits>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+
+// Signed interval of the values an i64 may hold at some program point
+namespace {
+
+struct Range {
+    int64_t lo = INT64_MIN;
+    int64_t hi = INT64_MAX;
+
+    static Range of(int64_t v) {
+        return {v, v};
+    }
+    Range intersect(const Range& other) const {
+        return {std::max(lo, other.lo), std::min(hi, other.hi)};
+    }
+    // Shifts by a constant, or the full range if either end could wrap
+    Range offset(int64_t c) const {
+        int64_t new_lo, new_hi;
+        if (__builtin_add_overflow(lo, c, &new_lo) || __builtin_add_overflow(hi, c, &new_hi))
+            return {};
+        return {new_lo, new_hi};
+    }
+};
+
+// Ranges come from the definition of a value (constants, narrow loads and extensions, masks,
+// induction variables) narrowed by the branch conditions and bounds checks that dominate the
+// point of interest. Recursion is depth limited, so the analysis stays cheap and only
+// ever loses precision.
+class RangeAnalysis {
+  public:
+    RangeAnalysis(const DominatorTree& p_dt, const LoopInfo& p_loops)
+        : dt(p_dt), loops(p_loops) {}
+
+    // Range of `v` whenever `at` executes
+    Range rangeAt(const Value* v, const Instruction* at, int depth = 0);
+
+  private:
+    static constexpr int MAX_DEPTH = 6;
+
+    const DominatorTree& dt;
+    const LoopInfo& loops;
+    // Induction variables being analyzed, with the range assumed for them meanwhile
+    std::unordered_map<const Instruction*, Range> assumed;
+
+    Range definition(const Value* v, const Instruction* at, int depth);
+    Range inductionVariable(const Instruction* phi, int depth);
+    Range refine(const Value* v, Range r, const Instruction* at, int depth);
+    Range applyCondition(const Value* v, Range r, const Instruction* cmp, bool holds,
+                         const Instruction* at, int depth);
+};
+
+} // namespace
+
+static const ConstantInt* as_int(const Value* v) {
+    return v->kind == ValueKind::CONSTANT_INT ? static_cast<const ConstantInt*>(v) : nullptr;
+}
+
+static Range range_of_width(const MemType& m, bool is_signed) {
+    if (m.size >= 8)
+        return {};
+    int bits = m.size * 8;
+    if (is_signed)
+        return {-(int64_t(1) << (bits - 1)), (int64_t(1) << (bits - 1)) - 1};
+    return {0, (int64_t(1) << bits) - 1};
+}
+
+Range RangeAnalysis::rangeAt(const Value* v, const Instruction* at, int depth) {
+    if (const ConstantInt* c = as_int(v))
+        return Range::of(c->value);
+    if (depth > MAX_DEPTH || v->type != IRType::I64)
+        return {};
+    return refine(v, definition(v, at, depth), at, depth);
+}
+
+Range RangeAnalysis::definition(const Value* v, const Instruction* at, int depth) {
+    if (v->kind == ValueKind::ARGUMENT) {
+        const auto* arg = static_cast<const Argument*>(v);
+        return range_of_width(arg->mem, arg->mem.is_signed);
+    }
+    if (v->kind != ValueKind::INSTRUCTION)
+        return {};
+
+    const auto* inst = static_cast<const Instruction*>(v);
+    auto it = assumed.find(inst);
+    if (it != assumed.end())
+        return it->second;
+
+    const ConstantInt* rhs = inst->operands.size() == 2 ? as_int(inst->operands[1]) : nullptr;
+    switch (inst->op) {
+    case Opcode::ADD:
+        if (rhs)
+            return rangeAt(inst->operands[0], at, depth + 1).offset(rhs->value);
+        if (const ConstantInt* lhs = as_int(inst->operands[0]))
+            return rangeAt(inst->operands[1], at, depth + 1).offset(lhs->value);
+        return {};
+    case Opcode::SUB:
+        if (rhs && rhs->value != INT64_MIN)
+            return rangeAt(inst->operands[0], at, depth + 1).offset(-rhs->value);
+        return {};
+    case Opcode::AND:
+        if (rhs && rhs->value >= 0)
+            return {0, rhs->value};
+        return {};
+    case Opcode::LSHR:
+        if (rhs && rhs->value > 0 && rhs->value < 64)
+            return {0, static_cast<int64_t>(UINT64_MAX >> rhs->value)};
+        return {};
+    case Opcode::ICMP:
+    case Opcode::FCMP:
+        return {0, 1};
+    case Opcode::SEXT:
+        return range_of_width(inst->mem, true);
+    case Opcode::ZEXT:
+        return range_of_width(inst->mem, false);
+    case Opcode::LOAD:
+        if (inst->mem.is_float)
+            return {};
+        return range_of_width(inst->mem, inst->mem.is_signed);
+    case Opcode::PHI:
+        return inductionVariable(inst, depth);
+    default:
+        return {};
+    }
+}
+
+// A header phi stepping by a constant, `i = phi [init, preheader], [i + c, latch]`, never
+// moves past its initial value in the other direction as long as the step cannot wrap
+Range RangeAnalysis::inductionVariable(const Instruction* phi, int depth) {
+    Loop* loop = loops.loopFor(phi->parent);
+    if (!loop || loop->header != phi->parent || phi->operands.size() != 2)
+        return {};
+
+    int inside = loop->contains(phi->blocks[0]) ? 0 : 1;
+    if (!loop->contains(phi->blocks[inside]) || loop->contains(phi->blocks[1 - inside]))
+        return {};
+
+    const Value* next = phi->operands[inside];
+    if (next->kind != ValueKind::INSTRUCTION)
+        return {};
+    const auto* step_inst = static_cast<const Instruction*>(next);
+    int64_t step = 0;
+    if (step_inst->op == Opcode::ADD && step_inst->operands[0] == phi && as_int(step_inst->operands[1]))
+        step = as_int(step_inst->operands[1])->value;
+    else if (step_inst->op == Opcode::ADD && step_inst->operands[1] == phi &&
+             as_int(step_inst->operands[0]))
+        step = as_int(step_inst->operands[0])->value;
+    else if (step_inst->op == Opcode::SUB && step_inst->operands[0] == phi &&
+             as_int(step_inst->operands[1]) && as_int(step_inst->operands[1])->value != INT64_MIN)
+        step = -as_int(step_inst->operands[1])->value;
+    if (step == 0)
+        return {};
+
+    BasicBlock* entry_pred = phi->blocks[1 - inside];
+    Range init = rangeAt(phi->operands[1 - inside], entry_pred->terminator(), depth + 1);
+    Range candidate = step > 0 ? Range{init.lo, INT64_MAX} : Range{INT64_MIN, init.hi};
+
+    // Assuming the candidate for the phi, the step must not wrap where it is computed
+    assumed[phi] = candidate;
+    Range before_step = rangeAt(phi, step_inst, depth + 1);
+    assumed.erase(phi);
+
+    if (before_step.offset(step).lo == INT64_MIN && before_step.offset(step).hi == INT64_MAX)
+        return {};
+    return candidate;
+}
+
+Range RangeAnalysis::applyCondition(const Value* v, Range r, const Instruction* cmp, bool holds,
+                                    const Instruction* at, int depth) {
+    Cond cond = holds ? cmp->cond : cond_inverse(cmp->cond);
+    const Value* other;
+    if (cmp->operands[0] == v) {
+        other = cmp->operands[1];
+    } else if (cmp->operands[1] == v) {
+        other = cmp->operands[0];
+        cond = cond_swapped(cond);
+    } else {
+        return r;
+    }
+
+    Range bound = rangeAt(other, at, depth + 1);
+    switch (cond) {
+    case Cond::LT:
+        if (bound.hi != INT64_MIN)
+            r.hi = std::min(r.hi, bound.hi - 1);
+        break;
+    case Cond::LE:
+        r.hi = std::min(r.hi, bound.hi);
+        break;
+    case Cond::GT:
+        if (bound.lo != INT64_MAX)
+            r.lo = std::max(r.lo, bound.lo + 1);
+        break;
+    case Cond::GE:
+        r.lo = std::max(r.lo, bound.lo);
+        break;
+    case Cond::EQ:
+        r = r.intersect(bound);
+        break;
+    // Unsigned bounds only carry over when the bound is a non-negative signed value
+    case Cond::ULT:
+        if (bound.lo >= 0 && bound.hi > 0)
+            r = r.intersect({0, bound.hi - 1});
+        break;
+    case Cond::ULE:
+        if (bound.lo >= 0)
+            r = r.intersect({0, bound.hi});
+        break;
+    default:
+        break;
+    }
+    return r;
+}
+
+Range RangeAnalysis::refine(const Value* v, Range r, const Instruction* at, int depth) {
+    auto apply_checks = [&](const BasicBlock* bb, const Instruction* stop) {
+        for (const auto& inst : bb->insts) {
+            if (inst.get() == stop)
+                break;
+            if (inst->op == Opcode::BOUNDS_CHECK && inst->operands[0] == v)
+                r = r.intersect({0, inst->imm - 1});
+        }
+    };
+
+    BasicBlock* bb = at->parent;
+    apply_checks(bb, at);
+
+    // Every block up the dominator tree has executed, and a block entered from a single
+    // conditional branch runs only when its condition went that way
+    while (true) {
+        if (bb->preds.size() == 1) {
+            Instruction* term = bb->preds[0]->terminator();
+            if (term && term->op == Opcode::COND_BR && term->blocks[0] != term->blocks[1] &&
+                term->operands[0]->kind == ValueKind::INSTRUCTION) {
+                const auto* cmp = static_cast<const Instruction*>(term->operands[0]);
+                if (cmp->op == Opcode::ICMP)
+                    r = applyCondition(v, r, cmp, term->blocks[0] == bb, term, depth);
+            }
+        }
+
+        BasicBlock* parent = dt.idom(bb);
+        if (!parent || parent == bb)
+            break;
+        bb = parent;
+        apply_checks(bb, nullptr);
+    }
+    return r;
+}
+
+// Hoisting
+
+// True if the first iteration certainly reaches `check`, with nothing observable happening
+// before it, once the loop is entered
+static bool runs_first_in_loop(const Loop& loop, const LoopInfo& loops, Instruction* check,
+                               Module& mod) {
+    BasicBlock* target = check->parent;
+
+    for (const auto& inst : target->insts) {
+        if (inst.get() == check)
+            break;
+        if (inst->hasSideEffects() && inst->op != Opcode::BOUNDS_CHECK)
+            return false;
+    }
+    if (target == loop.header)
+        return true;
+
+    // Blocks of the iteration that may run before the check
+    std::unordered_set<BasicBlock*> before;
+    std::vector<BasicBlock*> work(target->preds.begin(), target->preds.end());
+    while (!work.empty()) {
+        BasicBlock* bb = work.back();
+        work.pop_back();
+        if (!loop.contains(bb) || !before.insert(bb).second || bb == loop.header)
+            continue;
+        work.insert(work.end(), bb->preds.begin(), bb->preds.end());
+    }
+    if (!before.count(loop.header))
+        return false;
+
+    for (BasicBlock* bb : before) {
+        if (loops.loopFor(bb) != &loop)
+            return false;
+        for (const auto& inst : bb->insts) {
+            if (inst->hasSideEffects() && inst->op != Opcode::BOUNDS_CHECK &&
+                !inst->isTerminator())
+                return false;
+        }
+        if (bb == loop.header)
+            continue;
+        Instruction* term = bb->terminator();
+        if (!term || term->op == Opcode::RET || term->op == Opcode::UNREACHABLE)
+            return false;
+        for (BasicBlock* succ : term->blocks) {
+            if (!loop.contains(succ))
+                return false;
+        }
+    }
+
+    // The header may leave the loop, unless its test is known to pass on entry
+    Instruction* term = loop.header->terminator();
+    if (!term || term->op != Opcode::COND_BR)
+        return term && term->op == Opcode::BR && loop.contains(term->blocks[0]);
+    if (term->operands[0]->kind != ValueKind::INSTRUCTION)
+        return false;
+    const auto* cmp = static_cast<const Instruction*>(term->operands[0]);
+    if (cmp->parent != loop.header || cmp->op != Opcode::ICMP)
+        return false;
+
+    std::vector<Value*> entry_operands;
+    for (Value* op : cmp->operands) {
+        Value* entry_value = op;
+        if (op->kind == ValueKind::INSTRUCTION && static_cast<Instruction*>(op)->op == Opcode::PHI &&
+            static_cast<Instruction*>(op)->parent == loop.header) {
+            auto* phi = static_cast<Instruction*>(op);
+            entry_value = nullptr;
+            for (size_t i = 0; i < phi->blocks.size(); i++) {
+                if (!loop.contains(phi->blocks[i]))
+                    entry_value = phi->operands[i];
+            }
+        }
+        entry_operands.push_back(entry_value);
+    }
+    Value* taken = fold_constant(*cmp, entry_operands, mod);
+    if (!taken)
+        return false;
+    BasicBlock* first = term->blocks[static_cast<ConstantInt*>(taken)->value ? 0 : 1];
+    return loop.contains(first);
+}
+
+bool BoundsCheckPass::runOnFunction(Function& fn) {
+    BoundsMode mode = ctx.options.bounds_mode;
+    bool changed = false;
+
+    std::vector<Instruction*> checks;
+    auto collect = [&]() {
+        checks.clear();
+        for (auto& bb : fn.blocks) {
+            for (auto& inst : bb->insts) {
+                if (inst->op == Opcode::BOUNDS_CHECK)
+                    checks.push_back(inst.get());
+            }
+        }
+    };
+    collect();
+    size_t emitted = checks.size();
+    size_t eliminated = 0;
+    size_t hoisted = 0;
+
+    if (mode == BoundsMode::OFF) {
+        for (Instruction* check : checks)
+            check->parent->erase(check);
+        eliminated = checks.size();
+        changed = !checks.empty();
+        checks.clear();
+    } else if (mode != BoundsMode::FULL && !checks.empty()) {
+        fn.rebuildCFG();
+
+        // Hoisting needs somewhere to put the checks
+        {
+            DominatorTree dt(fn);
+            LoopInfo loops(dt);
+            for (auto& loop : loops.loops()) {
+                if (!loop->preheader()) {
+                    ensure_preheader(fn, *loop);
+                    changed = true;
+                }
+            }
+        }
+
+        DominatorTree dt(fn);
+        LoopInfo loops(dt);
+        RangeAnalysis ranges(dt, loops);
+
+        // Decide everything before erasing, later checks may rely on earlier ones
+        std::vector<Instruction*> redundant;
+        for (Instruction* check : checks) {
+            if (!dt.isReachable(check->parent))
+                continue;
+            Range r = ranges.rangeAt(check->operands[0], check);
+            if (r.lo >= 0 && r.hi < check->imm)
+                redundant.push_back(check);
+        }
+        for (Instruction* check : redundant)
+            check->parent->erase(check);
+        eliminated = redundant.size();
+        changed |= !redundant.empty();
+
+        collect();
+        for (Instruction* check : checks) {
+            Loop* loop = loops.loopFor(check->parent);
+            if (!loop || !loop->isInvariant(check->operands[0]))
+                continue;
+            if (!runs_first_in_loop(*loop, loops, check, *fn.parent))
+                continue;
+
+            BasicBlock* pre = loop->preheader();
+            if (!pre)
+                continue;
+            hoist_to_preheader(check, pre);
+            hoisted++;
+            changed = true;
+        }
+    }
+
+    if (ctx.options.bounds_report && emitted > 0) {
+        std::cout << "bounds checks in '" << fn.name << "': " << emitted - eliminated
+                  << " of " << emitted << " remain";
+        if (mode != BoundsMode::OFF)
+            std::cout << " (" << eliminated << " proven safe, " << hoisted
+                      << " hoisted out of loops)";
+        std::cout << "\n";
+    }
+    return changed;
+}
@@ -1,29 +1,172 @@
 #include "CodeGen.h"
 
 #include "AbstractSyntaxTree.h"
+#include "Immediates.h"
+#include "StrengthReduction.h"
 #include "Token.h"
 #include "Type.h"
-#include "capp_stdlib.h"
+#include "utils.h"
 
+#include <algorithm>
+#include <bit>
 #include <cstdint>
 #include <iomanip>
+#include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
 
-CodeGen::CodeGen(const Program& prog, std::ostream& output, CompilerContext& p_ctx)
-    : prog(prog), out(output), current_type(TypeSystem::Int32), ctx(p_ctx) {}
+CodeGen::CodeGen(const Program& prog, const SemanticInfo& p_sema, std::ostream& output,
+                 CompilerContext& p_ctx)
+    : prog(prog), sema(p_sema), out(output), ctx(p_ctx), peephole(p_ctx) {}
 
 std::string CodeGen::nextLabel(const std::string& prefix) {
     return prefix + "_" + std::to_string(label_counter++);
 }
 
 void CodeGen::emit(const std::string& instr) {
-    out << "\t" << instr << "\n";
+    if (current_block)
+        current_block->insts.push_back(parse_machine_instr(instr));
+    else
+        out << "\t" << instr << "\n";
 }
 
 void CodeGen::emitLabel(const std::string& label) {
-    out << label << ":\n";
+    if (current_function) {
+        current_block = current_function->createBlock(label);
+        current_block->loop_depth = loop_depth;
+    } else
+        out << label << ":\n";
+}
+
+void CodeGen::emitInteger(const std::string& reg, uint64_t value) {
+    std::vector<MoveStep> steps = integer_move_sequence(value);
+    if (steps.size() <= MAX_MOVE_STEPS) {
+        for (const MoveStep& step : steps)
+            emit(move_step_text(step, reg));
+        return;
+    }
+    std::string label = literalLabel(value);
+    emit("adrp " + reg + ", " + label + "@PAGE");
+    emit("ldr " + reg + ", [" + reg + ", " + label + "@PAGEOFF]");
+}
+
+std::string CodeGen::literalLabel(uint64_t bits) {
+    auto [it, inserted] = literal_labels.try_emplace(bits);
+    if (inserted) {
+        it->second = nextLabel("L_lit");
+        literals.push_back({it->second, bits});
+    }
+    return it->second;
+}
+
+// `dst = base +/- amount` (opcode add or sub) for an amount below 2^24, in 12-bit halves
+static std::vector<MachineInstr> split_immediate(const std::string& opcode, const std::string& dst,
+                                                 const std::string& base, int64_t amount) {
+    std::vector<MachineInstr> out;
+    if (amount <= 4095) {
+        out.push_back(parse_machine_instr(opcode + " " + dst + ", " + base + ", #" +
+                                          std::to_string(amount)));
+        return out;
+    }
+    out.push_back(parse_machine_instr(opcode + " " + dst + ", " + base + ", #" +
+                                      std::to_string(amount >> 12) + ", lsl #12"));
+    if (amount & 0xFFF)
+        out.push_back(parse_machine_instr(opcode + " " + dst + ", " + dst + ", #" +
+                                          std::to_string(amount & 0xFFF)));
+    return out;
+}
+
+// Locals further than 256 bytes below x29 are out of reach of ldur / stur, their address
+// goes through x16 first. Frame adjustments and address computations past the 12-bit
+// immediate of add / sub are split in two.
+static void legalize_frame_offsets(MachineFunction& mf) {
+    for (auto& mb : mf.blocks) {
+        std::vector<MachineInstr> out;
+        for (auto& mi : mb->insts) {
+            const std::string& op = mi.opcode;
+            bool is_memory = (op.rfind("ld", 0) == 0 || op.rfind("st", 0) == 0) &&
+                             op != "ldp" && op != "stp" && mi.ops.size() == 2 &&
+                             mi.ops[1].kind == MachineOperand::Kind::MEM;
+            if (is_memory) {
+                MachineOperand& addr = mi.ops[1];
+                if (addr.mode == AddrMode::OFFSET && addr.reg == MReg::phys(REG_FP) &&
+                    addr.imm < -256) {
+                    for (auto& sub : split_immediate("sub", "x16", "x29", -addr.imm))
+                        out.push_back(std::move(sub));
+                    addr.reg = MReg::phys(16);
+                    addr.imm = 0;
+                    if (op.size() > 2 && op[2] == 'u')
+                        mi.opcode = op.substr(0, 2) + op.substr(3);
+                }
+            } else if ((op == "add" || op == "sub") && mi.ops.size() == 3 &&
+                       mi.ops[2].kind == MachineOperand::Kind::IMM && mi.ops[2].imm > 4095 &&
+                       mi.ops[2].imm < (1 << 24)) {
+                for (auto& split : split_immediate(op, reg_name(mi.ops[0].reg, 'x'),
+                                                   reg_name(mi.ops[1].reg, 'x'), mi.ops[2].imm))
+                    out.push_back(std::move(split));
+                continue;
+            }
+            out.push_back(std::move(mi));
+        }
+        mb->insts = std::move(out);
+    }
+}
+
+void CodeGen::flushFunction() {
+    peephole.run(*current_function);
+    legalize_frame_offsets(*current_function);
+
+    if (ctx.options.bounds_report && bounds_checks > 0)
+        std::cout << "bounds checks in '" << current_function->name << "': " << bounds_checks
+                  << " of " << bounds_checks << " remain\n";
+    bounds_checks = 0;
+
+    // Labels no instruction refers to are only reached by falling through
+    std::unordered_set<std::string> referenced;
+    for (const auto& mb : current_function->blocks) {
+        for (const auto& mi : mb->insts) {
+            for (const auto& op : mi.ops) {
+                if (op.kind == MachineOperand::Kind::SYMBOL)
+                    referenced.insert(op.text);
+            }
+        }
+    }
+
+    std::ostringstream text;
+    text << ".p2align 2\n";
+    for (const auto& mb : current_function->blocks) {
+        if (mb == current_function->blocks.front() || referenced.count(mb->label))
+            text << mb->label << ":\n";
+        for (const auto& mi : mb->insts) {
+            text << "\t";
+            print_machine_instr(text, mi);
+            text << "\n";
+        }
+    }
+    layout.addFunction(*current_function);
+    function_text["_" + current_function->name] = text.str();
+
+    current_function.reset();
+    current_block = nullptr;
+}
+
+// The AST generator has no analysis to drop checks with, so hoisted checking is full checking
+void CodeGen::genBoundsCheck(int length) {
+    if (ctx.options.bounds_mode == BoundsMode::OFF)
+        return;
+
+    bounds_checks++;
+    emit("cmp x0, #" + std::to_string(length));
+    if (ctx.options.bounds_mode == BoundsMode::TRAP) {
+        requires_bounds_trap = true;
+        emit("b.hs L_bounds_trap");
+    } else {
+        requires_bounds_panic = true; // Tell the compiler to emit the panic routine later
+        emit("b.hs L_bounds_violation_panic");
+    }
 }
 
 // Dispatch Methods (Visitor Entry Points)
@@ -34,25 +177,46 @@ void CodeGen::genStmt(const Stmt* stmt) {
 }
 
 void CodeGen::genExpr(const Expr* expr) {
-    if (expr)
-        expr->accept(*this);
+    if (!expr)
+        return;
+
+    expr->accept(*this);
+    emitConversion(sema.expr(expr));
+}
+
+void CodeGen::emitConversion(const ExprInfo& info) {
+    switch (info.conversion) {
+    case ConversionKind::NONE:
+        break;
+    case ConversionKind::INT_TO_FLOAT:
+        if (info.converted_type.size_bytes == 4)
+            emit("scvtf s0, x0");
+        else
+            emit("scvtf d0, x0");
+        break;
+    case ConversionKind::FLOAT_TO_INT:
+        if (info.type.size_bytes == 4)
+            emit("fcvtzs x0, s0");
+        else
+            emit("fcvtzs x0, d0");
+        break;
+    case ConversionKind::FLOAT_EXTEND:
+        emit("fcvt d0, s0");
+        break;
+    case ConversionKind::FLOAT_TRUNCATE:
+        emit("fcvt s0, d0");
+        break;
+    }
 }
 
 void CodeGen::visitArrayAccessExpr(const ArrayAccessExpr* expr) {
     genExpr(expr->idx.get());
 
-    auto* ident = dynamic_cast<const IdentifierExpr*>(expr->array.get());
-    if (!ident)
-        ctx.de.report(DiagnosticLevel::ERROR, "Only direct array identifiers are supported in MVP.",
-                      0, 0);
-
-    Type arrayType = ident->type;
-    Type elementType = *arrayType.baseType;
-    int length = arrayType.array_length;
+    const ExprInfo& info = sema.expr(expr);
+    Type elementType = info.type;
+    int length = sema.expr(expr->array.get()).type.array_length;
 
-    requires_bounds_panic = true; // Tell the compiler to emit the panic routine later
-    emit("cmp x0, #" + std::to_string(length));
-    emit("b.hs L_bounds_violation_panic");
+    genBoundsCheck(length);
 
     int shift = 0;
     if (elementType.size_bytes == 8)
@@ -68,7 +232,7 @@ void CodeGen::visitArrayAccessExpr(const ArrayAccessExpr* expr) {
         emit("mov x1, x0"); // 1 byte size
 
     // 4. Calculate actual address: (Frame Pointer - Array Base Offset) + Element Offset
-    emit("sub x2, x29, #" + std::to_string(ident->offset));
+    emit("sub x2, x29, #" + std::to_string(info.frame_offset));
     emit("add x2, x2, x1"); // x2 now holds the exact address of arr[i]
 
     // 5. Load the value from memory into our working register
@@ -89,58 +253,52 @@ void CodeGen::visitArrayAccessExpr(const ArrayAccessExpr* expr) {
             else
                 emit("ldrh w0, [x2]");
         } else if (elementType.size_bytes == 4) {
-            emit("ldr w0, [x2]");
+            if (elementType.is_signed)
+                emit("ldrsw x0, [x2]");
+            else
+                emit("ldr w0, [x2]");
         } else {
             emit("ldr x0, [x2]");
         }
     }
-
-    current_type = elementType;
 }
 
 void CodeGen::visitArrayLiteralExpr(const ArrayLiteralExpr* expr) {
-    ctx.de.report(DiagnosticLevel::ERROR,
-                  "Array literals are currently only supported in variable declarations.", 0, 0);
+    // Only reachable through visitVariableDeclStmt, which stores the elements itself
 }
 
 void CodeGen::visitPropertyAccessExpr(const PropertyAccessExpr* expr) {
-    if (expr->type.kind == TypeKind::CLASS) {
-        ctx.de.report(DiagnosticLevel::ERROR, "Class field access by value is not supported.", 0,
-                      0);
-    }
-    auto* ident = dynamic_cast<const IdentifierExpr*>(expr->object.get());
-    if (!ident) {
-        ctx.de.report(DiagnosticLevel::ERROR,
-                      "Only direct object identifiers are supported for field access.", 0, 0);
-    }
+    const ExprInfo& info = sema.expr(expr);
+    const Type& fieldType = info.type;
 
     // Base address of object
-    emit("sub x2, x29, #" + std::to_string(ident->offset));
+    emit("sub x2, x29, #" + std::to_string(info.frame_offset));
 
     if (expr->field_offset != 0) {
         emit("add x2, x2, #" + std::to_string(expr->field_offset));
     }
 
-    current_type = expr->type;
-
-    if (current_type.is_float) {
-        if (current_type.size_bytes == 4)
+    if (fieldType.is_float) {
+        if (fieldType.size_bytes == 4)
             emit("ldr s0, [x2]");
         else
             emit("ldr d0, [x2]");
     } else {
-        if (current_type.size_bytes == 1) {
-            if (current_type.is_signed)
+        if (fieldType.size_bytes == 1) {
+            if (fieldType.is_signed)
                 emit("ldrsb x0, [x2]");
             else
                 emit("ldrb w0, [x2]");
-        } else if (current_type.size_bytes == 2) {
-            if (current_type.is_signed)
+        } else if (fieldType.size_bytes == 2) {
+            if (fieldType.is_signed)
                 emit("ldrsh x0, [x2]");
             else
                 emit("ldrh w0, [x2]");
-        } else if (current_type.size_bytes == 4) {
-            emit("ldr w0, [x2]");
+        } else if (fieldType.size_bytes == 4) {
+            if (fieldType.is_signed)
+                emit("ldrsw x0, [x2]");
+            else
+                emit("ldr w0, [x2]");
         } else {
             emit("ldr x0, [x2]");
         }
@@ -155,7 +313,16 @@ void CodeGen::generate() {
         genStmt(s.get());
     }
 
-    if (requires_bounds_panic) {
+    // Functions main cannot reach are dropped, the rest go out in call graph order
+    for (const std::string& symbol : layout.order())
+        out << function_text.at(symbol);
+
+    // Along with the data only they referred to
+    std::set<std::string> used = layout.referencedSymbols();
+    std::erase_if(string_literals, [&](const auto& s) { return !used.count(s.first); });
+    std::erase_if(literals, [&](const auto& lit) { return !used.count(lit.first); });
+
+    if (requires_bounds_panic && used.count("L_bounds_violation_panic")) {
         emitLabel("L_bounds_violation_panic");
         emit("adrp x0, L_panic_msg@PAGE");
         emit("add x0, x0, L_panic_msg@PAGEOFF");
@@ -164,23 +331,71 @@ void CodeGen::generate() {
 
         string_literals.push_back({"L_panic_msg", "Runtime Error: Array index out of bounds!\\n"});
     }
+    if (requires_bounds_trap && used.count("L_bounds_trap")) {
+        emitLabel("L_bounds_trap");
+        emit("brk #1");
+    }
+
+    emit_cstrings(out, string_literals);
 
-    if (!string_literals.empty()) {
-        out << "\n.section __TEXT,__cstring,cstring_literals\n";
-        for (const auto& [label, value] : string_literals) {
+    if (!literals.empty()) {
+        out << "\n.section __TEXT,__literal8,8byte_literals\n.p2align 3\n";
+        for (const auto& [label, bits] : literals) {
             emitLabel(label);
-            out << "\t.asciz \"" << value << "\"\n";
+            out << "\t.quad 0x" << std::hex << bits << std::dec << "\n";
         }
     }
 
-    out << STDLIB_ASM;
+    emit_stdlib(out, layout.externalCallees());
+    // Every function is an atom of its own, for the linker's dead stripping and ordering
+    out << "\n.subsections_via_symbols\n";
+
+    if (ctx.options.peephole_stats)
+        peephole.printStats(std::cout);
 }
 
 // Statement Visitors
 
+// True if every path through `stmt` ends in a return, so nothing after it can run
+static bool always_returns(const Stmt* stmt) {
+    if (dynamic_cast<const ReturnStmt*>(stmt))
+        return true;
+    if (auto* block = dynamic_cast<const BlockStmt*>(stmt)) {
+        return std::any_of(block->statements.begin(), block->statements.end(),
+                           [](const StmtPtr& s) { return always_returns(s.get()); });
+    }
+    if (auto* branch = dynamic_cast<const IfStmt*>(stmt)) {
+        return branch->else_branch && always_returns(branch->then_branch.get()) &&
+               always_returns(branch->else_branch.value().get());
+    }
+    return false;
+}
+
+// True if evaluating `expr` only computes its value: no assignment, call, pointer read or
+// bounds checked array access
+static bool is_pure_expr(const Expr* expr) {
+    if (dynamic_cast<const LiteralExpr*>(expr) || dynamic_cast<const IdentifierExpr*>(expr))
+        return true;
+    if (auto* group = dynamic_cast<const GroupingExpr*>(expr))
+        return is_pure_expr(group->expr.get());
+    if (auto* unary = dynamic_cast<const UnaryExpr*>(expr)) {
+        TokenType op = unary->op.type;
+        return (op == TokenType::OPERATOR_MINUS || op == TokenType::EXCLAMATION) &&
+               is_pure_expr(unary->right.get());
+    }
+    if (auto* binary = dynamic_cast<const BinaryExpr*>(expr)) {
+        return binary->op.type != TokenType::OPERATOR_ASSIGNMENT &&
+               is_pure_expr(binary->left.get()) && is_pure_expr(binary->right.get());
+    }
+    return false;
+}
+
 void CodeGen::visitBlockStmt(const BlockStmt* stmt) {
     for (const auto& s : stmt->statements) {
         genStmt(s.get());
+        // Statements after a return are never executed
+        if (always_returns(s.get()))
+            break;
     }
 }
 
@@ -205,46 +420,21 @@ void CodeGen::visitReturnStmt(const ReturnStmt* stmt) {
 
 void CodeGen::visitVariableDeclStmt(const VariableDeclStmt* stmt) {
     if (stmt->initializer) {
+        const DeclInfo& decl = sema.decl(stmt);
+        Type varType = decl.type;
 
         if (auto* arrayLit =
                 dynamic_cast<const ArrayLiteralExpr*>(stmt->initializer.value().get())) {
-            Type varType = stmt->type;
-
-            if (varType.kind != TypeKind::ARRAY) {
-
-                ctx.de.report(DiagnosticLevel::ERROR,
-                              "Cannot assign an array literal to a non-array type.", 0, 0);
-            }
-            if (arrayLit->elements.size() > varType.array_length) {
-                ctx.de.report(DiagnosticLevel::ERROR, "Too many initializers for array bounds.", 0,
-                              0);
-            }
-
             Type elementType = *varType.baseType;
             int element_size = elementType.size_bytes;
 
-            // Iterate through the literal values
+            // Iterate through the literal values (already converted to the element type)
             for (int i = 0; i < arrayLit->elements.size(); i++) {
                 genExpr(arrayLit->elements[i].get());
 
-                if (elementType.is_float) {
-                    if (!current_type.is_float) {
-                        emit("scvtf d0, x0");
-                        current_type = (current_type.size_bytes == 4) ? TypeSystem::Float32
-                                                                      : TypeSystem::Float64;
-                    }
-                    if (elementType.size_bytes == 4 && current_type.size_bytes == 8)
-                        emit("fcvt s0, d0");
-                    else if (elementType.size_bytes == 8 && current_type.size_bytes == 4)
-                        emit("fcvt d0, s0");
-                } else {
-                    if (current_type.is_float)
-                        emit("fcvtzs x0, d0");
-                }
-
-                // Array base is at: x29 - stmt->offset
+                // Array base is at: x29 - decl.frame_offset
                 // Element address is: Array base + (i * element_size)
-                int memory_offset = stmt->offset - (i * element_size);
+                int memory_offset = decl.frame_offset - (i * element_size);
 
                 if (elementType.is_float) {
                     if (elementType.size_bytes == 4)
@@ -265,116 +455,103 @@ void CodeGen::visitVariableDeclStmt(const VariableDeclStmt* stmt) {
             return;
         }
 
+        // Evaluates and converts the initializer to the declared type
         genExpr(stmt->initializer.value().get());
 
-        Type varType = TypeSystem::from_string(stmt->type_token.lexeme).value();
-
-        if (varType.is_float) {
-            // Int -> Float
-            if (!current_type.is_float) {
-                emit("scvtf d0, x0");
-                current_type =
-                    (current_type.size_bytes == 4) ? TypeSystem::Float32 : TypeSystem::Float64;
-            }
-
-            // Float64 -> Float32 (Downcast)
-            if (varType.size_bytes == 4 && current_type.size_bytes == 8) {
-                emit("fcvt s0, d0");
-            }
-            // Float32 -> Float64 (Upcast)
-            else if (varType.size_bytes == 8 && current_type.size_bytes == 4) {
-                emit("fcvt d0, s0");
-            }
-        }
-        // Handle Int conversions (Simple cast or Float->Int)
-        else {
-            if (current_type.is_float) {
-                emit("fcvtzs x0, d0"); // Float -> Int
-            }
-        }
-
         // Store result
         if (varType.is_float) {
             if (varType.size_bytes == 4) {
-                emit("stur s0, [x29, #-" + std::to_string(stmt->offset) + "]");
+                emit("stur s0, [x29, #-" + std::to_string(decl.frame_offset) + "]");
             } else {
-                emit("stur d0, [x29, #-" + std::to_string(stmt->offset) + "]");
+                emit("stur d0, [x29, #-" + std::to_string(decl.frame_offset) + "]");
             }
         } else {
             if (varType.size_bytes == 1) {
-                emit("sturb w0, [x29, #-" + std::to_string(stmt->offset) + "]");
+                emit("sturb w0, [x29, #-" + std::to_string(decl.frame_offset) + "]");
             } else if (varType.size_bytes == 2) {
-                emit("sturh w0, [x29, #-" + std::to_string(stmt->offset) + "]");
+                emit("sturh w0, [x29, #-" + std::to_string(decl.frame_offset) + "]");
             } else if (varType.size_bytes == 4) {
-                emit("stur w0, [x29, #-" + std::to_string(stmt->offset) + "]");
+                emit("stur w0, [x29, #-" + std::to_string(decl.frame_offset) + "]");
             } else {
-                emit("stur x0, [x29, #-" + std::to_string(stmt->offset) + "]");
+                emit("stur x0, [x29, #-" + std::to_string(decl.frame_offset) + "]");
             }
         }
     }
 }
-
 void CodeGen::visitExprStmt(const ExprStmt* stmt) {
+    // The value is discarded, so an expression without effects needs no code at all
+    if (is_pure_expr(stmt->expr.get()))
+        return;
     genExpr(stmt->expr.get());
 }
 
 void CodeGen::visitIfStmt(const IfStmt* stmt) {
-    std::string labelElse = nextLabel("L_else");
     std::string labelEnd = nextLabel("L_if_end");
 
-    genExpr(stmt->condition.get());
-    emit("cmp x0, #0");
-    emit("b.eq " + labelElse);
+    if (!stmt->else_branch) {
+        genCondBranch(stmt->condition.get(), labelEnd, false);
+        genStmt(stmt->then_branch.get());
+        emitLabel(labelEnd);
+        return;
+    }
+
+    std::string labelElse = nextLabel("L_else");
+    genCondBranch(stmt->condition.get(), labelElse, false);
 
     genStmt(stmt->then_branch.get());
-    emit("b " + labelEnd);
+    if (!always_returns(stmt->then_branch.get()))
+        emit("b " + labelEnd);
 
     emitLabel(labelElse);
-    if (stmt->else_branch) {
-        genStmt(stmt->else_branch.value().get());
-    }
-    emitLabel(labelEnd);
+    genStmt(stmt->else_branch.value().get());
+    if (!always_returns(stmt))
+        emitLabel(labelEnd);
 }
 
+// Loops are emitted bottom-tested: a guard skips the loop when the condition fails on entry,
+// and the test after the body branches back, so an iteration takes one branch instead of
+// two.
 void CodeGen::visitWhileStmt(const WhileStmt* stmt) {
-    std::string labelStart = nextLabel("L_while_start");
+    std::string labelBody = nextLabel("L_while_body");
     std::string labelEnd = nextLabel("L_while_end");
 
-    emitLabel(labelStart);
-
-    genExpr(stmt->condition.get());
-    emit("cmp x0, #0");
-    emit("b.eq " + labelEnd);
+    genCondBranch(stmt->condition.get(), labelEnd, false);
 
+    loop_depth++;
+    emitLabel(labelBody);
     genStmt(stmt->body.get());
 
-    emit("b " + labelStart);
+    genCondBranch(stmt->condition.get(), labelBody, true);
+    loop_depth--;
     emitLabel(labelEnd);
 }
 
 void CodeGen::visitForStmt(const ForStmt* stmt) {
-    std::string labelStart = nextLabel("L_for_start");
+    std::string labelBody = nextLabel("L_for_body");
     std::string labelEnd = nextLabel("L_for_end");
 
     if (stmt->initializer) {
         genStmt(stmt->initializer.value().get());
     }
 
-    emitLabel(labelStart);
-
     if (stmt->condition) {
-        genExpr(stmt->condition.value().get());
-        emit("cmp x0, #0");
-        emit("b.eq " + labelEnd);
+        genCondBranch(stmt->condition.value().get(), labelEnd, false);
     }
 
+    loop_depth++;
+    emitLabel(labelBody);
     genStmt(stmt->body.get());
 
     if (stmt->increment) {
         genExpr(stmt->increment.value().get());
     }
 
-    emit("b " + labelStart);
+    if (stmt->condition) {
+        genCondBranch(stmt->condition.value().get(), labelBody, true);
+    } else {
+        emit("b " + labelBody);
+    }
+    loop_depth--;
     emitLabel(labelEnd);
 }
 
@@ -385,6 +562,7 @@ void CodeGen::visitFunctionDeclStmt(const FunctionDeclStmt* stmt) {
     int saved_stack_size = current_func_stack_size;
     current_func_stack_size = stmt->stack_size;
 
+    current_function = std::make_unique<MachineFunction>(stmt->name_token.lexeme);
     emitLabel(name);
 
     // Prologue
@@ -400,23 +578,24 @@ void CodeGen::visitFunctionDeclStmt(const FunctionDeclStmt* stmt) {
     }
 
     // Process parameters
-    // We use current_param_index to track which register (w0/x0/s0/d0 etc) to use
-    current_param_index = 0;
     for (const auto& param : stmt->params) {
         genStmt(param.get()); // Dispatches to visitFunctionParameterStmt
-        current_param_index++;
     }
 
     // Generate function body
     genStmt(stmt->body.get());
 
     // Epilogue (implicit return 0 if no return stmt reached)
-    emit("mov x0, #0");
-    if (stackSize > 0) {
-        emit("add sp, sp, #" + std::to_string(stackSize));
+    if (!always_returns(stmt->body.get())) {
+        emit("mov x0, #0");
+        if (stackSize > 0) {
+            emit("add sp, sp, #" + std::to_string(stackSize));
+        }
+        emit("ldp x29, x30, [sp], #16");
+        emit("ret");
     }
-    emit("ldp x29, x30, [sp], #16");
-    emit("ret");
+
+    flushFunction();
 
     // Restore state
     current_func_stack_size = saved_stack_size;
@@ -424,20 +603,21 @@ void CodeGen::visitFunctionDeclStmt(const FunctionDeclStmt* stmt) {
 
 void CodeGen::visitFunctionParameterStmt(const FunctionParameterStmt* stmt) {
     // This method is called via genStmt loop in visitFunctionDeclStmt
-    int offset = stmt->offset;
-    Type param_type = TypeSystem::from_string(stmt->type_token.lexeme).value();
+    const DeclInfo& decl = sema.decl(stmt);
+    int offset = decl.frame_offset;
+    const Type& param_type = decl.type;
 
     // Limit to 8 registers for arguments
-    if (current_param_index > 7)
+    if (decl.param_index > 7)
         return;
 
     if (param_type.is_float) {
         std::string reg =
-            (param_type.size_bytes == 4 ? "s" : "d") + std::to_string(current_param_index);
+            (param_type.size_bytes == 4 ? "s" : "d") + std::to_string(decl.param_index);
         emit("stur " + reg + ", [x29, #-" + std::to_string(offset) + "]");
     } else {
         std::string reg =
-            (param_type.size_bytes < 8 ? "w" : "x") + std::to_string(current_param_index);
+            (param_type.size_bytes < 8 ? "w" : "x") + std::to_string(decl.param_index);
 
         if (param_type.size_bytes == 1) {
             emit("sturb " + reg + ", [x29, #-" + std::to_string(offset) + "]");
@@ -453,158 +633,146 @@ void CodeGen::visitFunctionParameterStmt(const FunctionParameterStmt* stmt) {
 
 // Expression Visitors
 
+
 void CodeGen::visitLiteralExpr(const LiteralExpr* expr) {
     if (std::holds_alternative<uint64_t>(expr->token.fd)) {
-        uint64_t val = std::get<uint64_t>(expr->token.fd);
-        emit("ldr x0, =" + std::to_string(val));
-        current_type = TypeSystem::Int64;
+        emitInteger("x0", std::get<uint64_t>(expr->token.fd));
     } else if (std::holds_alternative<double>(expr->token.fd)) {
         double val = std::get<double>(expr->token.fd);
-        std::string label = nextLabel("L_float");
-
-        emit(".section __TEXT,__literal8,8byte_literals");
-        emitLabel(label);
-
-        std::ostringstream oss;
-        oss << std::fixed << std::setprecision(15) << val;
-        emit(".double " + oss.str());
-
-        emit(".section __TEXT,__text,regular,pure_instructions");
-
-        emit("adrp x0, " + label + "@PAGE");
-        emit("ldr d0, [x0, " + label + "@PAGEOFF]");
-
-        current_type = TypeSystem::Float64;
+        if (std::bit_cast<uint64_t>(val) == 0) {
+            emit("movi d0, #0");
+        } else if (is_fmov_immediate(val)) {
+            std::ostringstream oss;
+            oss << std::setprecision(17) << val;
+            std::string text = oss.str();
+            if (text.find_first_of(".e") == std::string::npos)
+                text += ".0";
+            emit("fmov d0, #" + text);
+        } else {
+            // Pooled after the functions, so no section switch splits the instruction stream
+            std::string label = literalLabel(std::bit_cast<uint64_t>(val));
+            emit("adrp x0, " + label + "@PAGE");
+            emit("ldr d0, [x0, " + label + "@PAGEOFF]");
+        }
     } else if (std::holds_alternative<std::string>(expr->token.fd)) {
-        std::string val = std::get<std::string>(expr->token.fd);
-        std::string label = nextLabel("L_str");
-
-        string_literals.push_back({label, val});
+        const std::string& val = std::get<std::string>(expr->token.fd);
+        auto [it, inserted] = string_labels.try_emplace(val);
+        if (inserted) {
+            it->second = nextLabel("L_str");
+            string_literals.push_back({it->second, val});
+        }
+        const std::string& label = it->second;
 
         emit("adrp x0, " + label + "@PAGE");
         emit("add x0, x0, " + label + "@PAGEOFF");
-        current_type = TypeSystem::StringLiteral;
     }
 }
 
 void CodeGen::visitIdentifierExpr(const IdentifierExpr* expr) {
-    current_type = expr->type;
-
-    if (current_type.kind == TypeKind::CLASS) {
-        ctx.de.report(DiagnosticLevel::ERROR,
-                      "Class values cannot be used directly, Use field access or pointers. ", 0, 0);
-    }
+    const ExprInfo& info = sema.expr(expr);
+    const Type& varType = info.type;
+    std::string offset = std::to_string(info.frame_offset);
 
-    if (current_type.is_float) {
-        if (current_type.size_bytes == 4) {
-            emit("ldur s0, [x29, #-" + std::to_string(expr->offset) + "]");
+    if (varType.is_float) {
+        if (varType.size_bytes == 4) {
+            emit("ldur s0, [x29, #-" + offset + "]");
         } else {
-            emit("ldur d0, [x29, #-" + std::to_string(expr->offset) + "]");
+            emit("ldur d0, [x29, #-" + offset + "]");
         }
     } else {
-        if (current_type.size_bytes == 1) {
-            if (current_type.is_signed) {
-                emit("ldursb x0, [x29, #-" + std::to_string(expr->offset) + "]");
+        if (varType.size_bytes == 1) {
+            if (varType.is_signed) {
+                emit("ldursb x0, [x29, #-" + offset + "]");
             } else {
-                emit("ldurb w0, [x29, #-" + std::to_string(expr->offset) + "]");
+                emit("ldurb w0, [x29, #-" + offset + "]");
             }
-        } else if (current_type.size_bytes == 2) {
-            if (current_type.is_signed) {
-                emit("ldursh x0, [x29, #-" + std::to_string(expr->offset) + "]");
+        } else if (varType.size_bytes == 2) {
+            if (varType.is_signed) {
+                emit("ldursh x0, [x29, #-" + offset + "]");
             } else {
-                emit("ldurh w0, [x29, #-" + std::to_string(expr->offset) + "]");
+                emit("ldurh w0, [x29, #-" + offset + "]");
+            }
+        } else if (varType.size_bytes == 4) {
+            if (varType.is_signed) {
+                emit("ldursw x0, [x29, #-" + offset + "]");
+            } else {
+                emit("ldur w0, [x29, #-" + offset + "]");
             }
-        } else if (current_type.size_bytes == 4) {
-            emit("ldur w0, [x29, #-" + std::to_string(expr->offset) + "]");
         } else {
-            emit("ldur x0, [x29, #-" + std::to_string(expr->offset) + "]");
+            emit("ldur x0, [x29, #-" + offset + "]");
         }
     }
 }
 
 void CodeGen::visitUnaryExpr(const UnaryExpr* expr) {
+    const ExprInfo& info = sema.expr(expr);
+
+    // '&' only needs the address of its operand, everything else evaluates it first
+    if (expr->op.type == TokenType::OPERATOR_AMPERSAND) {
+        emit("sub x0, x29, #" + std::to_string(info.frame_offset));
+        return;
+    }
+
     genExpr(expr->right.get());
+    const Type& operandType = sema.expr(expr->right.get()).converted_type;
 
     switch (expr->op.type) {
     case TokenType::OPERATOR_MINUS:
-        if (current_type.is_float) {
-            if (current_type.size_bytes == 4) {
+        if (operandType.is_float) {
+            if (operandType.size_bytes == 4) {
                 emit("fneg s0, s0");
             } else {
                 emit("fneg d0, d0");
             }
         } else {
-            if (current_type.size_bytes == 4) {
-                emit("neg w0, w0");
-            } else {
-                emit("neg x0, x0");
-            }
+            emit("neg x0, x0");
         }
         break;
     case TokenType::EXCLAMATION:
-        if (current_type.is_float) {
-            if (current_type.size_bytes == 4) {
+        if (operandType.is_float) {
+            if (operandType.size_bytes == 4) {
                 emit("fcmp s0, #0.0");
                 emit("cset x0, eq");
             } else {
                 emit("fcmp d0, #0.0");
                 emit("cset x0, eq");
             }
-            current_type = TypeSystem::Int64;
         } else {
-            if (current_type.size_bytes == 4) {
-                emit("cmp w0, #0");
-                emit("cset w0, eq");
-            } else {
-                emit("cmp x0, #0");
-                emit("cset x0, eq");
-            }
+            emit("cmp x0, #0");
+            emit("cset x0, eq");
         }
         break;
     case TokenType::OPERATOR_ASTERISK: {
-        if (current_type.kind != TypeKind::POINTER) {
-            ctx.de.report(DiagnosticLevel::ERROR,
-                          "Semantic Error: Cannot dereference a non-pointer type.", 0, 0);
-        }
-        current_type = *current_type.baseType;
+        const Type& targetType = info.type;
 
-        if (current_type.is_float) {
-            if (current_type.size_bytes == 4) {
+        if (targetType.is_float) {
+            if (targetType.size_bytes == 4) {
                 emit("ldr s0, [x0]");
             } else {
                 emit("ldr d0, [x0]");
             }
         } else {
-            if (current_type.size_bytes == 1) {
-                if (current_type.is_signed)
+            if (targetType.size_bytes == 1) {
+                if (targetType.is_signed)
                     emit("ldrsb x0, [x0]");
                 else
                     emit("ldrb w0, [x0]");
-            } else if (current_type.size_bytes == 2) {
-                if (current_type.is_signed)
+            } else if (targetType.size_bytes == 2) {
+                if (targetType.is_signed)
                     emit("ldrsh x0, [x0]");
                 else
                     emit("ldrh w0, [x0]");
-            } else if (current_type.size_bytes == 4) {
-                emit("ldr w0, [x0]");
+            } else if (targetType.size_bytes == 4) {
+                if (targetType.is_signed)
+                    emit("ldrsw x0, [x0]");
+                else
+                    emit("ldr w0, [x0]");
             } else {
                 emit("ldr x0, [x0]");
             }
         }
         break;
     }
-    case TokenType::OPERATOR_AMPERSAND: {
-        auto* ident = dynamic_cast<IdentifierExpr*>(expr->right.get());
-        if (!ident) {
-            ctx.de.report(DiagnosticLevel::ERROR,
-                          "Semantic Error: '&' operator requires a variable identifier.", 0, 0);
-        }
-
-        emit("sub x0, x29, #" + std::to_string(ident->offset));
-
-        current_type = TypeSystem::createPointer(ident->type);
-        break;
-    }
     default:
         ctx.de.report(DiagnosticLevel::ERROR, "Unknown unary operator", 0, 0);
     }
@@ -614,154 +782,274 @@ void CodeGen::visitGroupingExpr(const GroupingExpr* expr) {
     genExpr(expr->expr.get());
 }
 
-void CodeGen::visitBinaryExpr(const BinaryExpr* expr) {
-    if (expr->op.type == TokenType::OPERATOR_ASSIGNMENT) {
-        visitAssignment(expr);
-        return;
-    }
+void CodeGen::genOperands(const BinaryExpr* expr) {
+    // Both operands arrive already converted to the operand type chosen by the analyzer
+    const Type& opType = sema.expr(expr).operand_type;
 
     genExpr(expr->left.get());
-    Type leftType = current_type;
 
     // Push Left
-    if (leftType.is_float)
+    if (opType.is_float)
         emit("str d0, [sp, #-16]!");
     else
         emit("str x0, [sp, #-16]!");
 
     genExpr(expr->right.get());
-    Type rightType = current_type;
 
     // Move Right to Reg 1
-    if (rightType.is_float)
+    if (opType.is_float)
         emit("fmov d1, d0");
     else
         emit("mov x1, x0");
 
     // Pop Left to Reg 0
-    if (leftType.is_float)
+    if (opType.is_float)
         emit("ldr d0, [sp], #16");
     else
         emit("ldr x0, [sp], #16");
+}
 
-    // Implicit Casting for math
-    if (!leftType.is_float && rightType.is_float) {
-        emit("scvtf d0, x0");
-        leftType = TypeSystem::Float64;
-    } else if (leftType.is_float && !rightType.is_float) {
-        emit("scvtf d1, x1");
-        rightType = TypeSystem::Float64;
+// The condition code a comparison operator tests after cmp / fcmp, empty for other operators
+static std::string comparison_cond_code(TokenType op, bool is_float, bool is_unsigned) {
+    switch (op) {
+    case TokenType::OPERATOR_EQUALITY:
+        return "eq";
+    case TokenType::EXCL_EQUAL:
+        return "ne";
+    // After fcmp an unordered result sets C and V, so lt / le would be true for NaN
+    case TokenType::OPERATOR_LESS:
+        return is_float ? "mi" : is_unsigned ? "lo" : "lt";
+    case TokenType::OPERATOR_LESS_EQUALS:
+        return is_float ? "ls" : is_unsigned ? "ls" : "le";
+    case TokenType::OPERATOR_GREATER:
+        return is_unsigned && !is_float ? "hi" : "gt";
+    case TokenType::OPERATOR_GREATER_EQUALS:
+        return is_unsigned && !is_float ? "hs" : "ge";
+    default:
+        return "";
     }
+}
 
-    if (leftType.is_float && rightType.is_float) {
-        // Floating Point Math
-        if (rightType.size_bytes == 4 && leftType.size_bytes == 4) {
-            current_type = TypeSystem::Float32;
-            switch (expr->op.type) {
-            case TokenType::OPERATOR_PLUS:
-                emit("fadd s0, s0, s1");
-                break;
-            case TokenType::OPERATOR_MINUS:
-                emit("fsub s0, s0, s1");
-                break;
-            case TokenType::OPERATOR_ASTERISK:
-                emit("fmul s0, s0, s1");
-                break;
-            case TokenType::OPERATOR_FORWARD_SLASH:
-                emit("fdiv s0, s0, s1");
-                break;
-            case TokenType::OPERATOR_LESS:
-                emit("fcmp s0, s1");
-                emit("cset x0, mi");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_LESS_EQUALS:
-                emit("fcmp s0, s1");
-                emit("cset x0, le");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_GREATER:
-                emit("fcmp s0, s1");
-                emit("cset x0, gt");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_GREATER_EQUALS:
-                emit("fcmp s0, s1");
-                emit("cset x0, ge");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_EQUALITY:
-                emit("fcmp s0, s1");
-                emit("cset x0, eq");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::EXCL_EQUAL:
-                emit("fcmp s0, s1");
-                emit("cset x0, ne");
-                current_type = TypeSystem::Int64;
-                break;
-            default:
-                break;
+static bool is_zero_literal(const Expr* expr) {
+    auto* lit = dynamic_cast<const LiteralExpr*>(expr);
+    return lit && std::holds_alternative<uint64_t>(lit->token.fd) &&
+           std::get<uint64_t>(lit->token.fd) == 0;
+}
+
+void CodeGen::genCondBranch(const Expr* expr, const std::string& target, bool when) {
+    const ExprInfo& info = sema.expr(expr);
+
+    // A conversion of the condition itself (float to int truncation) can change its truth
+    if (info.conversion == ConversionKind::NONE) {
+        if (auto* group = dynamic_cast<const GroupingExpr*>(expr)) {
+            genCondBranch(group->expr.get(), target, when);
+            return;
+        }
+        if (auto* unary = dynamic_cast<const UnaryExpr*>(expr);
+            unary && unary->op.type == TokenType::EXCLAMATION) {
+            genCondBranch(unary->right.get(), target, !when);
+            return;
+        }
+
+        auto* binary = dynamic_cast<const BinaryExpr*>(expr);
+        std::string cc;
+        if (binary) {
+            const Type& opType = info.operand_type;
+            cc = comparison_cond_code(binary->op.type, opType.is_float, info.unsigned_op);
+        }
+        if (!cc.empty()) {
+            const Type& opType = info.operand_type;
+            if (!when)
+                cc = invert_cond_code(cc);
+
+            // Against a literal zero only equality and the sign bit need testing
+            if (!opType.is_float && is_zero_literal(binary->right.get())) {
+                const char* test = nullptr;
+                if (cc == "eq" || (cc == "ls" && info.unsigned_op))
+                    test = "cbz x0, ";
+                else if (cc == "ne" || cc == "hi")
+                    test = "cbnz x0, ";
+                else if (cc == "lt")
+                    test = "tbnz x0, #63, ";
+                else if (cc == "ge")
+                    test = "tbz x0, #63, ";
+                if (test) {
+                    genExpr(binary->left.get());
+                    emit(test + target);
+                    return;
+                }
             }
-        } else {
-            current_type = TypeSystem::Float64;
-            if (leftType.size_bytes == 4)
-                emit("fcvt d0, s0");
-            if (rightType.size_bytes == 4)
-                emit("fcvt d1, s1");
-
-            switch (expr->op.type) {
-            case TokenType::OPERATOR_PLUS:
-                emit("fadd d0, d0, d1");
-                break;
-            case TokenType::OPERATOR_MINUS:
-                emit("fsub d0, d0, d1");
-                break;
-            case TokenType::OPERATOR_ASTERISK:
-                emit("fmul d0, d0, d1");
-                break;
-            case TokenType::OPERATOR_FORWARD_SLASH:
-                emit("fdiv d0, d0, d1");
-                break;
-            case TokenType::OPERATOR_LESS:
-                emit("fcmp d0, d1");
-                emit("cset x0, mi");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_LESS_EQUALS:
-                emit("fcmp d0, d1");
-                emit("cset x0, le");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_GREATER:
-                emit("fcmp d0, d1");
-                emit("cset x0, gt");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_GREATER_EQUALS:
-                emit("fcmp d0, d1");
-                emit("cset x0, ge");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::OPERATOR_EQUALITY:
-                emit("fcmp d0, d1");
-                emit("cset x0, eq");
-                current_type = TypeSystem::Int64;
-                break;
-            case TokenType::EXCL_EQUAL:
-                emit("fcmp d0, d1");
-                emit("cset x0, ne");
-                current_type = TypeSystem::Int64;
-                break;
-            default:
-                break;
+
+            genOperands(binary);
+            if (opType.is_float) {
+                std::string r = (opType.size_bytes == 4) ? "s" : "d";
+                emit("fcmp " + r + "0, " + r + "1");
+            } else {
+                emit("cmp x0, x1");
             }
+            emit("b." + cc + " " + target);
+            return;
         }
+    }
+
+    genExpr(expr);
+    const Type& type = info.converted_type;
+    if (type.is_float) {
+        emit(type.size_bytes == 4 ? "fcmp s0, #0.0" : "fcmp d0, #0.0");
+        emit((when ? "b.ne " : "b.eq ") + target);
     } else {
-        // Integer Math
-        current_type = TypeSystem::Int64;
-        bool is_unsigned_math = (!leftType.is_signed || !rightType.is_signed);
+        emit((when ? "cbnz x0, " : "cbz x0, ") + target);
+    }
+}
+
+bool CodeGen::genConstantOperand(const BinaryExpr* expr) {
+    const ExprInfo& info = sema.expr(expr);
+    auto* lit = dynamic_cast<const LiteralExpr*>(expr->right.get());
+    if (info.operand_type.is_float || !lit || !std::holds_alternative<uint64_t>(lit->token.fd))
+        return false;
+    int64_t c = static_cast<int64_t>(std::get<uint64_t>(lit->token.fd));
+    bool is_signed = !info.unsigned_op;
+
+    if (expr->op.type == TokenType::OPERATOR_ASTERISK) {
+        std::optional<ShiftAddMultiply> form = shift_add_multiply(c);
+        if (!form)
+            return false;
+        genExpr(expr->left.get());
+        std::string shift = ", lsl #" + std::to_string(form->shift);
+        switch (form->form) {
+        case ShiftAddMultiply::Form::SHIFT:
+            emit("lsl x0, x0, #" + std::to_string(form->shift));
+            break;
+        case ShiftAddMultiply::Form::NEGATE:
+            emit("neg x0, x0" + (form->shift ? shift : ""));
+            break;
+        case ShiftAddMultiply::Form::ADD:
+            emit("add x0, x0, x0" + shift);
+            if (form->post_shift)
+                emit("lsl x0, x0, #" + std::to_string(form->post_shift));
+            break;
+        case ShiftAddMultiply::Form::SUB:
+            emit("lsl x1, x0, #" + std::to_string(form->shift));
+            emit("sub x0, x1, x0");
+            break;
+        case ShiftAddMultiply::Form::REVERSE_SUB:
+            emit("sub x0, x0, x0" + shift);
+            break;
+        }
+        return true;
+    }
+
+    if (expr->op.type != TokenType::OPERATOR_FORWARD_SLASH || c == 0)
+        return false;
+    genExpr(expr->left.get());
+
+    if (c == 1)
+        return true;
+    if (is_signed && c == -1) {
+        emit("neg x0, x0");
+        return true;
+    }
+
+    if (!is_signed) {
+        uint64_t d = static_cast<uint64_t>(c);
+        if (std::optional<int> k = exact_log2(d)) {
+            emit("lsr x0, x0, #" + std::to_string(*k));
+            return true;
+        }
+        UnsignedDivisionMagic magic = unsigned_division_magic(d);
+        emitInteger("x1", static_cast<uint64_t>(magic.multiplier));
+        emit("umulh x1, x0, x1");
+        if (magic.add) {
+            emit("sub x0, x0, x1");
+            emit("add x0, x1, x0, lsr #1");
+            emit("lsr x0, x0, #" + std::to_string(magic.shift - 1));
+        } else {
+            emit("lsr x0, x1, #" + std::to_string(magic.shift));
+        }
+        return true;
+    }
+
+    uint64_t ad = c < 0 ? 0 - static_cast<uint64_t>(c) : static_cast<uint64_t>(c);
+    if (std::optional<int> k = exact_log2(ad)) {
+        emit("asr x1, x0, #63");
+        emit("add x0, x0, x1, lsr #" + std::to_string(64 - *k));
+        emit(std::string(c > 0 ? "asr x0, x0, #" : "neg x0, x0, asr #") + std::to_string(*k));
+        return true;
+    }
+    SignedDivisionMagic magic = signed_division_magic(c);
+    emitInteger("x1", static_cast<uint64_t>(magic.multiplier));
+    emit("smulh x1, x0, x1");
+    if (c > 0 && magic.multiplier < 0)
+        emit("add x1, x1, x0");
+    else if (c < 0 && magic.multiplier > 0)
+        emit("sub x1, x1, x0");
+    if (magic.shift > 0)
+        emit("asr x1, x1, #" + std::to_string(magic.shift));
+    emit("add x0, x1, x1, lsr #63");
+    return true;
+}
+
+void CodeGen::visitBinaryExpr(const BinaryExpr* expr) {
+    if (expr->op.type == TokenType::OPERATOR_ASSIGNMENT) {
+        visitAssignment(expr);
+        return;
+    }
+
+    const ExprInfo& info = sema.expr(expr);
+    const Type& opType = info.operand_type;
+
+    if (genConstantOperand(expr))
+        return;
+    genOperands(expr);
+
+    if (opType.is_float) {
+        // Floating Point Math
+        std::string r = (opType.size_bytes == 4) ? "s" : "d";
+        std::string ops = r + "0, " + r + "0, " + r + "1";
+        std::string cmp = "fcmp " + r + "0, " + r + "1";
 
+        switch (expr->op.type) {
+        case TokenType::OPERATOR_PLUS:
+            emit("fadd " + ops);
+            break;
+        case TokenType::OPERATOR_MINUS:
+            emit("fsub " + ops);
+            break;
+        case TokenType::OPERATOR_ASTERISK:
+            emit("fmul " + ops);
+            break;
+        case TokenType::OPERATOR_FORWARD_SLASH:
+            emit("fdiv " + ops);
+            break;
+        case TokenType::OPERATOR_LESS:
+            emit(cmp);
+            emit("cset x0, mi");
+            break;
+        case TokenType::OPERATOR_LESS_EQUALS:
+            emit(cmp);
+            emit("cset x0, ls");
+            break;
+        case TokenType::OPERATOR_GREATER:
+            emit(cmp);
+            emit("cset x0, gt");
+            break;
+        case TokenType::OPERATOR_GREATER_EQUALS:
+            emit(cmp);
+            emit("cset x0, ge");
+            break;
+        case TokenType::OPERATOR_EQUALITY:
+            emit(cmp);
+            emit("cset x0, eq");
+            break;
+        case TokenType::EXCL_EQUAL:
+            emit(cmp);
+            emit("cset x0, ne");
+            break;
+        default:
+            break;
+        }
+    } else {
+        // Integer Math
         switch (expr->op.type) {
         case TokenType::OPERATOR_PLUS:
             emit("add x0, x0, x1");
@@ -773,7 +1061,7 @@ void CodeGen::visitBinaryExpr(const BinaryExpr* expr) {
             emit("mul x0, x0, x1");
             break;
         case TokenType::OPERATOR_FORWARD_SLASH:
-            if (is_unsigned_math)
+            if (info.unsigned_op)
                 emit("udiv x0, x0, x1");
             else
                 emit("sdiv x0, x0, x1");
@@ -786,55 +1074,21 @@ void CodeGen::visitBinaryExpr(const BinaryExpr* expr) {
             emit("cmp x0, x1");
             emit("cset x0, ne");
             break;
-
         case TokenType::OPERATOR_LESS:
-            if (leftType.is_signed && rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, lt");
-            } else if (!leftType.is_signed && !rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, lo");
-            } else { /* Mixed sign comparison logic omitted for brevity, use standard signed if
-                        unsure */
-                emit("cmp x0, x1");
-                emit("cset x0, lt");
-            }
+            emit("cmp x0, x1");
+            emit(info.unsigned_op ? "cset x0, lo" : "cset x0, lt");
             break;
         case TokenType::OPERATOR_LESS_EQUALS:
-            if (leftType.is_signed && rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, le");
-            } else if (!leftType.is_signed && !rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, ls");
-            } else {
-                emit("cmp x0, x1");
-                emit("cset x0, le");
-            }
+            emit("cmp x0, x1");
+            emit(info.unsigned_op ? "cset x0, ls" : "cset x0, le");
             break;
         case TokenType::OPERATOR_GREATER:
-            if (leftType.is_signed && rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, gt");
-            } else if (!leftType.is_signed && !rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, hi");
-            } else {
-                emit("cmp x0, x1");
-                emit("cset x0, gt");
-            }
+            emit("cmp x0, x1");
+            emit(info.unsigned_op ? "cset x0, hi" : "cset x0, gt");
             break;
         case TokenType::OPERATOR_GREATER_EQUALS:
-            if (leftType.is_signed && rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, ge");
-            } else if (!leftType.is_signed && !rightType.is_signed) {
-                emit("cmp x0, x1");
-                emit("cset x0, hs");
-            } else {
-                emit("cmp x0, x1");
-                emit("cset x0, ge");
-            }
+            emit("cmp x0, x1");
+            emit(info.unsigned_op ? "cset x0, hs" : "cset x0, ge");
             break;
         default:
             break;
@@ -843,81 +1097,39 @@ void CodeGen::visitBinaryExpr(const BinaryExpr* expr) {
 }
 
 void CodeGen::visitAssignment(const BinaryExpr* expr) {
+    // The right-hand side is converted to the target type by genExpr
+    const Type& targetType = sema.expr(expr).type;
+
     // Case 1: Standard Variable Assignment (e.g., x = 5)
-    if (auto* ident = dynamic_cast<const IdentifierExpr*>(expr->left.get())) {
+    if (dynamic_cast<const IdentifierExpr*>(expr->left.get())) {
         genExpr(expr->right.get());
 
-        Type varType = ident->type;
-
-        if (varType.kind == TypeKind::CLASS) {
-            ctx.de.report(DiagnosticLevel::ERROR, "Class assignment by value is not supported.", 0,
-                          0);
-        }
-
-        // Implicit Casting (RHS -> Variable Type)
-        if (varType.is_float) {
-            if (!current_type.is_float) {
-                emit("scvtf d0, x0"); // Int -> Float
-                current_type =
-                    (current_type.size_bytes == 4) ? TypeSystem::Float32 : TypeSystem::Float64;
-            }
-
-            // Float64 -> Float32 (Downcast)
-            if (varType.size_bytes == 4 && current_type.size_bytes == 8) {
-                emit("fcvt s0, d0");
-            }
-            // Float32 -> Float64 (Upcast)
-            else if (varType.size_bytes == 8 && current_type.size_bytes == 4) {
-                emit("fcvt d0, s0");
-            }
-        } else {
-            // Float -> Int
-            if (current_type.is_float) {
-                emit("fcvtzs x0, d0");
-            }
-        }
-
         // Store to Stack (Frame Pointer - Offset)
-        if (varType.is_float) {
-            if (varType.size_bytes == 4) {
-                emit("stur s0, [x29, #-" + std::to_string(ident->offset) + "]");
+        std::string offset = std::to_string(sema.expr(expr).frame_offset);
+        if (targetType.is_float) {
+            if (targetType.size_bytes == 4) {
+                emit("stur s0, [x29, #-" + offset + "]");
             } else {
-                emit("stur d0, [x29, #-" + std::to_string(ident->offset) + "]");
+                emit("stur d0, [x29, #-" + offset + "]");
             }
         } else {
-            if (varType.size_bytes == 1) {
-                emit("sturb w0, [x29, #-" + std::to_string(ident->offset) + "]");
-            } else if (varType.size_bytes == 2) {
-                emit("sturh w0, [x29, #-" + std::to_string(ident->offset) + "]");
-            } else if (varType.size_bytes == 4) {
-                emit("stur w0, [x29, #-" + std::to_string(ident->offset) + "]");
+            if (targetType.size_bytes == 1) {
+                emit("sturb w0, [x29, #-" + offset + "]");
+            } else if (targetType.size_bytes == 2) {
+                emit("sturh w0, [x29, #-" + offset + "]");
+            } else if (targetType.size_bytes == 4) {
+                emit("stur w0, [x29, #-" + offset + "]");
             } else {
-                emit("stur x0, [x29, #-" + std::to_string(ident->offset) + "]");
+                emit("stur x0, [x29, #-" + offset + "]");
             }
         }
-
-        // Update current_type to allow chained assignments
-        current_type = varType;
     }
 
     //  Pointer Dereference Assignment (e.g., *ptr = 5)
     else if (auto* unary = dynamic_cast<const UnaryExpr*>(expr->left.get())) {
-        if (unary->op.type != TokenType::OPERATOR_ASTERISK) {
-            ctx.de.report(DiagnosticLevel::ERROR,
-                          "Invalid assignment target. Expected variable or pointer dereference.", 0,
-                          0);
-        }
-
         // Evaluate the Pointer (LHS) to get the target memory address
         genExpr(unary->right.get());
 
-        if (current_type.kind != TypeKind::POINTER) {
-            ctx.de.report(DiagnosticLevel::ERROR,
-                          "Semantic Error: Assigning to a non-pointer dereference.", 0, 0);
-        }
-
-        Type targetType = *current_type.baseType; // The type the pointer points to
-
         // Push the Address to the stack to preserve it while we evaluate the RHS
         emit("str x0, [sp, #-16]!");
 
@@ -925,25 +1137,6 @@ void CodeGen::visitAssignment(const BinaryExpr* expr) {
         genExpr(expr->right.get());
         // x0 (or d0) now holds the value to assign
 
-        // Perform Implicit Casting (RHS -> TargetType)
-        if (targetType.is_float) {
-            if (!current_type.is_float) {
-                emit("scvtf d0, x0"); // Int -> Float
-                current_type =
-                    (current_type.size_bytes == 4) ? TypeSystem::Float32 : TypeSystem::Float64;
-            }
-
-            if (targetType.size_bytes == 4 && current_type.size_bytes == 8) {
-                emit("fcvt s0, d0");
-            } else if (targetType.size_bytes == 8 && current_type.size_bytes == 4) {
-                emit("fcvt d0, s0");
-            }
-        } else {
-            if (current_type.is_float) {
-                emit("fcvtzs x0, d0"); // Float -> Int
-            }
-        }
-
         // Pop the Memory Address into x1
         emit("ldr x1, [sp], #16");
 
@@ -966,24 +1159,19 @@ void CodeGen::visitAssignment(const BinaryExpr* expr) {
             }
         }
 
-        current_type = targetType;
-
     } else if (auto* arrAccess = dynamic_cast<const ArrayAccessExpr*>(expr->left.get())) {
         genExpr(expr->right.get());
 
-        if (current_type.is_float)
+        if (targetType.is_float)
             emit("str d0, [sp, #-16]!");
         else
             emit("str x0, [sp, #-16]!");
 
         genExpr(arrAccess->idx.get());
 
-        auto* ident = dynamic_cast<const IdentifierExpr*>(arrAccess->array.get());
-        Type targetType = *ident->type.baseType;
+        const ExprInfo& element = sema.expr(arrAccess);
 
-        requires_bounds_panic = true;
-        emit("cmp x0, #" + std::to_string(ident->type.array_length));
-        emit("b.hs L_bounds_violation_panic");
+        genBoundsCheck(sema.expr(arrAccess->array.get()).type.array_length);
 
         int shift = (targetType.size_bytes == 8)   ? 3
                     : (targetType.size_bytes == 4) ? 2
@@ -994,36 +1182,14 @@ void CodeGen::visitAssignment(const BinaryExpr* expr) {
         else
             emit("mov x1, x0");
 
-        emit("sub x2, x29, #" + std::to_string(ident->offset));
+        emit("sub x2, x29, #" + std::to_string(element.frame_offset));
         emit("add x2, x2, x1");
 
-        if (current_type.is_float)
+        if (targetType.is_float)
             emit("ldr d0, [sp], #16");
         else
             emit("ldr x0, [sp], #16");
 
-        if (targetType.is_float) {
-            if (!current_type.is_float) {
-                emit("scvtf d0, x0"); // Int -> Float
-                current_type =
-                    (current_type.size_bytes == 4) ? TypeSystem::Float32 : TypeSystem::Float64;
-            }
-
-            // Float64 -> Float32 (Downcast)
-            if (targetType.size_bytes == 4 && current_type.size_bytes == 8) {
-                emit("fcvt s0, d0");
-            }
-            // Float32 -> Float64 (Upcast)
-            else if (targetType.size_bytes == 8 && current_type.size_bytes == 4) {
-                emit("fcvt d0, s0");
-            }
-        } else {
-            // Float -> Int
-            if (current_type.is_float) {
-                emit("fcvtzs x0, d0");
-            }
-        }
-
         if (targetType.is_float) {
             if (targetType.size_bytes == 4)
                 emit("str s0, [x2]");
@@ -1039,59 +1205,24 @@ void CodeGen::visitAssignment(const BinaryExpr* expr) {
             else
                 emit("str x0, [x2]");
         }
-
-        current_type = targetType;
     } else if (auto* prop = dynamic_cast<const PropertyAccessExpr*>(expr->left.get())) {
         genExpr(expr->right.get());
 
-        if (current_type.is_float)
+        if (targetType.is_float)
             emit("str d0, [sp, #-16]!");
         else
             emit("str x0, [sp, #-16]!");
 
-        auto* ident = dynamic_cast<const IdentifierExpr*>(prop->object.get());
-        if (!ident) {
-            ctx.de.report(DiagnosticLevel::ERROR,
-                          "Only direct object identifiers are supported for field assignment.", 0,
-                          0);
-        }
-
-        emit("sub x2, x29, #" + std::to_string(ident->offset));
+        emit("sub x2, x29, #" + std::to_string(sema.expr(prop).frame_offset));
         if (prop->field_offset != 0) {
             emit("add x2, x2, #" + std::to_string(prop->field_offset));
         }
 
-        if (current_type.is_float)
+        if (targetType.is_float)
             emit("ldr d0, [sp], #16");
         else
             emit("ldr x0, [sp], #16");
 
-        Type targetType = prop->type;
-
-        if (targetType.kind == TypeKind::CLASS) {
-            ctx.de.report(DiagnosticLevel::ERROR,
-                          "Only direct object identifiers are supported for field assignment.", 0,
-                          0);
-        }
-
-        if (targetType.is_float) {
-            if (!current_type.is_float) {
-                emit("scvtf d0, x0");
-                current_type =
-                    (current_type.size_bytes == 4) ? TypeSystem::Float32 : TypeSystem::Float64;
-            }
-
-            if (targetType.size_bytes == 4 && current_type.size_bytes == 8) {
-                emit("fcvt s0, d0");
-            } else if (targetType.size_bytes == 8 && current_type.size_bytes == 4) {
-                emit("fcvt d0, s0");
-            }
-        } else {
-            if (current_type.is_float) {
-                emit("fcvtzs x0, d0");
-            }
-        }
-
         if (targetType.is_float) {
             if (targetType.size_bytes == 4)
                 emit("str s0, [x2]");
@@ -1107,87 +1238,110 @@ void CodeGen::visitAssignment(const BinaryExpr* expr) {
             else
                 emit("str x0, [x2]");
         }
+    }
+}
 
-        current_type = targetType;
-    } else {
-        ctx.de.report(DiagnosticLevel::ERROR, "Invalid assignment target.", 0, 0);
+bool CodeGen::genBuiltin(const FunctionCallExpr* expr) {
+    static const std::unordered_map<std::string, std::string> float_unary = {
+        {"abs_f", "fabs"},    {"sqrt_f", "fsqrt"}, {"floor_f", "frintm"},
+        {"ceil_f", "frintp"}, {"round_f", "frinta"},
+    };
+    const std::string& name = expr->name_token.lexeme;
+
+    if (name == "abs") {
+        genExpr(expr->args[0].get());
+        emit("cmp x0, #0");
+        emit("cneg x0, x0, mi");
+        return true;
     }
+    if (auto it = float_unary.find(name); it != float_unary.end()) {
+        genExpr(expr->args[0].get());
+        emit(it->second + " d0, d0");
+        return true;
+    }
+    if (name == "min_f" || name == "max_f") {
+        genExpr(expr->args[0].get());
+        emit("str d0, [sp, #-16]!");
+        genExpr(expr->args[1].get());
+        emit("ldr d1, [sp], #16");
+        emit(std::string(name == "min_f" ? "fminnm" : "fmaxnm") + " d0, d1, d0");
+        return true;
+    }
+    return false;
 }
 
 void CodeGen::visitFunctionCallExpr(const FunctionCallExpr* expr) {
-    // Evaluate arguments and push them (preserving type info)
+    if (genBuiltin(expr))
+        return;
+
+    // Evaluate arguments (converted to the parameter types). All but the last are pushed,
+    // the last one goes from x0 / d0 straight into its register
     std::vector<Type> argTypes;
-    for (int i = 0; i < expr->args.size(); i++) {
+    int argCount = expr->args.size();
+    for (int i = 0; i < argCount; i++) {
         const auto& arg = expr->args[i];
         genExpr(arg.get());
 
-        if (i < expr->param_types.size()) {
-            Type expected = expr->param_types[i];
-
-            if (expected.is_float) {
-                if (!current_type.is_float) {
-                    emit("scvtf d0, x0");
-                    current_type = TypeSystem::Float64;
-                }
+        const Type& argType = sema.expr(arg.get()).converted_type;
+        argTypes.push_back(argType);
 
-                if (expected.size_bytes == 8 && current_type.size_bytes == 4) {
-                    emit("fcvt d0, s0");
-                    current_type = TypeSystem::Float64; // Treat as double on stack
-                } else if (expected.size_bytes == 4 && current_type.size_bytes == 8) {
-                    emit("fcvt s0, d0");
-                    current_type = TypeSystem::Float32;
-                }
-            } else if (!expected.is_float && current_type.is_float) {
-                emit("fcvtzs x0, d0");
-                current_type = TypeSystem::Int64;
-            }
-        }
-
-        argTypes.push_back(current_type);
-
-        if (current_type.is_float) {
+        if (i == argCount - 1)
+            break;
+        if (argType.is_float) {
             emit("str d0, [sp, #-16]!");
         } else {
             emit("str x0, [sp, #-16]!");
         }
     }
 
-    int argCount = expr->args.size();
-    for (int i = argCount - 1; i >= 0; --i) {
-        if (i < 8) {
-            if (argTypes[i].is_float) {
-                if (argTypes[i].size_bytes == 4)
-                    emit("ldr s" + std::to_string(i) + ", [sp], #16");
-                else
-                    emit("ldr d" + std::to_string(i) + ", [sp], #16");
-            } else {
-                if (argTypes[i].size_bytes == 4)
-                    emit("ldr w" + std::to_string(i) + ", [sp], #16");
-                else
-                    emit("ldr x" + std::to_string(i) + ", [sp], #16");
-            }
+    int last = argCount - 1;
+    if (last > 0 && last < 8) {
+        std::string reg = std::to_string(last);
+        if (argTypes[last].is_float) {
+            if (argTypes[last].size_bytes == 4)
+                emit("fmov s" + reg + ", s0");
+            else
+                emit("fmov d" + reg + ", d0");
+        } else {
+            emit("mov x" + reg + ", x0");
+        }
+    }
+
+    for (int i = argCount - 2; i >= 0; --i) {
+        if (i >= 8) {
+            // Parameters beyond 8 are ignored
+            emit("add sp, sp, #16");
+        } else if (argTypes[i].is_float) {
+            if (argTypes[i].size_bytes == 4)
+                emit("ldr s" + std::to_string(i) + ", [sp], #16");
+            else
+                emit("ldr d" + std::to_string(i) + ", [sp], #16");
+        } else {
+            if (argTypes[i].size_bytes == 4)
+                emit("ldr w" + std::to_string(i) + ", [sp], #16");
+            else
+                emit("ldr x" + std::to_string(i) + ", [sp], #16");
         }
     }
 
-    std::string funcName = "_" + expr->name_token.lexeme;
-    emit("bl " + funcName);
+    emit("bl " + symbol_name(expr->name_token.lexeme));
 
-    current_type = expr->return_type;
+    const Type& returnType = sema.expr(expr).type;
 
-    if (!current_type.is_float && current_type.size_bytes < 8) {
-        if (current_type.is_signed) {
-            if (current_type.size_bytes == 1)
+    if (!returnType.is_float && returnType.size_bytes < 8) {
+        if (returnType.is_signed) {
+            if (returnType.size_bytes == 1)
                 emit("sxtb x0, w0");
-            else if (current_type.size_bytes == 2)
+            else if (returnType.size_bytes == 2)
                 emit("sxth x0, w0");
-            else if (current_type.size_bytes == 4)
+            else if (returnType.size_bytes == 4)
                 emit("sxtw x0, w0");
         } else {
-            if (current_type.size_bytes == 1)
+            if (returnType.size_bytes == 1)
                 emit("uxtb x0, w0");
-            else if (current_type.size_bytes == 2)
+            else if (returnType.size_bytes == 2)
                 emit("uxth x0, w0");
-            else if (current_type.size_bytes == 4)
+            else if (returnType.size_bytes == 4)
                 emit("uxtw x0, w0");
         }
     }
@@ -0,0 +1,221 @@
+#include "ConstantFold.h"
+
+#include <climits>
+#include <cmath>
+
+static bool compare_int(Cond c, int64_t a, int64_t b) {
+    uint64_t ua = static_cast<uint64_t>(a);
+    uint64_t ub = static_cast<uint64_t>(b);
+    switch (c) {
+    case Cond::EQ:
+        return a == b;
+    case Cond::NE:
+        return a != b;
+    case Cond::LT:
+        return a < b;
+    case Cond::LE:
+        return a <= b;
+    case Cond::GT:
+        return a > b;
+    case Cond::GE:
+        return a >= b;
+    case Cond::ULT:
+        return ua < ub;
+    case Cond::ULE:
+        return ua <= ub;
+    case Cond::UGT:
+        return ua > ub;
+    case Cond::UGE:
+        return ua >= ub;
+    }
+    return false;
+}
+
+// Ordered comparisons are false on NaN, NE is true
+static bool compare_float(Cond c, double a, double b) {
+    switch (c) {
+    case Cond::EQ:
+        return a == b;
+    case Cond::NE:
+        return a != b;
+    case Cond::LT:
+    case Cond::ULT:
+        return a < b;
+    case Cond::LE:
+    case Cond::ULE:
+        return a <= b;
+    case Cond::GT:
+    case Cond::UGT:
+        return a > b;
+    case Cond::GE:
+    case Cond::UGE:
+        return a >= b;
+    }
+    return false;
+}
+
+static int64_t truncate_int(int64_t v, const MemType& m, bool is_signed) {
+    if (m.size >= 8)
+        return v;
+    int bits = m.size * 8;
+    uint64_t mask = (uint64_t(1) << bits) - 1;
+    uint64_t low = static_cast<uint64_t>(v) & mask;
+    if (is_signed && (low >> (bits - 1)) & 1)
+        low |= ~mask;
+    return static_cast<int64_t>(low);
+}
+
+// fcvtzs: round toward zero, saturate, NaN becomes 0
+static int64_t float_to_int(double v) {
+    if (std::isnan(v))
+        return 0;
+    if (v >= 9223372036854775808.0)
+        return INT64_MAX;
+    if (v < -9223372036854775808.0)
+        return INT64_MIN;
+    return static_cast<int64_t>(v);
+}
+
+Value* fold_constant(const Instruction& inst, const std::vector<Value*>& operands,
+                     Module& mod) {
+    for (Value* op : operands) {
+        if (!op || !op->isConstant())
+            return nullptr;
+    }
+
+    auto int_at = [&](size_t i) { return static_cast<ConstantInt*>(operands[i])->value; };
+    auto uint_at = [&](size_t i) { return static_cast<uint64_t>(int_at(i)); };
+    auto float_at = [&](size_t i) { return static_cast<ConstantFloat*>(operands[i])->value; };
+    auto make_int = [&](uint64_t v) { return mod.constInt(static_cast<int64_t>(v)); };
+    auto make_float = [&](double v) { return mod.constFloat(v, inst.type); };
+
+    // f32 arithmetic rounds every intermediate result to float precision
+    auto float_result = [&](double v) {
+        if (inst.type == IRType::F32)
+            return make_float(static_cast<float>(v));
+        return make_float(v);
+    };
+
+    switch (inst.op) {
+    case Opcode::ADD:
+        return make_int(uint_at(0) + uint_at(1));
+    case Opcode::SUB:
+        return make_int(uint_at(0) - uint_at(1));
+    case Opcode::MUL:
+        return make_int(uint_at(0) * uint_at(1));
+    case Opcode::SDIV:
+        if (int_at(1) == 0)
+            return make_int(0);
+        if (int_at(0) == INT64_MIN && int_at(1) == -1)
+            return make_int(uint_at(0));
+        return mod.constInt(int_at(0) / int_at(1));
+    case Opcode::UDIV:
+        if (uint_at(1) == 0)
+            return make_int(0);
+        return make_int(uint_at(0) / uint_at(1));
+    case Opcode::NEG:
+        return make_int(0 - uint_at(0));
+    case Opcode::ABS:
+        return make_int(int_at(0) < 0 ? 0 - uint_at(0) : uint_at(0));
+    case Opcode::SHL:
+        return make_int(uint_at(0) << (uint_at(1) & 63));
+    case Opcode::LSHR:
+        return make_int(uint_at(0) >> (uint_at(1) & 63));
+    case Opcode::ASHR:
+        return mod.constInt(int_at(0) >> (uint_at(1) & 63));
+    case Opcode::AND:
+        return make_int(uint_at(0) & uint_at(1));
+    case Opcode::OR:
+        return make_int(uint_at(0) | uint_at(1));
+    case Opcode::XOR:
+        return make_int(uint_at(0) ^ uint_at(1));
+
+    case Opcode::FADD:
+        return float_result(float_at(0) + float_at(1));
+    case Opcode::FSUB:
+        return float_result(float_at(0) - float_at(1));
+    case Opcode::FMUL:
+        return float_result(float_at(0) * float_at(1));
+    case Opcode::FDIV:
+        return float_result(float_at(0) / float_at(1));
+    case Opcode::FNEG:
+        return float_result(-float_at(0));
+    case Opcode::FABS:
+        return float_result(std::fabs(float_at(0)));
+    case Opcode::FSQRT:
+        return float_result(std::sqrt(float_at(0)));
+    case Opcode::FMIN:
+        return float_result(std::fmin(float_at(0), float_at(1)));
+    case Opcode::FMAX:
+        return float_result(std::fmax(float_at(0), float_at(1)));
+    case Opcode::FFLOOR:
+        return float_result(std::floor(float_at(0)));
+    case Opcode::FCEIL:
+        return float_result(std::ceil(float_at(0)));
+    case Opcode::FROUND:
+        return float_result(std::round(float_at(0)));
+
+    case Opcode::ICMP:
+        return mod.constInt(compare_int(inst.cond, int_at(0), int_at(1)) ? 1 : 0);
+    case Opcode::FCMP:
+        return mod.constInt(compare_float(inst.cond, float_at(0), float_at(1)) ? 1 : 0);
+
+    case Opcode::SEXT:
+        return mod.constInt(truncate_int(int_at(0), inst.mem, true));
+    case Opcode::ZEXT:
+        return mod.constInt(truncate_int(int_at(0), inst.mem, false));
+    case Opcode::SITOFP:
+        if (inst.type == IRType::F32)
+            return make_float(static_cast<float>(int_at(0)));
+        return make_float(static_cast<double>(int_at(0)));
+    case Opcode::FPTOSI:
+        return mod.constInt(float_to_int(float_at(0)));
+    case Opcode::FPEXT:
+    case Opcode::FPTRUNC:
+        return make_float(float_at(0));
+
+    default:
+        return nullptr;
+    }
+}
+
+Value* fold_constant(const Instruction& inst, Module& mod) {
+    return fold_constant(inst, inst.operands, mod);
+}
+
+Value* fold_identity(const Instruction& inst) {
+    if (inst.type != IRType::I64 || inst.operands.size() != 2)
+        return nullptr;
+    auto is = [&](size_t i, int64_t value) {
+        const Value* v = inst.operands[i];
+        return v->kind == ValueKind::CONSTANT_INT &&
+               static_cast<const ConstantInt*>(v)->value == value;
+    };
+
+    switch (inst.op) {
+    case Opcode::ADD:
+    case Opcode::OR:
+    case Opcode::XOR:
+        if (is(0, 0))
+            return inst.operands[1];
+        return is(1, 0) ? inst.operands[0] : nullptr;
+    case Opcode::MUL:
+        if (is(0, 1))
+            return inst.operands[1];
+        return is(1, 1) ? inst.operands[0] : nullptr;
+    case Opcode::AND:
+        if (is(0, -1))
+            return inst.operands[1];
+        return is(1, -1) ? inst.operands[0] : nullptr;
+    case Opcode::SUB:
+    case Opcode::SHL:
+    case Opcode::LSHR:
+    case Opcode::ASHR:
+        return is(1, 0) ? inst.operands[0] : nullptr;
+    case Opcode::SDIV:
+    case Opcode::UDIV:
+        return is(1, 1) ? inst.operands[0] : nullptr;
+    default:
+        return nullptr;
+    }
+}
@@ -0,0 +1,184 @@
+#include "Passes.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+// Everything a side effect or a branch depends on is live, whatever else is left only
+// feeds other dead values. Unlike counting uses, this also removes cycles of phis and
+// updates that nothing reads, like a counter kept after its last use was folded away.
+static bool remove_dead_instructions(Function& fn) {
+    std::unordered_set<const Instruction*> live;
+    std::vector<const Instruction*> work;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            if (inst->hasSideEffects()) {
+                live.insert(inst.get());
+                work.push_back(inst.get());
+            }
+        }
+    }
+    while (!work.empty()) {
+        const Instruction* inst = work.back();
+        work.pop_back();
+        for (const Value* op : inst->operands) {
+            if (op->kind != ValueKind::INSTRUCTION)
+                continue;
+            const auto* def = static_cast<const Instruction*>(op);
+            if (live.insert(def).second)
+                work.push_back(def);
+        }
+    }
+
+    std::vector<Instruction*> dead;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            if (!live.count(inst.get()))
+                dead.push_back(inst.get());
+        }
+    }
+    // Dead instructions only use each other, so they can go in any order
+    for (Instruction* inst : dead)
+        inst->parent->erase(inst);
+    return !dead.empty();
+}
+
+// cond_br %c, ^a, ^a  ->  br ^a
+static bool fold_same_target_branches(Function& fn) {
+    bool changed = false;
+    for (auto& bb : fn.blocks) {
+        Instruction* term = bb->terminator();
+        if (!term || term->op != Opcode::COND_BR || term->blocks[0] != term->blocks[1])
+            continue;
+        BasicBlock* target = term->blocks[0];
+        auto br = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+        br->blocks.push_back(target);
+        bb->erase(term);
+        bb->append(std::move(br));
+
+        // Both edges carried the same phi inputs, one of them is left
+        for (auto& phi : target->insts) {
+            if (phi->op != Opcode::PHI)
+                break;
+            auto first = std::find(phi->blocks.begin(), phi->blocks.end(), bb.get());
+            if (first == phi->blocks.end())
+                continue;
+            auto second = std::find(first + 1, phi->blocks.end(), bb.get());
+            if (second != phi->blocks.end()) {
+                phi->operands.erase(phi->operands.begin() + (second - phi->blocks.begin()));
+                phi->blocks.erase(second);
+            }
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// A block holding nothing but `br ^target` is bypassed: its predecessors branch to the
+// target directly, and the target's phis take the block's input from each of them. Not
+// done when a predecessor already reaches a target with phis, its inputs could differ.
+static bool remove_forwarding_blocks(Function& fn) {
+    for (auto& owned : fn.blocks) {
+        BasicBlock* bb = owned.get();
+        Instruction* term = bb->terminator();
+        if (bb == fn.entry() || bb->insts.size() != 1 || term->op != Opcode::BR ||
+            term->blocks[0] == bb || bb->preds.empty())
+            continue;
+        BasicBlock* target = term->blocks[0];
+        bool has_phis = target->insts.front()->op == Opcode::PHI;
+        if (has_phis && std::any_of(bb->preds.begin(), bb->preds.end(), [&](BasicBlock* p) {
+                return std::find(target->preds.begin(), target->preds.end(), p) !=
+                       target->preds.end();
+            }))
+            continue;
+
+        for (BasicBlock* pred : bb->preds) {
+            Instruction* branch = pred->terminator();
+            std::replace(branch->blocks.begin(), branch->blocks.end(), bb, target);
+        }
+        for (auto& phi : target->insts) {
+            if (phi->op != Opcode::PHI)
+                break;
+            auto it = std::find(phi->blocks.begin(), phi->blocks.end(), bb);
+            Value* input = phi->operands[it - phi->blocks.begin()];
+            phi->operands.erase(phi->operands.begin() + (it - phi->blocks.begin()));
+            phi->blocks.erase(it);
+            for (BasicBlock* pred : bb->preds) {
+                phi->operands.push_back(input);
+                phi->blocks.push_back(pred);
+            }
+        }
+        fn.removeBlock(bb);
+        fn.rebuildCFG();
+        return true;
+    }
+    return false;
+}
+
+// A block whose only predecessor unconditionally branches to it is appended to that
+// predecessor, its phis having a single input
+static bool merge_into_predecessor(Function& fn) {
+    for (auto& owned : fn.blocks) {
+        BasicBlock* bb = owned.get();
+        if (bb == fn.entry() || bb->preds.size() != 1 || bb->preds[0] == bb)
+            continue;
+        BasicBlock* pred = bb->preds[0];
+        Instruction* branch = pred->terminator();
+        if (branch->op != Opcode::BR)
+            continue;
+
+        while (bb->insts.front()->op == Opcode::PHI) {
+            Instruction* phi = bb->insts.front().get();
+            fn.replaceAllUses(phi, phi->operands[0]);
+            bb->erase(phi);
+        }
+        pred->erase(branch);
+        for (auto& inst : bb->insts)
+            inst->parent = pred;
+        pred->insts.splice(pred->insts.end(), bb->insts);
+
+        for (BasicBlock* succ : pred->successors()) {
+            for (auto& phi : succ->insts) {
+                if (phi->op != Opcode::PHI)
+                    break;
+                std::replace(phi->blocks.begin(), phi->blocks.end(), bb, pred);
+            }
+        }
+        fn.removeBlock(bb);
+        fn.rebuildCFG();
+        return true;
+    }
+    return false;
+}
+
+// Stack slots whose address is no longer taken anywhere
+static bool remove_unused_slots(Function& fn) {
+    std::unordered_set<const StackSlot*> used;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            if (inst->op == Opcode::FRAME_ADDR)
+                used.insert(inst->slot);
+        }
+    }
+    std::vector<StackSlot*> unused;
+    for (auto& slot : fn.slots) {
+        if (!used.count(slot.get()))
+            unused.push_back(slot.get());
+    }
+    for (StackSlot* slot : unused)
+        fn.removeSlot(slot);
+    return !unused.empty();
+}
+
+bool DeadCodeEliminationPass::runOnFunction(Function& fn) {
+    if (fn.blocks.empty())
+        return false;
+
+    bool changed = fn.removeUnreachableBlocks() > 0;
+    changed |= fold_same_target_branches(fn);
+    changed |= remove_dead_instructions(fn);
+    fn.rebuildCFG();
+    while (remove_forwarding_blocks(fn) || merge_into_predecessor(fn))
+        changed = true;
+    changed |= remove_unused_slots(fn);
+    return changed;
+}
@@ -0,0 +1,364 @@
+#include "Dominators.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// Where an address points: into a frame slot at a constant or an unknown offset. Values
+// that are no frame address (arguments, loaded pointers, integers) have no slot.
+struct FrameLocation {
+    StackSlot* slot = nullptr;
+    int64_t offset = 0;
+    bool known_offset = true;
+
+    bool operator==(const FrameLocation& other) const = default;
+};
+
+} // namespace
+
+// Merges two addresses reaching the same phi. Different offsets into one slot are still
+// inside it (a pointer walking an array), addresses of different slots are not tracked.
+static FrameLocation merge(const FrameLocation& a, const FrameLocation& b) {
+    if (a.slot != b.slot)
+        return {};
+    if (a.known_offset && b.known_offset && a.offset == b.offset)
+        return a;
+    return {a.slot, 0, false};
+}
+
+// The frame location of every instruction computing an address from a FRAME_ADDR. Phis
+// are solved optimistically: inputs on back edges are left out until they are computed,
+// then the walk is repeated until nothing changes.
+static std::unordered_map<const Value*, FrameLocation>
+frame_locations(const std::vector<BasicBlock*>& order) {
+    static const FrameLocation no_slot;
+    std::unordered_map<const Value*, FrameLocation> locations;
+    auto location = [&](const Value* v) -> const FrameLocation* {
+        if (v->kind != ValueKind::INSTRUCTION)
+            return &no_slot;
+        auto it = locations.find(v);
+        return it == locations.end() ? nullptr : &it->second;
+    };
+    auto constant = [](const Value* v) -> const ConstantInt* {
+        return v->kind == ValueKind::CONSTANT_INT ? static_cast<const ConstantInt*>(v) : nullptr;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (BasicBlock* bb : order) {
+            for (auto& inst : bb->insts) {
+                FrameLocation loc;
+                switch (inst->op) {
+                case Opcode::FRAME_ADDR:
+                    loc.slot = inst->slot;
+                    break;
+                case Opcode::ADD:
+                case Opcode::SUB: {
+                    const FrameLocation* lhs = location(inst->operands[0]);
+                    const FrameLocation* rhs = location(inst->operands[1]);
+                    if (!lhs || !rhs)
+                        continue;
+                    bool commuted = inst->op == Opcode::ADD && !lhs->slot;
+                    const FrameLocation* base = commuted ? rhs : lhs;
+                    const Value* delta = inst->operands[commuted ? 0 : 1];
+                    if (!base->slot || (commuted ? lhs : rhs)->slot)
+                        break;
+                    loc = *base;
+                    if (const ConstantInt* c = constant(delta); c && loc.known_offset)
+                        loc.offset += inst->op == Opcode::ADD ? c->value : -c->value;
+                    else
+                        loc = {base->slot, 0, false};
+                    break;
+                }
+                case Opcode::PHI: {
+                    bool first = true;
+                    for (const Value* input : inst->operands) {
+                        const FrameLocation* in = location(input);
+                        if (!in)
+                            continue;
+                        loc = first ? *in : merge(loc, *in);
+                        first = false;
+                    }
+                    if (first)
+                        continue;
+                    break;
+                }
+                default:
+                    break;
+                }
+                auto [it, inserted] = locations.try_emplace(inst.get(), loc);
+                if (inserted || !(it->second == loc)) {
+                    it->second = loc;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return locations;
+}
+
+// Slots whose address reaches anything but a load or store address, further address
+// arithmetic into the same slot or a comparison: passed to a call (including the `this` of
+// a method), stored, returned or mixed with other values. Calls and accesses through
+// pointers of unknown origin may read these.
+static std::unordered_set<StackSlot*>
+escaped_slots(const std::vector<BasicBlock*>& order,
+              const std::unordered_map<const Value*, FrameLocation>& locations) {
+    std::unordered_set<StackSlot*> escaped;
+    for (BasicBlock* bb : order) {
+        for (auto& inst : bb->insts) {
+            for (size_t i = 0; i < inst->operands.size(); i++) {
+                auto it = locations.find(inst->operands[i]);
+                if (it == locations.end() || !it->second.slot)
+                    continue;
+                StackSlot* slot = it->second.slot;
+                bool address_use = false;
+                switch (inst->op) {
+                case Opcode::LOAD:
+                case Opcode::VLOAD:
+                    address_use = i == 0;
+                    break;
+                case Opcode::STORE:
+                case Opcode::VSTORE:
+                    address_use = i == 1;
+                    break;
+                case Opcode::ICMP:
+                    address_use = true;
+                    break;
+                case Opcode::ADD:
+                case Opcode::SUB:
+                case Opcode::PHI:
+                    address_use = locations.at(inst.get()).slot == slot;
+                    break;
+                default:
+                    break;
+                }
+                if (!address_use)
+                    escaped.insert(slot);
+            }
+        }
+    }
+    return escaped;
+}
+
+namespace {
+
+// One bit for every byte of every stack slot, set while the byte may still be read
+class LiveBytes {
+  public:
+    explicit LiveBytes(size_t bits) : words((bits + 63) / 64, 0) {}
+
+    void set(size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            words[i / 64] |= uint64_t(1) << (i % 64);
+    }
+    void clear(size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            words[i / 64] &= ~(uint64_t(1) << (i % 64));
+    }
+    bool any(size_t begin, size_t end) const {
+        for (size_t i = begin; i < end; i++) {
+            if (words[i / 64] >> (i % 64) & 1)
+                return true;
+        }
+        return false;
+    }
+    bool merge(const LiveBytes& other) {
+        bool changed = false;
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t merged = words[i] | other.words[i];
+            changed |= merged != words[i];
+            words[i] = merged;
+        }
+        return changed;
+    }
+    void reset() {
+        std::fill(words.begin(), words.end(), 0);
+    }
+
+  private:
+    std::vector<uint64_t> words;
+};
+
+// Backward liveness of the frame bytes. A store is dead when none of the bytes it writes
+// is live after it: each is overwritten, or the function returns, before any read.
+class DeadStoreAnalysis {
+  public:
+    DeadStoreAnalysis(Function& fn, const std::vector<BasicBlock*>& order)
+        : fn(fn), locations(frame_locations(order)), escaped(escaped_slots(order, locations)) {
+        for (auto& slot : fn.slots) {
+            first_bit[slot.get()] = bits;
+            bits += slot->size;
+        }
+    }
+
+    size_t bitCount() const {
+        return bits;
+    }
+
+    // Applies `inst` to the bytes live after it, returning true if it is a dead store
+    bool step(const Instruction& inst, LiveBytes& live) const {
+        switch (inst.op) {
+        case Opcode::LOAD:
+        case Opcode::VLOAD:
+            read(inst.operands[0], access_size(inst), live);
+            return false;
+        case Opcode::STORE:
+        case Opcode::VSTORE:
+            return write(inst.operands[1], access_size(inst), live);
+        case Opcode::CALL: {
+            Function* callee = fn.parent->findFunction(inst.callee);
+            if (!callee || callee->purity != Purity::PURE)
+                readEscaped(live);
+            return false;
+        }
+        case Opcode::RET:
+        case Opcode::UNREACHABLE:
+            live.reset(); // The frame is gone
+            return false;
+        default:
+            return false;
+        }
+    }
+
+  private:
+    Function& fn;
+    std::unordered_map<const Value*, FrameLocation> locations;
+    std::unordered_set<StackSlot*> escaped;
+    std::unordered_map<const StackSlot*, size_t> first_bit;
+    size_t bits = 0;
+
+    static int access_size(const Instruction& inst) {
+        return inst.op == Opcode::VLOAD || inst.op == Opcode::VSTORE ? 16 : inst.mem.size;
+    }
+
+    const FrameLocation* location(const Value* addr) const {
+        auto it = locations.find(addr);
+        return it == locations.end() || !it->second.slot ? nullptr : &it->second;
+    }
+
+    static bool is_exact(const FrameLocation& loc, int size) {
+        return loc.known_offset && loc.offset >= 0 && loc.offset + size <= loc.slot->size;
+    }
+
+    // The bytes an access covers, or the whole slot when the offset is not known
+    std::pair<size_t, size_t> range(const FrameLocation& loc, int size) const {
+        size_t base = first_bit.at(loc.slot);
+        if (!is_exact(loc, size))
+            return {base, base + loc.slot->size};
+        return {base + loc.offset, base + loc.offset + size};
+    }
+
+    void read(const Value* addr, int size, LiveBytes& live) const {
+        if (const FrameLocation* loc = location(addr)) {
+            auto [begin, end] = range(*loc, size);
+            live.set(begin, end);
+        } else {
+            readEscaped(live);
+        }
+    }
+
+    void readEscaped(LiveBytes& live) const {
+        for (StackSlot* slot : escaped) {
+            size_t base = first_bit.at(slot);
+            live.set(base, base + slot->size);
+        }
+    }
+
+    bool write(const Value* addr, int size, LiveBytes& live) const {
+        const FrameLocation* loc = location(addr);
+        if (!loc)
+            return false;
+        auto [begin, end] = range(*loc, size);
+        bool dead = !live.any(begin, end);
+        // Only a store to a known place overwrites what an earlier one left there
+        if (is_exact(*loc, size))
+            live.clear(begin, end);
+        return dead;
+    }
+};
+
+} // namespace
+
+// Tracking every byte of every block gets expensive for huge frames, such functions are
+// left alone
+static constexpr size_t MAX_TRACKED_BITS = size_t(1) << 24;
+
+// Deletes what computed the values of deleted stores once nothing else uses it. Loads are
+// among them, and dropping a load can make earlier stores to its bytes dead in turn.
+static void remove_unused_operands(Function& fn, std::vector<Value*> work) {
+    // An address shared by several stores is queued once per store
+    std::unordered_set<Value*> erased;
+    while (!work.empty()) {
+        Value* v = work.back();
+        work.pop_back();
+        if (erased.count(v) || v->kind != ValueKind::INSTRUCTION)
+            continue;
+        auto* inst = static_cast<Instruction*>(v);
+        if (inst->hasSideEffects() || inst->op == Opcode::PHI || fn.countUses(inst) > 0)
+            continue;
+        work.insert(work.end(), inst->operands.begin(), inst->operands.end());
+        erased.insert(inst);
+        inst->parent->erase(inst);
+    }
+}
+
+static bool remove_dead_stores(Function& fn) {
+    DominatorTree dom(fn);
+    const std::vector<BasicBlock*>& order = dom.rpo();
+    DeadStoreAnalysis analysis(fn, order);
+    if (analysis.bitCount() * order.size() > MAX_TRACKED_BITS)
+        return false;
+
+    // Bytes live on entry to each block, solved in post-order so successors come first
+    std::unordered_map<BasicBlock*, LiveBytes> live_in;
+    for (BasicBlock* bb : order)
+        live_in.emplace(bb, LiveBytes(analysis.bitCount()));
+    auto live_out = [&](BasicBlock* bb) {
+        LiveBytes live(analysis.bitCount());
+        for (BasicBlock* succ : bb->successors())
+            live.merge(live_in.at(succ));
+        return live;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            LiveBytes live = live_out(*it);
+            for (auto inst = (*it)->insts.rbegin(); inst != (*it)->insts.rend(); ++inst)
+                analysis.step(**inst, live);
+            changed |= live_in.at(*it).merge(live);
+        }
+    }
+
+    std::vector<Instruction*> dead;
+    for (BasicBlock* bb : order) {
+        LiveBytes live = live_out(bb);
+        for (auto inst = bb->insts.rbegin(); inst != bb->insts.rend(); ++inst) {
+            if (analysis.step(**inst, live))
+                dead.push_back(inst->get());
+        }
+    }
+    std::vector<Value*> operands;
+    for (Instruction* store : dead) {
+        operands.insert(operands.end(), store->operands.begin(), store->operands.end());
+        store->parent->erase(store);
+    }
+    remove_unused_operands(fn, std::move(operands));
+    return !dead.empty();
+}
+
+bool DeadStoreEliminationPass::runOnFunction(Function& fn) {
+    if (fn.blocks.empty() || fn.slots.empty())
+        return false;
+
+    bool changed = false;
+    while (remove_dead_stores(fn))
+        changed = true;
+    return changed;
+}
@@ -215,7 +215,8 @@ void DebugVisitor::visitFunctionParameterStmt(const FunctionParameterStmt* stmt)
 }
 
 void DebugVisitor::visitFunctionDeclStmt(const FunctionDeclStmt* stmt) {
-    std::cout << pad() << "Function " << stmt->name_token.lexeme << " returns "
+    const char* specifier = stmt->is_inline ? "inline " : stmt->is_noinline ? "noinline " : "";
+    std::cout << pad() << specifier << "Function " << stmt->name_token.lexeme << " returns "
               << stmt->return_type.name << "\n";
     std::cout << pad() << "  Params:\n";
 
@@ -0,0 +1,138 @@
+#include "Dominators.h"
+
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
+DominatorTree::DominatorTree(Function& fn) {
+    // Post-order DFS from the entry
+    std::unordered_set<BasicBlock*> visited;
+    std::vector<BasicBlock*> post;
+    std::vector<std::pair<BasicBlock*, size_t>> stack = {{fn.entry(), 0}};
+    visited.insert(fn.entry());
+
+    while (!stack.empty()) {
+        auto& [bb, next] = stack.back();
+        std::vector<BasicBlock*> succs = bb->successors();
+        if (next < succs.size()) {
+            BasicBlock* succ = succs[next++];
+            if (visited.insert(succ).second)
+                stack.push_back({succ, 0});
+        } else {
+            post.push_back(bb);
+            stack.pop_back();
+        }
+    }
+
+    order.assign(post.rbegin(), post.rend());
+    for (size_t i = 0; i < order.size(); i++)
+        rpo_index[order[i]] = static_cast<int>(i);
+
+    BasicBlock* entry = fn.entry();
+    idoms[entry] = entry;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++) {
+            BasicBlock* bb = order[i];
+            BasicBlock* new_idom = nullptr;
+            for (BasicBlock* pred : bb->preds) {
+                if (!idoms.count(pred))
+                    continue;
+                new_idom = new_idom ? intersect(pred, new_idom) : pred;
+            }
+            if (new_idom && idoms[bb] != new_idom) {
+                idoms[bb] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 1; i < order.size(); i++)
+        tree_children[idoms[order[i]]].push_back(order[i]);
+
+    // Pre/post numbering of the tree for constant time dominance queries
+    int counter = 0;
+    std::function<void(BasicBlock*)> number = [&](BasicBlock* bb) {
+        int in = counter++;
+        for (BasicBlock* child : children(bb))
+            number(child);
+        dfs_range[bb] = {in, counter++};
+    };
+    number(entry);
+}
+
+BasicBlock* DominatorTree::intersect(BasicBlock* a, BasicBlock* b) const {
+    while (a != b) {
+        while (rpo_index.at(a) > rpo_index.at(b))
+            a = idoms.at(a);
+        while (rpo_index.at(b) > rpo_index.at(a))
+            b = idoms.at(b);
+    }
+    return a;
+}
+
+bool DominatorTree::isReachable(BasicBlock* bb) const {
+    return rpo_index.count(bb) > 0;
+}
+
+BasicBlock* DominatorTree::idom(BasicBlock* bb) const {
+    auto it = idoms.find(bb);
+    if (it == idoms.end() || it->second == bb)
+        return nullptr;
+    return it->second;
+}
+
+const std::vector<BasicBlock*>& DominatorTree::children(BasicBlock* bb) const {
+    static const std::vector<BasicBlock*> none;
+    auto it = tree_children.find(bb);
+    return it == tree_children.end() ? none : it->second;
+}
+
+bool DominatorTree::dominates(BasicBlock* a, BasicBlock* b) const {
+    auto ra = dfs_range.find(a);
+    auto rb = dfs_range.find(b);
+    if (ra == dfs_range.end() || rb == dfs_range.end())
+        return false;
+    return ra->second.first <= rb->second.first && rb->second.second <= ra->second.second;
+}
+
+bool DominatorTree::dominates(const Instruction* def, const Instruction* use) const {
+    if (def->parent != use->parent)
+        return dominates(def->parent, use->parent);
+
+    for (const auto& inst : def->parent->insts) {
+        if (inst.get() == def)
+            return true;
+        if (inst.get() == use)
+            return false;
+    }
+    return false;
+}
+
+std::unordered_map<BasicBlock*, std::vector<BasicBlock*>> DominatorTree::frontiers() const {
+    std::unordered_map<BasicBlock*, std::vector<BasicBlock*>> df;
+
+    for (BasicBlock* bb : order) {
+        std::vector<BasicBlock*> preds;
+        for (BasicBlock* p : bb->preds) {
+            if (isReachable(p))
+                preds.push_back(p);
+        }
+        if (preds.size() < 2)
+            continue;
+
+        for (BasicBlock* pred : preds) {
+            BasicBlock* runner = pred;
+            while (runner != idoms.at(bb)) {
+                auto& list = df[runner];
+                if (std::find(list.begin(), list.end(), bb) == list.end())
+                    list.push_back(bb);
+                runner = idoms.at(runner);
+            }
+        }
+    }
+
+    return df;
+}
@@ -0,0 +1,497 @@
+#include "FrameLowering.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <unordered_map>
+
+using MO = MachineOperand;
+
+static const MReg SP = MReg::phys(REG_SP);
+static const MReg FP = MReg::phys(REG_FP);
+static const MReg LR = MReg::phys(REG_LR);
+
+// Address scratch for out-of-range offsets. Spill code may already use x16 itself, in
+// which case x17 takes over.
+static MReg address_scratch(MachineInstr& mi) {
+    bool uses_x16 = false;
+    mi.forEachReg([&](MReg& reg, bool, bool) {
+        uses_x16 |= !reg.is_virtual && reg.cls == RegClass::GPR && reg.id == 16;
+    });
+    return MReg::phys(uses_x16 ? 17 : 16);
+}
+
+static int align_to(int value, int align) {
+    return (value + align - 1) / align * align;
+}
+
+// Bytes transferred by a load or store, used to pick a legal offset encoding
+static int access_size(const MachineInstr& mi) {
+    const std::string& op = mi.opcode;
+    if (op == "ldrb" || op == "strb" || op == "ldrsb")
+        return 1;
+    if (op == "ldrh" || op == "strh" || op == "ldrsh")
+        return 2;
+    if (op == "ldrsw")
+        return 4;
+    switch (mi.ops[0].view) {
+    case 'w':
+    case 's':
+        return 4;
+    case 'q':
+        return 16;
+    default:
+        return 8;
+    }
+}
+
+static bool is_pair(const MachineInstr& mi) {
+    return mi.opcode == "ldp" || mi.opcode == "stp";
+}
+
+static const std::map<std::string, std::string> UNSCALED = {
+    {"ldr", "ldur"},     {"str", "stur"},     {"ldrb", "ldurb"},   {"strb", "sturb"},
+    {"ldrh", "ldurh"},   {"strh", "sturh"},   {"ldrsb", "ldursb"}, {"ldrsh", "ldursh"},
+    {"ldrsw", "ldursw"},
+};
+
+FrameLowering::FrameLowering(MachineFunction& p_mf, bool p_keep_frame_pointer)
+    : mf(p_mf), keep_frame_pointer(p_keep_frame_pointer) {}
+
+void FrameLowering::run() {
+    layoutObjects();
+    eliminateFrameIndices();
+    placeSaves();
+    if (!save_block)
+        return; // A leaf keeping everything in caller-saved registers needs no frame
+    insertPrologue();
+    insertEpilogues();
+}
+
+// Which frame objects can be live at the same time. An object is live from a store to it
+// up to its last load, and a store covering all of it ends the previous contents. Objects
+// whose address is taken into a register can be reached by anything and conflict with
+// every other one.
+static std::vector<std::vector<bool>> frame_interference(MachineFunction& mf) {
+    size_t n = mf.frame_objects.size();
+    std::vector<std::vector<bool>> conflicts(n, std::vector<bool>(n, false));
+    auto conflict = [&](size_t a, size_t b) {
+        if (a != b)
+            conflicts[a][b] = conflicts[b][a] = true;
+    };
+
+    for (auto& mb : mf.blocks) {
+        for (auto& mi : mb->insts) {
+            for (auto& op : mi.ops) {
+                if (op.kind != MO::Kind::FRAME_INDEX)
+                    continue;
+                for (size_t other = 0; other < n; other++)
+                    conflict(op.frame_index, other);
+            }
+        }
+    }
+
+    // Applies one instruction to the objects live after it, recording conflicts when asked
+    auto step = [&](MachineInstr& mi, std::vector<bool>& live, bool record) {
+        for (auto& op : mi.ops) {
+            if (op.kind != MO::Kind::MEM || op.frame_index < 0)
+                continue;
+            const FrameObject& obj = mf.frame_objects[op.frame_index];
+            if (mi.opcode.rfind("st", 0) == 0) {
+                if (record) {
+                    for (size_t other = 0; other < n; other++) {
+                        if (live[other])
+                            conflict(op.frame_index, other);
+                    }
+                }
+                int size = (is_pair(mi) ? 2 : 1) * access_size(mi);
+                if (op.imm <= 0 && op.imm + size >= obj.size)
+                    live[op.frame_index] = false;
+            } else {
+                live[op.frame_index] = true;
+            }
+        }
+    };
+
+    mf.rebuildCFG();
+    std::unordered_map<MachineBlock*, std::vector<bool>> live_in;
+    for (auto& mb : mf.blocks)
+        live_in[mb.get()].assign(n, false);
+    auto live_out = [&](MachineBlock* mb) {
+        std::vector<bool> live(n, false);
+        for (MachineBlock* succ : mb->succs) {
+            for (size_t i = 0; i < n; i++)
+                live[i] = live[i] || live_in[succ][i];
+        }
+        return live;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = mf.blocks.rbegin(); it != mf.blocks.rend(); ++it) {
+            std::vector<bool> live = live_out(it->get());
+            for (auto mi = (*it)->insts.rbegin(); mi != (*it)->insts.rend(); ++mi)
+                step(*mi, live, false);
+            if (live != live_in[it->get()]) {
+                live_in[it->get()] = std::move(live);
+                changed = true;
+            }
+        }
+    }
+
+    for (auto& mb : mf.blocks) {
+        std::vector<bool> live = live_out(mb.get());
+        for (auto mi = mb->insts.rbegin(); mi != mb->insts.rend(); ++mi)
+            step(*mi, live, true);
+    }
+    // Read before any store, their contents are whatever was on the stack at entry
+    const std::vector<bool>& entry = live_in[mf.blocks.front().get()];
+    for (size_t a = 0; a < n; a++) {
+        for (size_t b = 0; b < n && entry[a]; b++) {
+            if (entry[b])
+                conflict(a, b);
+        }
+    }
+    return conflicts;
+}
+
+// Objects that are never live at the same time share frame space: each goes at the lowest
+// aligned offset clear of the objects it conflicts with. Spill slots go first, closest to
+// sp, where the scaled offsets of single instructions reach them.
+void FrameLowering::layoutObjects() {
+    std::vector<std::vector<bool>> conflicts = frame_interference(mf);
+    std::vector<size_t> placed;
+    int end = 0;
+    unshared_size = 0;
+    for (bool spills : {true, false}) {
+        for (size_t i = 0; i < mf.frame_objects.size(); i++) {
+            FrameObject& obj = mf.frame_objects[i];
+            if (obj.is_spill != spills)
+                continue;
+            unshared_size = align_to(unshared_size, obj.align) + obj.size;
+
+            int offset = 0;
+            bool moved = true;
+            while (moved) {
+                moved = false;
+                for (size_t other : placed) {
+                    const FrameObject& o = mf.frame_objects[other];
+                    if (conflicts[i][other] && offset < o.offset + o.size &&
+                        o.offset < offset + obj.size) {
+                        offset = align_to(o.offset + o.size, obj.align);
+                        moved = true;
+                    }
+                }
+            }
+            obj.offset = offset;
+            placed.push_back(i);
+            end = std::max(end, offset + obj.size);
+        }
+    }
+    locals_size = align_to(end, 16);
+    unshared_size = align_to(unshared_size, 16);
+}
+
+void FrameLowering::emitAddImmediate(std::vector<MachineInstr>& out, const std::string& opcode,
+                                     MReg dst, MReg base, int64_t imm, MReg scratch) {
+    if (imm >= 0 && imm <= 4095) {
+        out.emplace_back(opcode, std::vector<MO>{MO::def(dst, 'x'), MO::use(base, 'x'),
+                                                 MO::immediate(imm)});
+        return;
+    }
+    if (imm > 0 && imm < (1 << 24)) {
+        out.emplace_back(opcode, std::vector<MO>{MO::def(dst, 'x'), MO::use(base, 'x'),
+                                                 MO::immediate(imm >> 12), MO::raw("lsl #12")});
+        if (imm & 0xFFF)
+            out.emplace_back(opcode, std::vector<MO>{MO::def(dst, 'x'), MO::use(dst, 'x'),
+                                                     MO::immediate(imm & 0xFFF)});
+        return;
+    }
+    out.emplace_back("ldr", std::vector<MO>{MO::def(scratch, 'x'),
+                                            MO::raw("=" + std::to_string(imm))});
+    out.emplace_back(opcode, std::vector<MO>{MO::def(dst, 'x'), MO::use(base, 'x'),
+                                             MO::use(scratch, 'x')});
+}
+
+void FrameLowering::eliminateFrameIndices() {
+    for (auto& mb : mf.blocks) {
+        std::vector<MachineInstr> out;
+
+        for (auto& mi : mb->insts) {
+            bool handled = false;
+
+            for (auto& op : mi.ops) {
+                if (op.kind == MO::Kind::FRAME_INDEX) {
+                    // add dst, sp, #FI
+                    int64_t offset = mf.frame_objects[op.frame_index].offset + op.imm;
+                    emitAddImmediate(out, mi.opcode, mi.ops[0].reg, mi.ops[1].reg, offset,
+                                     address_scratch(mi));
+                    handled = true;
+                    break;
+                }
+
+                if (op.kind != MO::Kind::MEM || op.frame_index < 0)
+                    continue;
+
+                int64_t offset = mf.frame_objects[op.frame_index].offset + op.imm;
+                op.frame_index = -1;
+                op.reg = SP;
+                op.imm = offset;
+
+                int size = is_pair(mi) ? 8 : access_size(mi);
+                bool scaled = offset >= 0 && offset % size == 0 &&
+                              offset <= (is_pair(mi) ? 63 : 4095) * size;
+                if (scaled)
+                    break;
+
+                auto unscaled = UNSCALED.find(mi.opcode);
+                if (unscaled != UNSCALED.end() && offset >= -256 && offset <= 255) {
+                    mi.opcode = unscaled->second;
+                    break;
+                }
+
+                MReg scratch = address_scratch(mi);
+                emitAddImmediate(out, "add", scratch, SP, offset, scratch);
+                op.reg = scratch;
+                op.imm = 0;
+                break;
+            }
+
+            if (!handled)
+                out.push_back(std::move(mi));
+        }
+
+        mb->insts = std::move(out);
+    }
+}
+
+// Whether a block touches anything the prologue sets up: the stack, the frame record or a
+// callee-saved register the allocator handed out
+bool FrameLowering::needsFrame(MachineBlock& mb) {
+    auto saved = [&](const MReg& reg) {
+        const auto& used = reg.cls == RegClass::GPR ? mf.used_callee_saved_gpr
+                                                    : mf.used_callee_saved_fpr;
+        return std::find(used.begin(), used.end(), reg.id) != used.end();
+    };
+    for (auto& mi : mb.insts) {
+        if (mi.is_call)
+            return true;
+        bool touches = false;
+        mi.forEachReg([&](MReg& reg, bool, bool) {
+            if (reg.is_virtual)
+                return;
+            touches |= saved(reg) || (reg.cls == RegClass::GPR &&
+                                      (reg.id == REG_SP || reg.id == REG_FP || reg.id == REG_LR));
+        });
+        if (touches)
+            return true;
+    }
+    return false;
+}
+
+// Shrink-wrapping: the prologue goes into the deepest block that dominates every block
+// needing the frame and is not inside a loop, so early exits in front of it (`if (n < 2)
+// return n;`) run without one. Epilogues go in front of the returns it dominates and on the
+// edges leaving its dominance region, which can never lead back into it. This relies on
+// the entry not writing callee-saved registers: instruction selection copies arguments and
+// phi inputs for the slow path in the blocks after the entry's branch.
+void FrameLowering::placeSaves() {
+    bool has_calls = false;
+    for (auto& mb : mf.blocks) {
+        for (auto& mi : mb->insts)
+            has_calls |= mi.is_call;
+    }
+    frame_record = has_calls || keep_frame_pointer;
+
+    std::vector<MachineBlock*> needing;
+    for (auto& mb : mf.blocks) {
+        if (needsFrame(*mb))
+            needing.push_back(mb.get());
+    }
+    if (needing.empty() && !frame_record && locals_size == 0)
+        return;
+    save_block = mf.blocks.front().get();
+    // Profilers walk the frame records, which must then be set up before anything else. A
+    // huge frame needs x16 to adjust sp, which could hold a value past the entry.
+    if (keep_frame_pointer || locals_size >= (1 << 24) || mf.blocks.size() > 256)
+        return;
+
+    mf.rebuildCFG();
+    MachineBlock* entry = mf.blocks.front().get();
+    // Blocks reached from the entry without passing through `avoid`
+    auto reachable = [&](MachineBlock* from, MachineBlock* avoid) {
+        std::unordered_set<MachineBlock*> seen;
+        std::vector<MachineBlock*> work;
+        if (from != avoid) {
+            seen.insert(from);
+            work.push_back(from);
+        }
+        while (!work.empty()) {
+            MachineBlock* mb = work.back();
+            work.pop_back();
+            for (MachineBlock* succ : mb->succs) {
+                if (succ != avoid && seen.insert(succ).second)
+                    work.push_back(succ);
+            }
+        }
+        return seen;
+    };
+
+    std::unordered_set<MachineBlock*> live = reachable(entry, nullptr);
+    std::vector<MachineBlock*> candidates;
+    std::unordered_map<MachineBlock*, std::unordered_set<MachineBlock*>> bypassed;
+    for (auto& owned : mf.blocks) {
+        MachineBlock* mb = owned.get();
+        if (!live.count(mb))
+            continue;
+        std::unordered_set<MachineBlock*> around = reachable(entry, mb);
+        bool dominates_all = std::none_of(needing.begin(), needing.end(), [&](MachineBlock* n) {
+            return around.count(n);
+        });
+        bool in_loop = std::any_of(mb->succs.begin(), mb->succs.end(), [&](MachineBlock* succ) {
+            return reachable(succ, nullptr).count(mb);
+        });
+        if (dominates_all && !in_loop) {
+            candidates.push_back(mb);
+            bypassed[mb] = std::move(around);
+        }
+    }
+
+    // The candidates lie on one dominator chain, the deepest is dominated by all the others
+    for (MachineBlock* candidate : candidates) {
+        bool deepest = std::all_of(candidates.begin(), candidates.end(), [&](MachineBlock* other) {
+            return other == candidate || !bypassed[other].count(candidate);
+        });
+        if (deepest) {
+            save_block = candidate;
+            for (MachineBlock* mb : live) {
+                if (!bypassed[candidate].count(mb))
+                    region.insert(mb);
+            }
+            return;
+        }
+    }
+}
+
+std::vector<MachineInstr> FrameLowering::makeEpilogue() {
+    std::vector<MachineInstr> epilogue;
+
+    if (locals_size > 0)
+        emitAddImmediate(epilogue, "add", SP, SP, locals_size, MReg::phys(16));
+
+    auto restore = [&](const std::vector<int>& regs, RegClass cls, char view) {
+        size_t count = regs.size();
+        if (count % 2 == 1) {
+            epilogue.emplace_back("ldr", std::vector<MO>{MO::def(MReg::phys(regs[count - 1], cls),
+                                                                 view),
+                                                         MO::mem(SP, 16, AddrMode::POST_INDEX)});
+            count--;
+        }
+        for (size_t i = count; i >= 2; i -= 2) {
+            epilogue.emplace_back(
+                "ldp", std::vector<MO>{MO::def(MReg::phys(regs[i - 2], cls), view),
+                                       MO::def(MReg::phys(regs[i - 1], cls), view),
+                                       MO::mem(SP, 16, AddrMode::POST_INDEX)});
+        }
+    };
+    restore(mf.used_callee_saved_fpr, RegClass::FPR, 'd');
+    restore(mf.used_callee_saved_gpr, RegClass::GPR, 'x');
+
+    if (frame_record)
+        epilogue.emplace_back("ldp", std::vector<MO>{MO::def(FP, 'x'), MO::def(LR, 'x'),
+                                                     MO::mem(SP, 16, AddrMode::POST_INDEX)});
+    return epilogue;
+}
+
+void FrameLowering::insertPrologue() {
+    std::vector<MachineInstr> prologue;
+
+    if (frame_record) {
+        prologue.emplace_back("stp", std::vector<MO>{MO::use(FP, 'x'), MO::use(LR, 'x'),
+                                                     MO::mem(SP, -16, AddrMode::PRE_INDEX)});
+        prologue.emplace_back("mov", std::vector<MO>{MO::def(FP, 'x'), MO::use(SP, 'x')});
+    }
+
+    auto save = [&](const std::vector<int>& regs, RegClass cls, char view) {
+        for (size_t i = 0; i < regs.size(); i += 2) {
+            MReg first = MReg::phys(regs[i], cls);
+            if (i + 1 < regs.size()) {
+                prologue.emplace_back(
+                    "stp", std::vector<MO>{MO::use(first, view),
+                                           MO::use(MReg::phys(regs[i + 1], cls), view),
+                                           MO::mem(SP, -16, AddrMode::PRE_INDEX)});
+            } else {
+                prologue.emplace_back("str", std::vector<MO>{MO::use(first, view),
+                                                             MO::mem(SP, -16,
+                                                                     AddrMode::PRE_INDEX)});
+            }
+        }
+    };
+    save(mf.used_callee_saved_gpr, RegClass::GPR, 'x');
+    save(mf.used_callee_saved_fpr, RegClass::FPR, 'd');
+
+    if (locals_size > 0)
+        emitAddImmediate(prologue, "sub", SP, SP, locals_size, MReg::phys(16));
+
+    auto& insts = save_block->insts;
+    insts.insert(insts.begin(), prologue.begin(), prologue.end());
+}
+
+void FrameLowering::insertEpilogues() {
+    std::vector<MachineInstr> epilogue = makeEpilogue();
+    bool wrapped = !region.empty();
+
+    // Edges leaving the region go through a new block that tears the frame down
+    std::vector<std::pair<MachineBlock*, MachineBlock*>> exits;
+    for (auto& mb : mf.blocks) {
+        if (!wrapped || !region.count(mb.get()))
+            continue;
+        for (MachineBlock* succ : mb->succs) {
+            if (!region.count(succ))
+                exits.push_back({mb.get(), succ});
+        }
+    }
+    for (auto [from, to] : exits) {
+        auto exit = std::make_unique<MachineBlock>("L" + mf.name + "_epilogue" +
+                                                   std::to_string(exit_count++));
+        exit->insts = epilogue;
+        // A short return block is copied rather than branched to
+        bool returns = to->insts.size() <= 4 && !to->insts.empty() &&
+                       to->insts.back().isReturn() &&
+                       std::none_of(to->insts.begin(), to->insts.end() - 1,
+                                    [](const MachineInstr& mi) { return mi.isTerminator(); });
+        if (returns)
+            exit->insts.insert(exit->insts.end(), to->insts.begin(), to->insts.end());
+        else
+            exit->insts.emplace_back("b", std::vector<MO>{MO::label(to)});
+
+        for (auto& mi : from->insts) {
+            for (auto& op : mi.ops) {
+                if (op.kind == MO::Kind::BLOCK && op.block == to)
+                    op.block = exit.get();
+            }
+        }
+        // Between the two blocks when they are adjacent, which keeps a fall-through edge
+        // falling through and lets the peephole pass drop the branches to the next block
+        auto pos = std::find_if(mf.blocks.begin(), mf.blocks.end(),
+                                [&](const auto& mb) { return mb.get() == from; });
+        if (pos + 1 != mf.blocks.end() && (pos + 1)->get() == to)
+            mf.blocks.insert(pos + 1, std::move(exit));
+        else
+            mf.blocks.push_back(std::move(exit));
+    }
+    if (!exits.empty())
+        mf.rebuildCFG();
+
+    for (auto& mb : mf.blocks) {
+        if (wrapped && !region.count(mb.get()))
+            continue;
+        for (size_t i = 0; i < mb->insts.size(); i++) {
+            if (!mb->insts[i].isReturn())
+                continue;
+            mb->insts.insert(mb->insts.begin() + i, epilogue.begin(), epilogue.end());
+            i += epilogue.size();
+        }
+    }
+}
@@ -0,0 +1,150 @@
+#include "FunctionLayout.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+// Iterations assumed per loop level around a call site, as in block placement
+static constexpr double LOOP_ITERATIONS = 8.0;
+
+void FunctionLayout::addFunction(const MachineFunction& mf) {
+    std::string symbol = "_" + mf.name;
+    defined.push_back(symbol);
+    auto& out = calls[symbol];
+    auto& refs = references[symbol];
+    if (!mf.blocks.empty() && mf.blocks.front()->profile_count == 0)
+        cold.insert(symbol);
+    for (const auto& mb : mf.blocks) {
+        double weight = mb->profile_count >= 0
+                            ? static_cast<double>(mb->profile_count)
+                            : std::pow(LOOP_ITERATIONS, std::min(mb->loop_depth, 3));
+        for (const auto& mi : mb->insts) {
+            bool is_call = mi.opcode == "bl" || mi.opcode == "b";
+            for (const auto& op : mi.ops) {
+                if (op.kind != MachineOperand::Kind::SYMBOL &&
+                    !(op.kind == MachineOperand::Kind::MEM && op.mode == AddrMode::PAGE_OFFSET))
+                    continue;
+                std::string target = op.text.substr(0, op.text.find('@'));
+                refs.insert(target);
+                // Block labels of the AST code generator are symbols too, they start with L
+                if (is_call && target.rfind('_', 0) == 0)
+                    out[target] += weight;
+            }
+        }
+    }
+}
+
+std::set<std::string> FunctionLayout::reachable() const {
+    std::set<std::string> seen;
+    std::vector<std::string> work = {"_main"};
+    while (!work.empty()) {
+        std::string fn = work.back();
+        work.pop_back();
+        if (!seen.insert(fn).second)
+            continue;
+        auto it = calls.find(fn);
+        if (it == calls.end())
+            continue;
+        for (const auto& [callee, weight] : it->second)
+            work.push_back(callee);
+    }
+    return seen;
+}
+
+std::set<std::string> FunctionLayout::externalCallees() const {
+    std::set<std::string> external;
+    for (const std::string& fn : reachable()) {
+        if (!calls.count(fn))
+            external.insert(fn);
+    }
+    return external;
+}
+
+std::set<std::string> FunctionLayout::referencedSymbols() const {
+    std::set<std::string> used;
+    for (const std::string& fn : reachable()) {
+        auto it = references.find(fn);
+        if (it != references.end())
+            used.insert(it->second.begin(), it->second.end());
+    }
+    return used;
+}
+
+// Edges are visited from the heaviest, each joining the chains of its two functions. Of
+// the four ways to concatenate them, the one putting the two functions closest wins.
+std::vector<std::string> FunctionLayout::order() const {
+    std::set<std::string> live = reachable();
+    std::vector<std::string> functions;
+    for (const std::string& fn : defined) {
+        if (live.count(fn))
+            functions.push_back(fn);
+    }
+
+    // Calls in both directions add up
+    std::map<std::pair<std::string, std::string>, double> weights;
+    for (const std::string& caller : functions) {
+        for (const auto& [callee, weight] : calls.at(caller)) {
+            if (callee == caller || !calls.count(callee) || !live.count(callee))
+                continue;
+            weights[std::minmax(caller, callee)] += weight;
+        }
+    }
+    struct Edge {
+        std::string a, b;
+        double weight;
+    };
+    std::vector<Edge> edges;
+    for (const auto& [pair, weight] : weights)
+        edges.push_back({pair.first, pair.second, weight});
+    std::stable_sort(edges.begin(), edges.end(),
+                     [](const Edge& x, const Edge& y) { return x.weight > y.weight; });
+
+    std::vector<std::vector<std::string>> chains;
+    std::map<std::string, size_t> chain_of;
+    for (const std::string& fn : functions) {
+        chain_of[fn] = chains.size();
+        chains.push_back({fn});
+    }
+
+    for (const Edge& e : edges) {
+        size_t ca = chain_of.at(e.a);
+        size_t cb = chain_of.at(e.b);
+        if (ca == cb)
+            continue;
+
+        std::vector<std::string> best;
+        size_t best_distance = SIZE_MAX;
+        for (bool flip_a : {false, true}) {
+            for (bool flip_b : {false, true}) {
+                std::vector<std::string> merged = chains[ca];
+                if (flip_a)
+                    std::reverse(merged.begin(), merged.end());
+                size_t tail = merged.size();
+                merged.insert(merged.end(), chains[cb].begin(), chains[cb].end());
+                if (flip_b)
+                    std::reverse(merged.begin() + tail, merged.end());
+                auto pa = std::find(merged.begin(), merged.end(), e.a) - merged.begin();
+                auto pb = std::find(merged.begin(), merged.end(), e.b) - merged.begin();
+                size_t distance = static_cast<size_t>(std::abs(pa - pb));
+                if (distance < best_distance) {
+                    best_distance = distance;
+                    best = std::move(merged);
+                }
+            }
+        }
+        for (const std::string& fn : chains[cb])
+            chain_of[fn] = ca;
+        chains[ca] = std::move(best);
+        chains[cb].clear();
+    }
+
+    // Every live function is connected to main, so this is normally a single chain. The
+    // functions the profile never saw run follow the others.
+    std::vector<std::string> result;
+    for (const auto& chain : chains)
+        result.insert(result.end(), chain.begin(), chain.end());
+    std::stable_partition(result.begin(), result.end(),
+                          [&](const std::string& fn) { return !cold.count(fn); });
+    return result;
+}
@@ -0,0 +1,608 @@
+#include "IR.h"
+
+#include <algorithm>
+#include <bit>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+std::string ir_type_name(IRType t) {
+    switch (t) {
+    case IRType::VOID:
+        return "void";
+    case IRType::I64:
+        return "i64";
+    case IRType::F32:
+        return "f32";
+    case IRType::F64:
+        return "f64";
+    case IRType::V128:
+        return "v128";
+    }
+    return "?";
+}
+
+IRType ir_type_of(const Type& t) {
+    if (t.kind == TypeKind::VOID)
+        return IRType::VOID;
+    if (t.kind == TypeKind::PRIMITIVE && t.is_float)
+        return t.size_bytes == 4 ? IRType::F32 : IRType::F64;
+    return IRType::I64;
+}
+
+const char* opcode_name(Opcode op) {
+    switch (op) {
+    case Opcode::ADD:
+        return "add";
+    case Opcode::SUB:
+        return "sub";
+    case Opcode::MUL:
+        return "mul";
+    case Opcode::SDIV:
+        return "sdiv";
+    case Opcode::UDIV:
+        return "udiv";
+    case Opcode::NEG:
+        return "neg";
+    case Opcode::ABS:
+        return "abs";
+    case Opcode::SHL:
+        return "shl";
+    case Opcode::LSHR:
+        return "lshr";
+    case Opcode::ASHR:
+        return "ashr";
+    case Opcode::AND:
+        return "and";
+    case Opcode::OR:
+        return "or";
+    case Opcode::XOR:
+        return "xor";
+    case Opcode::FADD:
+        return "fadd";
+    case Opcode::FSUB:
+        return "fsub";
+    case Opcode::FMUL:
+        return "fmul";
+    case Opcode::FDIV:
+        return "fdiv";
+    case Opcode::FNEG:
+        return "fneg";
+    case Opcode::FABS:
+        return "fabs";
+    case Opcode::FSQRT:
+        return "fsqrt";
+    case Opcode::FMIN:
+        return "fmin";
+    case Opcode::FMAX:
+        return "fmax";
+    case Opcode::FFLOOR:
+        return "ffloor";
+    case Opcode::FCEIL:
+        return "fceil";
+    case Opcode::FROUND:
+        return "fround";
+    case Opcode::ICMP:
+        return "icmp";
+    case Opcode::FCMP:
+        return "fcmp";
+    case Opcode::SEXT:
+        return "sext";
+    case Opcode::ZEXT:
+        return "zext";
+    case Opcode::SITOFP:
+        return "sitofp";
+    case Opcode::FPTOSI:
+        return "fptosi";
+    case Opcode::FPEXT:
+        return "fpext";
+    case Opcode::FPTRUNC:
+        return "fptrunc";
+    case Opcode::FRAME_ADDR:
+        return "frame_addr";
+    case Opcode::LOAD:
+        return "load";
+    case Opcode::STORE:
+        return "store";
+    case Opcode::BOUNDS_CHECK:
+        return "bounds_check";
+    case Opcode::PROFILE_INC:
+        return "profile_inc";
+    case Opcode::VLOAD:
+        return "vload";
+    case Opcode::VSTORE:
+        return "vstore";
+    case Opcode::VSPLAT:
+        return "vsplat";
+    case Opcode::VREDUCE:
+        return "vreduce";
+    case Opcode::VWIDEN:
+        return "vwiden";
+    case Opcode::CALL:
+        return "call";
+    case Opcode::PHI:
+        return "phi";
+    case Opcode::BR:
+        return "br";
+    case Opcode::COND_BR:
+        return "cond_br";
+    case Opcode::RET:
+        return "ret";
+    case Opcode::UNREACHABLE:
+        return "unreachable";
+    }
+    return "?";
+}
+
+const char* cond_name(Cond c) {
+    switch (c) {
+    case Cond::EQ:
+        return "eq";
+    case Cond::NE:
+        return "ne";
+    case Cond::LT:
+        return "lt";
+    case Cond::LE:
+        return "le";
+    case Cond::GT:
+        return "gt";
+    case Cond::GE:
+        return "ge";
+    case Cond::ULT:
+        return "ult";
+    case Cond::ULE:
+        return "ule";
+    case Cond::UGT:
+        return "ugt";
+    case Cond::UGE:
+        return "uge";
+    }
+    return "?";
+}
+
+Cond cond_inverse(Cond c) {
+    switch (c) {
+    case Cond::EQ:
+        return Cond::NE;
+    case Cond::NE:
+        return Cond::EQ;
+    case Cond::LT:
+        return Cond::GE;
+    case Cond::LE:
+        return Cond::GT;
+    case Cond::GT:
+        return Cond::LE;
+    case Cond::GE:
+        return Cond::LT;
+    case Cond::ULT:
+        return Cond::UGE;
+    case Cond::ULE:
+        return Cond::UGT;
+    case Cond::UGT:
+        return Cond::ULE;
+    case Cond::UGE:
+        return Cond::ULT;
+    }
+    return c;
+}
+
+Cond cond_swapped(Cond c) {
+    switch (c) {
+    case Cond::LT:
+        return Cond::GT;
+    case Cond::LE:
+        return Cond::GE;
+    case Cond::GT:
+        return Cond::LT;
+    case Cond::GE:
+        return Cond::LE;
+    case Cond::ULT:
+        return Cond::UGT;
+    case Cond::ULE:
+        return Cond::UGE;
+    case Cond::UGT:
+        return Cond::ULT;
+    case Cond::UGE:
+        return Cond::ULE;
+    default:
+        return c;
+    }
+}
+
+MemType mem_type_of(const Type& t) {
+    if (t.kind != TypeKind::PRIMITIVE)
+        return MemType{.size = 8, .is_signed = false, .is_float = false};
+    return MemType{.size = t.size_bytes, .is_signed = t.is_signed, .is_float = t.is_float};
+}
+
+std::string mem_type_name(const MemType& m) {
+    if (m.is_float)
+        return "f" + std::to_string(m.size * 8);
+    return (m.is_signed ? "i" : "u") + std::to_string(m.size * 8);
+}
+
+// Instruction
+
+bool Instruction::isTerminator() const {
+    return op == Opcode::BR || op == Opcode::COND_BR || op == Opcode::RET ||
+           op == Opcode::UNREACHABLE;
+}
+
+bool Instruction::hasSideEffects() const {
+    switch (op) {
+    case Opcode::STORE:
+    case Opcode::VSTORE:
+    case Opcode::BOUNDS_CHECK:
+    case Opcode::PROFILE_INC:
+    case Opcode::CALL:
+    case Opcode::BR:
+    case Opcode::COND_BR:
+    case Opcode::RET:
+    case Opcode::UNREACHABLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// BasicBlock
+
+Instruction* BasicBlock::terminator() const {
+    if (insts.empty() || !insts.back()->isTerminator())
+        return nullptr;
+    return insts.back().get();
+}
+
+std::vector<BasicBlock*> BasicBlock::successors() const {
+    Instruction* term = terminator();
+    if (!term || term->op == Opcode::RET || term->op == Opcode::UNREACHABLE)
+        return {};
+    return term->blocks;
+}
+
+Instruction* BasicBlock::append(std::unique_ptr<Instruction> inst) {
+    inst->parent = this;
+    insts.push_back(std::move(inst));
+    return insts.back().get();
+}
+
+Instruction* BasicBlock::insertBeforeTerminator(std::unique_ptr<Instruction> inst) {
+    inst->parent = this;
+    auto pos = terminator() ? std::prev(insts.end()) : insts.end();
+    return insts.insert(pos, std::move(inst))->get();
+}
+
+Instruction* BasicBlock::insertAtFront(std::unique_ptr<Instruction> inst) {
+    inst->parent = this;
+    insts.push_front(std::move(inst));
+    return insts.front().get();
+}
+
+Instruction* BasicBlock::insertBefore(Instruction* pos, std::unique_ptr<Instruction> inst) {
+    inst->parent = this;
+    return insts.insert(find(pos), std::move(inst))->get();
+}
+
+void BasicBlock::erase(Instruction* inst) {
+    insts.erase(find(inst));
+}
+
+std::list<std::unique_ptr<Instruction>>::iterator BasicBlock::find(Instruction* inst) {
+    auto it = std::find_if(insts.begin(), insts.end(),
+                           [inst](const auto& i) { return i.get() == inst; });
+    if (it == insts.end())
+        throw std::logic_error("Instruction is not part of block '" + name + "'");
+    return it;
+}
+
+// Function
+
+BasicBlock* Function::createBlock(const std::string& hint) {
+    std::string n = blocks.empty() ? hint : hint + std::to_string(block_counter);
+    block_counter++;
+    blocks.push_back(std::make_unique<BasicBlock>(n, this));
+    return blocks.back().get();
+}
+
+StackSlot* Function::createSlot(const std::string& name, const Type& type, int frame_offset) {
+    int align = type.size_bytes;
+    if (type.kind == TypeKind::ARRAY)
+        align = type.baseType->size_bytes;
+    else if (type.kind == TypeKind::CLASS)
+        align = 8;
+    align = std::clamp(align, 1, 8);
+
+    slots.push_back(std::make_unique<StackSlot>(StackSlot{.id = slot_counter++,
+                                                          .name = name,
+                                                          .size = type.size_bytes,
+                                                          .align = align,
+                                                          .var_type = type,
+                                                          .frame_offset = frame_offset}));
+    return slots.back().get();
+}
+
+void Function::removeBlock(BasicBlock* bb) {
+    auto it = std::find_if(blocks.begin(), blocks.end(),
+                           [bb](const auto& b) { return b.get() == bb; });
+    if (it != blocks.end())
+        blocks.erase(it);
+}
+
+void Function::removeSlot(StackSlot* slot) {
+    auto it = std::find_if(slots.begin(), slots.end(),
+                           [slot](const auto& s) { return s.get() == slot; });
+    if (it != slots.end())
+        slots.erase(it);
+}
+
+void Function::rebuildCFG() {
+    for (auto& bb : blocks)
+        bb->preds.clear();
+
+    for (auto& bb : blocks) {
+        for (BasicBlock* succ : bb->successors()) {
+            // A conditional branch with both targets equal still contributes one edge
+            if (std::find(succ->preds.begin(), succ->preds.end(), bb.get()) == succ->preds.end())
+                succ->preds.push_back(bb.get());
+        }
+    }
+}
+
+int Function::removeUnreachableBlocks() {
+    std::set<BasicBlock*> reachable;
+    std::vector<BasicBlock*> worklist = {entry()};
+    while (!worklist.empty()) {
+        BasicBlock* bb = worklist.back();
+        worklist.pop_back();
+        if (!reachable.insert(bb).second)
+            continue;
+        for (BasicBlock* succ : bb->successors())
+            worklist.push_back(succ);
+    }
+
+    if (reachable.size() == blocks.size())
+        return 0;
+
+    for (auto& bb : blocks) {
+        if (!reachable.count(bb.get()))
+            continue;
+        for (auto& inst : bb->insts) {
+            if (inst->op != Opcode::PHI)
+                break;
+            for (size_t i = inst->blocks.size(); i-- > 0;) {
+                if (!reachable.count(inst->blocks[i])) {
+                    inst->blocks.erase(inst->blocks.begin() + i);
+                    inst->operands.erase(inst->operands.begin() + i);
+                }
+            }
+        }
+    }
+
+    int removed = 0;
+    for (size_t i = blocks.size(); i-- > 0;) {
+        if (!reachable.count(blocks[i].get())) {
+            blocks.erase(blocks.begin() + i);
+            removed++;
+        }
+    }
+
+    rebuildCFG();
+    return removed;
+}
+
+void Function::replaceAllUses(Value* from, Value* to) {
+    for (auto& bb : blocks) {
+        for (auto& inst : bb->insts) {
+            for (Value*& op : inst->operands) {
+                if (op == from)
+                    op = to;
+            }
+        }
+    }
+}
+
+int Function::countUses(const Value* v) const {
+    int count = 0;
+    for (const auto& bb : blocks) {
+        for (const auto& inst : bb->insts) {
+            count += std::count(inst->operands.begin(), inst->operands.end(), v);
+        }
+    }
+    return count;
+}
+
+void Function::renumber() {
+    int counter = 0;
+    for (auto& bb : blocks) {
+        for (auto& inst : bb->insts) {
+            inst->id = inst->type == IRType::VOID ? -1 : counter++;
+        }
+    }
+}
+
+// Module
+
+ConstantInt* Module::constInt(int64_t v) {
+    auto& slot = int_constants[v];
+    if (!slot)
+        slot = std::make_unique<ConstantInt>(v);
+    return slot.get();
+}
+
+ConstantFloat* Module::constFloat(double v, IRType t) {
+    if (t == IRType::F32)
+        v = static_cast<float>(v);
+
+    auto& slot = float_constants[{std::bit_cast<uint64_t>(v), t}];
+    if (!slot)
+        slot = std::make_unique<ConstantFloat>(v, t);
+    return slot.get();
+}
+
+Value* Module::zero(IRType t) {
+    if (t == IRType::F32 || t == IRType::F64)
+        return constFloat(0.0, t);
+    return constInt(0);
+}
+
+GlobalString* Module::createString(const std::string& text) {
+    auto [it, inserted] = interned_strings.try_emplace(text);
+    if (inserted) {
+        std::string label = "L_str_" + std::to_string(strings.size());
+        strings.push_back(std::make_unique<GlobalString>(label, text));
+        it->second = strings.back().get();
+    }
+    return it->second;
+}
+
+Function* Module::findFunction(const std::string& name) const {
+    for (const auto& fn : functions) {
+        if (fn->name == name)
+            return fn.get();
+    }
+    return nullptr;
+}
+
+// Printing
+
+static std::string format_double(double v) {
+    std::ostringstream oss;
+    oss << std::setprecision(17) << v;
+    std::string s = oss.str();
+    if (s.find_first_of(".eni") == std::string::npos)
+        s += ".0";
+    return s;
+}
+
+void print_value_ref(std::ostream& os, const Value* v) {
+    switch (v->kind) {
+    case ValueKind::CONSTANT_INT:
+        os << static_cast<const ConstantInt*>(v)->value;
+        break;
+    case ValueKind::CONSTANT_FLOAT:
+        os << format_double(static_cast<const ConstantFloat*>(v)->value);
+        break;
+    case ValueKind::ARGUMENT:
+        os << "%" << static_cast<const Argument*>(v)->name;
+        break;
+    case ValueKind::GLOBAL_STRING:
+        os << "@" << static_cast<const GlobalString*>(v)->label;
+        break;
+    case ValueKind::INSTRUCTION:
+        os << "%" << static_cast<const Instruction*>(v)->id;
+        break;
+    }
+}
+
+static void print_instruction(std::ostream& os, const Instruction& inst) {
+    os << "  ";
+    if (inst.type != IRType::VOID)
+        os << "%" << inst.id << " = ";
+
+    os << opcode_name(inst.op);
+
+    switch (inst.op) {
+    case Opcode::ICMP:
+    case Opcode::FCMP:
+        os << " " << cond_name(inst.cond);
+        break;
+    case Opcode::LOAD:
+    case Opcode::STORE:
+    case Opcode::SEXT:
+    case Opcode::ZEXT:
+    case Opcode::VSTORE:
+    case Opcode::VREDUCE:
+        os << "." << mem_type_name(inst.mem);
+        break;
+    default:
+        if (inst.type == IRType::V128)
+            os << "." << mem_type_name(inst.mem);
+        break;
+    }
+
+    if (inst.type != IRType::VOID)
+        os << " " << ir_type_name(inst.type);
+
+    if (inst.op == Opcode::CALL)
+        os << " @" << inst.callee << "(";
+    if (inst.op == Opcode::FRAME_ADDR)
+        os << " $" << inst.slot->id << "." << inst.slot->name;
+
+    for (size_t i = 0; i < inst.operands.size(); i++) {
+        os << (i == 0 && inst.op != Opcode::CALL ? " " : "") << (i > 0 ? ", " : "");
+        if (inst.op == Opcode::PHI)
+            os << "[";
+        print_value_ref(os, inst.operands[i]);
+        if (inst.op == Opcode::PHI)
+            os << ", ^" << inst.blocks[i]->name << "]";
+    }
+
+    if (inst.op == Opcode::CALL)
+        os << ")";
+    if (inst.op == Opcode::BOUNDS_CHECK)
+        os << ", " << inst.imm;
+    if (inst.op == Opcode::PROFILE_INC)
+        os << " " << inst.imm;
+
+    if (inst.op == Opcode::BR || inst.op == Opcode::COND_BR) {
+        for (size_t i = 0; i < inst.blocks.size(); i++) {
+            os << (i == 0 && inst.operands.empty() ? " " : ", ") << "^" << inst.blocks[i]->name;
+        }
+    }
+
+    os << "\n";
+}
+
+void print_function(std::ostream& os, Function& fn) {
+    fn.renumber();
+
+    os << "define ";
+    if (fn.is_inline)
+        os << "inline ";
+    else if (fn.is_noinline)
+        os << "noinline ";
+    if (fn.purity == Purity::PURE)
+        os << "pure ";
+    else if (fn.purity == Purity::READ_ONLY)
+        os << "readonly ";
+    os << ir_type_name(fn.return_type) << " @" << fn.name << "(";
+    for (size_t i = 0; i < fn.args.size(); i++) {
+        if (i > 0)
+            os << ", ";
+        os << mem_type_name(fn.args[i]->mem) << " %" << fn.args[i]->name;
+    }
+    os << ") {\n";
+
+    for (const auto& slot : fn.slots) {
+        os << "  $" << slot->id << "." << slot->name << " = slot " << slot->var_type.name
+           << ", size " << slot->size << ", align " << slot->align << "\n";
+    }
+
+    for (const auto& bb : fn.blocks) {
+        os << bb->name << ":";
+        if (!bb->preds.empty()) {
+            os << "  ; preds:";
+            for (BasicBlock* p : bb->preds)
+                os << " ^" << p->name;
+        }
+        os << "\n";
+        for (const auto& inst : bb->insts)
+            print_instruction(os, *inst);
+    }
+    os << "}\n";
+}
+
+void print_module(std::ostream& os, Module& mod) {
+    for (const auto& str : mod.strings) {
+        os << "@" << str->label << " = string \"" << str->text << "\"\n";
+    }
+    if (!mod.strings.empty())
+        os << "\n";
+
+    for (size_t i = 0; i < mod.functions.size(); i++) {
+        if (i > 0)
+            os << "\n";
+        print_function(os, *mod.functions[i]);
+    }
+}
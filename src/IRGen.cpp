@@ -0,0 +1,517 @@
+#include "IRGen.h"
+
+#include "AbstractSyntaxTree.h"
+#include "Token.h"
+#include "Type.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <variant>
+
+IRGen::IRGen(const SemanticInfo& p_sema, CompilerContext& p_ctx) : sema(p_sema), ctx(p_ctx) {}
+
+std::unique_ptr<Module> IRGen::generate(const Program& prog) {
+    module = std::make_unique<Module>();
+
+    for (const auto& s : prog.statements) {
+        genStmt(s.get());
+    }
+
+    return std::move(module);
+}
+
+// Helpers
+
+Value* IRGen::genExpr(const Expr* expr) {
+    current = nullptr;
+    expr->accept(*this);
+    Value* value = current;
+
+    const ExprInfo& info = sema.expr(expr);
+    IRType target = ir_type_of(info.converted_type);
+
+    switch (info.conversion) {
+    case ConversionKind::NONE:
+        break;
+    case ConversionKind::INT_TO_FLOAT:
+        value = emit(Opcode::SITOFP, target, {value});
+        break;
+    case ConversionKind::FLOAT_TO_INT:
+        value = emit(Opcode::FPTOSI, IRType::I64, {value});
+        break;
+    case ConversionKind::FLOAT_EXTEND:
+        value = emit(Opcode::FPEXT, IRType::F64, {value});
+        break;
+    case ConversionKind::FLOAT_TRUNCATE:
+        value = emit(Opcode::FPTRUNC, IRType::F32, {value});
+        break;
+    }
+
+    current = value;
+    return value;
+}
+
+void IRGen::genStmt(const Stmt* stmt) {
+    if (stmt)
+        stmt->accept(*this);
+}
+
+Value* IRGen::genCondition(const Expr* expr) {
+    Value* cond = genExpr(expr);
+    if (cond->type == IRType::F32 || cond->type == IRType::F64) {
+        Instruction* cmp = emit(Opcode::FCMP, IRType::I64, {cond, module->zero(cond->type)});
+        cmp->cond = Cond::NE;
+        return cmp;
+    }
+    return cond;
+}
+
+Instruction* IRGen::emit(Opcode op, IRType type, std::vector<Value*> operands) {
+    return block->append(std::make_unique<Instruction>(op, type, std::move(operands)));
+}
+
+void IRGen::branch(BasicBlock* target) {
+    Instruction* br = emit(Opcode::BR, IRType::VOID);
+    br->blocks = {target};
+}
+
+void IRGen::condBranch(Value* cond, BasicBlock* if_true, BasicBlock* if_false) {
+    Instruction* br = emit(Opcode::COND_BR, IRType::VOID, {cond});
+    br->blocks = {if_true, if_false};
+}
+
+void IRGen::startBlock(BasicBlock* bb) {
+    // Fall through from the open block into the new one
+    if (!block->terminator())
+        branch(bb);
+    block = bb;
+}
+
+StackSlot* IRGen::slotFor(int frame_offset) {
+    auto it = slots.find(frame_offset);
+    if (it == slots.end())
+        throw std::logic_error("No stack slot at frame offset " + std::to_string(frame_offset));
+    return it->second;
+}
+
+Value* IRGen::frameAddr(int frame_offset) {
+    Instruction* addr = emit(Opcode::FRAME_ADDR, IRType::I64);
+    addr->slot = slotFor(frame_offset);
+    return addr;
+}
+
+Value* IRGen::elementAddr(int frame_offset, Value* index, int element_size) {
+    Value* base = frameAddr(frame_offset);
+
+    int shift = 0;
+    while ((1 << shift) < element_size)
+        shift++;
+
+    Value* scaled = index;
+    if (shift > 0)
+        scaled = emit(Opcode::SHL, IRType::I64, {index, module->constInt(shift)});
+    return emit(Opcode::ADD, IRType::I64, {base, scaled});
+}
+
+Value* IRGen::load(Value* addr, const Type& type) {
+    Instruction* ld = emit(Opcode::LOAD, ir_type_of(type), {addr});
+    ld->mem = mem_type_of(type);
+    if (ld->type == IRType::VOID)
+        ld->type = IRType::I64;
+    return ld;
+}
+
+void IRGen::store(Value* value, Value* addr, const Type& type) {
+    Instruction* st = emit(Opcode::STORE, IRType::VOID, {value, addr});
+    st->mem = mem_type_of(type);
+}
+
+// Expression Visitors
+
+void IRGen::visitLiteralExpr(const LiteralExpr* expr) {
+    if (std::holds_alternative<uint64_t>(expr->token.fd)) {
+        current = module->constInt(static_cast<int64_t>(std::get<uint64_t>(expr->token.fd)));
+    } else if (std::holds_alternative<double>(expr->token.fd)) {
+        current = module->constFloat(std::get<double>(expr->token.fd), IRType::F64);
+    } else if (std::holds_alternative<std::string>(expr->token.fd)) {
+        current = module->createString(std::get<std::string>(expr->token.fd));
+    } else {
+        current = module->constInt(0);
+    }
+}
+
+void IRGen::visitIdentifierExpr(const IdentifierExpr* expr) {
+    const ExprInfo& info = sema.expr(expr);
+    current = load(frameAddr(info.frame_offset), info.type);
+}
+
+void IRGen::visitUnaryExpr(const UnaryExpr* expr) {
+    const ExprInfo& info = sema.expr(expr);
+
+    if (expr->op.type == TokenType::OPERATOR_AMPERSAND) {
+        current = frameAddr(info.frame_offset);
+        return;
+    }
+
+    Value* operand = genExpr(expr->right.get());
+    bool is_float = operand->type == IRType::F32 || operand->type == IRType::F64;
+
+    switch (expr->op.type) {
+    case TokenType::OPERATOR_MINUS:
+        current = emit(is_float ? Opcode::FNEG : Opcode::NEG, operand->type, {operand});
+        break;
+    case TokenType::EXCLAMATION: {
+        Instruction* cmp = emit(is_float ? Opcode::FCMP : Opcode::ICMP, IRType::I64,
+                                {operand, module->zero(operand->type)});
+        cmp->cond = Cond::EQ;
+        current = cmp;
+        break;
+    }
+    case TokenType::OPERATOR_ASTERISK:
+        current = load(operand, info.type);
+        break;
+    default:
+        current = module->constInt(0);
+    }
+}
+
+void IRGen::visitGroupingExpr(const GroupingExpr* expr) {
+    current = genExpr(expr->expr.get());
+}
+
+void IRGen::visitBinaryExpr(const BinaryExpr* expr) {
+    const ExprInfo& info = sema.expr(expr);
+
+    if (expr->op.type == TokenType::OPERATOR_ASSIGNMENT) {
+        const Type& target = info.type;
+
+        if (dynamic_cast<const IdentifierExpr*>(expr->left.get())) {
+            Value* value = genExpr(expr->right.get());
+            store(value, frameAddr(info.frame_offset), target);
+            current = value;
+        } else if (auto* unary = dynamic_cast<const UnaryExpr*>(expr->left.get())) {
+            Value* addr = genExpr(unary->right.get());
+            Value* value = genExpr(expr->right.get());
+            store(value, addr, target);
+            current = value;
+        } else if (auto* arrAccess = dynamic_cast<const ArrayAccessExpr*>(expr->left.get())) {
+            Value* value = genExpr(expr->right.get());
+            Value* index = genExpr(arrAccess->idx.get());
+
+            Instruction* check = emit(Opcode::BOUNDS_CHECK, IRType::VOID, {index});
+            check->imm = sema.expr(arrAccess->array.get()).type.array_length;
+
+            const ExprInfo& element = sema.expr(arrAccess);
+            store(value, elementAddr(element.frame_offset, index, target.size_bytes), target);
+            current = value;
+        } else if (auto* prop = dynamic_cast<const PropertyAccessExpr*>(expr->left.get())) {
+            Value* value = genExpr(expr->right.get());
+            Value* addr = frameAddr(sema.expr(prop).frame_offset);
+            if (prop->field_offset != 0)
+                addr = emit(Opcode::ADD, IRType::I64, {addr, module->constInt(prop->field_offset)});
+            store(value, addr, target);
+            current = value;
+        }
+        return;
+    }
+
+    // Both operands arrive already converted to the operand type chosen by the analyzer
+    Value* left = genExpr(expr->left.get());
+    Value* right = genExpr(expr->right.get());
+
+    IRType opType = ir_type_of(info.operand_type);
+    bool is_float = info.operand_type.is_float;
+
+    auto compare = [&](Cond signed_cond, Cond unsigned_cond) {
+        Instruction* cmp = emit(is_float ? Opcode::FCMP : Opcode::ICMP, IRType::I64, {left, right});
+        cmp->cond = (!is_float && info.unsigned_op) ? unsigned_cond : signed_cond;
+        current = cmp;
+    };
+
+    switch (expr->op.type) {
+    case TokenType::OPERATOR_PLUS:
+        current = emit(is_float ? Opcode::FADD : Opcode::ADD, opType, {left, right});
+        break;
+    case TokenType::OPERATOR_MINUS:
+        current = emit(is_float ? Opcode::FSUB : Opcode::SUB, opType, {left, right});
+        break;
+    case TokenType::OPERATOR_ASTERISK:
+        current = emit(is_float ? Opcode::FMUL : Opcode::MUL, opType, {left, right});
+        break;
+    case TokenType::OPERATOR_FORWARD_SLASH: {
+        Opcode op = is_float ? Opcode::FDIV : (info.unsigned_op ? Opcode::UDIV : Opcode::SDIV);
+        current = emit(op, opType, {left, right});
+        break;
+    }
+    case TokenType::OPERATOR_EQUALITY:
+        compare(Cond::EQ, Cond::EQ);
+        break;
+    case TokenType::EXCL_EQUAL:
+        compare(Cond::NE, Cond::NE);
+        break;
+    case TokenType::OPERATOR_LESS:
+        compare(Cond::LT, Cond::ULT);
+        break;
+    case TokenType::OPERATOR_LESS_EQUALS:
+        compare(Cond::LE, Cond::ULE);
+        break;
+    case TokenType::OPERATOR_GREATER:
+        compare(Cond::GT, Cond::UGT);
+        break;
+    case TokenType::OPERATOR_GREATER_EQUALS:
+        compare(Cond::GE, Cond::UGE);
+        break;
+    default:
+        current = module->zero(opType);
+        break;
+    }
+}
+
+// Builtins backed by a single instruction, emitted in place of the call
+static std::optional<Opcode> builtin_opcode(const std::string& name) {
+    static const std::unordered_map<std::string, Opcode> builtins = {
+        {"abs", Opcode::ABS},        {"abs_f", Opcode::FABS},     {"sqrt_f", Opcode::FSQRT},
+        {"min_f", Opcode::FMIN},     {"max_f", Opcode::FMAX},     {"floor_f", Opcode::FFLOOR},
+        {"ceil_f", Opcode::FCEIL},   {"round_f", Opcode::FROUND},
+    };
+    auto it = builtins.find(name);
+    if (it == builtins.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void IRGen::visitFunctionCallExpr(const FunctionCallExpr* expr) {
+    std::vector<Value*> args;
+    for (const auto& arg : expr->args) {
+        args.push_back(genExpr(arg.get()));
+    }
+
+    const Type& returnType = sema.expr(expr).type;
+
+    if (std::optional<Opcode> op = builtin_opcode(expr->name_token.lexeme)) {
+        current = emit(*op, ir_type_of(returnType), std::move(args));
+        return;
+    }
+
+    Instruction* call = emit(Opcode::CALL, ir_type_of(returnType), std::move(args));
+    call->callee = expr->name_token.lexeme;
+
+    if (call->type == IRType::VOID) {
+        current = module->constInt(0);
+        return;
+    }
+
+    current = call;
+
+    // Narrow integer results are only defined in the low bits of x0
+    if (returnType.kind == TypeKind::PRIMITIVE && !returnType.is_float &&
+        returnType.size_bytes < 8) {
+        Instruction* ext =
+            emit(returnType.is_signed ? Opcode::SEXT : Opcode::ZEXT, IRType::I64, {call});
+        ext->mem = mem_type_of(returnType);
+        current = ext;
+    }
+}
+
+void IRGen::visitArrayAccessExpr(const ArrayAccessExpr* expr) {
+    Value* index = genExpr(expr->idx.get());
+
+    const ExprInfo& info = sema.expr(expr);
+
+    Instruction* check = emit(Opcode::BOUNDS_CHECK, IRType::VOID, {index});
+    check->imm = sema.expr(expr->array.get()).type.array_length;
+
+    current = load(elementAddr(info.frame_offset, index, info.type.size_bytes), info.type);
+}
+
+void IRGen::visitArrayLiteralExpr(const ArrayLiteralExpr*) {
+    // Only reachable through visitVariableDeclStmt, which stores the elements itself
+    current = module->constInt(0);
+}
+
+void IRGen::visitPropertyAccessExpr(const PropertyAccessExpr* expr) {
+    const ExprInfo& info = sema.expr(expr);
+
+    Value* addr = frameAddr(info.frame_offset);
+    if (expr->field_offset != 0)
+        addr = emit(Opcode::ADD, IRType::I64, {addr, module->constInt(expr->field_offset)});
+
+    current = load(addr, info.type);
+}
+
+// Statement Visitors
+
+void IRGen::visitExprStmt(const ExprStmt* stmt) {
+    genExpr(stmt->expr.get());
+}
+
+void IRGen::visitVariableDeclStmt(const VariableDeclStmt* stmt) {
+    const DeclInfo& decl = sema.decl(stmt);
+    slots[decl.frame_offset] = fn->createSlot(stmt->name, decl.type, decl.frame_offset);
+
+    if (!stmt->initializer)
+        return;
+
+    if (auto* arrayLit = dynamic_cast<const ArrayLiteralExpr*>(stmt->initializer.value().get())) {
+        const Type& elementType = *decl.type.baseType;
+
+        for (size_t i = 0; i < arrayLit->elements.size(); i++) {
+            Value* value = genExpr(arrayLit->elements[i].get());
+
+            Value* addr = frameAddr(decl.frame_offset);
+            if (i > 0) {
+                int64_t offset = static_cast<int64_t>(i) * elementType.size_bytes;
+                addr = emit(Opcode::ADD, IRType::I64, {addr, module->constInt(offset)});
+            }
+            store(value, addr, elementType);
+        }
+        return;
+    }
+
+    Value* value = genExpr(stmt->initializer.value().get());
+    store(value, frameAddr(decl.frame_offset), decl.type);
+}
+
+void IRGen::visitBlockStmt(const BlockStmt* stmt) {
+    for (const auto& s : stmt->statements) {
+        genStmt(s.get());
+    }
+}
+
+void IRGen::visitIfStmt(const IfStmt* stmt) {
+    BasicBlock* thenBlock = fn->createBlock("if.then");
+    BasicBlock* elseBlock = stmt->else_branch ? fn->createBlock("if.else") : nullptr;
+    BasicBlock* endBlock = fn->createBlock("if.end");
+
+    condBranch(genCondition(stmt->condition.get()), thenBlock, elseBlock ? elseBlock : endBlock);
+
+    block = thenBlock;
+    genStmt(stmt->then_branch.get());
+    if (!block->terminator())
+        branch(endBlock);
+
+    if (elseBlock) {
+        block = elseBlock;
+        genStmt(stmt->else_branch.value().get());
+        if (!block->terminator())
+            branch(endBlock);
+    }
+
+    block = endBlock;
+}
+
+void IRGen::visitWhileStmt(const WhileStmt* stmt) {
+    BasicBlock* condBlock = fn->createBlock("while.cond");
+    BasicBlock* bodyBlock = fn->createBlock("while.body");
+    BasicBlock* endBlock = fn->createBlock("while.end");
+
+    startBlock(condBlock);
+    condBranch(genCondition(stmt->condition.get()), bodyBlock, endBlock);
+
+    block = bodyBlock;
+    genStmt(stmt->body.get());
+    if (!block->terminator())
+        branch(condBlock);
+
+    block = endBlock;
+}
+
+void IRGen::visitForStmt(const ForStmt* stmt) {
+    if (stmt->initializer) {
+        genStmt(stmt->initializer.value().get());
+    }
+
+    BasicBlock* condBlock = fn->createBlock("for.cond");
+    BasicBlock* bodyBlock = fn->createBlock("for.body");
+    BasicBlock* endBlock = fn->createBlock("for.end");
+
+    startBlock(condBlock);
+    if (stmt->condition)
+        condBranch(genCondition(stmt->condition.value().get()), bodyBlock, endBlock);
+    else
+        branch(bodyBlock);
+
+    block = bodyBlock;
+    genStmt(stmt->body.get());
+
+    if (stmt->increment) {
+        genExpr(stmt->increment.value().get());
+    }
+    if (!block->terminator())
+        branch(condBlock);
+
+    block = endBlock;
+}
+
+void IRGen::visitReturnStmt(const ReturnStmt* stmt) {
+    std::vector<Value*> operands;
+
+    if (stmt->value) {
+        Value* value = genExpr(stmt->value.value().get());
+        if (fn->return_type != IRType::VOID)
+            operands.push_back(value);
+    } else if (fn->return_type != IRType::VOID) {
+        operands.push_back(module->zero(fn->return_type));
+    }
+
+    emit(Opcode::RET, IRType::VOID, std::move(operands));
+
+    // Anything after a return is unreachable, keep it out of the live blocks
+    block = fn->createBlock("dead");
+}
+
+void IRGen::visitFunctionParameterStmt(const FunctionParameterStmt* stmt) {
+    const DeclInfo& decl = sema.decl(stmt);
+
+    auto arg = std::make_unique<Argument>(ir_type_of(decl.type), stmt->name, decl.param_index,
+                                          mem_type_of(decl.type));
+    Argument* argument = arg.get();
+    fn->args.push_back(std::move(arg));
+
+    slots[decl.frame_offset] = fn->createSlot(stmt->name, decl.type, decl.frame_offset);
+
+    // Only the first 8 arguments are passed in registers
+    if (decl.param_index > 7)
+        return;
+
+    store(argument, frameAddr(decl.frame_offset), decl.type);
+}
+
+void IRGen::visitFunctionDeclStmt(const FunctionDeclStmt* stmt) {
+    const Type& returnType = sema.returnType(stmt);
+
+    module->functions.push_back(std::make_unique<Function>(
+        stmt->name_token.lexeme, ir_type_of(returnType), returnType, module.get()));
+    fn = module->functions.back().get();
+    fn->is_inline = stmt->is_inline;
+    fn->is_noinline = stmt->is_noinline;
+    slots.clear();
+
+    block = fn->createBlock("entry");
+
+    for (const auto& param : stmt->params) {
+        genStmt(param.get());
+    }
+
+    genStmt(stmt->body.get());
+
+    // Implicit return at the end of the body
+    if (!block->terminator()) {
+        if (fn->return_type == IRType::VOID)
+            emit(Opcode::RET, IRType::VOID);
+        else
+            emit(Opcode::RET, IRType::VOID, {module->zero(fn->return_type)});
+    }
+
+    fn->rebuildCFG();
+    fn = nullptr;
+    block = nullptr;
+}
+
+void IRGen::visitClassDeclStmt(const ClassDeclStmt* stmt) {
+    for (const auto& method : stmt->methods) {
+        genStmt(method.get());
+    }
+}
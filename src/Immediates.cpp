@@ -0,0 +1,87 @@
+#include "Immediates.h"
+
+#include <bit>
+#include <cmath>
+
+std::vector<MoveStep> integer_move_sequence(uint64_t value) {
+    using Kind = MoveStep::Kind;
+    uint16_t chunks[4];
+    int zeros = 0, ones = 0;
+    for (int i = 0; i < 4; i++) {
+        chunks[i] = static_cast<uint16_t>(value >> (16 * i));
+        zeros += chunks[i] == 0;
+        ones += chunks[i] == 0xFFFF;
+    }
+
+    // Chunks equal to `fill` come for free with the first instruction
+    bool inverted = ones > zeros;
+    uint16_t fill = inverted ? 0xFFFF : 0;
+    std::vector<MoveStep> steps;
+    for (int i = 0; i < 4; i++) {
+        if (chunks[i] == fill)
+            continue;
+        if (steps.empty())
+            steps.push_back({inverted ? Kind::MOVN : Kind::MOVZ,
+                             inverted ? uint16_t(~chunks[i]) : chunks[i], 16 * i});
+        else
+            steps.push_back({Kind::MOVK, chunks[i], 16 * i});
+    }
+    if (steps.empty())
+        steps.push_back({inverted ? Kind::MOVN : Kind::MOVZ, 0, 0});
+
+    if (steps.size() > 1 && is_logical_immediate(value))
+        return {{Kind::ORR, value, 0}};
+    return steps;
+}
+
+std::string move_step_text(const MoveStep& step, const std::string& dst) {
+    std::string shift = step.shift ? ", lsl #" + std::to_string(step.shift) : "";
+    switch (step.kind) {
+    case MoveStep::Kind::MOVZ:
+        if (step.shift == 0)
+            return "mov " + dst + ", #" + std::to_string(step.imm);
+        return "movz " + dst + ", #" + std::to_string(step.imm) + shift;
+    case MoveStep::Kind::MOVN:
+        return "movn " + dst + ", #" + std::to_string(step.imm) + shift;
+    case MoveStep::Kind::MOVK:
+        return "movk " + dst + ", #" + std::to_string(step.imm) + shift;
+    case MoveStep::Kind::ORR:
+        return "orr " + dst + ", xzr, #" + std::to_string(static_cast<int64_t>(step.imm));
+    }
+    return "";
+}
+
+bool is_arith_immediate(int64_t v) {
+    return (v >= 0 && v <= 0xFFF) || ((v & 0xFFF) == 0 && v > 0 && v <= 0xFFF000);
+}
+
+// A bitmask immediate is a power of two sized element, repeated across the register,
+// holding a rotated run of ones
+bool is_logical_immediate(uint64_t v) {
+    if (v == 0 || v == ~uint64_t(0))
+        return false;
+
+    int size = 64;
+    while (size > 2) {
+        int half = size / 2;
+        uint64_t mask = (uint64_t(1) << half) - 1;
+        if ((v & mask) != ((v >> half) & mask))
+            break;
+        size = half;
+    }
+
+    uint64_t mask = size == 64 ? ~uint64_t(0) : (uint64_t(1) << size) - 1;
+    uint64_t elem = v & mask;
+    auto is_run = [](uint64_t x) { return x != 0 && ((x + (x & (~x + 1))) & x) == 0; };
+    return is_run(elem) || is_run(~elem & mask);
+}
+
+bool is_fmov_immediate(double value) {
+    if (value == 0.0 || !std::isfinite(value))
+        return false;
+    uint64_t bits = std::bit_cast<uint64_t>(value);
+    int exponent = static_cast<int>((bits >> 52) & 0x7FF) - 1023;
+    uint64_t fraction = bits & ((uint64_t(1) << 52) - 1);
+    // Four fraction bits, the rest zero
+    return exponent >= -3 && exponent <= 4 && (fraction & ((uint64_t(1) << 48) - 1)) == 0;
+}
@@ -0,0 +1,504 @@
+#include "ConstantFold.h"
+#include "Dominators.h"
+#include "LoopInfo.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <map>
+
+namespace {
+
+// The shape `while` and `for` lower to: a header holding nothing but phis and the exit
+// test, a single exit block entered from the header only, and one latch branching back
+struct TopTestedLoop {
+    BasicBlock* preheader;
+    BasicBlock* header;
+    BasicBlock* body; // Where the header continues when the test passes
+    BasicBlock* latch;
+    BasicBlock* exit;
+    Instruction* test;
+    bool stay_on_true; // The loop continues when the test holds
+};
+
+// A header phi advanced by a constant on every iteration
+struct InductionVariable {
+    Instruction* phi;
+    Instruction* next; // `phi + step`, its input from the latch
+    Value* start;      // Its input from the preheader
+    int64_t step;
+};
+
+} // namespace
+
+static Value* incoming(const Instruction* phi, const BasicBlock* from) {
+    auto it = std::find(phi->blocks.begin(), phi->blocks.end(), from);
+    return phi->operands[it - phi->blocks.begin()];
+}
+
+static const ConstantInt* as_const_int(const Value* v) {
+    return v->kind == ValueKind::CONSTANT_INT ? static_cast<const ConstantInt*>(v) : nullptr;
+}
+
+static bool is_op(const Value* v, Opcode op) {
+    return v->kind == ValueKind::INSTRUCTION && static_cast<const Instruction*>(v)->op == op;
+}
+
+static bool match_top_tested(Function& fn, const Loop& loop, TopTestedLoop& shape) {
+    shape.header = loop.header;
+    shape.preheader = loop.preheader();
+    if (!shape.preheader || loop.latches.size() != 1 || loop.latches[0] == loop.header)
+        return false;
+    shape.latch = loop.latches[0];
+    Instruction* back = shape.latch->terminator();
+    if (!back || back->op != Opcode::BR)
+        return false;
+
+    Instruction* term = shape.header->terminator();
+    if (!term || term->op != Opcode::COND_BR)
+        return false;
+    auto it = shape.header->insts.begin();
+    while ((*it)->op == Opcode::PHI)
+        ++it;
+    shape.test = it->get();
+    if ((shape.test->op != Opcode::ICMP && shape.test->op != Opcode::FCMP) ||
+        std::next(it)->get() != term || term->operands[0] != shape.test ||
+        fn.countUses(shape.test) != 1)
+        return false;
+
+    shape.stay_on_true = loop.contains(term->blocks[0]);
+    shape.body = term->blocks[shape.stay_on_true ? 0 : 1];
+    shape.exit = term->blocks[shape.stay_on_true ? 1 : 0];
+    if (!loop.contains(shape.body) || loop.contains(shape.exit) || shape.exit->preds.size() != 1)
+        return false;
+
+    // The header is the only way out
+    for (BasicBlock* bb : loop.blocks) {
+        if (bb == shape.header)
+            continue;
+        Instruction* t = bb->terminator();
+        if (!t || t->op == Opcode::RET || t->op == Opcode::UNREACHABLE)
+            return false;
+        for (BasicBlock* succ : bb->successors()) {
+            if (!loop.contains(succ))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Inserts `a op b` before the terminator of `bb`, or returns the constant it folds to
+static Value* emit(BasicBlock* bb, Opcode op, Value* a, Value* b) {
+    auto inst = std::make_unique<Instruction>(op, IRType::I64, std::vector<Value*>{a, b});
+    if (Value* folded = fold_constant(*inst, *bb->parent->parent))
+        return folded;
+    return bb->insertBeforeTerminator(std::move(inst));
+}
+
+// Moves the exit test from the header to the latch, guarded by a copy of it in the
+// preheader: `while (c) body` becomes `if (c) do body while (c)`, one branch per iteration
+// instead of two. Header phis used after the loop get a phi in the exit block. Returns
+// false when the guard is known to skip the loop.
+static bool rotate(Function& fn, const Loop& loop, const TopTestedLoop& s) {
+    auto on_edge = [&](Value* v, BasicBlock* from) -> Value* {
+        if (is_op(v, Opcode::PHI) && static_cast<Instruction*>(v)->parent == s.header)
+            return incoming(static_cast<Instruction*>(v), from);
+        return v;
+    };
+    auto test_on_edge = [&](BasicBlock* from) {
+        auto test = std::make_unique<Instruction>(s.test->op, s.test->type);
+        for (Value* op : s.test->operands)
+            test->operands.push_back(on_edge(op, from));
+        test->cond = s.test->cond;
+        return test;
+    };
+    auto branch = [&](Value* test, BasicBlock* stay) {
+        auto br = std::make_unique<Instruction>(Opcode::COND_BR, IRType::VOID,
+                                                std::vector<Value*>{test});
+        br->blocks = s.stay_on_true ? std::vector<BasicBlock*>{stay, s.exit}
+                                    : std::vector<BasicBlock*>{s.exit, stay};
+        return br;
+    };
+
+    // The preheader skips the loop unless the first iteration runs, which may be known
+    Instruction* pre_br = s.preheader->terminator();
+    auto entry_test = test_on_edge(s.preheader);
+    bool may_skip = true;
+    bool enters = true;
+    if (const Value* folded = fold_constant(*entry_test, *fn.parent)) {
+        enters = (as_const_int(folded)->value != 0) == s.stay_on_true;
+        may_skip = false;
+    }
+    if (may_skip) {
+        Instruction* test = s.preheader->insertBefore(pre_br, std::move(entry_test));
+        s.preheader->erase(pre_br);
+        s.preheader->append(branch(test, s.header));
+    } else if (!enters) {
+        pre_br->blocks[0] = s.exit;
+    }
+
+    Instruction* latch_br = s.latch->terminator();
+    Instruction* latch_test = s.latch->insertBefore(latch_br, test_on_edge(s.latch));
+    s.latch->erase(latch_br);
+    s.latch->append(branch(latch_test, s.header));
+
+    Instruction* header_br = s.header->terminator();
+    s.header->erase(header_br);
+    s.header->erase(s.test);
+    auto br = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+    br->blocks.push_back(s.body);
+    s.header->append(std::move(br));
+
+    std::vector<BasicBlock*> exit_preds;
+    if (may_skip || !enters)
+        exit_preds.push_back(s.preheader);
+    exit_preds.push_back(s.latch);
+
+    for (auto& inst : s.exit->insts) {
+        if (inst->op != Opcode::PHI)
+            break;
+        Value* v = inst->operands[0];
+        inst->operands.clear();
+        inst->blocks.clear();
+        for (BasicBlock* pred : exit_preds) {
+            inst->operands.push_back(on_edge(v, pred));
+            inst->blocks.push_back(pred);
+        }
+    }
+
+    // Collected before any exit phi exists, those refer to the header phis on purpose
+    std::map<Instruction*, std::vector<Value**>> outside;
+    for (auto& bb : fn.blocks) {
+        if (loop.contains(bb.get()))
+            continue;
+        for (auto& inst : bb->insts) {
+            for (Value*& op : inst->operands) {
+                if (is_op(op, Opcode::PHI) && static_cast<Instruction*>(op)->parent == s.header)
+                    outside[static_cast<Instruction*>(op)].push_back(&op);
+            }
+        }
+    }
+    for (auto& [phi, uses] : outside) {
+        auto merged = std::make_unique<Instruction>(Opcode::PHI, phi->type);
+        for (BasicBlock* pred : exit_preds) {
+            merged->operands.push_back(on_edge(phi, pred));
+            merged->blocks.push_back(pred);
+        }
+        Instruction* exit_phi = s.exit->insertAtFront(std::move(merged));
+        for (Value** op : uses)
+            *op = exit_phi;
+    }
+
+    fn.rebuildCFG();
+    return enters;
+}
+
+// Instructions besides phis a return block may hold to be copied for a guard
+static constexpr int MAX_RETURN_COPY = 4;
+
+// When the guard skips the loop into a block that only computes the return value, it gets
+// its own copy of that block, with the exit phis replaced by their inputs from the guard.
+// The early exit then shares nothing with the loop, and the frame set up for calls in the
+// loop can be left out of it (`if (n < 2) return n;` ahead of recursion turned into a loop).
+static void duplicate_return(Function& fn, BasicBlock* exit, BasicBlock* guard) {
+    Instruction* ret = exit->terminator();
+    Instruction* guard_br = guard->terminator();
+    if (!ret || ret->op != Opcode::RET || !guard_br || guard_br->op != Opcode::COND_BR ||
+        std::count(guard_br->blocks.begin(), guard_br->blocks.end(), exit) != 1)
+        return;
+    int size = 0;
+    for (auto& inst : exit->insts) {
+        if (inst->op == Opcode::PHI || inst.get() == ret)
+            continue;
+        if (inst->hasSideEffects() || inst->op == Opcode::LOAD || ++size > MAX_RETURN_COPY)
+            return;
+    }
+
+    BasicBlock* copy = fn.createBlock(exit->name + ".guard");
+    std::map<const Value*, Value*> mapped;
+    for (auto& inst : exit->insts) {
+        if (inst->op == Opcode::PHI) {
+            mapped[inst.get()] = incoming(inst.get(), guard);
+            continue;
+        }
+        auto clone = std::make_unique<Instruction>(inst->op, inst->type);
+        for (Value* op : inst->operands)
+            clone->operands.push_back(mapped.count(op) ? mapped[op] : op);
+        clone->cond = inst->cond;
+        clone->mem = inst->mem;
+        clone->slot = inst->slot;
+        if (Value* folded = fold_constant(*clone, *fn.parent)) {
+            mapped[inst.get()] = folded;
+            continue;
+        }
+        if (Value* same = fold_identity(*clone)) {
+            mapped[inst.get()] = same;
+            continue;
+        }
+        mapped[inst.get()] = copy->append(std::move(clone));
+    }
+
+    std::replace(guard_br->blocks.begin(), guard_br->blocks.end(), exit, copy);
+    for (auto& inst : exit->insts) {
+        if (inst->op != Opcode::PHI)
+            break;
+        auto it = std::find(inst->blocks.begin(), inst->blocks.end(), guard);
+        inst->operands.erase(inst->operands.begin() + (it - inst->blocks.begin()));
+        inst->blocks.erase(it);
+    }
+    fn.rebuildCFG();
+}
+
+static bool match_induction(Instruction* phi, const TopTestedLoop& s, InductionVariable& iv) {
+    Value* next = incoming(phi, s.latch);
+    if (phi->type != IRType::I64 || next->kind != ValueKind::INSTRUCTION)
+        return false;
+    auto* inst = static_cast<Instruction*>(next);
+    if (inst->op == Opcode::ADD) {
+        Value* other = inst->operands[0] == phi ? inst->operands[1] : inst->operands[0];
+        if (!as_const_int(other) || (inst->operands[0] != phi && inst->operands[1] != phi))
+            return false;
+        iv.step = as_const_int(other)->value;
+    } else if (inst->op == Opcode::SUB && inst->operands[0] == phi &&
+               as_const_int(inst->operands[1])) {
+        iv.step = 0 - as_const_int(inst->operands[1])->value;
+    } else {
+        return false;
+    }
+    iv.phi = phi;
+    iv.next = inst;
+    iv.start = incoming(phi, s.preheader);
+    return true;
+}
+
+namespace {
+
+// An address `base + index * scale` of a memory access in the loop, index being an
+// induction variable
+struct ScaledAddress {
+    Instruction* addr;
+    Instruction* index; // The shl / mul scaling the induction variable, or nullptr
+    Value* base;
+    int64_t scale;
+};
+
+} // namespace
+
+static bool match_address(Value* v, const Loop& loop, const InductionVariable& iv,
+                          ScaledAddress& out) {
+    if (!is_op(v, Opcode::ADD))
+        return false;
+    auto* add = static_cast<Instruction*>(v);
+    for (int i = 0; i < 2; i++) {
+        Value* base = add->operands[i];
+        Value* index = add->operands[1 - i];
+        // Frame addresses are rematerialized in the preheader
+        if (!loop.isInvariant(base) && !is_op(base, Opcode::FRAME_ADDR))
+            continue;
+
+        out = {add, nullptr, base, 1};
+        if (index == iv.phi)
+            return true;
+        if (index->kind != ValueKind::INSTRUCTION)
+            continue;
+        auto* scaled = static_cast<Instruction*>(index);
+        if ((scaled->op != Opcode::SHL && scaled->op != Opcode::MUL) ||
+            scaled->operands[0] != iv.phi || !as_const_int(scaled->operands[1]))
+            continue;
+        const ConstantInt* amount = as_const_int(scaled->operands[1]);
+        if (scaled->op == Opcode::SHL && amount->value >= 0 && amount->value < 32)
+            out = {add, scaled, base, int64_t(1) << amount->value};
+        else if (scaled->op == Opcode::MUL)
+            out = {add, scaled, base, amount->value};
+        else
+            continue;
+        return true;
+    }
+    return false;
+}
+
+// Addresses of loads and stores in the loop indexed by `iv`
+static std::vector<ScaledAddress> scaled_addresses(const Loop& loop, const InductionVariable& iv) {
+    std::vector<ScaledAddress> found;
+    for (BasicBlock* bb : loop.blocks) {
+        for (auto& inst : bb->insts) {
+            int index = -1;
+            if (inst->op == Opcode::LOAD || inst->op == Opcode::VLOAD)
+                index = 0;
+            else if (inst->op == Opcode::STORE || inst->op == Opcode::VSTORE)
+                index = 1;
+            ScaledAddress address;
+            if (index >= 0 && match_address(inst->operands[index], loop, iv, address) &&
+                std::none_of(found.begin(), found.end(),
+                             [&](const ScaledAddress& a) { return a.addr == address.addr; }))
+                found.push_back(address);
+        }
+    }
+    return found;
+}
+
+// After the rotation the latch tests `next` against a loop invariant bound. When the
+// variable counts by one towards the bound, the loop runs exactly `bound - start` times.
+static Value* count_bound(const Loop& loop, const TopTestedLoop& s, const InductionVariable& iv,
+                          Instruction* test) {
+    if (test->op != Opcode::ICMP || (iv.step != 1 && iv.step != -1))
+        return nullptr;
+    Cond cond = test->cond;
+    Value* bound = test->operands[1];
+    if (test->operands[1] == iv.next) {
+        cond = cond_swapped(cond);
+        bound = test->operands[0];
+    } else if (test->operands[0] != iv.next) {
+        return nullptr;
+    }
+    if (!loop.isInvariant(bound))
+        return nullptr;
+    if (!s.stay_on_true)
+        cond = cond_inverse(cond);
+
+    // The test held on entry and the variable moves one at a time, so it leaves exactly
+    // when reaching the bound
+    bool counts = iv.step == 1 ? cond == Cond::LT || cond == Cond::ULT || cond == Cond::NE
+                               : cond == Cond::GT || cond == Cond::UGT || cond == Cond::NE;
+    return counts ? bound : nullptr;
+}
+
+// Rewrites the addresses indexed by a counting induction variable into pointers advanced
+// by the latch, then replaces the variable by a count of the remaining iterations
+static bool reduce(Function& fn, const Loop& loop, const TopTestedLoop& s) {
+    Instruction* latch_br = s.latch->terminator();
+    auto* test = static_cast<Instruction*>(latch_br->operands[0]);
+
+    for (auto& phi : s.header->insts) {
+        if (phi->op != Opcode::PHI)
+            break;
+        InductionVariable iv;
+        if (!match_induction(phi.get(), s, iv))
+            continue;
+        Value* bound = count_bound(loop, s, iv, test);
+        if (!bound)
+            continue;
+
+        // Only worth it when the variable goes away: apart from its own increment, every
+        // use has to be one of the addresses, and the increment only feeds the test, the
+        // phi and exit phis (where it equals the bound)
+        std::vector<ScaledAddress> addresses = scaled_addresses(loop, iv);
+        int uses = fn.countUses(iv.phi) - 1;
+        std::map<Instruction*, int> index_uses;
+        for (auto& a : addresses) {
+            if (a.index)
+                index_uses[a.index]++;
+            else
+                uses--;
+        }
+        for (auto& [index, count] : index_uses) {
+            if (fn.countUses(index) == count)
+                uses--;
+        }
+        int exit_uses = 0;
+        for (auto& inst : s.exit->insts) {
+            if (inst->op != Opcode::PHI)
+                break;
+            exit_uses += incoming(inst.get(), s.latch) == iv.next;
+        }
+        if (uses != 0 || fn.countUses(iv.next) != 2 + exit_uses)
+            continue;
+
+        // One pointer per array and scale
+        std::map<std::pair<const void*, int64_t>, Instruction*> pointers;
+        for (auto& a : addresses) {
+            const void* base_key = a.base;
+            if (is_op(a.base, Opcode::FRAME_ADDR))
+                base_key = static_cast<Instruction*>(a.base)->slot;
+            Instruction*& ptr = pointers[{base_key, a.scale}];
+            if (!ptr) {
+                Value* base = a.base;
+                if (!loop.isInvariant(base)) {
+                    auto frame = std::make_unique<Instruction>(Opcode::FRAME_ADDR, IRType::I64);
+                    frame->slot = static_cast<Instruction*>(base)->slot;
+                    base = s.preheader->insertBeforeTerminator(std::move(frame));
+                }
+                Value* offset =
+                    emit(s.preheader, Opcode::MUL, iv.start, fn.parent->constInt(a.scale));
+                Value* start = base;
+                if (!as_const_int(offset) || as_const_int(offset)->value != 0)
+                    start = emit(s.preheader, Opcode::ADD, base, offset);
+
+                ptr = s.header->insertAtFront(
+                    std::make_unique<Instruction>(Opcode::PHI, IRType::I64));
+                Value* next =
+                    emit(s.latch, Opcode::ADD, ptr, fn.parent->constInt(iv.step * a.scale));
+                ptr->operands = {start, next};
+                ptr->blocks = {s.preheader, s.latch};
+            }
+            fn.replaceAllUses(a.addr, ptr);
+            a.addr->parent->erase(a.addr);
+        }
+        for (auto& [index, count] : index_uses) {
+            if (fn.countUses(index) == 0)
+                index->parent->erase(index);
+        }
+
+        // Count the remaining iterations down to zero, `subs` / `cbnz` in the latch
+        Value* trips = iv.step == 1 ? emit(s.preheader, Opcode::SUB, bound, iv.start)
+                                    : emit(s.preheader, Opcode::SUB, iv.start, bound);
+        Instruction* count =
+            s.header->insertAtFront(std::make_unique<Instruction>(Opcode::PHI, IRType::I64));
+        Value* remaining = emit(s.latch, Opcode::SUB, count, fn.parent->constInt(1));
+        count->operands = {trips, remaining};
+        count->blocks = {s.preheader, s.latch};
+
+        auto done = std::make_unique<Instruction>(
+            Opcode::ICMP, IRType::I64, std::vector<Value*>{remaining, fn.parent->constInt(0)});
+        done->cond = Cond::NE;
+        latch_br->operands[0] = s.latch->insertBefore(latch_br, std::move(done));
+        latch_br->blocks = {s.header, s.exit};
+
+        for (auto& inst : s.exit->insts) {
+            if (inst->op != Opcode::PHI)
+                break;
+            for (size_t i = 0; i < inst->blocks.size(); i++) {
+                if (inst->blocks[i] == s.latch && inst->operands[i] == iv.next)
+                    inst->operands[i] = bound;
+            }
+        }
+        s.latch->erase(test);
+        iv.phi->operands.clear();
+        iv.next->parent->erase(iv.next);
+        s.header->erase(iv.phi);
+        return true;
+    }
+    return false;
+}
+
+bool InductionVariablePass::runOnFunction(Function& fn) {
+    if (fn.blocks.empty())
+        return false;
+    fn.rebuildCFG();
+
+    // Every rotation changes the loop structure, so the analyses start over after each.
+    // A rotated loop no longer has a test in its header.
+    bool changed = false;
+    while (true) {
+        DominatorTree dt(fn);
+        LoopInfo loops(dt);
+        bool rotated = false;
+        for (auto& loop : loops.loops()) {
+            TopTestedLoop shape;
+            if (!match_top_tested(fn, *loop, shape))
+                continue;
+            if (rotate(fn, *loop, shape)) {
+                reduce(fn, *loop, shape);
+                duplicate_return(fn, shape.exit, shape.preheader);
+            }
+            rotated = true;
+            break;
+        }
+        if (!rotated)
+            break;
+        changed = true;
+    }
+
+    if (changed)
+        fn.removeUnreachableBlocks();
+    return changed;
+}
@@ -0,0 +1,323 @@
+#include "Dominators.h"
+#include "LoopInfo.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+// Size estimate in IR instructions. Phis become copies or nothing, frame addresses fold
+// into addressing modes.
+static int size_of(const Function& fn) {
+    int size = 0;
+    for (const auto& bb : fn.blocks) {
+        for (const auto& inst : bb->insts) {
+            if (inst->op != Opcode::PHI && inst->op != Opcode::FRAME_ADDR)
+                size++;
+        }
+    }
+    return size;
+}
+
+static bool has_calls(const Function& fn) {
+    for (const auto& bb : fn.blocks) {
+        for (const auto& inst : bb->insts) {
+            if (inst->op == Opcode::CALL)
+                return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+
+class CallGraph {
+  public:
+    explicit CallGraph(Module& mod) : module(mod) {
+        for (auto& fn : mod.functions) {
+            auto& out = callees[fn.get()];
+            for (auto& bb : fn->blocks) {
+                for (auto& inst : bb->insts) {
+                    if (inst->op != Opcode::CALL)
+                        continue;
+                    if (Function* callee = mod.findFunction(inst->callee))
+                        out.insert(callee);
+                }
+            }
+        }
+        for (auto& fn : mod.functions)
+            reach[fn.get()] = reachable(fn.get());
+    }
+
+    // Callees before callers, except inside cycles of recursion
+    std::vector<Function*> bottomUp() const {
+        std::vector<Function*> order;
+        std::unordered_set<Function*> visited;
+        std::function<void(Function*)> visit = [&](Function* fn) {
+            if (!visited.insert(fn).second)
+                return;
+            for (Function* callee : callees.at(fn))
+                visit(callee);
+            order.push_back(fn);
+        };
+        for (auto& fn : module.functions)
+            visit(fn.get());
+        return order;
+    }
+
+    // True if `callee` can call back into `caller`, directly or not
+    bool recursive(Function* caller, Function* callee) const {
+        return caller == callee || reach.at(callee).count(caller);
+    }
+
+  private:
+    Module& module;
+    std::unordered_map<Function*, std::unordered_set<Function*>> callees;
+    std::unordered_map<Function*, std::unordered_set<Function*>> reach;
+
+    std::unordered_set<Function*> reachable(Function* from) const {
+        std::unordered_set<Function*> seen;
+        std::vector<Function*> work(callees.at(from).begin(), callees.at(from).end());
+        while (!work.empty()) {
+            Function* fn = work.back();
+            work.pop_back();
+            if (!seen.insert(fn).second)
+                continue;
+            work.insert(work.end(), callees.at(fn).begin(), callees.at(fn).end());
+        }
+        return seen;
+    }
+};
+
+} // namespace
+
+// Size limits, in IR instructions. A call and its frame setup cost about as much as a small
+// function body.
+static constexpr int INLINE_THRESHOLD = 12;
+static constexpr int LEAF_BONUS = 8;
+static constexpr int LOOP_BONUS = 24;  // Per level of loop nesting around the call, up to 3
+static constexpr int CONSTANT_ARG_BONUS = 4;
+static constexpr int SINGLE_CALL_THRESHOLD = 200;
+static constexpr int MAX_CALLER_SIZE = 2000;
+// Iterations assumed per loop level, as in block placement
+static constexpr double LOOP_ITERATIONS = 8.0;
+
+// Calls per call of the caller measured by the profile, -1 without one
+static double call_frequency(const Instruction& call, const Function& caller) {
+    int64_t calls = call.parent->profile_count;
+    int64_t entries = caller.entry()->profile_count;
+    if (calls < 0 || entries < 0)
+        return -1;
+    return entries == 0 ? 0.0 : static_cast<double>(calls) / static_cast<double>(entries);
+}
+
+static bool should_inline(const Instruction& call, Function& caller, Function& callee,
+                          int loop_depth, const CallGraph& graph) {
+    if (callee.blocks.empty() || callee.is_noinline || callee.name == "main" ||
+        graph.recursive(&caller, &callee))
+        return false;
+    // Arguments past the eighth would have to come from the caller's outgoing stack area
+    if (call.operands.size() > 8 || !callee.entry()->preds.empty())
+        return false;
+    if (callee.is_inline)
+        return true;
+
+    // A call site the profile saw never run is left alone, single caller or not
+    double frequency = call_frequency(call, caller);
+    if (frequency == 0)
+        return false;
+
+    int size = size_of(callee);
+    if (size_of(caller) + size > MAX_CALLER_SIZE)
+        return false;
+
+    int calls = 0;
+    for (auto& fn : caller.parent->functions) {
+        for (auto& bb : fn->blocks) {
+            for (auto& inst : bb->insts)
+                calls += inst->op == Opcode::CALL && inst->callee == callee.name;
+        }
+    }
+    if (calls == 1 && size <= SINGLE_CALL_THRESHOLD)
+        return true;
+
+    // A measured frequency replaces the guess from the loops around the call, eight calls
+    // per call of the caller counting as one level of nesting
+    if (frequency > 0) {
+        double levels = std::log(frequency) / std::log(LOOP_ITERATIONS);
+        loop_depth = std::max(0, static_cast<int>(levels));
+    }
+
+    int threshold = INLINE_THRESHOLD;
+    if (!has_calls(callee))
+        threshold += LEAF_BONUS;
+    threshold += LOOP_BONUS * std::min(loop_depth, 3);
+    for (const Value* arg : call.operands) {
+        if (arg->isConstant())
+            threshold += CONSTANT_ARG_BONUS;
+    }
+    return size <= threshold;
+}
+
+static void place_after(Function& fn, BasicBlock* bb, BasicBlock* pos) {
+    auto it = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                           [bb](const auto& b) { return b.get() == bb; });
+    std::unique_ptr<BasicBlock> owned = std::move(*it);
+    fn.blocks.erase(it);
+    it = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                      [pos](const auto& b) { return b.get() == pos; });
+    fn.blocks.insert(it + 1, std::move(owned));
+}
+
+// Replaces `call` with a copy of the callee's body: the block is split after the call, the
+// callee's blocks go in between, and its returns branch to the second half
+static void inline_call(Function& caller, Instruction* call, Function& callee) {
+    BasicBlock* bb = call->parent;
+
+    BasicBlock* cont = caller.createBlock(callee.name + ".ret");
+    place_after(caller, cont, bb);
+    cont->profile_count = bb->profile_count;
+    auto split = std::next(bb->find(call));
+    while (split != bb->insts.end()) {
+        std::unique_ptr<Instruction> moved = std::move(*split);
+        split = bb->insts.erase(split);
+        moved->parent = cont;
+        cont->insts.push_back(std::move(moved));
+    }
+    for (BasicBlock* succ : cont->successors()) {
+        for (auto& inst : succ->insts) {
+            if (inst->op != Opcode::PHI)
+                break;
+            std::replace(inst->blocks.begin(), inst->blocks.end(), bb, cont);
+        }
+    }
+
+    // The callee's slots go after the caller's, in both the frame and the parser's offsets
+    std::unordered_map<StackSlot*, StackSlot*> slots;
+    int base = 0;
+    for (auto& slot : caller.slots)
+        base = std::max(base, slot->frame_offset + slot->size);
+    for (auto& slot : callee.slots) {
+        slots[slot.get()] = caller.createSlot(callee.name + "." + slot->name, slot->var_type,
+                                              base + slot->frame_offset);
+    }
+
+    std::unordered_map<const Value*, Value*> values;
+    for (size_t i = 0; i < callee.args.size(); i++)
+        values[callee.args[i].get()] = call->operands[i];
+
+    // The callee's counts cover all its calls, this site gets its share of them
+    double share = -1;
+    int64_t entries = callee.entry()->profile_count;
+    if (bb->profile_count >= 0 && entries >= 0)
+        share = entries == 0 ? 0.0 : static_cast<double>(bb->profile_count) / entries;
+
+    std::unordered_map<BasicBlock*, BasicBlock*> blocks;
+    BasicBlock* last = bb;
+    for (auto& block : callee.blocks) {
+        BasicBlock* copy = caller.createBlock(callee.name + "." + block->name);
+        place_after(caller, copy, last);
+        last = copy;
+        blocks[block.get()] = copy;
+        if (share >= 0 && block->profile_count >= 0)
+            copy->profile_count = std::llround(block->profile_count * share);
+    }
+
+    std::vector<Instruction*> copies;
+    for (auto& block : callee.blocks) {
+        for (auto& inst : block->insts) {
+            auto copy = std::make_unique<Instruction>(inst->op, inst->type, inst->operands);
+            copy->blocks = inst->blocks;
+            copy->cond = inst->cond;
+            copy->mem = inst->mem;
+            copy->slot = inst->slot ? slots.at(inst->slot) : nullptr;
+            copy->callee = inst->callee;
+            copy->imm = inst->imm;
+            copy->taken = inst->taken;
+            values[inst.get()] = copy.get();
+            copies.push_back(blocks[block.get()]->append(std::move(copy)));
+        }
+    }
+
+    std::vector<std::pair<BasicBlock*, Value*>> returns;
+    for (Instruction* inst : copies) {
+        for (Value*& op : inst->operands) {
+            auto it = values.find(op);
+            if (it != values.end())
+                op = it->second;
+        }
+        for (BasicBlock*& target : inst->blocks)
+            target = blocks.at(target);
+
+        if (inst->op == Opcode::RET) {
+            returns.push_back({inst->parent, inst->operands.empty() ? nullptr : inst->operands[0]});
+            inst->op = Opcode::BR;
+            inst->operands.clear();
+            inst->blocks = {cont};
+        }
+    }
+
+    if (call->type != IRType::VOID) {
+        Value* result;
+        if (returns.size() == 1) {
+            result = returns[0].second;
+        } else {
+            auto phi = std::make_unique<Instruction>(Opcode::PHI, call->type);
+            for (auto& [from, value] : returns) {
+                phi->operands.push_back(value);
+                phi->blocks.push_back(from);
+            }
+            result = cont->insertAtFront(std::move(phi));
+        }
+        caller.replaceAllUses(call, result ? result : caller.parent->zero(call->type));
+    }
+
+    bb->erase(call);
+    auto br = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+    br->blocks.push_back(blocks.at(callee.entry()));
+    bb->append(std::move(br));
+}
+
+bool InlinerPass::run(Module& mod) {
+    CallGraph graph(mod);
+    bool changed = false;
+
+    for (Function* caller : graph.bottomUp()) {
+        if (caller->blocks.empty())
+            continue;
+        caller->rebuildCFG();
+
+        // Call sites are chosen up front: calls brought in by inlining were already
+        // considered inside the callee
+        std::vector<std::pair<Instruction*, int>> sites;
+        {
+            DominatorTree dt(*caller);
+            LoopInfo loops(dt);
+            for (auto& bb : caller->blocks) {
+                Loop* loop = loops.loopFor(bb.get());
+                for (auto& inst : bb->insts) {
+                    if (inst->op == Opcode::CALL && mod.findFunction(inst->callee))
+                        sites.push_back({inst.get(), loop ? loop->depth : 0});
+                }
+            }
+        }
+
+        bool inlined = false;
+        for (auto& [call, depth] : sites) {
+            Function* callee = mod.findFunction(call->callee);
+            callee->rebuildCFG();
+            if (!should_inline(*call, *caller, *callee, depth, graph))
+                continue;
+            inline_call(*caller, call, *callee);
+            caller->rebuildCFG();
+            inlined = true;
+        }
+        if (inlined) {
+            caller->removeUnreachableBlocks();
+            changed = true;
+        }
+    }
+    return changed;
+}
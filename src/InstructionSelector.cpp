@@ -0,0 +1,1558 @@
+#include "InstructionSelector.h"
+
+#include "LoopInfo.h"
+#include "StrengthReduction.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+char view_of(IRType t) {
+    switch (t) {
+    case IRType::F32:
+        return 's';
+    case IRType::F64:
+        return 'd';
+    case IRType::V128:
+        return 'q';
+    default:
+        return 'x';
+    }
+}
+
+RegClass class_of(IRType t) {
+    return (t == IRType::F32 || t == IRType::F64 || t == IRType::V128) ? RegClass::FPR
+                                                                         : RegClass::GPR;
+}
+
+static const ConstantInt* as_const_int(const Value* v) {
+    return v->kind == ValueKind::CONSTANT_INT ? static_cast<const ConstantInt*>(v) : nullptr;
+}
+
+// Operand for an add / sub / cmp immediate, with the optional `lsl #12`
+static std::vector<MachineOperand> arith_immediate(int64_t v) {
+    if (v <= 0xFFF)
+        return {MachineOperand::immediate(v)};
+    return {MachineOperand::immediate(v >> 12), MachineOperand::raw("lsl #12")};
+}
+
+static int log2_size(int size) {
+    switch (size) {
+    case 2:
+        return 1;
+    case 4:
+        return 2;
+    case 8:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+std::vector<MReg> caller_saved_regs() {
+    std::vector<MReg> regs;
+    for (int i = 0; i <= 17; i++)
+        regs.push_back(MReg::phys(i));
+    regs.push_back(MReg::phys(REG_LR));
+    for (int i = 0; i <= 7; i++)
+        regs.push_back(MReg::phys(i, RegClass::FPR));
+    for (int i = 16; i <= 31; i++)
+        regs.push_back(MReg::phys(i, RegClass::FPR));
+    return regs;
+}
+
+static const char* cond_code(Cond c, bool is_float) {
+    switch (c) {
+    case Cond::EQ:
+        return "eq";
+    case Cond::NE:
+        return "ne";
+    // After fcmp an unordered result sets C and V, so lt / le would be true for NaN
+    case Cond::LT:
+        return is_float ? "mi" : "lt";
+    case Cond::LE:
+        return is_float ? "ls" : "le";
+    case Cond::GT:
+        return "gt";
+    case Cond::GE:
+        return "ge";
+    case Cond::ULT:
+        return "lo";
+    case Cond::ULE:
+        return "ls";
+    case Cond::UGT:
+        return "hi";
+    case Cond::UGE:
+        return "hs";
+    }
+    return "al";
+}
+
+static std::string block_label(const Function& fn, const std::string& name) {
+    std::string label = "L" + fn.name + "_" + name;
+    std::replace(label.begin(), label.end(), '.', '_');
+    return label;
+}
+
+InstructionSelector::InstructionSelector(Function& p_fn, ModuleAsmData& p_data,
+                                         const CompilerOptions& p_options)
+    : fn(p_fn), data(p_data), options(p_options) {}
+
+// Copies for a phi have to execute on its incoming edge only, so an edge from a block
+// with several successors into a block with phis gets a block of its own. The copies may
+// stay in front of the branch when nothing on the other edge can see them, which is
+// usually the case for the back edge of a rotated loop. Copies on the exit of a loop would
+// run on every iteration there, so exit edges are split even into a single predecessor
+// block.
+void InstructionSelector::splitCriticalEdges() {
+    fn.rebuildCFG();
+    DominatorTree dt(fn);
+    LoopInfo loops(dt);
+
+    // Copies out of the entry in front of its branch would run on an early return too.
+    // With calls they likely go to callee-saved registers, and the frame would have to be
+    // set up before the branch.
+    bool has_calls = false;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts)
+            has_calls |= inst->op == Opcode::CALL;
+    }
+
+    std::vector<BasicBlock*> original;
+    for (auto& bb : fn.blocks)
+        original.push_back(bb.get());
+
+    for (BasicBlock* bb : original) {
+        Instruction* term = bb->terminator();
+        if (!term || term->op != Opcode::COND_BR || term->blocks[0] == term->blocks[1])
+            continue;
+
+        for (size_t i = 0; i < 2; i++) {
+            BasicBlock*& target = term->blocks[i];
+            if (target->insts.front()->op != Opcode::PHI)
+                continue;
+            const Loop* loop = loops.loopFor(bb);
+            bool exits_loop = loop && !loop->contains(target);
+            if (target->preds.size() < 2 && !exits_loop)
+                continue;
+            if (!needsEdgeSplit(bb, target, term->blocks[1 - i]) &&
+                !(bb == fn.entry() && has_calls) && !exits_loop)
+                continue;
+
+            BasicBlock* edge = fn.createBlock(bb->name + ".edge");
+            auto br = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+            br->blocks.push_back(target);
+            edge->append(std::move(br));
+
+            // Between the branch and a target placed right after it, the edge still falls
+            // through
+            auto pos = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                                    [&](const auto& b) { return b.get() == bb; });
+            if (pos + 1 != fn.blocks.end() && (pos + 1)->get() == target)
+                std::rotate(pos + 1, fn.blocks.end() - 1, fn.blocks.end());
+
+            for (auto& inst : target->insts) {
+                if (inst->op != Opcode::PHI)
+                    break;
+                std::replace(inst->blocks.begin(), inst->blocks.end(), bb, edge);
+            }
+            target = edge;
+        }
+    }
+
+    fn.rebuildCFG();
+}
+
+bool InstructionSelector::needsEdgeSplit(BasicBlock* from, BasicBlock* target,
+                                         BasicBlock* other) const {
+    if (readsPhisAtBranch(from->terminator()->operands[0], target))
+        return true;
+
+    // Everything reachable from the other edge before coming back to the target would see
+    // the phis already holding their next values
+    std::vector<BasicBlock*> work = {other};
+    std::unordered_set<BasicBlock*> seen = {other};
+    while (!work.empty()) {
+        BasicBlock* bb = work.back();
+        work.pop_back();
+        for (BasicBlock* succ : bb->successors()) {
+            if (succ != target && seen.insert(succ).second)
+                work.push_back(succ);
+        }
+    }
+
+    for (BasicBlock* bb : seen) {
+        for (auto& inst : bb->insts) {
+            for (size_t i = 0; i < inst->operands.size(); i++) {
+                const Value* op = inst->operands[i];
+                if (op->kind != ValueKind::INSTRUCTION ||
+                    static_cast<const Instruction*>(op)->op != Opcode::PHI ||
+                    static_cast<const Instruction*>(op)->parent != target)
+                    continue;
+                // A phi reads its input at the end of the predecessor
+                if (inst->op != Opcode::PHI || inst->blocks[i] == from ||
+                    seen.count(inst->blocks[i]))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Deferred instructions are selected at the branch, after the phi copies of its block
+bool InstructionSelector::readsPhisAtBranch(const Value* v, const BasicBlock* target) const {
+    if (v->kind != ValueKind::INSTRUCTION)
+        return false;
+    const auto* inst = static_cast<const Instruction*>(v);
+    if (inst->op == Opcode::PHI)
+        return inst->parent == target;
+    if (!isDeferrable(*inst))
+        return false;
+    return std::any_of(inst->operands.begin(), inst->operands.end(),
+                       [&](const Value* op) { return readsPhisAtBranch(op, target); });
+}
+
+// An induction variable `next = add phi, c` used only by its phi, and maybe by the
+// comparison that ends the block, is computed in the phi's register after the other phi
+// copies have read it. The copy through a temporary and the separate register go away.
+void InstructionSelector::findInPlaceIncrements() {
+    for (auto& bb : fn.blocks) {
+        Instruction* term = bb->terminator();
+        if (!term || (term->op != Opcode::BR && term->op != Opcode::COND_BR))
+            continue;
+        const Value* cond = term->op == Opcode::COND_BR ? term->operands[0] : nullptr;
+
+        for (BasicBlock* succ : bb->successors()) {
+            for (auto& phi : succ->insts) {
+                if (phi->op != Opcode::PHI)
+                    break;
+                auto it = std::find(phi->blocks.begin(), phi->blocks.end(), bb.get());
+                const Value* input = phi->operands[it - phi->blocks.begin()];
+                if (input->kind != ValueKind::INSTRUCTION)
+                    continue;
+                const auto* next = static_cast<const Instruction*>(input);
+                if ((next->op != Opcode::ADD && next->op != Opcode::SUB) ||
+                    next->parent != bb.get() || next->operands[0] != phi.get() ||
+                    !as_const_int(next->operands[1]) || in_place.count(next))
+                    continue;
+
+                // Its only other use may be a comparison selected at the branch
+                int uses = use_counts.at(next);
+                if (uses == 2 && cond && cond->kind == ValueKind::INSTRUCTION) {
+                    const auto* cmp = static_cast<const Instruction*>(cond);
+                    if (cmp->op == Opcode::ICMP && isDeferrable(*cmp) &&
+                        std::count(cmp->operands.begin(), cmp->operands.end(), next) == 1)
+                        uses--;
+                }
+                if (uses != 1)
+                    continue;
+
+                in_place.insert(next);
+                vregs[next] = vregFor(phi.get());
+            }
+        }
+    }
+}
+
+void InstructionSelector::splitArgumentRanges(const DominatorTree& dt) {
+    BasicBlock* entry = fn.entry();
+    Instruction* term = entry->terminator();
+    if (fn.args.empty() || !term || term->op != Opcode::COND_BR)
+        return;
+    bool entry_calls = false;
+    bool calls = false;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            calls |= inst->op == Opcode::CALL;
+            entry_calls |= inst->op == Opcode::CALL && bb.get() == entry;
+        }
+    }
+    if (!calls || entry_calls)
+        return;
+
+    for (BasicBlock* succ : entry->successors()) {
+        if (succ == entry || succ->preds.size() != 1)
+            continue;
+        for (auto& bb : fn.blocks) {
+            if (dt.dominates(succ, bb.get()))
+                arg_region[bb.get()] = succ;
+        }
+    }
+
+    // A phi reads its input at the end of the incoming block
+    std::set<std::pair<const Value*, const BasicBlock*>> read;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            for (size_t i = 0; i < inst->operands.size(); i++) {
+                if (inst->operands[i]->kind != ValueKind::ARGUMENT)
+                    continue;
+                const BasicBlock* at = inst->op == Opcode::PHI ? inst->blocks[i] : bb.get();
+                auto region = arg_region.find(at);
+                if (region != arg_region.end())
+                    read.insert({inst->operands[i], region->second});
+            }
+        }
+    }
+    if (read.empty())
+        return;
+
+    for (auto& arg : fn.args)
+        arg_copies[{arg.get(), nullptr}] = vregFor(arg.get());
+    for (auto [arg, region] : read) {
+        MReg copy = mf->createVReg(class_of(arg->type));
+        mb = blocks[region];
+        emitCopy(copy, vregFor(arg), arg->type);
+        arg_copies[{arg, region}] = copy;
+    }
+}
+
+MReg InstructionSelector::vregFor(const Value* v) {
+    auto it = vregs.find(v);
+    if (it != vregs.end())
+        return it->second;
+    MReg r = mf->createVReg(class_of(v->type), v->type == IRType::V128);
+    vregs[v] = r;
+    return r;
+}
+
+MReg InstructionSelector::use(const Value* v) {
+    if (v->kind == ValueKind::INSTRUCTION) {
+        const auto* inst = static_cast<const Instruction*>(v);
+        if (deferred.erase(inst))
+            select(*inst);
+        return vregFor(v);
+    }
+    if (v->kind == ValueKind::ARGUMENT)
+        return vregFor(v);
+
+    MReg r = mf->createVReg(class_of(v->type));
+    materialize(v, r);
+    return r;
+}
+
+void InstructionSelector::materialize(const Value* v, MReg dst) {
+    using MO = MachineOperand;
+
+    if (v->kind == ValueKind::CONSTANT_INT) {
+        uint64_t value = static_cast<uint64_t>(static_cast<const ConstantInt*>(v)->value);
+        std::vector<MoveStep> steps = integer_move_sequence(value);
+        if (steps.size() > MAX_MOVE_STEPS) {
+            loadLiteral(dst, 'x', value, 8);
+            return;
+        }
+        for (const MoveStep& step : steps) {
+            if (step.kind == MoveStep::Kind::ORR) {
+                emit("orr", {MO::def(dst, 'x'), MO::use(MReg::phys(REG_ZR), 'x'),
+                             MO::immediate(static_cast<int64_t>(step.imm))});
+                continue;
+            }
+            const char* opcode = step.kind == MoveStep::Kind::MOVK   ? "movk"
+                                 : step.kind == MoveStep::Kind::MOVN ? "movn"
+                                 : step.shift                        ? "movz"
+                                                                     : "mov";
+            // movk keeps the other halfwords of dst, so it reads it as well as writing it
+            MO dest = MO::def(dst, 'x');
+            dest.is_use = step.kind == MoveStep::Kind::MOVK;
+            std::vector<MO> ops = {dest, MO::immediate(step.imm)};
+            if (step.shift)
+                ops.push_back(MO::raw("lsl #" + std::to_string(step.shift)));
+            emit(opcode, std::move(ops));
+        }
+        return;
+    }
+
+    if (v->kind == ValueKind::CONSTANT_FLOAT) {
+        const auto* c = static_cast<const ConstantFloat*>(v);
+        bool single = c->type == IRType::F32;
+        double value = single ? static_cast<float>(c->value) : c->value;
+        uint64_t bits = single ? std::bit_cast<uint32_t>(static_cast<float>(value))
+                               : std::bit_cast<uint64_t>(value);
+        if (bits == 0)
+            emit("movi", {MO::def(dst, 'd'), MO::immediate(0)}); // +0.0, not -0.0
+        else if (is_fmov_immediate(value))
+            emit("fmov", {MO::def(dst, view_of(c->type)), MO::floatImmediate(value)});
+        else
+            loadLiteral(dst, view_of(c->type), bits, single ? 4 : 8);
+        return;
+    }
+
+    if (v->kind == ValueKind::GLOBAL_STRING) {
+        const auto* s = static_cast<const GlobalString*>(v);
+        emit("adrp", {MO::def(dst, 'x'), MO::symbol(s->label + "@PAGE")});
+        emit("add", {MO::def(dst, 'x'), MO::use(dst, 'x'), MO::symbol(s->label + "@PAGEOFF")});
+        return;
+    }
+
+    throw std::logic_error("Cannot materialize value in function '" + fn.name + "'");
+}
+
+void InstructionSelector::loadLiteral(MReg dst, char view, uint64_t bits, int size) {
+    using MO = MachineOperand;
+    auto [it, inserted] = data.literal_labels.try_emplace({size, bits});
+    if (inserted) {
+        it->second = "L_lit_" + std::to_string(data.literals.size());
+        data.literals.push_back({it->second, bits, size});
+    }
+    MReg page = mf->createVReg(RegClass::GPR);
+    emit("adrp", {MO::def(page, 'x'), MO::symbol(it->second + "@PAGE")});
+    emit("ldr", {MO::def(dst, view), MO::memPage(page, it->second)});
+}
+
+bool InstructionSelector::isDeferrable(const Instruction& inst) const {
+    if (inst.type == IRType::V128)
+        return false;
+
+    switch (inst.op) {
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::SHL:
+    case Opcode::LSHR:
+    case Opcode::ASHR:
+    case Opcode::FRAME_ADDR:
+    case Opcode::ICMP:
+    case Opcode::FCMP:
+        break;
+    default:
+        return false;
+    }
+
+    auto it = use_counts.find(&inst);
+    if (it == use_counts.end() || it->second != 1)
+        return false;
+
+    // The single user has to be selected later in the same block, and not be a phi whose
+    // copies are emitted in another block
+    for (auto& user : inst.parent->insts) {
+        if (std::find(user->operands.begin(), user->operands.end(), &inst) !=
+            user->operands.end())
+            return user->op != Opcode::PHI;
+    }
+    return false;
+}
+
+const Instruction* InstructionSelector::peek(const Value* v, Opcode op) const {
+    if (v->kind != ValueKind::INSTRUCTION)
+        return nullptr;
+    const auto* inst = static_cast<const Instruction*>(v);
+    return inst->op == op && deferred.count(inst) ? inst : nullptr;
+}
+
+void InstructionSelector::claim(const Instruction* inst) {
+    deferred.erase(inst);
+}
+
+const Instruction* InstructionSelector::foldShift(const Value* v) {
+    for (Opcode op : {Opcode::SHL, Opcode::LSHR, Opcode::ASHR}) {
+        const Instruction* shift = peek(v, op);
+        if (!shift)
+            continue;
+        const ConstantInt* amount = as_const_int(shift->operands[1]);
+        if (amount && amount->value > 0 && amount->value < 64) {
+            claim(shift);
+            return shift;
+        }
+    }
+    return nullptr;
+}
+
+static std::string shift_text(const Instruction* shift) {
+    const char* kind = shift->op == Opcode::SHL ? "lsl" : shift->op == Opcode::LSHR ? "lsr" : "asr";
+    return std::string(kind) + " #" + std::to_string(as_const_int(shift->operands[1])->value);
+}
+
+// Addressing modes, from most to least specific:
+//   [sp, #slot + imm]          frame slot, optionally plus a constant
+//   [base, #imm]               scaled unsigned offset
+//   [base, index, lsl #size]   scaled register offset, the shape of array indexing
+//   [base, index]
+//   [addr]
+MachineOperand InstructionSelector::selectAddress(const Value* addr, int size) {
+    using MO = MachineOperand;
+
+    if (const Instruction* frame = peek(addr, Opcode::FRAME_ADDR)) {
+        claim(frame);
+        return MO::memFrame(slot_objects.at(frame->slot));
+    }
+
+    if (const Instruction* add = peek(addr, Opcode::ADD)) {
+        const Value* base = add->operands[0];
+        const Value* offset = add->operands[1];
+
+        if (const ConstantInt* c = as_const_int(offset)) {
+            if (const Instruction* frame = peek(base, Opcode::FRAME_ADDR)) {
+                claim(add);
+                claim(frame);
+                return MO::memFrame(slot_objects.at(frame->slot), c->value);
+            }
+            if (c->value >= 0 && c->value % size == 0 && c->value / size <= 4095) {
+                claim(add);
+                return MO::mem(use(base), c->value);
+            }
+        } else {
+            if (const Instruction* shl = peek(offset, Opcode::SHL)) {
+                const ConstantInt* amount = as_const_int(shl->operands[1]);
+                if (amount && (amount->value == 0 || amount->value == log2_size(size))) {
+                    claim(add);
+                    claim(shl);
+                    MReg b = use(base);
+                    return MO::memIndex(b, use(shl->operands[0]), amount->value);
+                }
+            }
+            claim(add);
+            MReg b = use(base);
+            return MO::memIndex(b, use(offset), 0);
+        }
+    }
+
+    return MO::mem(use(addr));
+}
+
+void InstructionSelector::emit(const std::string& opcode, std::vector<MachineOperand> ops) {
+    mb->insts.emplace_back(opcode, std::move(ops));
+}
+
+void InstructionSelector::emitCopy(MReg dst, MReg src, IRType type) {
+    if (type == IRType::V128) {
+        emit("mov", {MachineOperand::defVector(dst, "16b"), MachineOperand::useVector(src, "16b")});
+        return;
+    }
+    char view = view_of(type);
+    emit(class_of(type) == RegClass::FPR ? "fmov" : "mov",
+         {MachineOperand::def(dst, view), MachineOperand::use(src, view)});
+}
+
+// Parallel copy semantics: every phi input is read before any phi of the successor is
+// written, so the inputs go through fresh temporaries first
+void InstructionSelector::emitPhiCopies(const BasicBlock* from) {
+    std::vector<BasicBlock*> succs = from->successors();
+    // Both targets of a conditional branch may be the same block
+    succs.erase(std::unique(succs.begin(), succs.end()), succs.end());
+
+    for (BasicBlock* succ : succs) {
+        std::vector<std::pair<const Instruction*, MReg>> temps;
+        std::vector<const Instruction*> increments;
+        for (const auto& inst : succ->insts) {
+            if (inst->op != Opcode::PHI)
+                break;
+            auto it = std::find(inst->blocks.begin(), inst->blocks.end(), from);
+            const Value* input = inst->operands[it - inst->blocks.begin()];
+            if (in_place.count(static_cast<const Instruction*>(input))) {
+                increments.push_back(static_cast<const Instruction*>(input));
+                continue;
+            }
+
+            MReg temp = mf->createVReg(class_of(inst->type), inst->type == IRType::V128);
+            if (input->kind == ValueKind::INSTRUCTION || input->kind == ValueKind::ARGUMENT) {
+                MReg source = vregFor(input);
+                emitCopy(temp, source, inst->type);
+                // Values of the entry would take the phi's register, callee-saved when it
+                // is live across calls, in front of an early return
+                if (input->kind == ValueKind::INSTRUCTION &&
+                    static_cast<const Instruction*>(input)->parent != fn.entry())
+                    mf->phi_copies.push_back({temp.id, source.id});
+            } else {
+                materialize(input, temp);
+            }
+            temps.push_back({inst.get(), temp});
+        }
+        for (const Instruction* next : increments)
+            selectAddSub(*next);
+        for (auto& [phi, temp] : temps) {
+            MReg dst = vregFor(phi);
+            emitCopy(dst, temp, phi->type);
+            mf->phi_copies.push_back({dst.id, temp.id});
+        }
+    }
+}
+
+std::unique_ptr<MachineFunction> InstructionSelector::run() {
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            for (const Value* op : inst->operands)
+                use_counts[op]++;
+        }
+    }
+    splitCriticalEdges();
+
+    mf = std::make_unique<MachineFunction>(fn.name);
+    DominatorTree dt(fn);
+    LoopInfo loops(dt);
+    for (auto& bb : fn.blocks) {
+        MachineBlock* block = mf->createBlock(block_label(fn, bb->name));
+        blocks[bb.get()] = block;
+        block->profile_count = bb->profile_count;
+        const Loop* loop = loops.loopFor(bb.get());
+        if (!loop)
+            continue;
+        block->loop_depth = loop->depth;
+        // Innermost loops start on a fetch block boundary at -O2
+        if (options.optimization_level >= 2 && loop->header == bb.get() &&
+            loop->children.empty())
+            block->align = LOOP_ALIGNMENT;
+    }
+
+    for (auto& slot : fn.slots)
+        slot_objects[slot.get()] = mf->createFrameObject(slot->size, slot->align);
+
+    mb = blocks[fn.entry()];
+    for (auto& arg : fn.args) {
+        MReg r = vregFor(arg.get());
+        // Only register arguments are passed, like the AST code generator
+        if (arg->index > 7) {
+            materialize(fn.parent->zero(arg->type), r);
+            continue;
+        }
+        RegClass cls = class_of(arg->type);
+        emitCopy(r, MReg::phys(arg->index, cls), arg->type);
+    }
+
+    splitArgumentRanges(dt);
+    findInPlaceIncrements();
+
+    for (auto& bb : fn.blocks) {
+        mb = blocks[bb.get()];
+        if (!arg_copies.empty()) {
+            auto region = arg_region.find(bb.get());
+            const BasicBlock* key = region == arg_region.end() ? nullptr : region->second;
+            for (auto& arg : fn.args) {
+                auto copy = arg_copies.find({arg.get(), key});
+                if (copy == arg_copies.end())
+                    copy = arg_copies.find({arg.get(), nullptr});
+                vregs[arg.get()] = copy->second;
+            }
+        }
+        const Instruction* tail = tailCall(*bb);
+        for (auto& inst : bb->insts) {
+            if (inst.get() == tail) {
+                selectCall(*inst, true);
+                break;
+            }
+            if (in_place.count(inst.get()))
+                continue; // Selected with the phi copies
+            if (isDeferrable(*inst))
+                deferred.insert(inst.get());
+            else
+                select(*inst);
+        }
+        if (!deferred.empty())
+            throw std::logic_error("Deferred instruction left unselected in '" + fn.name + "'");
+    }
+
+    mf->rebuildCFG();
+    return std::move(mf);
+}
+
+void InstructionSelector::select(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    auto binary = [&](const char* opcode) {
+        char view = view_of(inst.type);
+        MReg lhs = use(inst.operands[0]);
+        MReg rhs = use(inst.operands[1]);
+        emit(opcode, {MO::def(vregFor(&inst), view), MO::use(lhs, view), MO::use(rhs, view)});
+    };
+    auto unary = [&](const char* opcode, char dst_view, char src_view) {
+        MReg src = use(inst.operands[0]);
+        emit(opcode, {MO::def(vregFor(&inst), dst_view), MO::use(src, src_view)});
+    };
+
+    if (inst.type == IRType::V128 || inst.op == Opcode::VSTORE || inst.op == Opcode::VREDUCE) {
+        selectVector(inst);
+        return;
+    }
+
+    switch (inst.op) {
+    case Opcode::ADD:
+    case Opcode::SUB:
+        selectAddSub(inst);
+        break;
+    case Opcode::MUL:
+        selectMultiply(inst);
+        break;
+    case Opcode::SDIV:
+    case Opcode::UDIV:
+        selectDivide(inst);
+        break;
+    case Opcode::SHL:
+    case Opcode::LSHR:
+    case Opcode::ASHR: {
+        const char* opcode =
+            inst.op == Opcode::SHL ? "lsl" : inst.op == Opcode::LSHR ? "lsr" : "asr";
+        const ConstantInt* amount = as_const_int(inst.operands[1]);
+        if (amount && amount->value >= 0 && amount->value < 64) {
+            MReg lhs = use(inst.operands[0]);
+            emit(opcode, {MO::def(vregFor(&inst), 'x'), MO::use(lhs, 'x'),
+                          MO::immediate(amount->value)});
+        } else {
+            binary(opcode);
+        }
+        break;
+    }
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+        selectLogical(inst);
+        break;
+    case Opcode::FADD:
+        binary("fadd");
+        break;
+    case Opcode::FSUB:
+        binary("fsub");
+        break;
+    case Opcode::FMUL:
+        binary("fmul");
+        break;
+    case Opcode::FDIV:
+        binary("fdiv");
+        break;
+    case Opcode::NEG:
+        if (const Instruction* mul = peek(inst.operands[0], Opcode::MUL)) {
+            claim(mul);
+            MReg a = use(mul->operands[0]);
+            MReg b = use(mul->operands[1]);
+            emit("mneg", {MO::def(vregFor(&inst), 'x'), MO::use(a, 'x'), MO::use(b, 'x')});
+        } else if (const Instruction* shift = foldShift(inst.operands[0])) {
+            MReg src = use(shift->operands[0]);
+            emit("neg",
+                 {MO::def(vregFor(&inst), 'x'), MO::use(src, 'x'), MO::raw(shift_text(shift))});
+        } else {
+            unary("neg", 'x', 'x');
+        }
+        break;
+    case Opcode::ABS: {
+        MReg src = use(inst.operands[0]);
+        emit("cmp", {MO::use(src, 'x'), MO::immediate(0)});
+        emit("cneg", {MO::def(vregFor(&inst), 'x'), MO::use(src, 'x'), MO::raw("mi")});
+        break;
+    }
+    case Opcode::FNEG:
+        unary("fneg", view_of(inst.type), view_of(inst.type));
+        break;
+    case Opcode::FABS:
+        unary("fabs", view_of(inst.type), view_of(inst.type));
+        break;
+    case Opcode::FSQRT:
+        unary("fsqrt", view_of(inst.type), view_of(inst.type));
+        break;
+    case Opcode::FMIN:
+        binary("fminnm");
+        break;
+    case Opcode::FMAX:
+        binary("fmaxnm");
+        break;
+    case Opcode::FFLOOR:
+        unary("frintm", view_of(inst.type), view_of(inst.type));
+        break;
+    case Opcode::FCEIL:
+        unary("frintp", view_of(inst.type), view_of(inst.type));
+        break;
+    case Opcode::FROUND:
+        unary("frinta", view_of(inst.type), view_of(inst.type));
+        break;
+
+    case Opcode::ICMP:
+    case Opcode::FCMP: {
+        Cond cond = selectCompare(inst);
+        emit("cset", {MO::def(vregFor(&inst), 'x'),
+                      MO::raw(cond_code(cond, inst.op == Opcode::FCMP))});
+        break;
+    }
+
+    case Opcode::SEXT:
+        if (inst.mem.size == 1)
+            unary("sxtb", 'x', 'w');
+        else if (inst.mem.size == 2)
+            unary("sxth", 'x', 'w');
+        else
+            unary("sxtw", 'x', 'w');
+        break;
+    case Opcode::ZEXT:
+        // Writing a w register clears the upper half
+        if (inst.mem.size == 1)
+            unary("uxtb", 'w', 'w');
+        else if (inst.mem.size == 2)
+            unary("uxth", 'w', 'w');
+        else
+            unary("mov", 'w', 'w');
+        break;
+    case Opcode::SITOFP:
+        unary("scvtf", view_of(inst.type), 'x');
+        break;
+    case Opcode::FPTOSI:
+        unary("fcvtzs", 'x', view_of(inst.operands[0]->type));
+        break;
+    case Opcode::FPEXT:
+        unary("fcvt", 'd', 's');
+        break;
+    case Opcode::FPTRUNC:
+        unary("fcvt", 's', 'd');
+        break;
+
+    case Opcode::FRAME_ADDR:
+        emit("add", {MO::def(vregFor(&inst), 'x'), MO::use(MReg::phys(REG_SP), 'x'),
+                     MO::frameIndex(slot_objects.at(inst.slot))});
+        break;
+    case Opcode::LOAD:
+        selectLoad(inst);
+        break;
+    case Opcode::STORE:
+        selectStore(inst);
+        break;
+
+    case Opcode::BOUNDS_CHECK: {
+        MReg index = use(inst.operands[0]);
+        if (is_arith_immediate(inst.imm)) {
+            std::vector<MO> ops = {MO::use(index, 'x')};
+            for (auto& op : arith_immediate(inst.imm))
+                ops.push_back(op);
+            emit("cmp", std::move(ops));
+        } else {
+            MReg length = use(fn.parent->constInt(inst.imm));
+            emit("cmp", {MO::use(index, 'x'), MO::use(length, 'x')});
+        }
+        if (options.bounds_mode == BoundsMode::TRAP) {
+            emit("b.hs", {MO::symbol("L_bounds_trap")});
+            data.requires_bounds_trap = true;
+        } else {
+            emit("b.hs", {MO::symbol("L_bounds_violation_panic")});
+            data.requires_bounds_panic = true;
+        }
+        break;
+    }
+
+    case Opcode::PROFILE_INC: {
+        std::string counter = "Lcapp_profile_counters";
+        if (inst.imm)
+            counter += "+" + std::to_string(inst.imm);
+        MReg page = mf->createVReg(RegClass::GPR);
+        MReg count = mf->createVReg(RegClass::GPR);
+        emit("adrp", {MO::def(page, 'x'), MO::symbol(counter + "@PAGE")});
+        emit("ldr", {MO::def(count, 'x'), MO::memPage(page, counter)});
+        emit("add", {MO::def(count, 'x'), MO::use(count, 'x'), MO::immediate(1)});
+        emit("str", {MO::use(count, 'x'), MO::memPage(page, counter)});
+        break;
+    }
+
+    case Opcode::CALL:
+        selectCall(inst);
+        break;
+
+    case Opcode::PHI:
+        // Lowered by the copies at the end of each predecessor
+        break;
+
+    case Opcode::VLOAD:
+    case Opcode::VSPLAT:
+    case Opcode::VWIDEN:
+    case Opcode::VSTORE:
+    case Opcode::VREDUCE:
+        // Always v128 typed or dispatched to selectVector above
+        throw std::logic_error("Vector instruction with a scalar type in function '" + fn.name + "'");
+
+    case Opcode::BR:
+        emitPhiCopies(inst.parent);
+        emit("b", {MO::label(blocks.at(inst.blocks[0]))});
+        break;
+    case Opcode::COND_BR: {
+        emitPhiCopies(inst.parent);
+        MachineBlock* if_true = blocks.at(inst.blocks[0]);
+        MachineBlock* if_false = blocks.at(inst.blocks[1]);
+
+        // Branch away on the negated condition when the true block comes next, so the
+        // unconditional branch falls through
+        auto pos = std::find_if(mf->blocks.begin(), mf->blocks.end(),
+                                [&](const auto& b) { return b.get() == mb; });
+        bool true_is_next = pos + 1 != mf->blocks.end() && (pos + 1)->get() == if_true;
+        selectCondBranch(inst.operands[0], true_is_next, true_is_next ? if_false : if_true);
+        emit("b", {MO::label(true_is_next ? if_true : if_false)});
+        break;
+    }
+    case Opcode::RET: {
+        MachineInstr ret("ret");
+        if (!inst.operands.empty()) {
+            IRType type = inst.operands[0]->type;
+            MReg result = MReg::phys(0, class_of(type));
+            emitCopy(result, use(inst.operands[0]), type);
+            ret.implicit_uses.push_back(result);
+        }
+        mb->insts.push_back(std::move(ret));
+        break;
+    }
+    case Opcode::UNREACHABLE:
+        emit("brk", {MO::immediate(1)});
+        break;
+    }
+}
+
+void InstructionSelector::selectAddSub(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    bool is_add = inst.op == Opcode::ADD;
+    const Value* lhs = inst.operands[0];
+    const Value* rhs = inst.operands[1];
+    MReg dst = vregFor(&inst);
+
+    // Address of a field or element at a constant offset into a frame slot
+    if (const ConstantInt* c = as_const_int(rhs); is_add && c) {
+        if (const Instruction* frame = peek(lhs, Opcode::FRAME_ADDR)) {
+            claim(frame);
+            emit("add", {MO::def(dst, 'x'), MO::use(MReg::phys(REG_SP), 'x'),
+                         MO::frameIndex(slot_objects.at(frame->slot), c->value)});
+            return;
+        }
+    }
+
+    // a + b * c, a - b * c
+    const Instruction* mul = peek(rhs, Opcode::MUL);
+    const Value* addend = lhs;
+    if (!mul && is_add) {
+        mul = peek(lhs, Opcode::MUL);
+        addend = rhs;
+    }
+    if (mul) {
+        claim(mul);
+        MReg a = use(mul->operands[0]);
+        MReg b = use(mul->operands[1]);
+        MReg c = use(addend);
+        emit(is_add ? "madd" : "msub",
+             {MO::def(dst, 'x'), MO::use(a, 'x'), MO::use(b, 'x'), MO::use(c, 'x')});
+        return;
+    }
+
+    if (is_add && as_const_int(lhs) && !as_const_int(rhs))
+        std::swap(lhs, rhs);
+
+    if (const ConstantInt* c = as_const_int(rhs)) {
+        int64_t value = c->value;
+        const char* opcode = is_add ? "add" : "sub";
+        if (value < 0 && value != INT64_MIN) {
+            value = -value;
+            opcode = is_add ? "sub" : "add";
+        }
+        if (is_arith_immediate(value)) {
+            std::vector<MO> ops = {MO::def(dst, 'x'), MO::use(use(lhs), 'x')};
+            for (auto& op : arith_immediate(value))
+                ops.push_back(op);
+            emit(opcode, std::move(ops));
+            return;
+        }
+    }
+
+    // Shifted register operand, only the second source can be shifted
+    const Instruction* shift = foldShift(rhs);
+    if (!shift && is_add) {
+        shift = foldShift(lhs);
+        if (shift)
+            std::swap(lhs, rhs);
+    }
+    if (shift) {
+        MReg a = use(lhs);
+        MReg b = use(shift->operands[0]);
+        emit(is_add ? "add" : "sub",
+             {MO::def(dst, 'x'), MO::use(a, 'x'), MO::use(b, 'x'), MO::raw(shift_text(shift))});
+        return;
+    }
+
+    MReg a = use(lhs);
+    MReg b = use(rhs);
+    emit(is_add ? "add" : "sub", {MO::def(dst, 'x'), MO::use(a, 'x'), MO::use(b, 'x')});
+}
+
+// Constant multipliers become one or two shift-and-add instructions where possible
+void InstructionSelector::selectMultiply(const Instruction& inst) {
+    using MO = MachineOperand;
+    using Form = ShiftAddMultiply::Form;
+
+    const Value* lhs = inst.operands[0];
+    const Value* rhs = inst.operands[1];
+    if (as_const_int(lhs) && !as_const_int(rhs))
+        std::swap(lhs, rhs);
+    const ConstantInt* c = as_const_int(rhs);
+    std::optional<ShiftAddMultiply> form = c ? shift_add_multiply(c->value) : std::nullopt;
+    MReg dst = vregFor(&inst);
+    if (!form) {
+        MReg a = use(lhs);
+        MReg b = use(rhs);
+        emit("mul", {MO::def(dst, 'x'), MO::use(a, 'x'), MO::use(b, 'x')});
+        return;
+    }
+
+    MReg x = use(lhs);
+    MO shift = MO::raw("lsl #" + std::to_string(form->shift));
+    switch (form->form) {
+    case Form::SHIFT:
+        emit("lsl", {MO::def(dst, 'x'), MO::use(x, 'x'), MO::immediate(form->shift)});
+        break;
+    case Form::NEGATE:
+        if (form->shift == 0)
+            emit("neg", {MO::def(dst, 'x'), MO::use(x, 'x')});
+        else
+            emit("neg", {MO::def(dst, 'x'), MO::use(x, 'x'), shift});
+        break;
+    case Form::ADD:
+        if (form->post_shift == 0) {
+            emit("add", {MO::def(dst, 'x'), MO::use(x, 'x'), MO::use(x, 'x'), shift});
+        } else {
+            MReg t = mf->createVReg(RegClass::GPR);
+            emit("add", {MO::def(t, 'x'), MO::use(x, 'x'), MO::use(x, 'x'), shift});
+            emit("lsl", {MO::def(dst, 'x'), MO::use(t, 'x'), MO::immediate(form->post_shift)});
+        }
+        break;
+    case Form::SUB: {
+        MReg t = mf->createVReg(RegClass::GPR);
+        emit("lsl", {MO::def(t, 'x'), MO::use(x, 'x'), MO::immediate(form->shift)});
+        emit("sub", {MO::def(dst, 'x'), MO::use(t, 'x'), MO::use(x, 'x')});
+        break;
+    }
+    case Form::REVERSE_SUB:
+        emit("sub", {MO::def(dst, 'x'), MO::use(x, 'x'), MO::use(x, 'x'), shift});
+        break;
+    }
+}
+
+// Division by a constant never reaches sdiv / udiv: powers of two become shifts, other
+// divisors a high multiply by their magic number. Division by zero keeps the instruction,
+// which gives zero.
+void InstructionSelector::selectDivide(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    bool is_signed = inst.op == Opcode::SDIV;
+    const ConstantInt* c = as_const_int(inst.operands[1]);
+    MReg dst = vregFor(&inst);
+    if (!c || c->value == 0) {
+        MReg a = use(inst.operands[0]);
+        MReg b = use(inst.operands[1]);
+        emit(is_signed ? "sdiv" : "udiv", {MO::def(dst, 'x'), MO::use(a, 'x'), MO::use(b, 'x')});
+        return;
+    }
+
+    int64_t d = c->value;
+    MReg x = use(inst.operands[0]);
+    auto temp = [&] { return mf->createVReg(RegClass::GPR); };
+    auto shifted = [](const char* kind, int amount) {
+        return MO::raw(std::string(kind) + " #" + std::to_string(amount));
+    };
+
+    if (d == 1 || (d == -1 && is_signed)) {
+        if (d == 1)
+            emitCopy(dst, x, IRType::I64);
+        else
+            emit("neg", {MO::def(dst, 'x'), MO::use(x, 'x')});
+        return;
+    }
+
+    if (!is_signed) {
+        uint64_t ud = static_cast<uint64_t>(d);
+        if (std::optional<int> k = exact_log2(ud)) {
+            emit("lsr", {MO::def(dst, 'x'), MO::use(x, 'x'), MO::immediate(*k)});
+            return;
+        }
+        UnsignedDivisionMagic magic = unsigned_division_magic(ud);
+        MReg m = use(fn.parent->constInt(static_cast<int64_t>(magic.multiplier)));
+        MReg t = temp();
+        emit("umulh", {MO::def(t, 'x'), MO::use(x, 'x'), MO::use(m, 'x')});
+        if (!magic.add) {
+            emit("lsr", {MO::def(dst, 'x'), MO::use(t, 'x'), MO::immediate(magic.shift)});
+            return;
+        }
+        MReg diff = temp();
+        MReg sum = temp();
+        emit("sub", {MO::def(diff, 'x'), MO::use(x, 'x'), MO::use(t, 'x')});
+        emit("add", {MO::def(sum, 'x'), MO::use(t, 'x'), MO::use(diff, 'x'), shifted("lsr", 1)});
+        emit("lsr", {MO::def(dst, 'x'), MO::use(sum, 'x'), MO::immediate(magic.shift - 1)});
+        return;
+    }
+
+    // Signed quotients round towards zero: negative dividends are biased by divisor - 1
+    // before shifting, and the magic sequence adds one to negative results
+    uint64_t ad = d < 0 ? 0 - static_cast<uint64_t>(d) : static_cast<uint64_t>(d);
+    if (std::optional<int> k = exact_log2(ad)) {
+        MReg biased = temp();
+        if (*k == 1) {
+            emit("add", {MO::def(biased, 'x'), MO::use(x, 'x'), MO::use(x, 'x'),
+                         shifted("lsr", 63)});
+        } else {
+            MReg sign = temp();
+            emit("asr", {MO::def(sign, 'x'), MO::use(x, 'x'), MO::immediate(63)});
+            emit("add", {MO::def(biased, 'x'), MO::use(x, 'x'), MO::use(sign, 'x'),
+                         shifted("lsr", 64 - *k)});
+        }
+        if (d > 0) {
+            emit("asr", {MO::def(dst, 'x'), MO::use(biased, 'x'), MO::immediate(*k)});
+        } else {
+            emit("neg", {MO::def(dst, 'x'), MO::use(biased, 'x'), shifted("asr", *k)});
+        }
+        return;
+    }
+
+    SignedDivisionMagic magic = signed_division_magic(d);
+    MReg m = use(fn.parent->constInt(magic.multiplier));
+    MReg q = temp();
+    emit("smulh", {MO::def(q, 'x'), MO::use(x, 'x'), MO::use(m, 'x')});
+    if ((d > 0 && magic.multiplier < 0) || (d < 0 && magic.multiplier > 0)) {
+        MReg corrected = temp();
+        emit(d > 0 ? "add" : "sub", {MO::def(corrected, 'x'), MO::use(q, 'x'), MO::use(x, 'x')});
+        q = corrected;
+    }
+    if (magic.shift > 0) {
+        MReg shifted_q = temp();
+        emit("asr", {MO::def(shifted_q, 'x'), MO::use(q, 'x'), MO::immediate(magic.shift)});
+        q = shifted_q;
+    }
+    emit("add", {MO::def(dst, 'x'), MO::use(q, 'x'), MO::use(q, 'x'), shifted("lsr", 63)});
+}
+
+void InstructionSelector::selectLogical(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    const char* opcode = inst.op == Opcode::AND ? "and" : inst.op == Opcode::OR ? "orr" : "eor";
+    const Value* lhs = inst.operands[0];
+    const Value* rhs = inst.operands[1];
+    MReg dst = vregFor(&inst);
+
+    if (as_const_int(lhs) && !as_const_int(rhs))
+        std::swap(lhs, rhs);
+
+    if (const ConstantInt* c = as_const_int(rhs);
+        c && is_logical_immediate(static_cast<uint64_t>(c->value))) {
+        std::ostringstream imm;
+        imm << "#0x" << std::hex << static_cast<uint64_t>(c->value);
+        MReg a = use(lhs);
+        emit(opcode, {MO::def(dst, 'x'), MO::use(a, 'x'), MO::raw(imm.str())});
+        return;
+    }
+
+    const Instruction* shift = foldShift(rhs);
+    if (!shift) {
+        shift = foldShift(lhs);
+        if (shift)
+            std::swap(lhs, rhs);
+    }
+    if (shift) {
+        MReg a = use(lhs);
+        MReg b = use(shift->operands[0]);
+        emit(opcode,
+             {MO::def(dst, 'x'), MO::use(a, 'x'), MO::use(b, 'x'), MO::raw(shift_text(shift))});
+        return;
+    }
+
+    MReg a = use(lhs);
+    MReg b = use(rhs);
+    emit(opcode, {MO::def(dst, 'x'), MO::use(a, 'x'), MO::use(b, 'x')});
+}
+
+Cond InstructionSelector::selectCompare(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    Cond cond = inst.cond;
+    const Value* lhs = inst.operands[0];
+    const Value* rhs = inst.operands[1];
+
+    if (inst.op == Opcode::FCMP) {
+        char view = view_of(lhs->type);
+        auto is_zero = [](const Value* v) {
+            return v->kind == ValueKind::CONSTANT_FLOAT &&
+                   std::bit_cast<uint64_t>(static_cast<const ConstantFloat*>(v)->value) == 0;
+        };
+        if (is_zero(lhs) && !is_zero(rhs)) {
+            std::swap(lhs, rhs);
+            cond = cond_swapped(cond);
+        }
+        if (is_zero(rhs)) {
+            emit("fcmp", {MO::use(use(lhs), view), MO::floatImmediate(0.0)});
+            return cond;
+        }
+        MReg a = use(lhs);
+        MReg b = use(rhs);
+        emit("fcmp", {MO::use(a, view), MO::use(b, view)});
+        return cond;
+    }
+
+    if (as_const_int(lhs) && !as_const_int(rhs)) {
+        std::swap(lhs, rhs);
+        cond = cond_swapped(cond);
+    }
+
+    if (const ConstantInt* c = as_const_int(rhs)) {
+        int64_t value = c->value;
+        const char* opcode = "cmp";
+        if (value < 0 && value != INT64_MIN && is_arith_immediate(-value)) {
+            value = -value;
+            opcode = "cmn";
+        }
+        if (is_arith_immediate(value)) {
+            std::vector<MO> ops = {MO::use(use(lhs), 'x')};
+            for (auto& op : arith_immediate(value))
+                ops.push_back(op);
+            emit(opcode, std::move(ops));
+            return cond;
+        }
+    }
+
+    const Instruction* shift = foldShift(rhs);
+    if (!shift) {
+        shift = foldShift(lhs);
+        if (shift) {
+            std::swap(lhs, rhs);
+            cond = cond_swapped(cond);
+        }
+    }
+    if (shift) {
+        MReg a = use(lhs);
+        MReg b = use(shift->operands[0]);
+        emit("cmp", {MO::use(a, 'x'), MO::use(b, 'x'), MO::raw(shift_text(shift))});
+        return cond;
+    }
+
+    MReg a = use(lhs);
+    MReg b = use(rhs);
+    emit("cmp", {MO::use(a, 'x'), MO::use(b, 'x')});
+    return cond;
+}
+
+void InstructionSelector::selectCondBranch(const Value* cond, bool negate,
+                                           MachineBlock* target) {
+    using MO = MachineOperand;
+
+    if (const Instruction* cmp = peek(cond, Opcode::ICMP)) {
+        claim(cmp);
+
+        const Value* lhs = cmp->operands[0];
+        const Value* rhs = cmp->operands[1];
+        Cond cc = negate ? cond_inverse(cmp->cond) : cmp->cond;
+        if (as_const_int(lhs) && !as_const_int(rhs)) {
+            std::swap(lhs, rhs);
+            cc = cond_swapped(cc);
+        }
+
+        // Against zero only equality and the sign bit need testing
+        if (const ConstantInt* c = as_const_int(rhs); c && c->value == 0) {
+            const char* opcode = nullptr;
+            switch (cc) {
+            case Cond::EQ:
+            case Cond::ULE:
+                opcode = "cbz";
+                break;
+            case Cond::NE:
+            case Cond::UGT:
+                opcode = "cbnz";
+                break;
+            case Cond::LT:
+                opcode = "tbnz";
+                break;
+            case Cond::GE:
+                opcode = "tbz";
+                break;
+            default:
+                break;
+            }
+            if (opcode) {
+                std::vector<MO> ops = {MO::use(use(lhs), 'x')};
+                if (opcode[0] == 't')
+                    ops.push_back(MO::immediate(63));
+                ops.push_back(MO::label(target));
+                emit(opcode, std::move(ops));
+                return;
+            }
+        }
+
+        Cond selected = selectCompare(*cmp);
+        std::string code = cond_code(selected, false);
+        if (negate)
+            code = invert_cond_code(code);
+        emit("b." + code, {MO::label(target)});
+        return;
+    }
+
+    if (const Instruction* cmp = peek(cond, Opcode::FCMP)) {
+        claim(cmp);
+        Cond selected = selectCompare(*cmp);
+        std::string code = cond_code(selected, true);
+        if (negate)
+            code = invert_cond_code(code);
+        emit("b." + code, {MO::label(target)});
+        return;
+    }
+
+    emit(negate ? "cbz" : "cbnz", {MO::use(use(cond), 'x'), MO::label(target)});
+}
+
+void InstructionSelector::selectLoad(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    const MemType& m = inst.mem;
+    MachineOperand addr = selectAddress(inst.operands[0], m.size);
+    MReg dst = vregFor(&inst);
+
+    if (m.is_float) {
+        emit("ldr", {MO::def(dst, m.size == 4 ? 's' : 'd'), addr});
+        return;
+    }
+
+    switch (m.size) {
+    case 1:
+        if (m.is_signed)
+            emit("ldrsb", {MO::def(dst, 'x'), addr});
+        else
+            emit("ldrb", {MO::def(dst, 'w'), addr});
+        break;
+    case 2:
+        if (m.is_signed)
+            emit("ldrsh", {MO::def(dst, 'x'), addr});
+        else
+            emit("ldrh", {MO::def(dst, 'w'), addr});
+        break;
+    case 4:
+        if (m.is_signed)
+            emit("ldrsw", {MO::def(dst, 'x'), addr});
+        else
+            emit("ldr", {MO::def(dst, 'w'), addr});
+        break;
+    default:
+        emit("ldr", {MO::def(dst, 'x'), addr});
+        break;
+    }
+}
+
+void InstructionSelector::selectStore(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    const MemType& m = inst.mem;
+    const Value* stored = inst.operands[0];
+
+    // Zero of any type is stored straight from the zero register
+    bool is_zero = (stored->kind == ValueKind::CONSTANT_INT &&
+                    static_cast<const ConstantInt*>(stored)->value == 0) ||
+                   (stored->kind == ValueKind::CONSTANT_FLOAT &&
+                    std::bit_cast<uint64_t>(static_cast<const ConstantFloat*>(stored)->value) == 0);
+    MReg value = is_zero ? MReg::phys(REG_ZR) : use(stored);
+    MachineOperand addr = selectAddress(inst.operands[1], m.size);
+
+    if (m.is_float && !is_zero) {
+        emit("str", {MO::use(value, m.size == 4 ? 's' : 'd'), addr});
+        return;
+    }
+
+    switch (m.size) {
+    case 1:
+        emit("strb", {MO::use(value, 'w'), addr});
+        break;
+    case 2:
+        emit("strh", {MO::use(value, 'w'), addr});
+        break;
+    case 4:
+        emit("str", {MO::use(value, 'w'), addr});
+        break;
+    default:
+        emit("str", {MO::use(value, 'x'), addr});
+        break;
+    }
+}
+
+// Arrangement of a vector instruction's lanes, taken from its lane type
+static std::string arrangement_of(const MemType& lane) {
+    return lane.size == 4 ? "4s" : "2d";
+}
+
+void InstructionSelector::selectVector(const Instruction& inst) {
+    using MO = MachineOperand;
+
+    const MemType& lane = inst.mem;
+    std::string arr = arrangement_of(lane);
+
+    auto binary = [&](const char* mnemonic, const std::string& a) {
+        MReg lhs = use(inst.operands[0]);
+        MReg rhs = use(inst.operands[1]);
+        emit(mnemonic,
+             {MO::defVector(vregFor(&inst), a), MO::useVector(lhs, a), MO::useVector(rhs, a)});
+    };
+    auto unary = [&](const char* mnemonic) {
+        MReg src = use(inst.operands[0]);
+        emit(mnemonic, {MO::defVector(vregFor(&inst), arr), MO::useVector(src, arr)});
+    };
+
+    switch (inst.op) {
+    case Opcode::VLOAD: {
+        MachineOperand addr = selectAddress(inst.operands[0], 16);
+        emit("ldr", {MO::def(vregFor(&inst), 'q'), addr});
+        break;
+    }
+    case Opcode::VSTORE: {
+        MReg value = use(inst.operands[0]);
+        MachineOperand addr = selectAddress(inst.operands[1], 16);
+        emit("str", {MO::use(value, 'q'), addr});
+        break;
+    }
+    case Opcode::VSPLAT: {
+        MReg dst = vregFor(&inst);
+        const Value* scalar = inst.operands[0];
+        bool is_zero =
+            (scalar->kind == ValueKind::CONSTANT_INT &&
+             static_cast<const ConstantInt*>(scalar)->value == 0) ||
+            (scalar->kind == ValueKind::CONSTANT_FLOAT &&
+             std::bit_cast<uint64_t>(static_cast<const ConstantFloat*>(scalar)->value) == 0);
+        if (is_zero) {
+            emit("movi", {MO::defVector(dst, "2d"), MO::immediate(0)});
+        } else if (lane.is_float) {
+            MReg src = use(scalar);
+            emit("dup",
+                 {MO::defVector(dst, arr), MO::useVector(src, lane.size == 4 ? "s[0]" : "d[0]")});
+        } else {
+            MReg src = use(scalar);
+            emit("dup", {MO::defVector(dst, arr), MO::use(src, lane.size == 4 ? 'w' : 'x')});
+        }
+        break;
+    }
+    case Opcode::VREDUCE: {
+        MReg src = use(inst.operands[0]);
+        MReg dst = vregFor(&inst);
+        if (lane.is_float && lane.size == 4) {
+            // Pairs of lanes first, then the remaining two
+            MReg pairs = mf->createVReg(RegClass::FPR, true);
+            emit("faddp",
+                 {MO::defVector(pairs, "4s"), MO::useVector(src, "4s"), MO::useVector(src, "4s")});
+            emit("faddp", {MO::def(dst, 's'), MO::useVector(pairs, "2s")});
+        } else if (lane.is_float) {
+            emit("faddp", {MO::def(dst, 'd'), MO::useVector(src, "2d")});
+        } else if (lane.size == 4) {
+            MReg sum = mf->createVReg(RegClass::FPR, true);
+            emit("addv", {MO::def(sum, 's'), MO::useVector(src, "4s")});
+            if (lane.is_signed)
+                emit("smov", {MO::def(dst, 'x'), MO::useVector(sum, "s[0]")});
+            else
+                emit("fmov", {MO::def(dst, 'w'), MO::use(sum, 's')});
+        } else {
+            MReg sum = mf->createVReg(RegClass::FPR);
+            emit("addp", {MO::def(sum, 'd'), MO::useVector(src, "2d")});
+            emit("fmov", {MO::def(dst, 'x'), MO::use(sum, 'd')});
+        }
+        break;
+    }
+    case Opcode::VWIDEN: {
+        MReg src = use(inst.operands[0]);
+        emit(lane.is_signed ? "saddlp" : "uaddlp",
+             {MO::defVector(vregFor(&inst), "2d"), MO::useVector(src, "4s")});
+        break;
+    }
+    case Opcode::ADD:
+        binary("add", arr);
+        break;
+    case Opcode::SUB:
+        binary("sub", arr);
+        break;
+    case Opcode::MUL:
+        binary("mul", arr);
+        break;
+    case Opcode::AND:
+        binary("and", "16b");
+        break;
+    case Opcode::OR:
+        binary("orr", "16b");
+        break;
+    case Opcode::XOR:
+        binary("eor", "16b");
+        break;
+    case Opcode::FADD:
+        binary("fadd", arr);
+        break;
+    case Opcode::FSUB:
+        binary("fsub", arr);
+        break;
+    case Opcode::FMUL:
+        binary("fmul", arr);
+        break;
+    case Opcode::FDIV:
+        binary("fdiv", arr);
+        break;
+    case Opcode::NEG:
+        unary("neg");
+        break;
+    case Opcode::FNEG:
+        unary("fneg");
+        break;
+    case Opcode::SHL: {
+        MReg src = use(inst.operands[0]);
+        emit("shl", {MO::defVector(vregFor(&inst), arr), MO::useVector(src, arr),
+                     MO::immediate(as_const_int(inst.operands[1])->value)});
+        break;
+    }
+    case Opcode::PHI:
+        break; // Copies are emitted at the end of the predecessors
+    default:
+        throw std::logic_error(std::string("No vector lowering for '") + opcode_name(inst.op) +
+                               "' in function '" + fn.name + "'");
+    }
+}
+
+const Instruction* InstructionSelector::tailCall(const BasicBlock& bb) const {
+    const Instruction* ret = bb.terminator();
+    if (!ret || ret->op != Opcode::RET || bb.insts.size() < 2)
+        return nullptr;
+    auto it = std::prev(bb.insts.end(), 2);
+
+    if (ret->operands.empty())
+        return (*it)->op == Opcode::CALL && !use_counts.count(it->get()) ? it->get() : nullptr;
+
+    // Narrow results are re-extended by the receiving caller, so returning the callee's
+    // x0 as is only works when both return the same type
+    const Value* result = ret->operands[0];
+    if (it->get() == result && ((*it)->op == Opcode::SEXT || (*it)->op == Opcode::ZEXT)) {
+        const Type& type = fn.lang_return_type;
+        bool narrow = type.kind == TypeKind::PRIMITIVE && !type.is_float && type.size_bytes < 8;
+        if (!narrow || (*it)->mem != mem_type_of(type) || it == bb.insts.begin() ||
+            use_counts.at(result) != 1)
+            return nullptr;
+        result = (*it)->operands[0];
+        --it;
+    }
+    if (it->get() != result || (*it)->op != Opcode::CALL || use_counts.at(result) != 1)
+        return nullptr;
+    return it->get();
+}
+
+void InstructionSelector::selectCall(const Instruction& inst, bool is_tail) {
+    using MO = MachineOperand;
+
+    std::vector<MReg> arg_regs;
+    std::vector<std::pair<MReg, const Value*>> moves;
+    for (size_t i = 0; i < inst.operands.size() && i < 8; i++) {
+        const Value* arg = inst.operands[i];
+        moves.push_back({MReg::phys(static_cast<int>(i), class_of(arg->type)), arg});
+    }
+
+    // Evaluate every argument before the physical registers are written
+    std::vector<MReg> values;
+    for (auto& [reg, arg] : moves)
+        values.push_back(use(arg));
+    for (size_t i = 0; i < moves.size(); i++) {
+        emitCopy(moves[i].first, values[i], moves[i].second->type);
+        arg_regs.push_back(moves[i].first);
+    }
+
+    if (is_tail) {
+        MachineInstr branch("b", {MO::symbol(symbol_name(inst.callee))});
+        branch.is_tail_call = true;
+        branch.implicit_uses = arg_regs;
+        mb->insts.push_back(std::move(branch));
+        if (options.tail_call_report)
+            std::cout << "turned the call to '" << inst.callee << "' in '" << fn.name
+                      << "' into a branch\n";
+        return;
+    }
+
+    MachineInstr call("bl", {MO::symbol(symbol_name(inst.callee))});
+    call.is_call = true;
+    call.implicit_uses = arg_regs;
+    call.implicit_defs = caller_saved_regs();
+    mb->insts.push_back(std::move(call));
+    mf->has_calls = true;
+
+    if (inst.type != IRType::VOID)
+        emitCopy(vregFor(&inst), MReg::phys(0, class_of(inst.type)), inst.type);
+}
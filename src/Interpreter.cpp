@@ -0,0 +1,249 @@
+#include "Interpreter.h"
+
+#include "ConstantFold.h"
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr long MAX_STEPS = 1000000;
+static constexpr size_t MAX_DEPTH = 256;
+
+// Frame addresses are FRAME_BASE + (stack position << FRAME_BITS) + offset, far from any
+// integer a program is likely to compute by accident
+static constexpr uint64_t FRAME_BASE = uint64_t(1) << 44;
+static constexpr int FRAME_BITS = 20;
+static constexpr int64_t MAX_FRAME_SIZE = int64_t(1) << FRAME_BITS;
+
+static int64_t int_of(const Value* v) {
+    return static_cast<const ConstantInt*>(v)->value;
+}
+
+static double float_of(const Value* v) {
+    return static_cast<const ConstantFloat*>(v)->value;
+}
+
+// Sign or zero extends the low `m.size` bytes of `v`, like a load or an incoming argument
+static int64_t extend(uint64_t v, const MemType& m) {
+    if (m.size >= 8)
+        return static_cast<int64_t>(v);
+    int bits = m.size * 8;
+    uint64_t mask = (uint64_t(1) << bits) - 1;
+    v &= mask;
+    if (m.is_signed && (v >> (bits - 1)) & 1)
+        v |= ~mask;
+    return static_cast<int64_t>(v);
+}
+
+bool Interpreter::call(Function& fn, const std::vector<Value*>& args, Value*& result) {
+    scratch = std::make_unique<Module>();
+    steps = 0;
+
+    Value* value = nullptr;
+    bool ok = run(fn, args, value);
+    result = nullptr;
+    // A narrow result is only defined in its low bits, wrap it like the caller's extension
+    if (ok && value && value->kind == ValueKind::CONSTANT_INT)
+        result = mod.constInt(extend(int_of(value), mem_type_of(fn.lang_return_type)));
+    else if (ok && value)
+        result = mod.constFloat(float_of(value), value->type);
+    scratch.reset();
+    return ok;
+}
+
+bool Interpreter::run(Function& fn, const std::vector<Value*>& args, Value*& result) {
+    // Arguments past the eighth are not passed, the callee would read whatever is there
+    if (fn.blocks.empty() || fn.purity != Purity::PURE || args.size() != fn.args.size() ||
+        args.size() > 8 || frames.size() >= MAX_DEPTH)
+        return false;
+
+    auto frame = std::make_unique<Frame>();
+    frame->index = static_cast<int>(frames.size());
+    int64_t size = 0;
+    for (auto& slot : fn.slots) {
+        size = (size + slot->align - 1) / slot->align * slot->align;
+        frame->offsets[slot.get()] = size;
+        size += slot->size;
+    }
+    if (size > MAX_FRAME_SIZE)
+        return false;
+    frame->memory.assign(size, 0);
+
+    for (size_t i = 0; i < args.size(); i++) {
+        const Argument& arg = *fn.args[i];
+        Value* value = args[i];
+        if (value->kind == ValueKind::CONSTANT_INT)
+            value = scratch->constInt(extend(int_of(value), arg.mem));
+        frame->values[&arg] = value;
+    }
+
+    frames.push_back(std::move(frame));
+    bool ok = execute(fn, *frames.back(), result);
+    frames.pop_back();
+    return ok;
+}
+
+bool Interpreter::execute(Function& fn, Frame& frame, Value*& result) {
+    BasicBlock* from = nullptr;
+    BasicBlock* bb = fn.entry();
+
+    while (true) {
+        // Phis read their inputs along the edge just taken, all at once
+        auto it = bb->insts.begin();
+        std::vector<std::pair<const Instruction*, Value*>> incoming;
+        for (; it != bb->insts.end() && (*it)->op == Opcode::PHI; ++it) {
+            const Instruction& phi = **it;
+            auto pos = std::find(phi.blocks.begin(), phi.blocks.end(), from);
+            if (pos == phi.blocks.end())
+                return false;
+            Value* value = get(frame, phi.operands[pos - phi.blocks.begin()]);
+            if (!value)
+                return false;
+            incoming.push_back({&phi, value});
+        }
+        for (auto& [phi, value] : incoming)
+            frame.values[phi] = value;
+
+        BasicBlock* next = nullptr;
+        for (; it != bb->insts.end() && !next; ++it) {
+            const Instruction& inst = **it;
+            if (++steps > MAX_STEPS)
+                return false;
+
+            switch (inst.op) {
+            case Opcode::BR:
+                next = inst.blocks[0];
+                break;
+            case Opcode::COND_BR: {
+                Value* cond = get(frame, inst.operands[0]);
+                if (!cond || cond->kind != ValueKind::CONSTANT_INT)
+                    return false;
+                next = inst.blocks[int_of(cond) != 0 ? 0 : 1];
+                break;
+            }
+            case Opcode::RET:
+                if (inst.operands.empty()) {
+                    result = nullptr;
+                    return true;
+                }
+                result = get(frame, inst.operands[0]);
+                return result != nullptr;
+            case Opcode::UNREACHABLE:
+                return false;
+            default:
+                if (!evaluate(frame, inst))
+                    return false;
+            }
+        }
+        if (!next)
+            return false; // Fell off a block without a terminator
+        from = bb;
+        bb = next;
+    }
+}
+
+bool Interpreter::evaluate(Frame& frame, const Instruction& inst) {
+    std::vector<Value*> operands;
+    for (Value* op : inst.operands) {
+        Value* value = get(frame, op);
+        if (!value)
+            return false;
+        operands.push_back(value);
+    }
+
+    Value* value = nullptr;
+    switch (inst.op) {
+    case Opcode::FRAME_ADDR:
+        value = scratch->constInt(static_cast<int64_t>(
+            FRAME_BASE + (uint64_t(frame.index) << FRAME_BITS) + frame.offsets.at(inst.slot)));
+        break;
+
+    case Opcode::LOAD: {
+        uint8_t* p = access(operands[0], inst.mem.size);
+        if (!p)
+            return false;
+        if (inst.mem.is_float && inst.mem.size == 4) {
+            float f;
+            std::memcpy(&f, p, 4);
+            value = scratch->constFloat(f, IRType::F32);
+        } else if (inst.mem.is_float) {
+            double d;
+            std::memcpy(&d, p, 8);
+            value = scratch->constFloat(d, IRType::F64);
+        } else {
+            uint64_t raw = 0;
+            std::memcpy(&raw, p, inst.mem.size); // Both hosts and target are little endian
+            value = scratch->constInt(extend(raw, inst.mem));
+        }
+        break;
+    }
+
+    case Opcode::STORE: {
+        uint8_t* p = access(operands[1], inst.mem.size);
+        if (!p)
+            return false;
+        if (inst.mem.is_float && inst.mem.size == 4) {
+            float f = static_cast<float>(float_of(operands[0]));
+            std::memcpy(p, &f, 4);
+        } else if (inst.mem.is_float) {
+            double d = float_of(operands[0]);
+            std::memcpy(p, &d, 8);
+        } else {
+            int64_t v = int_of(operands[0]);
+            std::memcpy(p, &v, inst.mem.size);
+        }
+        return true;
+    }
+
+    case Opcode::BOUNDS_CHECK:
+        return static_cast<uint64_t>(int_of(operands[0])) < static_cast<uint64_t>(inst.imm);
+
+    case Opcode::CALL: {
+        Function* callee = mod.findFunction(inst.callee);
+        if (!callee || !run(*callee, operands, value))
+            return false;
+        if (inst.type == IRType::VOID)
+            return true;
+        break;
+    }
+
+    case Opcode::VLOAD:
+    case Opcode::VSTORE:
+    case Opcode::VSPLAT:
+    case Opcode::VREDUCE:
+    case Opcode::VWIDEN:
+    case Opcode::PROFILE_INC:
+        return false;
+
+    default:
+        if (inst.type == IRType::V128)
+            return false;
+        value = fold_constant(inst, operands, *scratch);
+        break;
+    }
+
+    if (!value)
+        return false;
+    frame.values[&inst] = value;
+    return true;
+}
+
+Value* Interpreter::get(Frame& frame, Value* v) {
+    if (v->isConstant())
+        return v;
+    auto it = frame.values.find(v);
+    return it == frame.values.end() ? nullptr : it->second;
+}
+
+// The bytes at `addr`, if it points `size` bytes into a live frame
+uint8_t* Interpreter::access(const Value* addr, int size) {
+    if (addr->kind != ValueKind::CONSTANT_INT)
+        return nullptr;
+    uint64_t a = static_cast<uint64_t>(int_of(addr));
+    if (a < FRAME_BASE)
+        return nullptr;
+    uint64_t index = (a - FRAME_BASE) >> FRAME_BITS;
+    uint64_t offset = (a - FRAME_BASE) & (MAX_FRAME_SIZE - 1);
+    if (index >= frames.size() || offset + size > frames[index]->memory.size())
+        return nullptr;
+    return frames[index]->memory.data() + offset;
+}
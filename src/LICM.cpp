@@ -0,0 +1,268 @@
+#include "Dominators.h"
+#include "LoopInfo.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+// The frame slot an address points into, when it is computed from a FRAME_ADDR by adding
+// offsets. Addresses loaded from memory or passed in as pointers have no known slot.
+static StackSlot* slot_of(const Value* addr) {
+    if (addr->kind != ValueKind::INSTRUCTION)
+        return nullptr;
+    const auto* inst = static_cast<const Instruction*>(addr);
+    switch (inst->op) {
+    case Opcode::FRAME_ADDR:
+        return inst->slot;
+    case Opcode::ADD:
+        if (StackSlot* slot = slot_of(inst->operands[0]))
+            return slot;
+        return slot_of(inst->operands[1]);
+    case Opcode::SUB:
+        return slot_of(inst->operands[0]);
+    default:
+        return nullptr;
+    }
+}
+
+// Slots whose address is used for anything but loads, stores and further address
+// arithmetic: passed to a call, stored, compared or merged in a phi. Stores through
+// unknown pointers and calls may write to these.
+static std::unordered_set<StackSlot*> escaped_slots(Function& fn) {
+    std::unordered_set<StackSlot*> escaped;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            for (size_t i = 0; i < inst->operands.size(); i++) {
+                StackSlot* slot = slot_of(inst->operands[i]);
+                if (!slot)
+                    continue;
+                bool address_use = (inst->op == Opcode::LOAD && i == 0) ||
+                                   (inst->op == Opcode::STORE && i == 1) ||
+                                   inst->op == Opcode::ADD || inst->op == Opcode::SUB;
+                if (!address_use)
+                    escaped.insert(slot);
+            }
+        }
+    }
+    return escaped;
+}
+
+// What the blocks of a loop may write to
+struct LoopWrites {
+    std::unordered_set<StackSlot*> slots;
+    bool unknown = false; // Stores through pointers of unknown origin, or impure calls
+
+    bool clobbers(StackSlot* slot, const std::unordered_set<StackSlot*>& escaped) const {
+        return slots.count(slot) || (unknown && escaped.count(slot));
+    }
+};
+
+static LoopWrites writes_of(const Loop& loop) {
+    LoopWrites writes;
+    for (BasicBlock* bb : loop.blocks) {
+        for (auto& inst : bb->insts) {
+            if (inst->op == Opcode::CALL) {
+                Function* callee = bb->parent->parent->findFunction(inst->callee);
+                if (!callee || callee->purity == Purity::IMPURE)
+                    writes.unknown = true;
+            } else if (inst->op == Opcode::STORE) {
+                if (StackSlot* slot = slot_of(inst->operands[1]))
+                    writes.slots.insert(slot);
+                else
+                    writes.unknown = true;
+            }
+        }
+    }
+    return writes;
+}
+
+static bool is_const_int(const Value* v) {
+    return v->kind == ValueKind::CONSTANT_INT;
+}
+
+// Instruction selection folds a single-use value into its user when it fits an operand of
+// the user's instruction: frame addresses and constant offsets into addressing modes,
+// multiplies into madd / msub, shifts by a constant into shifted register operands. Such a
+// value costs nothing inside the loop, hoisting it alone would only tie up a register.
+static bool folds_into(const Instruction& inst, const Instruction& user, size_t index) {
+    bool address = (user.op == Opcode::LOAD && index == 0) || (user.op == Opcode::STORE && index == 1);
+    switch (inst.op) {
+    case Opcode::FRAME_ADDR:
+        return address || (user.op == Opcode::ADD && index == 0 && is_const_int(user.operands[1]));
+    case Opcode::ADD:
+        return address;
+    case Opcode::MUL:
+        return user.op == Opcode::ADD || (user.op == Opcode::SUB && index == 1);
+    case Opcode::SHL:
+    case Opcode::LSHR:
+    case Opcode::ASHR:
+        if (!is_const_int(inst.operands[1]))
+            return false;
+        switch (user.op) {
+        case Opcode::ADD:
+        case Opcode::AND:
+        case Opcode::OR:
+        case Opcode::XOR:
+            return true;
+        case Opcode::SUB:
+            return index == 1;
+        default:
+            return false;
+        }
+    default:
+        return false;
+    }
+}
+
+// A load that reads a fixed location inside a frame slot, so executing it early can never
+// fault, even when the loop body would not have run
+static StackSlot* fixed_slot_location(const Instruction& load) {
+    const Value* addr = load.operands[0];
+    if (addr->kind != ValueKind::INSTRUCTION)
+        return nullptr;
+    const auto* inst = static_cast<const Instruction*>(addr);
+
+    int64_t offset = 0;
+    if (inst->op == Opcode::ADD && inst->operands[1]->kind == ValueKind::CONSTANT_INT &&
+        inst->operands[0]->kind == ValueKind::INSTRUCTION) {
+        offset = static_cast<const ConstantInt*>(inst->operands[1])->value;
+        inst = static_cast<const Instruction*>(inst->operands[0]);
+    }
+    if (inst->op != Opcode::FRAME_ADDR || offset < 0 || offset + load.mem.size > inst->slot->size)
+        return nullptr;
+    return inst->slot;
+}
+
+static bool is_hoistable(const Instruction& inst) {
+    switch (inst.op) {
+    case Opcode::PHI:
+    case Opcode::LOAD: // Depends on the writes in the loop, checked separately
+    case Opcode::STORE:
+    case Opcode::BOUNDS_CHECK:
+    case Opcode::PROFILE_INC:
+    case Opcode::CALL:
+        return false;
+    default:
+        // Division by zero does not trap on AArch64, so the arithmetic can run speculatively
+        return !inst.isTerminator();
+    }
+}
+
+// Whether two hoistable instructions compute the same value, such as the FRAME_ADDR of one
+// slot taken separately for each access to it
+static bool same_computation(const Instruction& a, const Instruction& b) {
+    return a.op == b.op && a.type == b.type && a.operands == b.operands && a.cond == b.cond &&
+           a.mem == b.mem && a.slot == b.slot && a.imm == b.imm;
+}
+
+// An instruction already in the preheader computing what `inst` computes
+static Instruction* hoisted_equivalent(const Instruction& inst, BasicBlock* pre) {
+    for (auto& other : pre->insts) {
+        if (other->op != Opcode::LOAD && is_hoistable(*other) && same_computation(*other, inst))
+            return other.get();
+    }
+    return nullptr;
+}
+
+bool LICMPass::runOnFunction(Function& fn) {
+    if (fn.blocks.empty())
+        return false;
+    fn.rebuildCFG();
+
+    bool changed = false;
+    {
+        DominatorTree dt(fn);
+        LoopInfo loops(dt);
+        if (loops.loops().empty())
+            return false;
+        for (auto& loop : loops.loops()) {
+            if (!loop->preheader()) {
+                ensure_preheader(fn, *loop);
+                changed = true;
+            }
+        }
+    }
+
+    DominatorTree dt(fn);
+    LoopInfo loops(dt);
+    std::unordered_set<StackSlot*> escaped = escaped_slots(fn);
+
+    std::unordered_map<const Instruction*, std::vector<std::pair<Instruction*, size_t>>> users;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            for (size_t i = 0; i < inst->operands.size(); i++) {
+                if (inst->operands[i]->kind == ValueKind::INSTRUCTION)
+                    users[static_cast<Instruction*>(inst->operands[i])].push_back({inst.get(), i});
+            }
+        }
+    }
+
+    // Innermost loops first, so what leaves an inner loop can move on out of the outer one
+    const auto& all = loops.loops();
+    for (auto it = all.rbegin(); it != all.rend(); ++it) {
+        Loop& loop = **it;
+        BasicBlock* pre = loop.preheader();
+        if (!pre)
+            continue;
+        LoopWrites writes = writes_of(loop);
+
+        // Reverse post-order sees definitions before their uses, so whole chains of invariant
+        // instructions are found in one sweep
+        std::unordered_set<const Instruction*> invariant;
+        std::vector<Instruction*> order;
+        auto is_invariant = [&](const Value* v) {
+            return loop.isInvariant(v) || invariant.count(static_cast<const Instruction*>(v));
+        };
+        for (BasicBlock* bb : loop.blocks) {
+            for (auto& inst : bb->insts) {
+                bool operands = std::all_of(inst->operands.begin(), inst->operands.end(), is_invariant);
+                if (inst->op == Opcode::LOAD) {
+                    StackSlot* slot = fixed_slot_location(*inst);
+                    if (!operands || !slot || writes.clobbers(slot, escaped))
+                        continue;
+                } else if (!operands || !is_hoistable(*inst)) {
+                    continue;
+                }
+                invariant.insert(inst.get());
+                order.push_back(inst.get());
+            }
+        }
+
+        // Users come later in the order, so deciding backwards knows whether the single
+        // user of a foldable value leaves the loop as well
+        std::unordered_set<const Instruction*> hoisted;
+        for (auto inst = order.rbegin(); inst != order.rend(); ++inst) {
+            const auto& uses = users[*inst];
+            if (uses.size() == 1 && !hoisted.count(uses[0].first) &&
+                folds_into(**inst, *uses[0].first, uses[0].second))
+                continue;
+            hoisted.insert(*inst);
+        }
+        // An invariant computed again by another access reuses the hoisted copy instead of
+        // holding a second register across the loop. Operands are merged before their users,
+        // so whole address chains collapse.
+        for (Instruction* inst : order) {
+            if (!hoisted.count(inst))
+                continue;
+            changed = true;
+            Instruction* existing = inst->op == Opcode::LOAD ? nullptr : hoisted_equivalent(*inst, pre);
+            if (!existing) {
+                hoist_to_preheader(inst, pre);
+                continue;
+            }
+            fn.replaceAllUses(inst, existing);
+            auto& moved = users[inst];
+            users[existing].insert(users[existing].end(), moved.begin(), moved.end());
+            users.erase(inst);
+            for (const Value* op : inst->operands) {
+                if (op->kind != ValueKind::INSTRUCTION)
+                    continue;
+                auto& op_users = users[static_cast<const Instruction*>(op)];
+                std::erase_if(op_users, [inst](const auto& use) { return use.first == inst; });
+            }
+            inst->parent->erase(inst);
+        }
+    }
+    return changed;
+}
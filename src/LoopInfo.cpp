@@ -0,0 +1,165 @@
+#include "LoopInfo.h"
+
+#include <algorithm>
+
+// Loop
+
+bool Loop::isInvariant(const Value* v) const {
+    if (v->kind != ValueKind::INSTRUCTION)
+        return true;
+    return !contains(static_cast<const Instruction*>(v)->parent);
+}
+
+BasicBlock* Loop::preheader() const {
+    BasicBlock* entering = nullptr;
+    for (BasicBlock* pred : header->preds) {
+        if (contains(pred))
+            continue;
+        if (entering && entering != pred)
+            return nullptr;
+        entering = pred;
+    }
+    if (!entering || entering->successors().size() != 1)
+        return nullptr;
+    return entering;
+}
+
+// LoopInfo
+
+LoopInfo::LoopInfo(const DominatorTree& dt) {
+    std::unordered_map<BasicBlock*, Loop*> by_header;
+
+    for (BasicBlock* bb : dt.rpo()) {
+        for (BasicBlock* succ : bb->successors()) {
+            if (!dt.dominates(succ, bb))
+                continue;
+
+            // bb -> succ is a back edge
+            Loop*& loop = by_header[succ];
+            if (!loop) {
+                all.push_back(std::make_unique<Loop>());
+                loop = all.back().get();
+                loop->header = succ;
+                loop->block_set.insert(succ);
+            }
+            if (std::find(loop->latches.begin(), loop->latches.end(), bb) == loop->latches.end())
+                loop->latches.push_back(bb);
+
+            std::vector<BasicBlock*> work = {bb};
+            while (!work.empty()) {
+                BasicBlock* current = work.back();
+                work.pop_back();
+                if (!dt.isReachable(current) || !loop->block_set.insert(current).second)
+                    continue;
+                for (BasicBlock* pred : current->preds)
+                    work.push_back(pred);
+            }
+        }
+    }
+
+    for (auto& loop : all) {
+        loop->blocks.push_back(loop->header);
+        for (BasicBlock* bb : dt.rpo()) {
+            if (bb != loop->header && loop->contains(bb))
+                loop->blocks.push_back(bb);
+        }
+    }
+
+    // A loop nested in another one has strictly fewer blocks
+    std::stable_sort(all.begin(), all.end(), [](const auto& a, const auto& b) {
+        return a->blocks.size() > b->blocks.size();
+    });
+
+    for (size_t i = 0; i < all.size(); i++) {
+        Loop* loop = all[i].get();
+        for (size_t j = 0; j < i; j++) {
+            Loop* outer = all[j].get();
+            if (outer->contains(loop->header) &&
+                (!loop->parent || outer->blocks.size() < loop->parent->blocks.size()))
+                loop->parent = outer;
+        }
+        if (loop->parent) {
+            loop->parent->children.push_back(loop);
+            loop->depth = loop->parent->depth + 1;
+        }
+        for (BasicBlock* bb : loop->blocks)
+            innermost[bb] = loop;
+    }
+}
+
+Loop* LoopInfo::loopFor(const BasicBlock* bb) const {
+    auto it = innermost.find(bb);
+    return it == innermost.end() ? nullptr : it->second;
+}
+
+BasicBlock* ensure_preheader(Function& fn, Loop& loop) {
+    if (BasicBlock* existing = loop.preheader())
+        return existing;
+
+    BasicBlock* header = loop.header;
+    std::vector<BasicBlock*> entering;
+    for (BasicBlock* pred : header->preds) {
+        if (!loop.contains(pred) &&
+            std::find(entering.begin(), entering.end(), pred) == entering.end())
+            entering.push_back(pred);
+    }
+
+    // Laid out right before the header, so entering the loop falls through
+    BasicBlock* pre = fn.createBlock(header->name + ".preheader");
+    auto it = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                           [pre](const auto& b) { return b.get() == pre; });
+    std::unique_ptr<BasicBlock> owned = std::move(*it);
+    fn.blocks.erase(it);
+    it = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                      [header](const auto& b) { return b.get() == header; });
+    fn.blocks.insert(it, std::move(owned));
+
+    for (auto& inst : header->insts) {
+        if (inst->op != Opcode::PHI)
+            break;
+
+        std::vector<size_t> outside;
+        for (size_t i = 0; i < inst->blocks.size(); i++) {
+            if (!loop.contains(inst->blocks[i]))
+                outside.push_back(i);
+        }
+        if (outside.size() == 1) {
+            inst->blocks[outside[0]] = pre;
+            continue;
+        }
+
+        auto merged = std::make_unique<Instruction>(Opcode::PHI, inst->type);
+        for (size_t i : outside) {
+            merged->operands.push_back(inst->operands[i]);
+            merged->blocks.push_back(inst->blocks[i]);
+        }
+        for (size_t i = outside.size(); i-- > 0;) {
+            inst->operands.erase(inst->operands.begin() + outside[i]);
+            inst->blocks.erase(inst->blocks.begin() + outside[i]);
+        }
+        inst->operands.push_back(pre->append(std::move(merged)));
+        inst->blocks.push_back(pre);
+    }
+
+    for (BasicBlock* pred : entering) {
+        for (BasicBlock*& target : pred->terminator()->blocks) {
+            if (target == header)
+                target = pre;
+        }
+    }
+
+    auto br = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+    br->blocks.push_back(header);
+    pre->append(std::move(br));
+
+    fn.rebuildCFG();
+    return pre;
+}
+
+void hoist_to_preheader(Instruction* inst, BasicBlock* preheader) {
+    BasicBlock* from = inst->parent;
+    auto it = from->find(inst);
+    std::unique_ptr<Instruction> moved = std::move(*it);
+    from->insts.erase(it);
+    preheader->insertBeforeTerminator(std::move(moved));
+}
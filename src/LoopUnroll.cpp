@@ -0,0 +1,162 @@
+#include "Dominators.h"
+#include "LoopInfo.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+// Iterations per entry into the loop from which it is unrolled, and the largest body
+// copied, in IR instructions besides phis
+static constexpr double MIN_TRIP_COUNT = 16.0;
+static constexpr int MAX_BODY_SIZE = 32;
+
+static Value* incoming(const Instruction* phi, const BasicBlock* from) {
+    auto it = std::find(phi->blocks.begin(), phi->blocks.end(), from);
+    return phi->operands[it - phi->blocks.begin()];
+}
+
+// Executions of the blocks entering the loop, -1 if one of them has no count. Rotation
+// leaves a guard in front of the loop, so this counts the times the loop may be entered.
+static int64_t entry_count(const Loop& loop) {
+    int64_t entries = 0;
+    for (BasicBlock* pred : loop.header->preds) {
+        if (loop.contains(pred))
+            continue;
+        if (pred->profile_count < 0)
+            return -1;
+        entries += pred->profile_count;
+    }
+    return entries;
+}
+
+static bool should_unroll(const Loop& loop) {
+    BasicBlock* header = loop.header;
+    if (!loop.children.empty() || loop.blocks.size() != 1 || header->profile_count < 0)
+        return false;
+    Instruction* term = header->terminator();
+    if (term->op != Opcode::COND_BR || (term->blocks[0] == header) == (term->blocks[1] == header))
+        return false;
+
+    int size = 0;
+    for (auto& inst : header->insts)
+        size += inst->op != Opcode::PHI;
+    if (size > MAX_BODY_SIZE)
+        return false;
+
+    int64_t entries = entry_count(loop);
+    return entries > 0 && static_cast<double>(header->profile_count) / entries >= MIN_TRIP_COUNT;
+}
+
+// `header: phis, body, branch back to header or out` becomes `header: phis, body, branch
+// on to copy or out` followed by `copy: body, branch back to header or out`. Values of the
+// header used after the loop get a phi in the exit block when nothing else enters it.
+static bool unroll(Function& fn, BasicBlock* header) {
+    Instruction* term = header->terminator();
+    BasicBlock* exit = term->blocks[0] == header ? term->blocks[1] : term->blocks[0];
+
+    // Uses after the loop other than the exit phis, which the header dominates only when
+    // it is the exit's single predecessor
+    std::vector<Value**> outside;
+    for (auto& bb : fn.blocks) {
+        if (bb.get() == header)
+            continue;
+        for (auto& inst : bb->insts) {
+            if (bb.get() == exit && inst->op == Opcode::PHI)
+                continue;
+            for (Value*& op : inst->operands) {
+                if (op->kind == ValueKind::INSTRUCTION &&
+                    static_cast<Instruction*>(op)->parent == header)
+                    outside.push_back(&op);
+            }
+        }
+    }
+    if (!outside.empty() && exit->preds.size() != 1)
+        return false;
+
+    BasicBlock* copy = fn.createBlock(header->name + ".unrolled");
+    auto pos = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                            [header](const auto& b) { return b.get() == header; });
+    std::rotate(pos + 1, fn.blocks.end() - 1, fn.blocks.end());
+
+    // In the second copy a phi holds what the first one passes along the back edge
+    std::unordered_map<const Value*, Value*> values;
+    for (auto& inst : header->insts) {
+        if (inst->op == Opcode::PHI)
+            values[inst.get()] = incoming(inst.get(), header);
+    }
+    auto map = [&](Value* v) {
+        auto it = values.find(v);
+        return it == values.end() ? v : it->second;
+    };
+    std::vector<Instruction*> phis;
+    for (auto& inst : header->insts) {
+        if (inst->op == Opcode::PHI) {
+            phis.push_back(inst.get());
+            continue;
+        }
+        auto clone = std::make_unique<Instruction>(inst->op, inst->type);
+        for (Value* op : inst->operands)
+            clone->operands.push_back(map(op));
+        clone->blocks = inst->blocks;
+        clone->cond = inst->cond;
+        clone->mem = inst->mem;
+        clone->slot = inst->slot;
+        clone->callee = inst->callee;
+        clone->imm = inst->imm;
+        clone->taken = inst->taken;
+        values[inst.get()] = copy->append(std::move(clone));
+    }
+
+    std::replace(term->blocks.begin(), term->blocks.end(), header, copy);
+    for (Instruction* phi : phis) {
+        auto it = std::find(phi->blocks.begin(), phi->blocks.end(), header);
+        size_t i = it - phi->blocks.begin();
+        phi->operands[i] = map(phi->operands[i]);
+        phi->blocks[i] = copy;
+    }
+
+    for (auto& inst : exit->insts) {
+        if (inst->op != Opcode::PHI)
+            break;
+        inst->operands.push_back(map(incoming(inst.get(), header)));
+        inst->blocks.push_back(copy);
+    }
+    std::unordered_map<Value*, Instruction*> merged;
+    for (Value** use : outside) {
+        Instruction*& phi = merged[*use];
+        if (!phi) {
+            auto inst = std::make_unique<Instruction>(Opcode::PHI, (*use)->type);
+            inst->operands = {*use, map(*use)};
+            inst->blocks = {header, copy};
+            phi = exit->insertAtFront(std::move(inst));
+        }
+        *use = phi;
+    }
+
+    // Each copy runs about every other iteration
+    copy->profile_count = header->profile_count / 2;
+    header->profile_count -= copy->profile_count;
+    fn.rebuildCFG();
+    return true;
+}
+
+bool LoopUnrollPass::runOnFunction(Function& fn) {
+    if (fn.blocks.empty())
+        return false;
+    fn.rebuildCFG();
+
+    std::vector<BasicBlock*> headers;
+    {
+        DominatorTree dt(fn);
+        LoopInfo loops(dt);
+        for (auto& loop : loops.loops()) {
+            if (should_unroll(*loop))
+                headers.push_back(loop->header);
+        }
+    }
+
+    bool changed = false;
+    for (BasicBlock* header : headers)
+        changed |= unroll(fn, header);
+    return changed;
+}
@@ -0,0 +1,739 @@
+#include "CompilerContext.h"
+#include "ConstantFold.h"
+#include "Dominators.h"
+#include "LoopInfo.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// An address computed as FRAME_ADDR(slot) + coef * iv + offset
+struct Affine {
+    StackSlot* slot = nullptr;
+    int64_t coef = 0;
+    int64_t offset = 0;
+};
+
+struct Access {
+    Instruction* inst;
+    Affine addr;
+    size_t position; // Index in the loop body
+};
+
+// s = phi [init, preheader], [s + x, body] where s has no other use in the loop. The lanes
+// accumulate separate partial sums that are added together once the vector loop is done.
+struct Reduction {
+    Instruction* phi;
+    Instruction* add;    // The ADD / FADD of the phi and the term
+    Instruction* update; // What flows back into the phi: the add, or its re-extension
+    Value* term;
+    bool narrow = false; // A 32-bit sum, accumulated in 32-bit lanes
+    bool widen = false;  // 32-bit terms of a 64-bit sum, pairs added into 64-bit lanes
+    MemType lane;        // Lanes of the accumulator
+};
+
+// How a value of the loop body exists in the vector loop
+enum class Shape {
+    UNIFORM, // The same scalar for every lane: invariants and arithmetic on them
+    INDEX,   // A scalar following the induction variable, only usable in addresses
+    VECTOR,  // One value per lane
+};
+
+bool is_const_int(const Value* v) {
+    return v->kind == ValueKind::CONSTANT_INT;
+}
+
+int64_t const_value(const Value* v) {
+    return static_cast<const ConstantInt*>(v)->value;
+}
+
+bool is_float_op(Opcode op) {
+    switch (op) {
+    case Opcode::FADD:
+    case Opcode::FSUB:
+    case Opcode::FMUL:
+    case Opcode::FDIV:
+    case Opcode::FNEG:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_int_op(Opcode op) {
+    switch (op) {
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+    case Opcode::NEG:
+    case Opcode::SHL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Scalar arithmetic that may be recomputed once per vector iteration
+bool is_clonable(const Instruction& inst) {
+    switch (inst.op) {
+    case Opcode::PHI:
+    case Opcode::LOAD:
+    case Opcode::CALL:
+        return false;
+    default:
+        return !inst.hasSideEffects();
+    }
+}
+
+void place_before(Function& fn, BasicBlock* bb, BasicBlock* pos) {
+    auto it = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                           [bb](const auto& b) { return b.get() == bb; });
+    std::unique_ptr<BasicBlock> owned = std::move(*it);
+    fn.blocks.erase(it);
+    it = std::find_if(fn.blocks.begin(), fn.blocks.end(),
+                      [pos](const auto& b) { return b.get() == pos; });
+    fn.blocks.insert(it, std::move(owned));
+}
+
+class LoopVectorizer {
+  public:
+    LoopVectorizer(Function& p_fn, Loop& p_loop, const CompilerOptions& p_options)
+        : fn(p_fn), loop(p_loop), options(p_options) {}
+
+    // Rewrites the loop if it has the right shape and the vector version is cheaper
+    bool run();
+
+  private:
+    Function& fn;
+    Loop& loop;
+    const CompilerOptions& options;
+
+    BasicBlock* header = nullptr;
+    BasicBlock* body = nullptr;
+    BasicBlock* pre = nullptr;
+    Instruction* iv = nullptr;
+    Instruction* step = nullptr;
+    int64_t start = 0;
+    int64_t trip = 0;
+
+    int lane_size = 0;
+    std::vector<Reduction> reductions;
+    std::unordered_map<const Value*, Shape> shapes;
+    std::unordered_map<const Value*, const Value*> aliases; // Re-extensions that are no-ops on lanes
+    std::unordered_set<const Instruction*> reduction_insts;
+    std::vector<Access> accesses;
+
+    // Vector loop under construction
+    std::unordered_map<const Value*, Value*> scalars;
+    std::unordered_map<const Value*, Value*> vectors;
+    std::unordered_map<const Value*, Value*> splats;
+    BasicBlock* vbody = nullptr;
+
+    bool matchShape();
+    bool matchReductions();
+    bool classify();
+    bool checkDependences() const;
+    bool profitable() const;
+    void transform();
+
+    int usesInLoop(const Value* v) const;
+    Shape shapeOf(const Value* v) const;
+    std::optional<Affine> affine(const Value* v) const;
+    bool requireLane(int size);
+    MemType laneOf(IRType t) const;
+
+    Instruction* emit(BasicBlock* bb, Opcode op, IRType type, std::vector<Value*> operands,
+                      MemType mem = {});
+    Value* scalar(const Value* v);
+    Value* vector(const Value* v, IRType lane_type);
+};
+
+int LoopVectorizer::usesInLoop(const Value* v) const {
+    int count = 0;
+    for (BasicBlock* bb : loop.blocks) {
+        for (auto& inst : bb->insts)
+            count += static_cast<int>(std::count(inst->operands.begin(), inst->operands.end(), v));
+    }
+    return count;
+}
+
+// i = phi [start, preheader], [i + 1, body] in a header holding nothing but the phis and
+// the comparison of i against a constant end
+bool LoopVectorizer::matchShape() {
+    if (loop.blocks.size() != 2 || loop.latches.size() != 1 || !loop.children.empty())
+        return false;
+    header = loop.header;
+    body = loop.latches[0];
+    pre = loop.preheader();
+    if (!pre || body == header)
+        return false;
+
+    Instruction* br = header->terminator();
+    Instruction* back = body->terminator();
+    if (!br || br->op != Opcode::COND_BR || br->blocks[0] != body || loop.contains(br->blocks[1]))
+        return false;
+    if (!back || back->op != Opcode::BR || back->blocks[0] != header)
+        return false;
+
+    auto* cmp = br->operands[0]->kind == ValueKind::INSTRUCTION
+                    ? static_cast<Instruction*>(br->operands[0])
+                    : nullptr;
+    if (!cmp || cmp->op != Opcode::ICMP || cmp->parent != header || usesInLoop(cmp) != 1 ||
+        fn.countUses(cmp) != 1 || !is_const_int(cmp->operands[1]))
+        return false;
+    for (auto& inst : header->insts) {
+        if (inst->op != Opcode::PHI && inst.get() != cmp && inst.get() != br)
+            return false;
+    }
+
+    if (cmp->operands[0]->kind != ValueKind::INSTRUCTION)
+        return false;
+    iv = static_cast<Instruction*>(cmp->operands[0]);
+    if (iv->op != Opcode::PHI || iv->parent != header || iv->operands.size() != 2)
+        return false;
+    size_t entry = iv->blocks[0] == pre ? 0 : 1;
+    if (iv->blocks[entry] != pre || iv->blocks[1 - entry] != body || !is_const_int(iv->operands[entry]))
+        return false;
+    start = const_value(iv->operands[entry]);
+
+    Value* next = iv->operands[1 - entry];
+    if (next->kind != ValueKind::INSTRUCTION)
+        return false;
+    step = static_cast<Instruction*>(next);
+    if (step->op != Opcode::ADD || step->parent != body || step->operands[0] != iv ||
+        !is_const_int(step->operands[1]) || const_value(step->operands[1]) != 1 ||
+        fn.countUses(step) != 1)
+        return false;
+
+    int64_t limit = const_value(cmp->operands[1]);
+    int64_t end;
+    switch (cmp->cond) {
+    case Cond::LT:
+        end = limit;
+        break;
+    case Cond::LE:
+        if (limit == INT64_MAX)
+            return false;
+        end = limit + 1;
+        break;
+    case Cond::NE:
+        if (start > limit)
+            return false;
+        end = limit;
+        break;
+    case Cond::ULT:
+        if (start < 0 || limit < 0)
+            return false;
+        end = limit;
+        break;
+    default:
+        return false;
+    }
+    return !__builtin_sub_overflow(end, start, &trip) && trip > 0;
+}
+
+bool LoopVectorizer::matchReductions() {
+    for (auto& inst : header->insts) {
+        if (inst->op != Opcode::PHI)
+            break;
+        if (inst.get() == iv)
+            continue;
+
+        Instruction* phi = inst.get();
+        if (phi->operands.size() != 2)
+            return false;
+        size_t back = phi->blocks[0] == body ? 0 : 1;
+        if (phi->blocks[back] != body || phi->operands[back]->kind != ValueKind::INSTRUCTION)
+            return false;
+
+        Reduction red;
+        red.phi = phi;
+        red.update = static_cast<Instruction*>(phi->operands[back]);
+        red.add = red.update;
+        if ((red.update->op == Opcode::SEXT || red.update->op == Opcode::ZEXT) &&
+            red.update->mem.size == 4 && red.update->operands[0]->kind == ValueKind::INSTRUCTION) {
+            red.add = static_cast<Instruction*>(red.update->operands[0]);
+            red.narrow = true;
+        }
+        if (red.add->parent != body || (red.add->op != Opcode::ADD && red.add->op != Opcode::FADD))
+            return false;
+        if (red.add->op == Opcode::FADD && !options.fast_math)
+            return false;
+        if (red.add->operands[0] == phi)
+            red.term = red.add->operands[1];
+        else if (red.add->operands[1] == phi)
+            red.term = red.add->operands[0];
+        else
+            return false;
+
+        // Nothing but the chain may see the partial sums
+        if (usesInLoop(phi) != 1 || usesInLoop(red.add) != 1 ||
+            (red.narrow && usesInLoop(red.update) != 1))
+            return false;
+
+        reduction_insts.insert(red.add);
+        reduction_insts.insert(red.update);
+        reductions.push_back(red);
+    }
+    return true;
+}
+
+Shape LoopVectorizer::shapeOf(const Value* v) const {
+    if (v == iv)
+        return Shape::INDEX;
+    if (loop.isInvariant(v))
+        return Shape::UNIFORM;
+    auto it = shapes.find(v);
+    return it == shapes.end() ? Shape::VECTOR : it->second;
+}
+
+// The frame slot, stride and offset of an address, when it is affine in the induction variable
+std::optional<Affine> LoopVectorizer::affine(const Value* v) const {
+    if (v == iv)
+        return Affine{nullptr, 1, 0};
+    if (is_const_int(v))
+        return Affine{nullptr, 0, const_value(v)};
+    if (v->kind != ValueKind::INSTRUCTION)
+        return std::nullopt;
+
+    const auto* inst = static_cast<const Instruction*>(v);
+    if (inst->op == Opcode::FRAME_ADDR)
+        return Affine{inst->slot, 0, 0};
+    if (inst->op != Opcode::ADD && inst->op != Opcode::SUB && inst->op != Opcode::SHL &&
+        inst->op != Opcode::MUL)
+        return std::nullopt;
+
+    auto lhs = affine(inst->operands[0]);
+    auto rhs = affine(inst->operands[1]);
+    if (!lhs || !rhs)
+        return std::nullopt;
+
+    Affine result;
+    switch (inst->op) {
+    case Opcode::ADD:
+        if (lhs->slot && rhs->slot)
+            return std::nullopt;
+        result = {lhs->slot ? lhs->slot : rhs->slot, lhs->coef + rhs->coef, lhs->offset + rhs->offset};
+        break;
+    case Opcode::SUB:
+        if (rhs->slot)
+            return std::nullopt;
+        result = {lhs->slot, lhs->coef - rhs->coef, lhs->offset - rhs->offset};
+        break;
+    case Opcode::SHL:
+        if (lhs->slot || rhs->slot || rhs->coef != 0 || rhs->offset < 0 || rhs->offset > 16)
+            return std::nullopt;
+        result = {nullptr, lhs->coef << rhs->offset, lhs->offset << rhs->offset};
+        break;
+    default: // MUL
+        if (lhs->slot || rhs->slot || (lhs->coef != 0 && rhs->coef != 0))
+            return std::nullopt;
+        if (rhs->coef != 0)
+            std::swap(lhs, rhs);
+        result = {nullptr, lhs->coef * rhs->offset, lhs->offset * rhs->offset};
+        break;
+    }
+    return result;
+}
+
+bool LoopVectorizer::requireLane(int size) {
+    if (size != 4 && size != 8)
+        return false;
+    if (lane_size == 0)
+        lane_size = size;
+    return lane_size == size;
+}
+
+MemType LoopVectorizer::laneOf(IRType t) const {
+    switch (t) {
+    case IRType::F32:
+        return {4, true, true};
+    case IRType::F64:
+        return {8, true, true};
+    default:
+        return {lane_size, true, false};
+    }
+}
+
+// Decides the shape of every value in the body, bailing out on anything without a
+// lane-wise equivalent
+bool LoopVectorizer::classify() {
+    bool uses_mul = false;
+    std::vector<const Instruction*> shifts, extensions;
+
+    size_t position = 0;
+    for (auto& owned : body->insts) {
+        Instruction* inst = owned.get();
+        position++;
+        if (inst->isTerminator() || inst == step || reduction_insts.count(inst))
+            continue;
+
+        bool any_vector = false, any_index = false;
+        for (const Value* v : inst->operands) {
+            if (std::any_of(reductions.begin(), reductions.end(),
+                            [v](const Reduction& r) { return r.phi == v; }))
+                return false;
+            Shape s = shapeOf(v);
+            any_vector |= s == Shape::VECTOR;
+            any_index |= s == Shape::INDEX;
+        }
+
+        if (inst->op == Opcode::LOAD || inst->op == Opcode::STORE) {
+            const Value* addr = inst->operands[inst->op == Opcode::LOAD ? 0 : 1];
+            auto a = affine(addr);
+            if (shapeOf(addr) == Shape::VECTOR || !a || !a->slot || a->coef != inst->mem.size ||
+                !requireLane(inst->mem.size))
+                return false;
+            if (inst->op == Opcode::STORE && shapeOf(inst->operands[0]) == Shape::INDEX)
+                return false;
+            accesses.push_back({inst, *a, position});
+            if (inst->op == Opcode::LOAD)
+                shapes[inst] = Shape::VECTOR;
+            continue;
+        }
+
+        if (!any_vector) {
+            if (!is_clonable(*inst))
+                return false;
+            shapes[inst] = any_index ? Shape::INDEX : Shape::UNIFORM;
+            continue;
+        }
+
+        // Lane-wise operations; scalars feeding them must be the same for every lane
+        if (any_index)
+            return false;
+        if ((inst->op == Opcode::SEXT || inst->op == Opcode::ZEXT) && inst->mem.size >= 4) {
+            extensions.push_back(inst);
+            aliases[inst] = inst->operands[0];
+        } else if (is_float_op(inst->op)) {
+            if (!requireLane(inst->type == IRType::F32 ? 4 : 8))
+                return false;
+        } else if (is_int_op(inst->op)) {
+            if (inst->op == Opcode::MUL)
+                uses_mul = true;
+            if (inst->op == Opcode::SHL) {
+                if (!is_const_int(inst->operands[1]))
+                    return false;
+                shifts.push_back(inst);
+            }
+        } else {
+            return false;
+        }
+        shapes[inst] = Shape::VECTOR;
+    }
+
+    if (lane_size == 0 || accesses.empty())
+        return false;
+    // NEON has no multiply of 64-bit lanes
+    if (uses_mul && lane_size == 8)
+        return false;
+    for (const Instruction* shift : shifts) {
+        int64_t amount = const_value(shift->operands[1]);
+        if (amount < 0 || amount >= lane_size * 8)
+            return false;
+    }
+    // Re-extending the low bits a lane keeps changes nothing, narrower ones would
+    for (const Instruction* ext : extensions) {
+        if (ext->mem.size != lane_size)
+            return false;
+    }
+
+    for (Reduction& red : reductions) {
+        if (shapeOf(red.term) != Shape::VECTOR)
+            return false;
+        if (red.add->op == Opcode::FADD) {
+            if (red.narrow || !requireLane(red.phi->type == IRType::F32 ? 4 : 8))
+                return false;
+            red.lane = laneOf(red.phi->type);
+        } else if (lane_size == 8) {
+            if (red.narrow)
+                return false;
+            red.lane = {8, true, false};
+        } else if (red.narrow) {
+            red.lane = {4, red.update->op == Opcode::SEXT, false};
+        } else {
+            // Each term has to be the extension of its 32-bit lane for the pairwise widening
+            const auto* term = static_cast<const Instruction*>(red.term);
+            bool is_signed;
+            if (term->op == Opcode::LOAD && term->mem.size == 4 && !term->mem.is_float)
+                is_signed = term->mem.is_signed;
+            else if ((term->op == Opcode::SEXT || term->op == Opcode::ZEXT) && term->mem.size == 4)
+                is_signed = term->op == Opcode::SEXT;
+            else
+                return false;
+            red.widen = true;
+            red.lane = {4, is_signed, false};
+        }
+    }
+    return true;
+}
+
+// Loads and stores of one vector iteration happen together, in the order of the body. That
+// is only the scalar order when no store lands on an element loaded by a later iteration of
+// the same vector iteration.
+bool LoopVectorizer::checkDependences() const {
+    int vf = 16 / lane_size;
+    for (const Access& store : accesses) {
+        if (store.inst->op != Opcode::STORE)
+            continue;
+        for (const Access& other : accesses) {
+            if (other.addr.slot != store.addr.slot || &other == &store)
+                continue;
+            if (other.inst->mem != store.inst->mem)
+                return false;
+            int64_t distance = store.addr.offset - other.addr.offset;
+            if (distance % store.inst->mem.size != 0)
+                return false;
+            distance /= store.inst->mem.size;
+
+            if (other.inst->op == Opcode::STORE) {
+                if (distance != 0)
+                    return false;
+            } else if (distance > 0 && distance < vf) {
+                // Reads what an earlier iteration of the same vector iteration stores
+                return false;
+            } else if (distance < 0 && -distance < vf && other.position > store.position) {
+                // Would read what a later iteration stores
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Counts IR instructions as a stand-in for machine instructions on both sides
+bool LoopVectorizer::profitable() const {
+    int64_t vf = 16 / lane_size;
+    int64_t scalar_cost = static_cast<int64_t>(body->insts.size() + header->insts.size());
+
+    int64_t vector_cost = 3 + static_cast<int64_t>(reductions.size());
+    int64_t setup = 2;
+    std::unordered_set<const Value*> splatted;
+    for (auto& inst : body->insts) {
+        if (inst->isTerminator() || inst.get() == step || aliases.count(inst.get()))
+            continue;
+        vector_cost++;
+        if (inst->op != Opcode::STORE && shapeOf(inst.get()) != Shape::VECTOR)
+            continue;
+        for (size_t i = 0; i < inst->operands.size(); i++) {
+            const Value* v = inst->operands[i];
+            bool address = inst->op == Opcode::STORE && i == 1;
+            bool amount = inst->op == Opcode::SHL && i == 1;
+            if (address || amount || shapeOf(v) != Shape::UNIFORM || !splatted.insert(v).second)
+                continue;
+            if (loop.isInvariant(v))
+                setup++;
+            else
+                vector_cost++;
+        }
+    }
+    for (const Reduction& red : reductions)
+        setup += red.widen ? 4 : 3;
+
+    int64_t vectorized = (trip / vf) * vector_cost + setup + (trip % vf) * scalar_cost;
+    return vectorized * 5 < trip * scalar_cost * 4;
+}
+
+Instruction* LoopVectorizer::emit(BasicBlock* bb, Opcode op, IRType type,
+                                  std::vector<Value*> operands, MemType mem) {
+    auto inst = std::make_unique<Instruction>(op, type, std::move(operands));
+    inst->mem = mem;
+    return bb->insertBeforeTerminator(std::move(inst));
+}
+
+// The per-vector-iteration copy of a scalar in the body
+Value* LoopVectorizer::scalar(const Value* v) {
+    auto it = scalars.find(v);
+    if (it != scalars.end())
+        return it->second;
+    return const_cast<Value*>(v);
+}
+
+// The vector standing for `v`, splatting scalars. Invariant scalars are splatted once in
+// the preheader.
+Value* LoopVectorizer::vector(const Value* v, IRType lane_type) {
+    while (aliases.count(v))
+        v = aliases.at(v);
+    auto it = vectors.find(v);
+    if (it != vectors.end())
+        return it->second;
+
+    auto& splat = splats[v];
+    if (!splat) {
+        BasicBlock* bb = loop.isInvariant(v) ? pre : vbody;
+        MemType lane = laneOf(lane_type);
+        splat = emit(bb, Opcode::VSPLAT, IRType::V128, {scalar(v)}, lane);
+    }
+    return splat;
+}
+
+void LoopVectorizer::transform() {
+    Module& mod = *fn.parent;
+    int64_t vf = 16 / lane_size;
+    int64_t vector_end = start + trip / vf * vf;
+
+    BasicBlock* vcond = fn.createBlock("vector.cond");
+    vbody = fn.createBlock("vector.body");
+    BasicBlock* vexit = fn.createBlock("vector.end");
+    place_before(fn, vcond, header);
+    place_before(fn, vbody, header);
+    place_before(fn, vexit, header);
+
+    for (BasicBlock*& target : pre->terminator()->blocks) {
+        if (target == header)
+            target = vcond;
+    }
+
+    // Vector loop control, with the back edge inputs filled in once the body exists
+    Instruction* viv = emit(vcond, Opcode::PHI, IRType::I64, {mod.constInt(start)});
+    viv->blocks.push_back(pre);
+    std::vector<Instruction*> accumulators;
+    for (const Reduction& red : reductions) {
+        Value* zero = red.lane.is_float ? static_cast<Value*>(mod.constFloat(0.0, red.phi->type))
+                                        : mod.constInt(0);
+        Instruction* init = emit(pre, Opcode::VSPLAT, IRType::V128, {zero}, red.lane);
+        if (red.widen)
+            init->mem = {8, true, false};
+        Instruction* acc = emit(vcond, Opcode::PHI, IRType::V128, {init}, init->mem);
+        acc->blocks.push_back(pre);
+        accumulators.push_back(acc);
+    }
+    Instruction* cmp = emit(vcond, Opcode::ICMP, IRType::I64, {viv, mod.constInt(vector_end)});
+    cmp->cond = Cond::LT;
+    Instruction* cond_br = emit(vcond, Opcode::COND_BR, IRType::VOID, {cmp});
+    cond_br->blocks = {vbody, vexit};
+
+    scalars[iv] = viv;
+    for (auto& owned : body->insts) {
+        Instruction* inst = owned.get();
+        if (inst->isTerminator() || inst == step || aliases.count(inst))
+            continue;
+
+        auto red = std::find_if(reductions.begin(), reductions.end(),
+                                [inst](const Reduction& r) { return r.add == inst; });
+        if (red != reductions.end()) {
+            Instruction* acc = accumulators[red - reductions.begin()];
+            Value* term = vector(red->term, red->add->type);
+            if (red->widen)
+                term = emit(vbody, Opcode::VWIDEN, IRType::V128, {term}, red->lane);
+            Instruction* sum = emit(vbody, red->add->op, IRType::V128, {acc, term}, acc->mem);
+            acc->operands.push_back(sum);
+            acc->blocks.push_back(vbody);
+            continue;
+        }
+        if (reduction_insts.count(inst))
+            continue;
+
+        Shape shape = shapeOf(inst);
+        if (inst->op == Opcode::STORE) {
+            Value* value = vector(inst->operands[0], inst->operands[0]->type);
+            emit(vbody, Opcode::VSTORE, IRType::VOID, {value, scalar(inst->operands[1])}, inst->mem);
+        } else if (inst->op == Opcode::LOAD) {
+            vectors[inst] = emit(vbody, Opcode::VLOAD, IRType::V128, {scalar(inst->operands[0])}, inst->mem);
+        } else if (shape != Shape::VECTOR) {
+            auto clone = std::make_unique<Instruction>(inst->op, inst->type);
+            for (const Value* v : inst->operands)
+                clone->operands.push_back(scalar(v));
+            clone->cond = inst->cond;
+            clone->mem = inst->mem;
+            clone->slot = inst->slot;
+            clone->imm = inst->imm;
+
+            // Every access of the body scales the index the same way, one copy does for all
+            auto same = std::find_if(vbody->insts.begin(), vbody->insts.end(), [&](const auto& other) {
+                return other->op == clone->op && other->type == clone->type &&
+                       other->operands == clone->operands && other->cond == clone->cond &&
+                       other->mem == clone->mem && other->slot == clone->slot;
+            });
+            if (same != vbody->insts.end())
+                scalars[inst] = same->get();
+            else
+                scalars[inst] = vbody->insertBeforeTerminator(std::move(clone));
+        } else {
+            std::vector<Value*> operands;
+            for (size_t i = 0; i < inst->operands.size(); i++) {
+                bool amount = inst->op == Opcode::SHL && i == 1;
+                operands.push_back(amount ? inst->operands[i] : vector(inst->operands[i], inst->type));
+            }
+            vectors[inst] = emit(vbody, inst->op, IRType::V128, std::move(operands), laneOf(inst->type));
+        }
+    }
+
+    Instruction* next = emit(vbody, Opcode::ADD, IRType::I64, {viv, mod.constInt(vf)});
+    viv->operands.push_back(next);
+    viv->blocks.push_back(vbody);
+    emit(vbody, Opcode::BR, IRType::VOID, {})->blocks.push_back(vcond);
+
+    // The lanes are summed into the initial values, then the scalar loop picks up the rest
+    std::unordered_map<const Instruction*, Value*> entry_values;
+    entry_values[iv] = mod.constInt(vector_end);
+    for (size_t i = 0; i < reductions.size(); i++) {
+        const Reduction& red = reductions[i];
+        size_t entry = red.phi->blocks[0] == pre ? 0 : 1;
+        Value* init = red.phi->operands[entry];
+        IRType type = red.lane.is_float ? red.phi->type : IRType::I64;
+        Instruction* total = emit(vexit, Opcode::VREDUCE, type, {accumulators[i]}, accumulators[i]->mem);
+        Instruction* add = emit(vexit, red.add->op, red.add->type, {init, total});
+        Value* sum = add;
+        if (Value* same = fold_identity(*add)) {
+            vexit->erase(add);
+            sum = same;
+        }
+        if (red.narrow) {
+            sum = emit(vexit, red.update->op, IRType::I64, {sum}, red.update->mem);
+        }
+        entry_values[red.phi] = sum;
+    }
+    emit(vexit, Opcode::BR, IRType::VOID, {})->blocks.push_back(header);
+
+    for (auto& inst : header->insts) {
+        if (inst->op != Opcode::PHI)
+            break;
+        for (size_t i = 0; i < inst->blocks.size(); i++) {
+            if (inst->blocks[i] == pre) {
+                inst->blocks[i] = vexit;
+                inst->operands[i] = entry_values.at(inst.get());
+            }
+        }
+    }
+    fn.rebuildCFG();
+}
+
+bool LoopVectorizer::run() {
+    if (!matchShape() || !matchReductions() || !classify() || !checkDependences() || !profitable())
+        return false;
+    transform();
+
+    if (options.vectorize_report) {
+        int64_t vf = 16 / lane_size;
+        std::cout << "vectorized loop '" << header->name << "' in '" << fn.name << "': " << vf
+                  << " lanes, " << trip / vf << " vector and " << trip % vf
+                  << " scalar iterations\n";
+    }
+    return true;
+}
+
+} // namespace
+
+bool LoopVectorizePass::runOnFunction(Function& fn) {
+    if (fn.blocks.empty())
+        return false;
+    fn.rebuildCFG();
+
+    DominatorTree dt(fn);
+    LoopInfo loops(dt);
+    bool changed = false;
+    for (auto& loop : loops.loops()) {
+        LoopVectorizer vectorizer(fn, *loop, ctx.options);
+        changed |= vectorizer.run();
+    }
+    return changed;
+}
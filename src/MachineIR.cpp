@@ -0,0 +1,564 @@
+#include "MachineIR.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+// MachineOperand
+
+MachineOperand MachineOperand::def(MReg r, char view) {
+    MachineOperand op;
+    op.kind = Kind::REG;
+    op.reg = r;
+    op.view = view;
+    op.is_def = true;
+    return op;
+}
+
+MachineOperand MachineOperand::use(MReg r, char view) {
+    MachineOperand op;
+    op.kind = Kind::REG;
+    op.reg = r;
+    op.view = view;
+    op.is_use = true;
+    return op;
+}
+
+MachineOperand MachineOperand::defVector(MReg r, const std::string& arrangement) {
+    MachineOperand op = def(r, 'v');
+    op.text = "." + arrangement;
+    return op;
+}
+
+MachineOperand MachineOperand::useVector(MReg r, const std::string& arrangement) {
+    MachineOperand op = use(r, 'v');
+    op.text = "." + arrangement;
+    return op;
+}
+
+MachineOperand MachineOperand::immediate(int64_t v) {
+    MachineOperand op;
+    op.kind = Kind::IMM;
+    op.imm = v;
+    return op;
+}
+
+MachineOperand MachineOperand::floatImmediate(double v) {
+    MachineOperand op;
+    op.kind = Kind::FIMM;
+    op.fimm = v;
+    return op;
+}
+
+MachineOperand MachineOperand::label(MachineBlock* b) {
+    MachineOperand op;
+    op.kind = Kind::BLOCK;
+    op.block = b;
+    return op;
+}
+
+MachineOperand MachineOperand::symbol(const std::string& s) {
+    MachineOperand op;
+    op.kind = Kind::SYMBOL;
+    op.text = s;
+    return op;
+}
+
+MachineOperand MachineOperand::raw(const std::string& s) {
+    MachineOperand op;
+    op.kind = Kind::TEXT;
+    op.text = s;
+    return op;
+}
+
+MachineOperand MachineOperand::frameIndex(int index, int64_t addend) {
+    MachineOperand op;
+    op.kind = Kind::FRAME_INDEX;
+    op.frame_index = index;
+    op.imm = addend;
+    return op;
+}
+
+MachineOperand MachineOperand::mem(MReg base, int64_t offset, AddrMode mode) {
+    MachineOperand op;
+    op.kind = Kind::MEM;
+    op.reg = base;
+    op.imm = offset;
+    op.mode = mode;
+    return op;
+}
+
+MachineOperand MachineOperand::memIndex(MReg base, MReg index, int shift) {
+    MachineOperand op;
+    op.kind = Kind::MEM;
+    op.reg = base;
+    op.index = index;
+    op.shift = shift;
+    op.mode = AddrMode::REG_OFFSET;
+    return op;
+}
+
+MachineOperand MachineOperand::memFrame(int index, int64_t offset) {
+    MachineOperand op;
+    op.kind = Kind::MEM;
+    op.reg = MReg::phys(REG_SP);
+    op.frame_index = index;
+    op.imm = offset;
+    return op;
+}
+
+MachineOperand MachineOperand::memPage(MReg base, const std::string& symbol) {
+    MachineOperand op;
+    op.kind = Kind::MEM;
+    op.reg = base;
+    op.text = symbol;
+    op.mode = AddrMode::PAGE_OFFSET;
+    return op;
+}
+
+// MachineInstr
+
+bool MachineInstr::isBranch() const {
+    return branchTarget() != nullptr;
+}
+
+bool MachineInstr::isUnconditionalBranch() const {
+    return opcode == "b" && isBranch();
+}
+
+bool MachineInstr::isReturn() const {
+    return opcode == "ret" || is_tail_call;
+}
+
+bool MachineInstr::isTerminator() const {
+    return isBranch() || isReturn() || opcode == "brk";
+}
+
+MachineBlock* MachineInstr::branchTarget() const {
+    for (const auto& op : ops) {
+        if (op.kind == MachineOperand::Kind::BLOCK)
+            return op.block;
+    }
+    return nullptr;
+}
+
+void MachineInstr::forEachReg(const std::function<void(MReg&, bool, bool)>& fn) {
+    for (auto& op : ops) {
+        if (op.kind == MachineOperand::Kind::REG) {
+            fn(op.reg, op.is_def, op.is_use);
+        } else if (op.kind == MachineOperand::Kind::MEM) {
+            if (op.frame_index < 0 && op.reg.valid()) {
+                bool writeback = op.mode == AddrMode::PRE_INDEX || op.mode == AddrMode::POST_INDEX;
+                fn(op.reg, writeback, true);
+            }
+            if (op.mode == AddrMode::REG_OFFSET && op.index.valid())
+                fn(op.index, false, true);
+        }
+    }
+    for (auto& r : implicit_uses)
+        fn(r, false, true);
+    for (auto& r : implicit_defs)
+        fn(r, true, false);
+}
+
+// MachineFunction
+
+MachineBlock* MachineFunction::createBlock(const std::string& label) {
+    blocks.push_back(std::make_unique<MachineBlock>(label));
+    return blocks.back().get();
+}
+
+MReg MachineFunction::createVReg(RegClass cls, bool is_vector) {
+    vreg_classes.push_back(cls);
+    vreg_is_vector.push_back(is_vector);
+    return MReg::virt(static_cast<int>(vreg_classes.size()) - 1, cls);
+}
+
+int MachineFunction::createFrameObject(int size, int align, bool is_spill) {
+    frame_objects.push_back(FrameObject{.size = size, .align = align, .is_spill = is_spill});
+    return static_cast<int>(frame_objects.size()) - 1;
+}
+
+void MachineFunction::rebuildCFG() {
+    for (auto& mb : blocks) {
+        mb->succs.clear();
+        mb->preds.clear();
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        MachineBlock* mb = blocks[i].get();
+        bool falls_through = true;
+
+        for (const auto& mi : mb->insts) {
+            if (MachineBlock* target = mi.branchTarget()) {
+                if (std::find(mb->succs.begin(), mb->succs.end(), target) == mb->succs.end())
+                    mb->succs.push_back(target);
+            }
+        }
+        if (!mb->insts.empty()) {
+            const MachineInstr& last = mb->insts.back();
+            falls_through =
+                !(last.isUnconditionalBranch() || last.isReturn() || last.opcode == "brk");
+        }
+
+        if (falls_through && i + 1 < blocks.size()) {
+            MachineBlock* next = blocks[i + 1].get();
+            if (std::find(mb->succs.begin(), mb->succs.end(), next) == mb->succs.end())
+                mb->succs.push_back(next);
+        }
+    }
+
+    for (auto& mb : blocks) {
+        for (MachineBlock* succ : mb->succs)
+            succ->preds.push_back(mb.get());
+    }
+}
+
+// Condition codes
+
+std::string invert_cond_code(const std::string& cc) {
+    static const char* pairs[][2] = {{"eq", "ne"}, {"hs", "lo"}, {"mi", "pl"}, {"vs", "vc"},
+                                     {"hi", "ls"}, {"ge", "lt"}, {"gt", "le"}, {"cs", "cc"}};
+    for (const auto& pair : pairs) {
+        if (cc == pair[0])
+            return pair[1];
+        if (cc == pair[1])
+            return pair[0];
+    }
+    throw std::logic_error("No inverse for condition code '" + cc + "'");
+}
+
+// Printing
+
+std::string reg_name(const MReg& r, char view) {
+    if (r.is_virtual)
+        return std::string("%") + (r.cls == RegClass::GPR ? "r" : "f") + std::to_string(r.id);
+
+    if (r.cls == RegClass::GPR) {
+        if (r.id == REG_SP)
+            return view == 'w' ? "wsp" : "sp";
+        if (r.id == REG_ZR)
+            return view == 'w' ? "wzr" : "xzr";
+    }
+    return std::string(1, view) + std::to_string(r.id);
+}
+
+static std::string format_fimm(double v) {
+    std::ostringstream oss;
+    oss << std::setprecision(17) << v; // Every digit of fmov immediates like 0.1328125
+    std::string s = oss.str();
+    if (s.find_first_of(".e") == std::string::npos)
+        s += ".0";
+    return s;
+}
+
+static void print_operand(std::ostream& os, const MachineOperand& op) {
+    switch (op.kind) {
+    case MachineOperand::Kind::REG:
+        os << reg_name(op.reg, op.view);
+        if (op.view == 'v')
+            os << op.text;
+        break;
+    case MachineOperand::Kind::IMM:
+        os << "#" << op.imm;
+        break;
+    case MachineOperand::Kind::FIMM:
+        os << "#" << format_fimm(op.fimm);
+        break;
+    case MachineOperand::Kind::BLOCK:
+        os << op.block->label;
+        break;
+    case MachineOperand::Kind::SYMBOL:
+    case MachineOperand::Kind::TEXT:
+        os << op.text;
+        break;
+    case MachineOperand::Kind::FRAME_INDEX:
+        os << "#FI" << op.frame_index << "+" << op.imm;
+        break;
+    case MachineOperand::Kind::MEM: {
+        std::string base =
+            op.frame_index >= 0 ? "FI" + std::to_string(op.frame_index) : reg_name(op.reg, 'x');
+        switch (op.mode) {
+        case AddrMode::OFFSET:
+            os << "[" << base;
+            if (op.imm != 0)
+                os << ", #" << op.imm;
+            os << "]";
+            break;
+        case AddrMode::PRE_INDEX:
+            os << "[" << base << ", #" << op.imm << "]!";
+            break;
+        case AddrMode::POST_INDEX:
+            os << "[" << base << "], #" << op.imm;
+            break;
+        case AddrMode::REG_OFFSET:
+            os << "[" << base << ", " << reg_name(op.index, 'x');
+            if (op.shift != 0)
+                os << ", lsl #" << op.shift;
+            os << "]";
+            break;
+        case AddrMode::PAGE_OFFSET:
+            os << "[" << base << ", " << op.text << "@PAGEOFF]";
+            break;
+        }
+        break;
+    }
+    }
+}
+
+void print_machine_instr(std::ostream& os, const MachineInstr& mi) {
+    os << mi.opcode;
+    for (size_t i = 0; i < mi.ops.size(); i++) {
+        os << (i == 0 ? " " : ", ");
+        print_operand(os, mi.ops[i]);
+    }
+}
+
+void print_machine_function(std::ostream& os, const MachineFunction& mf) {
+    os << "_" << mf.name << ":\n";
+    for (const auto& mb : mf.blocks) {
+        os << mb->label << ":\n";
+        for (const auto& mi : mb->insts) {
+            os << "\t";
+            print_machine_instr(os, mi);
+            os << "\n";
+        }
+    }
+}
+
+// Parsing
+
+static std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t");
+    if (begin == std::string::npos)
+        return "";
+    size_t end = s.find_last_not_of(" \t");
+    return s.substr(begin, end - begin + 1);
+}
+
+// Splits on commas outside of brackets
+static std::vector<std::string> split_operands(const std::string& s) {
+    std::vector<std::string> parts;
+    std::string current;
+    int depth = 0;
+    for (char c : s) {
+        if (c == '[')
+            depth++;
+        else if (c == ']')
+            depth--;
+        if (c == ',' && depth == 0) {
+            parts.push_back(trim(current));
+            current.clear();
+        } else {
+            current += c;
+        }
+    }
+    if (!trim(current).empty())
+        parts.push_back(trim(current));
+    return parts;
+}
+
+static bool parse_register(const std::string& s, MReg& reg, char& view) {
+    if (s == "sp" || s == "wsp") {
+        reg = MReg::phys(REG_SP);
+        view = s[0] == 'w' ? 'w' : 'x';
+        return true;
+    }
+    if (s == "xzr" || s == "wzr") {
+        reg = MReg::phys(REG_ZR);
+        view = s[0];
+        return true;
+    }
+    if (s == "fp" || s == "lr") {
+        reg = MReg::phys(s == "fp" ? REG_FP : REG_LR);
+        view = 'x';
+        return true;
+    }
+
+    if (s.size() < 2 || std::string("xwbhsdq").find(s[0]) == std::string::npos)
+        return false;
+    if (!std::all_of(s.begin() + 1, s.end(), [](char c) { return std::isdigit(c); }))
+        return false;
+    int id = std::stoi(s.substr(1));
+    if (id > 31)
+        return false;
+
+    bool is_gpr = s[0] == 'x' || s[0] == 'w';
+    if (is_gpr && id == 31)
+        return false;
+    reg = MReg::phys(id, is_gpr ? RegClass::GPR : RegClass::FPR);
+    view = s[0];
+    return true;
+}
+
+static bool parse_immediate(const std::string& s, MachineOperand& op) {
+    if (s.size() < 2 || s[0] != '#')
+        return false;
+    std::string digits = s.substr(1);
+    try {
+        bool is_hex = digits.find("0x") != std::string::npos;
+        if (!is_hex && digits.find_first_of(".e") != std::string::npos) {
+            op = MachineOperand::floatImmediate(std::stod(digits));
+        } else {
+            size_t used = 0;
+            op = MachineOperand::immediate(static_cast<int64_t>(std::stoull(
+                digits[0] == '-' ? digits.substr(1) : digits, &used, 0)));
+            if (digits[0] == '-')
+                op.imm = -op.imm;
+            if (used != digits.size() - (digits[0] == '-' ? 1 : 0))
+                return false;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_memory(const std::string& s, MachineOperand& op) {
+    size_t close = s.find(']');
+    if (s[0] != '[' || close == std::string::npos)
+        return false;
+    std::string suffix = s.substr(close + 1);
+    if (!suffix.empty() && suffix != "!")
+        return false;
+
+    std::vector<std::string> parts = split_operands(s.substr(1, close - 1));
+    MReg base;
+    char view;
+    if (parts.empty() || !parse_register(parts[0], base, view))
+        return false;
+
+    if (parts.size() == 1) {
+        op = MachineOperand::mem(base);
+        return suffix.empty();
+    }
+
+    MachineOperand offset;
+    MReg index;
+    if (parse_immediate(parts[1], offset) && offset.kind == MachineOperand::Kind::IMM &&
+        parts.size() == 2) {
+        op = MachineOperand::mem(base, offset.imm,
+                                 suffix.empty() ? AddrMode::OFFSET : AddrMode::PRE_INDEX);
+        return true;
+    }
+    if (!suffix.empty())
+        return false;
+
+    const std::string pageoff = "@PAGEOFF";
+    if (parts.size() == 2 && parts[1].size() > pageoff.size() &&
+        parts[1].compare(parts[1].size() - pageoff.size(), pageoff.size(), pageoff) == 0) {
+        op = MachineOperand::memPage(base, parts[1].substr(0, parts[1].size() - pageoff.size()));
+        return true;
+    }
+
+    if (!parse_register(parts[1], index, view) || view != 'x')
+        return false;
+    int shift = 0;
+    if (parts.size() == 3) {
+        if (parts[2].rfind("lsl #", 0) != 0)
+            return false;
+        shift = std::stoi(parts[2].substr(5));
+    } else if (parts.size() > 3) {
+        return false;
+    }
+    op = MachineOperand::memIndex(base, index, shift);
+    return true;
+}
+
+static bool parse_operand(const std::string& s, MachineOperand& op) {
+    if (s.empty())
+        return false;
+    if (s[0] == '[')
+        return parse_memory(s, op);
+    if (s[0] == '#')
+        return parse_immediate(s, op);
+
+    MReg reg;
+    char view;
+    if (parse_register(s, reg, view)) {
+        op = MachineOperand::use(reg, view);
+        op.is_use = false;
+        return true;
+    }
+    if (s[0] == 'v') {
+        size_t dot = s.find('.');
+        if (dot != std::string::npos && parse_register("q" + s.substr(1, dot - 1), reg, view)) {
+            op = MachineOperand::use(reg, 'v');
+            op.is_use = false;
+            op.text = s.substr(dot);
+            return true;
+        }
+    }
+
+    // Literal pool loads (`=N`) and shift / extend modifiers stay text, the rest are labels
+    // and condition codes
+    if (s[0] == '=' || s.find(' ') != std::string::npos)
+        op = MachineOperand::raw(s);
+    else
+        op = MachineOperand::symbol(s);
+    return true;
+}
+
+// Opcodes whose register operands are all read
+static bool reads_all_operands(const std::string& opcode) {
+    static const std::vector<std::string> opcodes = {
+        "str", "strb", "strh", "stur", "sturb", "sturh", "stp", "cmp",  "cmn",
+        "tst", "fcmp", "fcmpe", "ccmp", "cbz", "cbnz", "tbz", "tbnz", "b",
+        "bl",  "br",  "blr",  "ret",  "brk",  "nop"};
+    return opcode.rfind("b.", 0) == 0 ||
+           std::find(opcodes.begin(), opcodes.end(), opcode) != opcodes.end();
+}
+
+MachineInstr parse_machine_instr(const std::string& text) {
+    std::string line = trim(text);
+
+    MachineInstr opaque(line);
+    opaque.is_opaque = true;
+    if (line.empty() || line[0] == '.' || line.back() == ':')
+        return opaque;
+
+    size_t space = line.find_first_of(" \t");
+    MachineInstr mi(line.substr(0, space));
+    std::vector<std::string> parts =
+        space == std::string::npos ? std::vector<std::string>{} : split_operands(line.substr(space));
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        MachineOperand op;
+        if (!parse_operand(parts[i], op))
+            return opaque;
+
+        // `[base], #imm` is a single post-indexed operand
+        if (op.kind == MachineOperand::Kind::MEM && op.mode == AddrMode::OFFSET && op.imm == 0 &&
+            i + 1 < parts.size() && parts[i].find(',') == std::string::npos) {
+            MachineOperand post;
+            if (parse_immediate(parts[i + 1], post) && post.kind == MachineOperand::Kind::IMM) {
+                op.mode = AddrMode::POST_INDEX;
+                op.imm = post.imm;
+                i++;
+            }
+        }
+        mi.ops.push_back(op);
+    }
+
+    int defs = 0;
+    if (!reads_all_operands(mi.opcode))
+        defs = (mi.opcode == "ldp" || mi.opcode == "ldpsw") ? 2 : 1;
+    bool def_is_read = mi.opcode == "movk" || mi.opcode == "bfi" || mi.opcode == "bfxil";
+
+    for (auto& op : mi.ops) {
+        if (op.kind != MachineOperand::Kind::REG)
+            continue;
+        if (defs > 0) {
+            op.is_def = true;
+            op.is_use = def_is_read;
+            defs--;
+        } else {
+            op.is_use = true;
+        }
+    }
+
+    mi.is_call = mi.opcode == "bl" || mi.opcode == "blr";
+    return mi;
+}
@@ -0,0 +1,247 @@
+#include "Dominators.h"
+#include "Passes.h"
+
+#include <unordered_map>
+#include <unordered_set>
+
+static bool is_promotable_type(const Type& t) {
+    return t.kind != TypeKind::ARRAY && t.kind != TypeKind::CLASS && t.kind != TypeKind::VOID;
+}
+
+// A slot is promotable if every use of its address is the address of a full-width load
+// or store, i.e. the address never escapes and the slot is never accessed piecewise
+static std::unordered_set<StackSlot*> find_promotable(Function& fn) {
+    std::unordered_set<StackSlot*> candidates;
+    for (const auto& slot : fn.slots) {
+        if (is_promotable_type(slot->var_type))
+            candidates.insert(slot.get());
+    }
+
+    for (const auto& bb : fn.blocks) {
+        for (const auto& inst : bb->insts) {
+            for (size_t i = 0; i < inst->operands.size(); i++) {
+                Value* v = inst->operands[i];
+                if (v->kind != ValueKind::INSTRUCTION)
+                    continue;
+                auto* addr = static_cast<Instruction*>(v);
+                if (addr->op != Opcode::FRAME_ADDR)
+                    continue;
+
+                MemType slot_mem = mem_type_of(addr->slot->var_type);
+                bool direct = (inst->op == Opcode::LOAD && i == 0 && inst->mem == slot_mem) ||
+                              (inst->op == Opcode::STORE && i == 1 && inst->mem == slot_mem);
+                if (!direct)
+                    candidates.erase(addr->slot);
+            }
+        }
+    }
+
+    return candidates;
+}
+
+static StackSlot* promoted_slot(const Instruction* inst, size_t addr_index,
+                                const std::unordered_set<StackSlot*>& promotable) {
+    const Value* addr = inst->operands[addr_index];
+    if (addr->kind != ValueKind::INSTRUCTION)
+        return nullptr;
+    const auto* frame = static_cast<const Instruction*>(addr);
+    if (frame->op != Opcode::FRAME_ADDR || !promotable.count(frame->slot))
+        return nullptr;
+    return frame->slot;
+}
+
+bool Mem2RegPass::runOnFunction(Function& fn) {
+    // Loads in unreachable code would have no dominating definition
+    fn.removeUnreachableBlocks();
+    fn.rebuildCFG();
+
+    std::unordered_set<StackSlot*> promotable = find_promotable(fn);
+    if (promotable.empty())
+        return false;
+
+    DominatorTree dom(fn);
+    auto frontiers = dom.frontiers();
+
+    // Phi placement at the iterated dominance frontier of each slot's stores
+    std::unordered_map<StackSlot*, std::vector<BasicBlock*>> def_blocks;
+    for (const auto& bb : fn.blocks) {
+        for (const auto& inst : bb->insts) {
+            if (inst->op != Opcode::STORE)
+                continue;
+            if (StackSlot* slot = promoted_slot(inst.get(), 1, promotable))
+                def_blocks[slot].push_back(bb.get());
+        }
+    }
+
+    std::unordered_map<Instruction*, StackSlot*> phi_slots;
+    std::unordered_map<BasicBlock*, std::vector<Instruction*>> block_phis;
+
+    for (auto& [slot, defs] : def_blocks) {
+        std::unordered_set<BasicBlock*> has_phi;
+        std::vector<BasicBlock*> worklist = defs;
+        std::unordered_set<BasicBlock*> queued(defs.begin(), defs.end());
+
+        while (!worklist.empty()) {
+            BasicBlock* bb = worklist.back();
+            worklist.pop_back();
+
+            for (BasicBlock* frontier : frontiers[bb]) {
+                if (!has_phi.insert(frontier).second)
+                    continue;
+
+                auto phi = std::make_unique<Instruction>(Opcode::PHI, ir_type_of(slot->var_type));
+                Instruction* inserted = frontier->insertAtFront(std::move(phi));
+                phi_slots[inserted] = slot;
+                block_phis[frontier].push_back(inserted);
+
+                if (queued.insert(frontier).second)
+                    worklist.push_back(frontier);
+            }
+        }
+    }
+
+    // Renaming over the dominator tree
+    std::unordered_map<Value*, Value*> replacements;
+    auto resolve = [&](Value* v) {
+        auto it = replacements.find(v);
+        while (it != replacements.end()) {
+            v = it->second;
+            it = replacements.find(v);
+        }
+        return v;
+    };
+
+    std::unordered_map<StackSlot*, std::vector<Value*>> stacks;
+    auto top = [&](StackSlot* slot) -> Value* {
+        auto& stack = stacks[slot];
+        if (stack.empty())
+            return fn.parent->zero(ir_type_of(slot->var_type));
+        return stack.back();
+    };
+
+    std::vector<Instruction*> dead;
+
+    struct Frame {
+        BasicBlock* bb;
+        std::vector<StackSlot*> pushed;
+        bool expanded;
+    };
+    std::vector<Frame> work = {{fn.entry(), {}, false}};
+
+    while (!work.empty()) {
+        if (work.back().expanded) {
+            for (StackSlot* slot : work.back().pushed)
+                stacks[slot].pop_back();
+            work.pop_back();
+            continue;
+        }
+
+        work.back().expanded = true;
+        BasicBlock* bb = work.back().bb;
+        std::vector<StackSlot*> pushed;
+
+        for (Instruction* phi : block_phis[bb]) {
+            stacks[phi_slots[phi]].push_back(phi);
+            pushed.push_back(phi_slots[phi]);
+        }
+
+        for (auto it = bb->insts.begin(); it != bb->insts.end(); ++it) {
+            Instruction* inst = it->get();
+
+            if (inst->op == Opcode::LOAD) {
+                if (StackSlot* slot = promoted_slot(inst, 0, promotable)) {
+                    replacements[inst] = top(slot);
+                    dead.push_back(inst);
+                }
+            } else if (inst->op == Opcode::STORE) {
+                if (StackSlot* slot = promoted_slot(inst, 1, promotable)) {
+                    Value* value = resolve(inst->operands[0]);
+
+                    // The slot only keeps the low bytes, reads see them re-extended
+                    const MemType& mem = inst->mem;
+                    if (!mem.is_float && mem.size < 8) {
+                        auto ext = std::make_unique<Instruction>(
+                            mem.is_signed ? Opcode::SEXT : Opcode::ZEXT, IRType::I64,
+                            std::vector<Value*>{value});
+                        ext->mem = mem;
+                        ext->parent = bb;
+                        value = bb->insts.insert(it, std::move(ext))->get();
+                    }
+
+                    stacks[slot].push_back(value);
+                    pushed.push_back(slot);
+                    dead.push_back(inst);
+                }
+            }
+        }
+
+        for (BasicBlock* succ : bb->successors()) {
+            for (Instruction* phi : block_phis[succ]) {
+                bool present = false;
+                for (BasicBlock* incoming : phi->blocks)
+                    present |= incoming == bb;
+                if (present)
+                    continue;
+                phi->operands.push_back(resolve(top(phi_slots[phi])));
+                phi->blocks.push_back(bb);
+            }
+        }
+
+        work.back().pushed = std::move(pushed);
+        for (BasicBlock* child : dom.children(bb))
+            work.push_back({child, {}, false});
+    }
+
+    for (Instruction* inst : dead)
+        inst->parent->erase(inst);
+
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            for (Value*& op : inst->operands)
+                op = resolve(op);
+        }
+    }
+
+    // Remove the now unused address computations and the slots themselves
+    for (auto& bb : fn.blocks) {
+        for (auto it = bb->insts.begin(); it != bb->insts.end();) {
+            Instruction* inst = it->get();
+            if (inst->op == Opcode::FRAME_ADDR && promotable.count(inst->slot))
+                it = bb->insts.erase(it);
+            else
+                ++it;
+        }
+    }
+    for (StackSlot* slot : promotable)
+        fn.removeSlot(slot);
+
+    // Minimal SSA places phis where the variable is dead, drop the ones nothing reads
+    std::unordered_set<Instruction*> live;
+    std::vector<Instruction*> worklist;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            if (phi_slots.count(inst.get()))
+                continue;
+            for (Value* op : inst->operands) {
+                if (auto* phi = dynamic_cast<Instruction*>(op);
+                    phi && phi_slots.count(phi) && live.insert(phi).second)
+                    worklist.push_back(phi);
+            }
+        }
+    }
+    while (!worklist.empty()) {
+        Instruction* phi = worklist.back();
+        worklist.pop_back();
+        for (Value* op : phi->operands) {
+            if (auto* input = dynamic_cast<Instruction*>(op);
+                input && phi_slots.count(input) && live.insert(input).second)
+                worklist.push_back(input);
+        }
+    }
+    for (auto& [phi, slot] : phi_slots) {
+        if (!live.count(phi))
+            phi->parent->erase(phi);
+    }
+
+    return true;
+}
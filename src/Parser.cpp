@@ -51,10 +51,16 @@ void register_intrinsics(SymbolTable& sym) {
     sym.declareFunction("input_f", TypeSystem::Float64, {});
 
     // Math (float -> float)
-    std::vector<std::string> math_funcs = {"sqrt_f", "sin_f", "cos_f", "tan_f", "abs_f"};
+    std::vector<std::string> math_funcs = {"sqrt_f", "sin_f",   "cos_f",  "tan_f",
+                                           "abs_f",  "floor_f", "ceil_f", "round_f"};
     for (const auto& name : math_funcs) {
         sym.declareFunction(name, TypeSystem::Float64, {TypeSystem::Float64});
     }
+    // float min_f(float, float), float max_f(float, float)
+    sym.declareFunction("min_f", TypeSystem::Float64, {TypeSystem::Float64, TypeSystem::Float64});
+    sym.declareFunction("max_f", TypeSystem::Float64, {TypeSystem::Float64, TypeSystem::Float64});
+    // int abs(int)
+    sym.declareFunction("abs", TypeSystem::Int64, {TypeSystem::Int64});
 }
 
 bool Parser::check(TokenType t) const {
@@ -375,9 +381,34 @@ StmtPtr Parser::parseStatement() {
         return parseClassDecl();
     }
 
+    if (match(TokenType::KEYWORD_INLINE) || match(TokenType::KEYWORD_NOINLINE)) {
+        return parseFunctionSpecifier();
+    }
+
     return parseExpressionStatement();
 }
 
+StmtPtr Parser::parseFunctionSpecifier() {
+    Token specifier = previous();
+
+    if (!check(TokenType::IDENTIFIER) && !TypeSystem::from_string(peek().lexeme).has_value()) {
+        error(peek(), "Expected a function declaration after '" + specifier.lexeme + "'.");
+    }
+    advance();
+
+    StmtPtr decl = parseVarOrFunctionDecl();
+    auto* fn = dynamic_cast<FunctionDeclStmt*>(decl.get());
+    if (!fn) {
+        error(specifier, "'" + specifier.lexeme + "' can only be applied to functions.");
+    }
+
+    if (specifier.type == TokenType::KEYWORD_INLINE)
+        fn->is_inline = true;
+    else
+        fn->is_noinline = true;
+    return decl;
+}
+
 StmtPtr Parser::parseExpressionStatement() {
     ExprPtr expr = parseExpression();
     consume(TokenType::SEMICOLON, "Expected ';' after expression statement.");
@@ -431,9 +462,9 @@ StmtPtr Parser::parseVarOrFunctionDecl() {
                 Token arg_type_tok = advance();
                 Token arg_name_tok = advance();
 
-                auto typeOpt = TypeSystem::from_string(identifierTypeToken.lexeme);
+                auto typeOpt = TypeSystem::from_string(arg_type_tok.lexeme);
                 if (!typeOpt.has_value()) {
-                    error(identifierTypeToken, "Unknown type '" + identifierTypeToken.lexeme + "'");
+                    error(arg_type_tok, "Unknown type '" + arg_type_tok.lexeme + "'");
                 }
                 Type argType = typeOpt.value();
 
@@ -477,6 +508,7 @@ StmtPtr Parser::parseVarOrFunctionDecl() {
         // SAVE this function's stack size for CodeGen
         int function_stack_size = symbolTable.getMaxStackSize();
         std::cout << "  Function stack size: " << function_stack_size << std::endl;
+        reportFrameSize(identifierName.lexeme);
 
         symbolTable.dump();
         symbolTable.exit_scope();
@@ -516,6 +548,16 @@ StmtPtr Parser::parseVarOrFunctionDecl() {
                                               std::move(init), sym->offset, type);
 }
 
+// The -O0 frame of a function with and without sharing offsets between sibling scopes,
+// rounded up to the 16 bytes the prologue reserves
+void Parser::reportFrameSize(const std::string& function) {
+    if (!ctx.options.frame_report || ctx.options.optimization_level > 0)
+        return;
+    auto frame = [](int size) { return (size + 15) / 16 * 16; };
+    std::cout << "frame of '" << function << "': " << frame(symbolTable.getUnsharedStackSize())
+              << " -> " << frame(symbolTable.getMaxStackSize()) << " bytes\n";
+}
+
 StmtPtr Parser::parseBlock() {
     symbolTable.enter_scope();
 
@@ -779,6 +821,7 @@ StmtPtr Parser::parseClassDecl() {
             symbolTable.exit_scope();
 
             std::string mangled_name = mangle_method(classInfo.name, memberName.lexeme);
+            reportFrameSize(mangled_name);
             Token mangledToken = memberName;
             mangledToken.lexeme = mangled_name;
 
@@ -856,6 +899,8 @@ void Parser::synchronize() {
         case TokenType::KEYWORD_WHILE:
         case TokenType::KEYWORD_FOR:
         case TokenType::KEYWORD_RETURN:
+        case TokenType::KEYWORD_INLINE:
+        case TokenType::KEYWORD_NOINLINE:
             return; // We found a valid boundary to resume parsing!
         default:
             break;
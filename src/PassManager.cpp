@@ -0,0 +1,58 @@
+#include "PassManager.h"
+
+#include "Passes.h"
+#include "Verifier.h"
+
+bool FunctionPass::run(Module& mod) {
+    bool changed = false;
+    for (auto& fn : mod.functions) {
+        changed |= runOnFunction(*fn);
+    }
+    return changed;
+}
+
+PassManager::PassManager(CompilerContext& p_ctx) : ctx(p_ctx) {}
+
+void PassManager::add(std::unique_ptr<Pass> pass) {
+    passes.push_back(std::move(pass));
+}
+
+void PassManager::addStandardPipeline(int level) {
+    if (level < 1)
+        return;
+
+    add(std::make_unique<Mem2RegPass>());
+    // Counters go on the CFG as written, before anything depending on the options changes it
+    if (!ctx.options.profile_generate.empty() || !ctx.options.profile_use.empty())
+        add(std::make_unique<ProfilePass>(ctx));
+    add(std::make_unique<SCCPPass>());
+    // Repeated pure calls share one result before inlining copies each of them, nothing
+    // later merges identical instructions
+    add(std::make_unique<PureCallPass>(ctx));
+    add(std::make_unique<InlinerPass>());
+    add(std::make_unique<TailRecursionPass>(ctx));
+    // Arguments that became constants fold through the inlined bodies
+    add(std::make_unique<SCCPPass>());
+    add(std::make_unique<PureCallPass>(ctx));
+    // Results of calls evaluated at compile time fold through their users
+    add(std::make_unique<SCCPPass>());
+    add(std::make_unique<BoundsCheckPass>(ctx));
+    add(std::make_unique<LICMPass>());
+    if (level >= 2)
+        add(std::make_unique<LoopVectorizePass>(ctx));
+    add(std::make_unique<InductionVariablePass>());
+    add(std::make_unique<DeadStoreEliminationPass>());
+    add(std::make_unique<DeadCodeEliminationPass>());
+    if (!ctx.options.profile_use.empty())
+        add(std::make_unique<LoopUnrollPass>());
+    add(std::make_unique<BlockPlacementPass>());
+}
+
+void PassManager::run(Module& mod) {
+    verify_module(mod, "IR generation");
+
+    for (auto& pass : passes) {
+        pass->run(mod);
+        verify_module(mod, std::string("pass '") + pass->name() + "'");
+    }
+}
@@ -0,0 +1,597 @@
+#include "Peephole.h"
+
+#include <algorithm>
+#include <iomanip>
+
+// Helpers. Rules run after register allocation, so registers are compared by class and
+// number: w3 and x3 are the same register, as are s3 and d3.
+
+static bool same_reg(const MReg& a, const MReg& b) {
+    return !a.is_virtual && !b.is_virtual && a.cls == b.cls && a.id == b.id;
+}
+
+static bool is_special(const MReg& r) {
+    return r.cls == RegClass::GPR && (r.id == REG_SP || r.id == REG_ZR);
+}
+
+static bool reads(MachineInstr& mi, const MReg& reg) {
+    bool found = false;
+    mi.forEachReg([&](MReg& r, bool, bool is_use) { found |= is_use && same_reg(r, reg); });
+    return found;
+}
+
+static bool writes(MachineInstr& mi, const MReg& reg) {
+    bool found = false;
+    mi.forEachReg([&](MReg& r, bool is_def, bool) { found |= is_def && same_reg(r, reg); });
+    return found;
+}
+
+static bool mentions_sp(MachineInstr& mi) {
+    bool found = false;
+    mi.forEachReg([&](MReg& r, bool, bool) { found |= same_reg(r, MReg::phys(REG_SP)); });
+    return found;
+}
+
+// Control flow, calls and anything the parser could not model end every window
+static bool is_barrier(const MachineInstr& mi) {
+    if (mi.is_opaque || mi.is_call || mi.isTerminator())
+        return true;
+    const std::string& op = mi.opcode;
+    return op == "b" || op.rfind("b.", 0) == 0 || op == "br" || op == "cbz" || op == "cbnz" ||
+           op == "tbz" || op == "tbnz";
+}
+
+static bool is_store(const MachineInstr& mi) {
+    return mi.opcode.rfind("st", 0) == 0;
+}
+
+static bool is_move(const MachineInstr& mi) {
+    return (mi.opcode == "mov" || mi.opcode == "fmov") && mi.ops.size() == 2 &&
+           mi.ops[0].kind == MachineOperand::Kind::REG &&
+           mi.ops[1].kind == MachineOperand::Kind::REG;
+}
+
+// True when `reg` is overwritten before it is read again, looking from `from` to the end of
+// the block. Unknown (a barrier or the end of the block) counts as live.
+static bool is_dead_after(std::vector<MachineInstr>& insts, size_t from, const MReg& reg) {
+    for (size_t i = from; i < insts.size(); i++) {
+        if (reads(insts[i], reg) || is_barrier(insts[i]))
+            return false;
+        if (writes(insts[i], reg))
+            return true;
+    }
+    return false;
+}
+
+// The register operand of an instruction whose only effect is writing that register
+static MachineOperand* sole_def(MachineInstr& mi) {
+    if (is_barrier(mi) || is_store(mi) || mi.ops.empty())
+        return nullptr;
+    MachineOperand& first = mi.ops[0];
+    if (first.kind != MachineOperand::Kind::REG || !first.is_def || first.is_use ||
+        is_special(first.reg) || std::string("xwds").find(first.view) == std::string::npos)
+        return nullptr;
+
+    int defs = 0;
+    mi.forEachReg([&](MReg&, bool is_def, bool) { defs += is_def; });
+    return defs == 1 ? &first : nullptr;
+}
+
+// A scalar load or store: `ldr`, `ldursh`, `strb`, ... with a register and a memory operand
+struct MemAccess {
+    bool is_load = false;
+    bool is_signed = false;
+    int size = 0;
+    MachineOperand* data = nullptr;
+    MachineOperand* addr = nullptr;
+};
+
+static bool memory_access(MachineInstr& mi, MemAccess& acc) {
+    const std::string& op = mi.opcode;
+    if (op.size() < 3 || mi.ops.size() != 2 || mi.ops[0].kind != MachineOperand::Kind::REG ||
+        mi.ops[1].kind != MachineOperand::Kind::MEM || mi.ops[1].frame_index >= 0)
+        return false;
+
+    std::string rest;
+    if (op.rfind("ld", 0) == 0)
+        acc.is_load = true;
+    else if (op.rfind("st", 0) != 0)
+        return false;
+    rest = op.substr(op[2] == 'u' ? 3 : 2);
+    if (rest.empty() || rest[0] != 'r')
+        return false;
+    rest = rest.substr(1);
+
+    acc.is_signed = !rest.empty() && rest[0] == 's';
+    if (acc.is_signed) {
+        if (!acc.is_load)
+            return false;
+        rest = rest.substr(1);
+    }
+
+    char view = mi.ops[0].view;
+    if (rest == "b")
+        acc.size = 1;
+    else if (rest == "h")
+        acc.size = 2;
+    else if (rest == "w")
+        acc.size = 4;
+    else if (rest.empty() && !acc.is_signed)
+        acc.size = view == 'b' ? 1 : view == 'h' ? 2 : (view == 'w' || view == 's') ? 4
+                   : (view == 'x' || view == 'd') ? 8 : 16;
+    else
+        return false;
+
+    acc.data = &mi.ops[0];
+    acc.addr = &mi.ops[1];
+    return true;
+}
+
+// Width the result of `mi` is known to be zero-extended from, 64 when unknown
+static int zero_extended_bits(const MachineInstr& mi, const MachineOperand& def) {
+    const std::string& op = mi.opcode;
+    if (op == "cset")
+        return 1;
+    if (op == "ldrb" || op == "ldurb" || op == "uxtb")
+        return 8;
+    if (op == "ldrh" || op == "ldurh" || op == "uxth")
+        return 16;
+    return def.view == 'w' ? 32 : 64;
+}
+
+// Width the result of `mi` is known to be sign-extended from, 64 when unknown
+static int sign_extended_bits(const MachineInstr& mi, const MachineOperand& def) {
+    if (def.view != 'x')
+        return 64;
+    const std::string& op = mi.opcode;
+    if (op == "ldrsb" || op == "ldursb" || op == "sxtb")
+        return 8;
+    if (op == "ldrsh" || op == "ldursh" || op == "sxth")
+        return 16;
+    if (op == "ldrsw" || op == "ldursw" || op == "sxtw")
+        return 32;
+    return 64;
+}
+
+static MachineInstr make_move(MReg dst, MReg src, char view) {
+    return MachineInstr(dst.cls == RegClass::GPR ? "mov" : "fmov",
+                        {MachineOperand::def(dst, view), MachineOperand::use(src, view)});
+}
+
+// Rules
+
+// ret / b / brk
+// <anything>        ->  deleted, up to the next label
+static bool unreachable_code(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    if (w.pos + 1 >= insts.size())
+        return false;
+    const std::string& op = insts[w.pos].opcode;
+    if (op != "ret" && op != "b" && op != "br" && op != "brk")
+        return false;
+    if (insts[w.pos + 1].is_opaque)
+        return false;
+    insts.erase(insts.begin() + w.pos + 1);
+    return true;
+}
+
+// b L
+// L:                ->  falls through
+static bool branch_to_next(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    MachineInstr& mi = insts[w.pos];
+    if (mi.opcode != "b" || w.pos + 1 != insts.size() || mi.ops.size() != 1)
+        return false;
+
+    const MachineOperand& target = mi.ops[0];
+    std::string label;
+    if (target.kind == MachineOperand::Kind::BLOCK)
+        label = target.block->label;
+    else if (target.kind == MachineOperand::Kind::SYMBOL)
+        label = target.text;
+    else
+        return false;
+
+    for (size_t i = w.block_index + 1; i < w.mf.blocks.size(); i++) {
+        if (w.mf.blocks[i]->label == label) {
+            insts.pop_back();
+            return true;
+        }
+        if (!w.mf.blocks[i]->insts.empty())
+            break;
+    }
+    return false;
+}
+
+// stur x0, [x29, #-8]
+// ldur x1, [x29, #-8]   ->  mov x1, x0 (or nothing when the registers match)
+static bool store_forwarding(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    MachineInstr& store = insts[w.pos];
+
+    // A plain store writes one slot, a pair store two consecutive ones
+    std::vector<std::pair<MachineOperand*, int64_t>> slots;
+    MachineOperand* addr = nullptr;
+    int size = 0;
+    MemAccess acc;
+    if (memory_access(store, acc) && !acc.is_load) {
+        addr = acc.addr;
+        size = acc.size;
+        slots.push_back({acc.data, addr->imm});
+    } else if (store.opcode == "stp" && store.ops.size() == 3 &&
+               store.ops[2].kind == MachineOperand::Kind::MEM) {
+        addr = &store.ops[2];
+        char view = store.ops[0].view;
+        size = (view == 'w' || view == 's') ? 4 : (view == 'x' || view == 'd') ? 8 : 0;
+        slots.push_back({&store.ops[0], addr->imm});
+        slots.push_back({&store.ops[1], addr->imm + size});
+    } else {
+        return false;
+    }
+    if (!addr || size == 0 || size > 8 || addr->mode != AddrMode::OFFSET || addr->frame_index >= 0)
+        return false;
+
+    size_t end = std::min(insts.size(), w.pos + 4);
+    for (size_t i = w.pos + 1; i < end; i++) {
+        MachineInstr& mi = insts[i];
+        MemAccess load;
+        if (memory_access(mi, load) && load.is_load && load.addr->mode == AddrMode::OFFSET &&
+            same_reg(load.addr->reg, addr->reg)) {
+            for (auto [data, offset] : slots) {
+                if (offset != load.addr->imm)
+                    continue;
+                if (load.size != size || data->reg.cls != load.data->reg.cls ||
+                    is_special(data->reg))
+                    return false;
+
+                MReg src = data->reg;
+                MReg dst = load.data->reg;
+                char view = load.data->view;
+                if (src.cls == RegClass::FPR || size == 8) {
+                    if (same_reg(src, dst))
+                        insts.erase(insts.begin() + i);
+                    else
+                        mi = make_move(dst, src, view);
+                    return true;
+                }
+
+                // Narrow loads extend what the store truncated
+                const char* opcode = size == 4 ? (load.is_signed ? "sxtw" : "mov")
+                                     : size == 2 ? (load.is_signed ? "sxth" : "uxth")
+                                                 : (load.is_signed ? "sxtb" : "uxtb");
+                mi = MachineInstr(opcode, {MachineOperand::def(dst, load.is_signed ? view : 'w'),
+                                           MachineOperand::use(src, 'w')});
+                return true;
+            }
+        }
+
+        if (is_barrier(mi) || is_store(mi) || writes(mi, addr->reg))
+            return false;
+        for (auto [data, offset] : slots) {
+            if (writes(mi, data->reg))
+                return false;
+        }
+    }
+    return false;
+}
+
+// stur x0, [x29, #-8]
+// ...                  (no load that could read the slot)
+// stur x1, [x29, #-8]  ->  only the second store
+static bool dead_store(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    MemAccess store;
+    if (!memory_access(insts[w.pos], store) || store.is_load ||
+        store.addr->mode != AddrMode::OFFSET)
+        return false;
+    const MReg base = store.addr->reg;
+    int64_t begin = store.addr->imm, end = begin + store.size;
+
+    size_t stop = std::min(insts.size(), w.pos + 8);
+    for (size_t i = w.pos + 1; i < stop; i++) {
+        MachineInstr& mi = insts[i];
+        if (is_barrier(mi) || writes(mi, base))
+            return false;
+        MemAccess acc;
+        bool same_base = memory_access(mi, acc) && acc.addr->mode == AddrMode::OFFSET &&
+                         same_reg(acc.addr->reg, base);
+        bool disjoint = same_base && (acc.addr->imm >= end || acc.addr->imm + acc.size <= begin);
+        if (!same_base && mi.opcode.rfind("ld", 0) == 0)
+            return false; // Through another register, it may read the same bytes
+        if (same_base && acc.is_load && !disjoint)
+            return false;
+        bool covers = same_base && acc.addr->imm <= begin && acc.addr->imm + acc.size >= end;
+        if (covers && !acc.is_load) {
+            insts.erase(insts.begin() + w.pos);
+            return true;
+        }
+    }
+    return false;
+}
+
+// str x0, [sp, #-16]!
+// ...               (no sp access, x0 unchanged)
+// ldr x1, [sp], #16  ->  mov x1, x0
+static bool push_pop(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    MachineInstr& push = insts[w.pos];
+    auto is_stack_op = [](const MachineInstr& mi, const char* opcode, AddrMode mode, int64_t imm) {
+        return mi.opcode == opcode && mi.ops.size() == 2 &&
+               mi.ops[0].kind == MachineOperand::Kind::REG &&
+               mi.ops[1].kind == MachineOperand::Kind::MEM && mi.ops[1].frame_index < 0 &&
+               same_reg(mi.ops[1].reg, MReg::phys(REG_SP)) && mi.ops[1].mode == mode &&
+               mi.ops[1].imm == imm;
+    };
+    if (!is_stack_op(push, "str", AddrMode::PRE_INDEX, -16))
+        return false;
+    MachineOperand src = push.ops[0];
+    if (is_special(src.reg) || (src.view != 'x' && src.view != 'd'))
+        return false;
+
+    size_t end = std::min(insts.size(), w.pos + 8);
+    for (size_t i = w.pos + 1; i < end; i++) {
+        MachineInstr& mi = insts[i];
+        if (is_stack_op(mi, "ldr", AddrMode::POST_INDEX, 16)) {
+            MachineOperand dst = mi.ops[0];
+            if (dst.reg.cls != src.reg.cls || std::string("xwds").find(dst.view) == std::string::npos)
+                return false;
+
+            bool full_width = dst.view == 'x' || dst.view == 'd';
+            if (same_reg(src.reg, dst.reg) && full_width)
+                insts.erase(insts.begin() + i);
+            else
+                mi = make_move(dst.reg, src.reg, dst.view);
+            insts.erase(insts.begin() + w.pos);
+            return true;
+        }
+        if (is_barrier(mi) || mentions_sp(mi) || writes(mi, src.reg))
+            return false;
+    }
+    return false;
+}
+
+// ldur x0, [x29, #-8]
+// mov x1, x0        ->  ldur x1, [x29, #-8]   (x0 overwritten before its next read)
+static bool copy_propagation(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    if (w.pos + 1 >= insts.size())
+        return false;
+    MachineOperand* def = sole_def(insts[w.pos]);
+    MachineInstr& mov = insts[w.pos + 1];
+    if (!def || !is_move(mov))
+        return false;
+
+    MReg dst = mov.ops[0].reg;
+    MReg src = mov.ops[1].reg;
+    char view = mov.ops[0].view;
+    if (!same_reg(src, def->reg) || same_reg(dst, src) || dst.cls != src.cls ||
+        is_special(dst) || view != mov.ops[1].view)
+        return false;
+
+    // A full-width copy also moves the zeroed upper half of a narrow def, a narrow one only
+    // matches a def of the same width
+    bool full_width = view == 'x' || view == 'd';
+    if (!full_width && def->view != view)
+        return false;
+    if (!is_dead_after(insts, w.pos + 2, src))
+        return false;
+
+    def->reg = dst;
+    insts.erase(insts.begin() + w.pos + 1);
+    return true;
+}
+
+// mov x1, x0        ->  deleted when x1 is overwritten before its next read, or x1 is x0
+static bool dead_move(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    MachineInstr& mov = insts[w.pos];
+    if (!is_move(mov) || is_special(mov.ops[0].reg))
+        return false;
+
+    // The frame record link stays intact for debuggers and unwinders
+    MReg dst = mov.ops[0].reg;
+    if (dst.cls == RegClass::GPR && (dst.id == REG_FP || dst.id == REG_LR))
+        return false;
+
+    char view = mov.ops[0].view;
+    bool identity = same_reg(mov.ops[0].reg, mov.ops[1].reg) && view == mov.ops[1].view &&
+                    (view == 'x' || view == 'd');
+    if (!identity && !is_dead_after(insts, w.pos + 1, mov.ops[0].reg))
+        return false;
+
+    insts.erase(insts.begin() + w.pos);
+    return true;
+}
+
+// ldrb w0, [x2]
+// uxtb x0, w0       ->  ldrb w0, [x2]
+static bool redundant_extension(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    if (w.pos + 1 >= insts.size())
+        return false;
+    MachineOperand* def = sole_def(insts[w.pos]);
+    MachineInstr& ext = insts[w.pos + 1];
+    if (!def || def->reg.cls != RegClass::GPR || ext.ops.size() != 2 ||
+        ext.ops[0].kind != MachineOperand::Kind::REG ||
+        ext.ops[1].kind != MachineOperand::Kind::REG || !same_reg(ext.ops[0].reg, def->reg) ||
+        !same_reg(ext.ops[1].reg, def->reg) || ext.ops[1].view != 'w')
+        return false;
+
+    const std::string& op = ext.opcode;
+    bool is_signed = op[0] == 's';
+    int bits = 0;
+    if (op == "uxtb" || op == "sxtb")
+        bits = 8;
+    else if (op == "uxth" || op == "sxth")
+        bits = 16;
+    else if (op == "uxtw" || op == "sxtw" || (op == "mov" && ext.ops[0].view == 'w'))
+        bits = 32;
+    else
+        return false;
+
+    int zero_bits = zero_extended_bits(insts[w.pos], *def);
+    bool redundant = is_signed ? ext.ops[0].view == 'x' &&
+                                     (sign_extended_bits(insts[w.pos], *def) <= bits ||
+                                      zero_bits < bits)
+                               : zero_bits <= bits;
+    if (!redundant)
+        return false;
+
+    insts.erase(insts.begin() + w.pos + 1);
+    return true;
+}
+
+// ldr x0, [x29, #-16]
+// ldr x1, [x29, #-8]   ->  ldp x0, x1, [x29, #-16]
+static bool pair_memory(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    if (w.pos + 1 >= insts.size())
+        return false;
+
+    MemAccess a, b;
+    if (!memory_access(insts[w.pos], a) || !memory_access(insts[w.pos + 1], b))
+        return false;
+    char view = a.data->view;
+    if (a.is_load != b.is_load || a.is_signed || b.is_signed || view != b.data->view ||
+        a.data->reg.cls != b.data->reg.cls || std::string("xwds").find(view) == std::string::npos)
+        return false;
+    if (a.addr->mode != AddrMode::OFFSET || b.addr->mode != AddrMode::OFFSET ||
+        !same_reg(a.addr->reg, b.addr->reg))
+        return false;
+
+    // ldp / stp move whole registers, strh w0 has a 'w' view but writes two bytes
+    int size = a.size;
+    if (size != b.size || size != ((view == 'x' || view == 'd') ? 8 : 4))
+        return false;
+    int64_t delta = b.addr->imm - a.addr->imm;
+    if (delta != size && delta != -size)
+        return false;
+    int64_t low = std::min(a.addr->imm, b.addr->imm);
+    if (low % size != 0 || low / size < -64 || low / size > 63)
+        return false;
+
+    // The first load must not change the base or the register the second one writes
+    if (a.is_load && (same_reg(a.data->reg, a.addr->reg) || same_reg(a.data->reg, b.data->reg)))
+        return false;
+
+    MachineOperand first = delta > 0 ? *a.data : *b.data;
+    MachineOperand second = delta > 0 ? *b.data : *a.data;
+    MReg base = a.addr->reg;
+    insts[w.pos] = MachineInstr(a.is_load ? "ldp" : "stp",
+                                {first, second, MachineOperand::mem(base, low)});
+    insts.erase(insts.begin() + w.pos + 1);
+    return true;
+}
+
+// ldr x0, [x9]
+// ...                 ->  ldr x0, [x9], #8
+// add x9, x9, #8          ...
+static bool post_index(PeepholeWindow& w) {
+    auto& insts = w.insts();
+    MemAccess acc;
+    if (!memory_access(insts[w.pos], acc) || insts[w.pos].opcode[2] == 'u' ||
+        acc.addr->mode != AddrMode::OFFSET || acc.addr->imm != 0 ||
+        same_reg(acc.data->reg, acc.addr->reg))
+        return false;
+    MReg base = acc.addr->reg;
+
+    size_t end = std::min(insts.size(), w.pos + 8);
+    for (size_t i = w.pos + 1; i < end; i++) {
+        MachineInstr& mi = insts[i];
+        bool is_step = (mi.opcode == "add" || mi.opcode == "sub") && mi.ops.size() == 3 &&
+                       mi.ops[0].kind == MachineOperand::Kind::REG && mi.ops[0].view == 'x' &&
+                       same_reg(mi.ops[0].reg, base) &&
+                       mi.ops[1].kind == MachineOperand::Kind::REG &&
+                       same_reg(mi.ops[1].reg, base) &&
+                       mi.ops[2].kind == MachineOperand::Kind::IMM;
+        if (is_step) {
+            int64_t step = mi.opcode == "add" ? mi.ops[2].imm : -mi.ops[2].imm;
+            if (step < -256 || step > 255)
+                return false;
+            acc.addr->mode = AddrMode::POST_INDEX;
+            acc.addr->imm = step;
+            insts.erase(insts.begin() + i);
+            return true;
+        }
+        if (is_barrier(mi) || reads(mi, base) || writes(mi, base))
+            return false;
+    }
+    return false;
+}
+
+const std::vector<PeepholeRule>& peephole_rules() {
+    static const std::vector<PeepholeRule> rules = {
+        {"unreachable-code", 2, unreachable_code},
+        {"branch-to-next", 1, branch_to_next},
+        {"store-forwarding", 4, store_forwarding},
+        {"dead-store", 8, dead_store},
+        {"push-pop", 8, push_pop},
+        {"copy-propagation", 2, copy_propagation},
+        {"dead-move", 1, dead_move},
+        {"redundant-extension", 2, redundant_extension},
+        {"pair-memory", 2, pair_memory},
+        {"post-index", 8, post_index},
+    };
+    return rules;
+}
+
+// PeepholeOptimizer
+
+PeepholeOptimizer::PeepholeOptimizer(CompilerContext& p_ctx) {
+    const auto& rules = peephole_rules();
+    hits.assign(rules.size(), 0);
+    if (!p_ctx.options.peephole)
+        return;
+
+    const auto& disabled = p_ctx.options.disabled_peepholes;
+    for (size_t i = 0; i < rules.size(); i++) {
+        if (std::find(disabled.begin(), disabled.end(), rules[i].name) != disabled.end())
+            continue;
+        enabled.push_back(i);
+        lookback = std::max(lookback, rules[i].window - 1);
+    }
+}
+
+bool PeepholeOptimizer::runOnBlock(MachineFunction& mf, size_t block_index) {
+    const auto& rules = peephole_rules();
+    PeepholeWindow w{mf, block_index, 0};
+    bool changed = false;
+
+    while (w.pos < w.insts().size()) {
+        bool fired = false;
+        for (size_t index : enabled) {
+            if (rules[index].apply(w)) {
+                hits[index]++;
+                fired = true;
+                break;
+            }
+        }
+        if (fired) {
+            changed = true;
+            w.pos = w.pos > lookback ? w.pos - lookback : 0;
+        } else {
+            w.pos++;
+        }
+    }
+    return changed;
+}
+
+void PeepholeOptimizer::run(MachineFunction& mf) {
+    if (enabled.empty())
+        return;
+    for (size_t i = 0; i < mf.blocks.size(); i++) {
+        while (runOnBlock(mf, i)) {
+        }
+    }
+}
+
+void PeepholeOptimizer::printStats(std::ostream& os) const {
+    const auto& rules = peephole_rules();
+    os << "Peephole rule hits:\n";
+    for (size_t i = 0; i < rules.size(); i++) {
+        os << "  " << std::left << std::setw(22) << rules[i].name << std::right << hits[i];
+        if (std::find(enabled.begin(), enabled.end(), i) == enabled.end())
+            os << " (disabled)";
+        os << "\n";
+    }
+}
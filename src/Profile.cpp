@@ -0,0 +1,69 @@
+#include "Profile.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+bool ProfileData::read(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+
+    size_t pos = 0;
+    auto word = [&](uint64_t& w) {
+        if (bytes.size() - pos < 8)
+            return false;
+        w = 0;
+        for (int i = 7; i >= 0; i--)
+            w = (w << 8) | static_cast<unsigned char>(bytes[pos + i]);
+        pos += 8;
+        return true;
+    };
+
+    uint64_t version, num_functions, num_counters;
+    if (bytes.size() < 8 || std::memcmp(bytes.data(), PROFILE_MAGIC, 8) != 0)
+        return false;
+    pos = 8;
+    if (!word(version) || version != PROFILE_VERSION || !word(num_functions) ||
+        !word(num_counters))
+        return false;
+
+    struct Entry {
+        std::string name;
+        uint64_t checksum, first, count;
+    };
+    std::vector<Entry> entries;
+    for (uint64_t i = 0; i < num_functions; i++) {
+        Entry e;
+        uint64_t length;
+        if (!word(length) || length > bytes.size() - pos)
+            return false;
+        e.name.assign(bytes.data() + pos, length);
+        pos += (length + 7) & ~uint64_t(7);
+        if (pos > bytes.size() || !word(e.checksum) || !word(e.first) || !word(e.count) ||
+            e.first > num_counters || e.count > num_counters - e.first)
+            return false;
+        entries.push_back(std::move(e));
+    }
+
+    if ((bytes.size() - pos) / 8 < num_counters)
+        return false;
+    std::vector<uint64_t> counters(num_counters);
+    for (uint64_t& c : counters)
+        word(c);
+
+    functions.clear();
+    for (const Entry& e : entries) {
+        FunctionProfile& fp = functions[e.name];
+        fp.checksum = e.checksum;
+        fp.counts.assign(counters.begin() + e.first, counters.begin() + e.first + e.count);
+    }
+    return true;
+}
+
+const FunctionProfile* ProfileData::find(const std::string& name) const {
+    auto it = functions.find(name);
+    return it == functions.end() ? nullptr : &it->second;
+}
@@ -0,0 +1,142 @@
+#include "Passes.h"
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+
+// Routine of the runtime writing the counters out, called by main before it returns
+static const char* const PROFILE_DUMP = "capp_profile_dump";
+
+// An edge from a block with two successors into a block with several predecessors gets a
+// block of its own, which then counts the edge alone
+static void split_critical_edges(Function& fn) {
+    fn.rebuildCFG();
+
+    std::vector<BasicBlock*> original;
+    for (auto& bb : fn.blocks)
+        original.push_back(bb.get());
+
+    for (BasicBlock* bb : original) {
+        Instruction* term = bb->terminator();
+        if (!term || term->op != Opcode::COND_BR || term->blocks[0] == term->blocks[1])
+            continue;
+        for (BasicBlock*& target : term->blocks) {
+            if (target->preds.size() < 2)
+                continue;
+            BasicBlock* edge = fn.createBlock(bb->name + ".edge");
+            auto br = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+            br->blocks.push_back(target);
+            edge->append(std::move(br));
+            for (auto& inst : target->insts) {
+                if (inst->op != Opcode::PHI)
+                    break;
+                std::replace(inst->blocks.begin(), inst->blocks.end(), bb, edge);
+            }
+            target = edge;
+        }
+    }
+
+    fn.rebuildCFG();
+}
+
+// FNV-1a over the number of blocks and the successors of each, by position. Anything
+// that changes the control flow of a function invalidates its counts.
+static uint64_t cfg_checksum(const Function& fn) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            hash ^= (value >> (8 * i)) & 0xFF;
+            hash *= 1099511628211ull;
+        }
+    };
+
+    std::unordered_map<const BasicBlock*, uint64_t> index;
+    for (size_t i = 0; i < fn.blocks.size(); i++)
+        index[fn.blocks[i].get()] = i;
+    mix(fn.blocks.size());
+    for (auto& bb : fn.blocks) {
+        std::vector<BasicBlock*> succs = bb->successors();
+        mix(succs.size());
+        for (BasicBlock* succ : succs)
+            mix(index.at(succ));
+    }
+    return hash;
+}
+
+static Instruction* first_non_phi(BasicBlock* bb) {
+    for (auto& inst : bb->insts) {
+        if (inst->op != Opcode::PHI)
+            return inst.get();
+    }
+    return nullptr;
+}
+
+static void instrument(Function& fn, uint64_t checksum) {
+    Module& mod = *fn.parent;
+    int first = 0;
+    if (!mod.profiled.empty())
+        first = mod.profiled.back().first_counter + mod.profiled.back().num_counters;
+
+    for (size_t i = 0; i < fn.blocks.size(); i++) {
+        BasicBlock* bb = fn.blocks[i].get();
+        auto inc = std::make_unique<Instruction>(Opcode::PROFILE_INC, IRType::VOID);
+        inc->imm = 8 * (first + static_cast<int64_t>(i));
+        bb->insertBefore(first_non_phi(bb), std::move(inc));
+    }
+    mod.profiled.push_back({fn.name, checksum, first, static_cast<int>(fn.blocks.size())});
+
+    if (fn.name != "main")
+        return;
+    for (auto& bb : fn.blocks) {
+        Instruction* term = bb->terminator();
+        if (term->op != Opcode::RET)
+            continue;
+        auto call = std::make_unique<Instruction>(Opcode::CALL, IRType::VOID);
+        call->callee = PROFILE_DUMP;
+        bb->insertBefore(term, std::move(call));
+    }
+}
+
+static void annotate(Function& fn, const FunctionProfile& profile) {
+    for (size_t i = 0; i < fn.blocks.size(); i++) {
+        uint64_t count = profile.counts[i];
+        fn.blocks[i]->profile_count = static_cast<int64_t>(std::min<uint64_t>(count, INT64_MAX));
+    }
+
+    // With critical edges split, the successors of a branch are only entered through it
+    for (auto& bb : fn.blocks) {
+        Instruction* term = bb->terminator();
+        if (term->op != Opcode::COND_BR || term->blocks[0] == term->blocks[1])
+            continue;
+        double t = static_cast<double>(term->blocks[0]->profile_count);
+        double f = static_cast<double>(term->blocks[1]->profile_count);
+        if (t + f > 0)
+            term->taken = t / (t + f);
+    }
+}
+
+bool ProfilePass::runOnFunction(Function& fn) {
+    if (fn.blocks.empty())
+        return false;
+    const CompilerOptions& options = ctx.options;
+
+    size_t before = fn.blocks.size();
+    split_critical_edges(fn);
+    uint64_t checksum = cfg_checksum(fn);
+
+    if (!options.profile_generate.empty()) {
+        instrument(fn, checksum);
+        return true;
+    }
+
+    // Functions added or edited since the profile was taken fall back on static estimates
+    const FunctionProfile* profile = ctx.profile.find(fn.name);
+    if (profile && (profile->checksum != checksum || profile->counts.size() != fn.blocks.size())) {
+        std::cerr << "warning: profile of '" << fn.name << "' does not match its code, ignored"
+                  << std::endl;
+        profile = nullptr;
+    }
+    if (profile)
+        annotate(fn, *profile);
+    return profile || fn.blocks.size() != before;
+}
@@ -0,0 +1,199 @@
+#include "Dominators.h"
+#include "Interpreter.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+// Library functions without side effects that are called rather than lowered to
+// instructions
+static bool is_pure_external(const std::string& name) {
+    return name == "sin_f" || name == "cos_f" || name == "tan_f";
+}
+
+// True if `addr` is computed from a FRAME_ADDR by adding offsets, i.e. points into the
+// function's own frame
+static bool is_frame_address(const Value* addr) {
+    if (addr->kind != ValueKind::INSTRUCTION)
+        return false;
+    const auto* inst = static_cast<const Instruction*>(addr);
+    switch (inst->op) {
+    case Opcode::FRAME_ADDR:
+        return true;
+    case Opcode::ADD:
+        return is_frame_address(inst->operands[0]) || is_frame_address(inst->operands[1]);
+    case Opcode::SUB:
+        return is_frame_address(inst->operands[0]);
+    default:
+        return false;
+    }
+}
+
+// Effects of the function body itself, assuming its callees are as currently recorded
+static Purity purity_of(const Function& fn) {
+    Purity purity = Purity::PURE;
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            switch (inst->op) {
+            case Opcode::LOAD:
+            case Opcode::VLOAD:
+                if (!is_frame_address(inst->operands[0]))
+                    purity = std::min(purity, Purity::READ_ONLY);
+                break;
+            case Opcode::STORE:
+            case Opcode::VSTORE:
+                if (!is_frame_address(inst->operands[1]))
+                    return Purity::IMPURE;
+                break;
+            case Opcode::PROFILE_INC:
+                return Purity::IMPURE;
+            case Opcode::CALL:
+                if (Function* callee = fn.parent->findFunction(inst->callee))
+                    purity = std::min(purity, callee->purity);
+                else if (!is_pure_external(inst->callee))
+                    return Purity::IMPURE;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    return purity;
+}
+
+// Optimistic fixpoint over the call graph: every defined function starts out pure and only
+// loses purity, so cycles of recursion stay pure unless something in them has effects
+static void compute_purity(Module& mod) {
+    for (auto& fn : mod.functions)
+        fn->purity = fn->blocks.empty() ? Purity::IMPURE : Purity::PURE;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto& fn : mod.functions) {
+            if (fn->blocks.empty())
+                continue;
+            Purity purity = purity_of(*fn);
+            if (purity != fn->purity) {
+                fn->purity = purity;
+                changed = true;
+            }
+        }
+    }
+}
+
+static Function* pure_callee(Module& mod, const Instruction& inst) {
+    if (inst.op != Opcode::CALL)
+        return nullptr;
+    Function* callee = mod.findFunction(inst.callee);
+    return callee && callee->purity == Purity::PURE ? callee : nullptr;
+}
+
+static void print_result(const Value* v) {
+    if (!v)
+        std::cout << "void";
+    else
+        print_value_ref(std::cout, v);
+}
+
+bool PureCallPass::run(Module& mod) {
+    std::map<const Function*, Purity> before;
+    for (auto& fn : mod.functions)
+        before[fn.get()] = fn->purity;
+    compute_purity(mod);
+
+    // The pass runs before and after inlining, a classification is reported once
+    if (ctx.options.pure_call_report) {
+        for (auto& fn : mod.functions) {
+            if (fn->purity == before[fn.get()])
+                continue;
+            if (fn->purity == Purity::PURE)
+                std::cout << "'" << fn->name << "' is pure\n";
+            else if (fn->purity == Purity::READ_ONLY)
+                std::cout << "'" << fn->name << "' is read-only\n";
+        }
+    }
+
+    // The same call is evaluated once per module, whether it succeeds or not
+    using CallKey = std::pair<Function*, std::vector<Value*>>;
+    std::map<CallKey, std::pair<bool, Value*>> evaluated;
+    Interpreter interpreter(mod);
+    bool changed = false;
+
+    for (auto& fn : mod.functions) {
+        if (fn->blocks.empty())
+            continue;
+        fn->rebuildCFG();
+
+        // Calls with constant arguments are run now. Calls whose result goes unused still
+        // have to run, the callee may fail a bounds check.
+        std::vector<Instruction*> calls;
+        for (auto& bb : fn->blocks) {
+            for (auto& inst : bb->insts) {
+                if (pure_callee(mod, *inst))
+                    calls.push_back(inst.get());
+            }
+        }
+        for (Instruction* call : calls) {
+            if (!std::all_of(call->operands.begin(), call->operands.end(),
+                             [](const Value* v) { return v->isConstant(); }))
+                continue;
+
+            Function* callee = pure_callee(mod, *call);
+            CallKey key{callee, call->operands};
+            auto it = evaluated.find(key);
+            if (it == evaluated.end()) {
+                Value* result = nullptr;
+                bool ok = interpreter.call(*callee, call->operands, result);
+                it = evaluated.emplace(key, std::make_pair(ok, result)).first;
+            }
+            auto [ok, result] = it->second;
+            if (!ok)
+                continue;
+
+            if (ctx.options.pure_call_report) {
+                std::cout << "evaluated the call to '" << callee->name << "' in '" << fn->name
+                          << "' at compile time: ";
+                print_result(result);
+                std::cout << "\n";
+            }
+            if (call->type != IRType::VOID)
+                fn->replaceAllUses(call, result);
+            call->parent->erase(call);
+            changed = true;
+        }
+
+        // A call dominated by the same call on the same values computes the same result,
+        // and cannot trap unless the first one already did
+        DominatorTree dt(*fn);
+        std::map<CallKey, std::vector<Instruction*>> available;
+        std::vector<std::pair<Instruction*, Instruction*>> redundant;
+        for (BasicBlock* bb : dt.rpo()) {
+            for (auto& inst : bb->insts) {
+                Function* callee = pure_callee(mod, *inst);
+                if (!callee)
+                    continue;
+                auto& earlier = available[{callee, inst->operands}];
+                auto dominating = std::find_if(earlier.begin(), earlier.end(), [&](Instruction* e) {
+                    return dt.dominates(e, inst.get());
+                });
+                if (dominating != earlier.end())
+                    redundant.push_back({inst.get(), *dominating});
+                else
+                    earlier.push_back(inst.get());
+            }
+        }
+        for (auto& [call, earlier] : redundant) {
+            if (ctx.options.pure_call_report) {
+                std::cout << "reused the result of an earlier call to '" << call->callee
+                          << "' in '" << fn->name << "'\n";
+            }
+            if (call->type != IRType::VOID)
+                fn->replaceAllUses(call, earlier);
+            call->parent->erase(call);
+            changed = true;
+        }
+    }
+    return changed;
+}
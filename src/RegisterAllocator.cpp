@@ -0,0 +1,525 @@
+#include "RegisterAllocator.h"
+
+#include <algorithm>
+#include <climits>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+
+// Allocation order: caller-saved registers first, argument registers last among them so
+// that values rarely sit in a register a call sequence needs, then callee-saved ones
+static const int GPR_ORDER[] = {9,  10, 11, 12, 13, 14, 8,  7,  6,  5,  4,  3,  2,
+                                1,  0,  19, 20, 21, 22, 23, 24, 25, 26, 27, 28};
+static const int FPR_ORDER[] = {16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 7,
+                                6,  5,  4,  3,  2,  1,  0,  8,  9,  10, 11, 12, 13, 14, 15};
+
+static bool is_callee_saved(RegClass cls, int phys) {
+    if (cls == RegClass::GPR)
+        return phys >= 19 && phys <= 28;
+    return phys >= 8 && phys <= 15;
+}
+
+static bool is_allocatable(const MReg& r) {
+    if (r.is_virtual)
+        return false;
+    const int* begin = r.cls == RegClass::GPR ? std::begin(GPR_ORDER) : std::begin(FPR_ORDER);
+    const int* end = r.cls == RegClass::GPR ? std::end(GPR_ORDER) : std::end(FPR_ORDER);
+    return std::find(begin, end, r.id) != end;
+}
+
+// A copy of every bit of a register into another of its class. A w register copy clears
+// the upper half and a vector lane move keeps the other lanes, neither is one.
+static bool is_full_copy(const MachineInstr& mi) {
+    if ((mi.opcode != "mov" && mi.opcode != "fmov") || mi.ops.size() != 2 ||
+        mi.ops[0].kind != MachineOperand::Kind::REG || mi.ops[1].kind != MachineOperand::Kind::REG)
+        return false;
+    const MachineOperand& dst = mi.ops[0];
+    const MachineOperand& src = mi.ops[1];
+    return dst.reg.cls == src.reg.cls && dst.view == src.view && dst.view != 'w' &&
+           (dst.view != 'v' || (dst.text == ".16b" && src.text == ".16b"));
+}
+
+static bool is_identity_copy(const MachineInstr& mi) {
+    return is_full_copy(mi) && mi.ops[0].reg == mi.ops[1].reg;
+}
+
+// Whether two sorted lists of inclusive position ranges share a position
+static bool ranges_overlap(const std::vector<std::pair<int, int>>& a,
+                           const std::vector<std::pair<int, int>>& b) {
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (a[i].second < b[j].first)
+            i++;
+        else if (b[j].second < a[i].first)
+            j++;
+        else
+            return true;
+    }
+    return false;
+}
+
+// Fixed size set of virtual registers
+class VRegSet {
+  public:
+    explicit VRegSet(size_t n = 0) : words((n + 63) / 64, 0) {}
+
+    void insert(int v) {
+        words[v / 64] |= uint64_t(1) << (v % 64);
+    }
+    void erase(int v) {
+        words[v / 64] &= ~(uint64_t(1) << (v % 64));
+    }
+    bool contains(int v) const {
+        return (words[v / 64] >> (v % 64)) & 1;
+    }
+    // this |= other, returns whether anything changed
+    bool merge(const VRegSet& other) {
+        bool changed = false;
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t merged = words[i] | other.words[i];
+            changed |= merged != words[i];
+            words[i] = merged;
+        }
+        return changed;
+    }
+    template <typename F> void forEach(F fn) const {
+        for (size_t i = 0; i < words.size(); i++) {
+            for (uint64_t w = words[i]; w != 0; w &= w - 1)
+                fn(static_cast<int>(i * 64 + __builtin_ctzll(w)));
+        }
+    }
+
+  private:
+    std::vector<uint64_t> words;
+};
+
+RegisterAllocator::RegisterAllocator(MachineFunction& p_mf)
+    : mf(p_mf), spill_slots(p_mf.vreg_classes.size(), -1) {}
+
+void RegisterAllocator::run() {
+    numberInstructions();
+    computeIntervals();
+    coalesce();
+    allocate();
+    rewrite();
+}
+
+void RegisterAllocator::numberInstructions() {
+    int index = 0;
+    for (auto& mb : mf.blocks) {
+        block_start.push_back(2 * index);
+        index += static_cast<int>(mb->insts.size());
+        block_end.push_back(std::max(2 * index - 1, block_start.back()));
+    }
+}
+
+void RegisterAllocator::computeIntervals() {
+    size_t num_vregs = mf.vreg_classes.size();
+    size_t num_blocks = mf.blocks.size();
+
+    std::unordered_map<const MachineBlock*, size_t> block_index;
+    for (size_t b = 0; b < num_blocks; b++)
+        block_index[mf.blocks[b].get()] = b;
+
+    // Upward exposed uses and definitions of each block
+    std::vector<VRegSet> uses(num_blocks, VRegSet(num_vregs));
+    std::vector<VRegSet> defs(num_blocks, VRegSet(num_vregs));
+    for (size_t b = 0; b < num_blocks; b++) {
+        for (auto& mi : mf.blocks[b]->insts) {
+            mi.forEachReg([&](MReg& reg, bool, bool is_use) {
+                if (reg.is_virtual && is_use && !defs[b].contains(reg.id))
+                    uses[b].insert(reg.id);
+            });
+            mi.forEachReg([&](MReg& reg, bool is_def, bool) {
+                if (reg.is_virtual && is_def)
+                    defs[b].insert(reg.id);
+            });
+        }
+    }
+
+    std::vector<VRegSet> live_in(num_blocks, VRegSet(num_vregs));
+    std::vector<VRegSet> live_out(num_blocks, VRegSet(num_vregs));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = num_blocks; b-- > 0;) {
+            for (MachineBlock* succ : mf.blocks[b]->succs)
+                live_out[b].merge(live_in[block_index[succ]]);
+
+            VRegSet in = uses[b];
+            live_out[b].forEach([&](int v) {
+                if (!defs[b].contains(v))
+                    in.insert(v);
+            });
+            changed |= live_in[b].merge(in);
+        }
+    }
+
+    intervals.clear();
+    def_positions.assign(num_vregs, {});
+    for (size_t v = 0; v < num_vregs; v++) {
+        intervals.push_back(LiveInterval{.vreg = static_cast<int>(v),
+                                         .cls = mf.vreg_classes[v],
+                                         .start = INT_MAX,
+                                         .end = -1,
+                                         .ranges = {}});
+    }
+
+    // Each block is walked backwards from its live-out set: a value is live from its
+    // definition, or the block start, to its last read before that, or the block end. A
+    // value the block redefines while live through it, like a loop phi's register, gets a
+    // hole between its last read and the new definition.
+    std::vector<int> segment_end(num_vregs, -1);
+    std::vector<int> open;
+    std::vector<std::pair<int, std::pair<int, int>>> found;
+
+    for (size_t b = 0; b < num_blocks; b++) {
+        int pos = block_start[b];
+        for (auto& mi : mf.blocks[b]->insts) {
+            // Copies between a virtual and a physical register suggest sharing it
+            if ((mi.opcode == "mov" || mi.opcode == "fmov") && mi.ops.size() == 2 &&
+                mi.ops[0].kind == MachineOperand::Kind::REG &&
+                mi.ops[1].kind == MachineOperand::Kind::REG) {
+                MReg dst = mi.ops[0].reg;
+                MReg src = mi.ops[1].reg;
+                if (dst.is_virtual && is_allocatable(src))
+                    intervals[dst.id].hint = src.id;
+                else if (src.is_virtual && is_allocatable(dst))
+                    intervals[src.id].hint = dst.id;
+                else if (dst.is_virtual && src.is_virtual && is_full_copy(mi))
+                    copy_sources[pos + 1] = src.id;
+            }
+            mi.forEachReg([&](MReg& reg, bool is_def, bool) {
+                if (reg.is_virtual && is_def)
+                    def_positions[reg.id].push_back(pos + 1);
+            });
+            pos += 2;
+        }
+
+        live_out[b].forEach([&](int v) {
+            segment_end[v] = block_end[b];
+            open.push_back(v);
+        });
+        pos = block_end[b] - 1;
+        for (auto it = mf.blocks[b]->insts.rbegin(); it != mf.blocks[b]->insts.rend(); ++it) {
+            it->forEachReg([&](MReg& reg, bool is_def, bool) {
+                if (!reg.is_virtual || !is_def)
+                    return;
+                int end = segment_end[reg.id] < 0 ? pos + 1 : segment_end[reg.id];
+                found.push_back({reg.id, {pos + 1, end}});
+                segment_end[reg.id] = -1;
+            });
+            it->forEachReg([&](MReg& reg, bool, bool is_use) {
+                if (!reg.is_virtual || !is_use || segment_end[reg.id] >= 0)
+                    return;
+                segment_end[reg.id] = pos;
+                open.push_back(reg.id);
+            });
+            pos -= 2;
+        }
+        for (int v : open) {
+            if (segment_end[v] < 0)
+                continue;
+            found.push_back({v, {block_start[b], segment_end[v]}});
+            segment_end[v] = -1;
+        }
+        open.clear();
+
+        // Found last to first
+        for (auto it = found.rbegin(); it != found.rend(); ++it) {
+            LiveInterval& interval = intervals[it->first];
+            interval.start = std::min(interval.start, it->second.first);
+            interval.end = std::max(interval.end, it->second.second);
+            interval.ranges.push_back(it->second);
+        }
+        found.clear();
+
+        // Physical registers are only live within a block, except arguments on entry
+        std::map<std::pair<RegClass, int>, int> live_until;
+        pos = block_end[b] - 1;
+        for (auto it = mf.blocks[b]->insts.rbegin(); it != mf.blocks[b]->insts.rend(); ++it) {
+            it->forEachReg([&](MReg& reg, bool is_def, bool) {
+                if (!is_def || !is_allocatable(reg))
+                    return;
+                auto key = std::make_pair(reg.cls, reg.id);
+                auto live = live_until.find(key);
+                int end = live == live_until.end() ? pos + 1 : live->second;
+                fixed_ranges[key].push_back({pos + 1, end});
+                if (live != live_until.end())
+                    live_until.erase(live);
+            });
+            it->forEachReg([&](MReg& reg, bool, bool is_use) {
+                if (!is_use || !is_allocatable(reg))
+                    return;
+                auto key = std::make_pair(reg.cls, reg.id);
+                if (!live_until.count(key))
+                    live_until[key] = pos;
+            });
+            pos -= 2;
+        }
+        for (auto& [key, end] : live_until)
+            fixed_ranges[key].push_back({block_start[b] - 1, end});
+    }
+}
+
+// Whether one of the sorted, disjoint `ranges` contains `pos`
+static bool covers(const std::vector<std::pair<int, int>>& ranges, int pos) {
+    auto it = std::lower_bound(ranges.begin(), ranges.end(), pos,
+                               [](const std::pair<int, int>& r, int p) { return r.second < p; });
+    return it != ranges.end() && it->first <= pos;
+}
+
+int RegisterAllocator::leaderOf(int vreg) {
+    while (leader[vreg] != vreg)
+        vreg = leader[vreg] = leader[leader[vreg]];
+    return vreg;
+}
+
+// Two values may share a register when neither is written while the other is live, other
+// than by a copy of it (Chaitin): the phi copies then become moves of a register onto
+// itself, which rewriting drops
+bool RegisterAllocator::writesWhileLive(int group, int other) {
+    for (int pos : def_positions[group]) {
+        auto copy = copy_sources.find(pos);
+        if (copy != copy_sources.end() && leaderOf(copy->second) == other)
+            continue;
+        if (covers(intervals[other].ranges, pos))
+            return true;
+    }
+    return false;
+}
+
+void RegisterAllocator::coalesce() {
+    leader.resize(intervals.size());
+    for (size_t v = 0; v < leader.size(); v++)
+        leader[v] = static_cast<int>(v);
+
+    for (auto [dst, src] : mf.phi_copies) {
+        int a = leaderOf(dst);
+        int b = leaderOf(src);
+        if (a == b || intervals[a].cls != intervals[b].cls ||
+            mf.vreg_is_vector[a] != mf.vreg_is_vector[b] || writesWhileLive(a, b) ||
+            writesWhileLive(b, a))
+            continue;
+
+        LiveInterval& into = intervals[a];
+        LiveInterval& from = intervals[b];
+        std::vector<std::pair<int, int>> ranges;
+        std::merge(into.ranges.begin(), into.ranges.end(), from.ranges.begin(),
+                   from.ranges.end(), std::back_inserter(ranges));
+        into.ranges.clear();
+        for (auto& range : ranges) {
+            if (!into.ranges.empty() && range.first <= into.ranges.back().second + 1)
+                into.ranges.back().second = std::max(into.ranges.back().second, range.second);
+            else
+                into.ranges.push_back(range);
+        }
+        into.start = std::min(into.start, from.start);
+        into.end = std::max(into.end, from.end);
+        if (into.hint < 0)
+            into.hint = from.hint;
+        def_positions[a].insert(def_positions[a].end(), def_positions[b].begin(),
+                                def_positions[b].end());
+
+        from.ranges.clear();
+        from.start = INT_MAX;
+        from.end = -1;
+        leader[b] = a;
+    }
+}
+
+bool RegisterAllocator::conflictsWithFixed(const LiveInterval& interval, RegClass cls,
+                                           int phys) const {
+    auto it = fixed_ranges.find({cls, phys});
+    if (it == fixed_ranges.end())
+        return false;
+    for (auto& [start, end] : it->second) {
+        for (auto& [from, to] : interval.ranges) {
+            if (start <= to && from <= end)
+                return true;
+        }
+    }
+    return false;
+}
+
+void RegisterAllocator::allocate() {
+    std::vector<LiveInterval*> order;
+    for (auto& interval : intervals) {
+        if (interval.start <= interval.end)
+            order.push_back(&interval);
+    }
+    std::sort(order.begin(), order.end(), [](const LiveInterval* a, const LiveInterval* b) {
+        return a->start < b->start || (a->start == b->start && a->vreg < b->vreg);
+    });
+
+    std::vector<LiveInterval*> active;
+
+    for (LiveInterval* cur : order) {
+        std::erase_if(active, [&](const LiveInterval* i) { return i->end < cur->start; });
+
+        auto in_use = [&](int phys) {
+            return std::any_of(active.begin(), active.end(), [&](const LiveInterval* i) {
+                return i->cls == cur->cls && i->phys == phys &&
+                       ranges_overlap(i->ranges, cur->ranges);
+            });
+        };
+        auto usable = [&](int phys) {
+            return !in_use(phys) && !conflictsWithFixed(*cur, cur->cls, phys);
+        };
+
+        int chosen = -1;
+        if (cur->hint >= 0 && is_allocatable(MReg::phys(cur->hint, cur->cls)) &&
+            usable(cur->hint))
+            chosen = cur->hint;
+
+        if (chosen < 0) {
+            if (cur->cls == RegClass::GPR) {
+                for (int phys : GPR_ORDER) {
+                    if (usable(phys)) {
+                        chosen = phys;
+                        break;
+                    }
+                }
+            } else {
+                for (int phys : FPR_ORDER) {
+                    if (usable(phys)) {
+                        chosen = phys;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (chosen < 0) {
+            // Register pressure: evict the compatible interval that ends last, if that
+            // is further away than the current one. Its register must not be shared with
+            // another interval overlapping the current one.
+            auto sharers = [&](const LiveInterval* v) {
+                return std::count_if(active.begin(), active.end(), [&](const LiveInterval* i) {
+                    return i->cls == v->cls && i->phys == v->phys &&
+                           ranges_overlap(i->ranges, cur->ranges);
+                });
+            };
+            LiveInterval* victim = nullptr;
+            for (LiveInterval* i : active) {
+                if (i->cls != cur->cls || conflictsWithFixed(*cur, cur->cls, i->phys) ||
+                    !ranges_overlap(i->ranges, cur->ranges) || sharers(i) != 1)
+                    continue;
+                if (!victim || i->end > victim->end)
+                    victim = i;
+            }
+
+            if (victim && victim->end > cur->end) {
+                chosen = victim->phys;
+                victim->spilled = true;
+                victim->phys = -1;
+                std::erase(active, victim);
+            } else {
+                cur->spilled = true;
+                continue;
+            }
+        }
+
+        cur->phys = chosen;
+        active.push_back(cur);
+    }
+
+    for (auto& interval : intervals) {
+        if (interval.phys < 0 || !is_callee_saved(interval.cls, interval.phys))
+            continue;
+        auto& used = interval.cls == RegClass::GPR ? mf.used_callee_saved_gpr
+                                                   : mf.used_callee_saved_fpr;
+        if (std::find(used.begin(), used.end(), interval.phys) == used.end())
+            used.push_back(interval.phys);
+    }
+    std::sort(mf.used_callee_saved_gpr.begin(), mf.used_callee_saved_gpr.end());
+    std::sort(mf.used_callee_saved_fpr.begin(), mf.used_callee_saved_fpr.end());
+}
+
+int RegisterAllocator::spillSlot(int vreg) {
+    int& slot = spill_slots[vreg];
+    if (slot < 0) {
+        int size = mf.vreg_is_vector[vreg] ? 16 : 8;
+        slot = mf.createFrameObject(size, size, true);
+    }
+    return slot;
+}
+
+char RegisterAllocator::spillView(int vreg, const MReg& phys) const {
+    if (phys.cls == RegClass::GPR)
+        return 'x';
+    return mf.vreg_is_vector[vreg] ? 'q' : 'd';
+}
+
+void RegisterAllocator::rewrite() {
+    using MO = MachineOperand;
+
+    for (auto& mb : mf.blocks) {
+        std::vector<MachineInstr> rewritten;
+
+        for (auto& mi : mb->insts) {
+            // Coalesced registers take the interval they were merged into. A copy within one
+            // goes away here, before spill code would reload and store it back.
+            mi.forEachReg([&](MReg& reg, bool, bool) {
+                if (reg.is_virtual)
+                    reg.id = leaderOf(reg.id);
+            });
+            if (is_identity_copy(mi))
+                continue;
+
+            // Spilled registers go through a scratch register around the instruction
+            std::map<int, MReg> scratch;
+            std::map<int, bool> read, written;
+            size_t next_gpr = 0, next_fpr = 0;
+
+            mi.forEachReg([&](MReg& reg, bool is_def, bool is_use) {
+                if (!reg.is_virtual || !intervals[reg.id].spilled)
+                    return;
+                if (!scratch.count(reg.id)) {
+                    int phys;
+                    if (reg.cls == RegClass::GPR) {
+                        if (next_gpr == std::size(GPR_SPILL_SCRATCH))
+                            throw std::logic_error("Out of spill registers in " + mf.name);
+                        phys = GPR_SPILL_SCRATCH[next_gpr++];
+                    } else {
+                        if (next_fpr == std::size(FPR_SPILL_SCRATCH))
+                            throw std::logic_error("Out of spill registers in " + mf.name);
+                        phys = FPR_SPILL_SCRATCH[next_fpr++];
+                    }
+                    scratch[reg.id] = MReg::phys(phys, reg.cls);
+                }
+                read[reg.id] = read[reg.id] || is_use;
+                written[reg.id] = written[reg.id] || is_def;
+            });
+
+            for (auto& [vreg, phys] : scratch) {
+                if (!read[vreg])
+                    continue;
+                char view = spillView(vreg, phys);
+                rewritten.emplace_back(
+                    "ldr", std::vector<MO>{MO::def(phys, view), MO::memFrame(spillSlot(vreg))});
+            }
+
+            mi.forEachReg([&](MReg& reg, bool, bool) {
+                if (!reg.is_virtual)
+                    return;
+                const LiveInterval& interval = intervals[reg.id];
+                reg = interval.spilled ? scratch.at(reg.id) : MReg::phys(interval.phys, reg.cls);
+            });
+
+            // Copies whose source and destination got the same register disappear
+            if (!is_identity_copy(mi))
+                rewritten.push_back(std::move(mi));
+
+            for (auto& [vreg, phys] : scratch) {
+                if (!written[vreg])
+                    continue;
+                char view = spillView(vreg, phys);
+                rewritten.emplace_back(
+                    "str", std::vector<MO>{MO::use(phys, view), MO::memFrame(spillSlot(vreg))});
+            }
+        }
+
+        mb->insts = std::move(rewritten);
+    }
+}
@@ -0,0 +1,266 @@
+#include "ConstantFold.h"
+#include "Passes.h"
+
+#include <set>
+#include <unordered_map>
+
+// Lattice of sparse conditional constant propagation (Wegman & Zadeck): a value is
+// UNDEFINED until some executable definition reaches it, CONSTANT while every reaching
+// definition agrees, and OVERDEFINED otherwise
+namespace {
+
+enum class LatticeState { UNDEFINED, CONSTANT, OVERDEFINED };
+
+struct LatticeValue {
+    LatticeState state = LatticeState::UNDEFINED;
+    Value* constant = nullptr;
+};
+
+class SCCPSolver {
+  public:
+    SCCPSolver(Function& p_fn) : fn(p_fn), mod(*p_fn.parent) {}
+
+    void solve();
+    bool rewrite();
+
+  private:
+    Function& fn;
+    Module& mod;
+
+    std::unordered_map<Value*, LatticeValue> values;
+    std::set<std::pair<BasicBlock*, BasicBlock*>> executable_edges;
+    std::set<BasicBlock*> executable_blocks;
+    std::unordered_map<Value*, std::vector<Instruction*>> users;
+
+    std::vector<std::pair<BasicBlock*, BasicBlock*>> cfg_worklist;
+    std::vector<Instruction*> ssa_worklist;
+
+    LatticeValue get(Value* v);
+    void update(Instruction* inst, LatticeValue lv);
+    void markEdge(BasicBlock* from, BasicBlock* to);
+    void visit(Instruction* inst);
+    void visitPhi(Instruction* phi);
+    void visitTerminator(Instruction* term);
+};
+
+} // namespace
+
+LatticeValue SCCPSolver::get(Value* v) {
+    if (v->isConstant())
+        return {LatticeState::CONSTANT, v};
+    if (v->kind != ValueKind::INSTRUCTION)
+        return {LatticeState::OVERDEFINED, nullptr};
+    return values[v];
+}
+
+void SCCPSolver::update(Instruction* inst, LatticeValue lv) {
+    LatticeValue& old = values[inst];
+    if (old.state == lv.state && old.constant == lv.constant)
+        return;
+    // Values only move down the lattice
+    if (old.state == LatticeState::OVERDEFINED)
+        return;
+    if (old.state == LatticeState::CONSTANT && lv.state == LatticeState::CONSTANT)
+        lv = {LatticeState::OVERDEFINED, nullptr};
+
+    old = lv;
+    for (Instruction* user : users[inst])
+        ssa_worklist.push_back(user);
+}
+
+void SCCPSolver::markEdge(BasicBlock* from, BasicBlock* to) {
+    if (executable_edges.insert({from, to}).second)
+        cfg_worklist.push_back({from, to});
+}
+
+void SCCPSolver::visitPhi(Instruction* phi) {
+    LatticeValue result;
+    for (size_t i = 0; i < phi->operands.size(); i++) {
+        if (!executable_edges.count({phi->blocks[i], phi->parent}))
+            continue;
+        LatticeValue input = get(phi->operands[i]);
+        if (input.state == LatticeState::UNDEFINED)
+            continue;
+        if (input.state == LatticeState::OVERDEFINED ||
+            (result.state == LatticeState::CONSTANT && result.constant != input.constant)) {
+            result = {LatticeState::OVERDEFINED, nullptr};
+            break;
+        }
+        result = input;
+    }
+    update(phi, result);
+}
+
+void SCCPSolver::visitTerminator(Instruction* term) {
+    BasicBlock* bb = term->parent;
+
+    if (term->op == Opcode::BR) {
+        markEdge(bb, term->blocks[0]);
+        return;
+    }
+    if (term->op != Opcode::COND_BR)
+        return;
+
+    LatticeValue cond = get(term->operands[0]);
+    if (cond.state == LatticeState::UNDEFINED)
+        return;
+    if (cond.state == LatticeState::OVERDEFINED) {
+        markEdge(bb, term->blocks[0]);
+        markEdge(bb, term->blocks[1]);
+        return;
+    }
+    bool taken = static_cast<ConstantInt*>(cond.constant)->value != 0;
+    markEdge(bb, term->blocks[taken ? 0 : 1]);
+}
+
+void SCCPSolver::visit(Instruction* inst) {
+    if (!executable_blocks.count(inst->parent))
+        return;
+
+    if (inst->op == Opcode::PHI) {
+        visitPhi(inst);
+        return;
+    }
+    if (inst->isTerminator()) {
+        visitTerminator(inst);
+        return;
+    }
+    if (inst->type == IRType::VOID)
+        return;
+
+    std::vector<Value*> operands;
+    bool undefined = false;
+    for (Value* op : inst->operands) {
+        LatticeValue lv = get(op);
+        undefined |= lv.state == LatticeState::UNDEFINED;
+        operands.push_back(lv.state == LatticeState::CONSTANT ? lv.constant : nullptr);
+    }
+
+    if (Value* folded = fold_constant(*inst, operands, mod)) {
+        update(inst, {LatticeState::CONSTANT, folded});
+    } else if (!undefined || inst->hasSideEffects() || inst->op == Opcode::LOAD ||
+               inst->op == Opcode::FRAME_ADDR) {
+        update(inst, {LatticeState::OVERDEFINED, nullptr});
+    }
+}
+
+void SCCPSolver::solve() {
+    for (auto& bb : fn.blocks) {
+        for (auto& inst : bb->insts) {
+            for (Value* op : inst->operands)
+                users[op].push_back(inst.get());
+        }
+    }
+
+    // A pseudo edge into the entry block
+    executable_blocks.insert(fn.entry());
+    for (auto& inst : fn.entry()->insts)
+        ssa_worklist.push_back(inst.get());
+
+    while (!cfg_worklist.empty() || !ssa_worklist.empty()) {
+        while (!cfg_worklist.empty()) {
+            auto [from, to] = cfg_worklist.back();
+            cfg_worklist.pop_back();
+
+            bool first_visit = executable_blocks.insert(to).second;
+            for (auto& inst : to->insts) {
+                // Phis see a new incoming edge, everything else only runs on the first visit
+                if (inst->op == Opcode::PHI || first_visit)
+                    visit(inst.get());
+            }
+        }
+        while (!ssa_worklist.empty()) {
+            Instruction* inst = ssa_worklist.back();
+            ssa_worklist.pop_back();
+            visit(inst);
+        }
+    }
+}
+
+bool SCCPSolver::rewrite() {
+    bool changed = false;
+
+    // Constant values replace their definitions, identities their passed-through operand
+    for (auto& bb : fn.blocks) {
+        if (!executable_blocks.count(bb.get()))
+            continue;
+        for (auto it = bb->insts.begin(); it != bb->insts.end();) {
+            Instruction* inst = it->get();
+            LatticeValue lv = values.count(inst) ? values[inst] : LatticeValue{};
+            Value* same = nullptr;
+            if (lv.state == LatticeState::CONSTANT && !inst->hasSideEffects()) {
+                fn.replaceAllUses(inst, lv.constant);
+                it = bb->insts.erase(it);
+                changed = true;
+            } else if ((same = fold_identity(*inst))) {
+                // `x + 0` and friends, left behind by accumulators meeting their initial value
+                fn.replaceAllUses(inst, same);
+                it = bb->insts.erase(it);
+                changed = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Branches with a decided condition become unconditional
+    for (auto& bb : fn.blocks) {
+        Instruction* term = bb->terminator();
+        if (!executable_blocks.count(bb.get()) || !term || term->op != Opcode::COND_BR)
+            continue;
+
+        bool true_live = executable_edges.count({bb.get(), term->blocks[0]});
+        bool false_live = executable_edges.count({bb.get(), term->blocks[1]});
+        if (true_live == false_live)
+            continue;
+
+        BasicBlock* kept = term->blocks[true_live ? 0 : 1];
+        BasicBlock* dropped = term->blocks[true_live ? 1 : 0];
+
+        if (dropped != kept) {
+            for (auto& inst : dropped->insts) {
+                if (inst->op != Opcode::PHI)
+                    break;
+                for (size_t i = inst->blocks.size(); i-- > 0;) {
+                    if (inst->blocks[i] == bb.get()) {
+                        inst->blocks.erase(inst->blocks.begin() + i);
+                        inst->operands.erase(inst->operands.begin() + i);
+                    }
+                }
+            }
+        }
+
+        term->op = Opcode::BR;
+        term->operands.clear();
+        term->blocks = {kept};
+        changed = true;
+    }
+
+    if (fn.removeUnreachableBlocks() > 0)
+        changed = true;
+    fn.rebuildCFG();
+
+    // Phis left with a single input are copies
+    for (auto& bb : fn.blocks) {
+        for (auto it = bb->insts.begin(); it != bb->insts.end();) {
+            Instruction* inst = it->get();
+            if (inst->op != Opcode::PHI)
+                break;
+            if (inst->operands.size() == 1 && inst->operands[0] != inst) {
+                fn.replaceAllUses(inst, inst->operands[0]);
+                it = bb->insts.erase(it);
+                changed = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    return changed;
+}
+
+bool SCCPPass::runOnFunction(Function& fn) {
+    SCCPSolver solver(fn);
+    solver.solve();
+    return solver.rewrite();
+}
@@ -0,0 +1,436 @@
+#include "SemanticAnalyzer.h"
+
+#include "AbstractSyntaxTree.h"
+#include "Token.h"
+#include "Type.h"
+
+#include <stdexcept>
+#include <string>
+#include <variant>
+
+ConversionKind conversion_between(const Type& from, const Type& to) {
+    if (to.kind != TypeKind::PRIMITIVE || from.kind == TypeKind::VOID)
+        return ConversionKind::NONE;
+
+    if (to.is_float) {
+        if (!from.is_float)
+            return ConversionKind::INT_TO_FLOAT;
+        if (from.size_bytes == 4 && to.size_bytes == 8)
+            return ConversionKind::FLOAT_EXTEND;
+        if (from.size_bytes == 8 && to.size_bytes == 4)
+            return ConversionKind::FLOAT_TRUNCATE;
+        return ConversionKind::NONE;
+    }
+
+    if (from.is_float)
+        return ConversionKind::FLOAT_TO_INT;
+
+    return ConversionKind::NONE;
+}
+
+// SemanticInfo
+
+const ExprInfo& SemanticInfo::expr(const Expr* e) const {
+    auto it = exprs.find(e);
+    if (it == exprs.end())
+        throw std::logic_error("Expression was never visited by the semantic analyzer");
+    return it->second;
+}
+
+const DeclInfo& SemanticInfo::decl(const Stmt* s) const {
+    auto it = decls.find(s);
+    if (it == decls.end())
+        throw std::logic_error("Declaration was never visited by the semantic analyzer");
+    return it->second;
+}
+
+const Type& SemanticInfo::returnType(const FunctionDeclStmt* fn) const {
+    auto it = return_types.find(fn);
+    if (it == return_types.end())
+        throw std::logic_error("Function was never visited by the semantic analyzer");
+    return it->second;
+}
+
+// SemanticAnalyzer
+
+SemanticAnalyzer::SemanticAnalyzer(CompilerContext& p_ctx) : ctx(p_ctx) {}
+
+SemanticInfo SemanticAnalyzer::analyze(const Program& prog) {
+    for (const auto& s : prog.statements) {
+        analyzeStmt(s.get());
+    }
+
+    return std::move(info);
+}
+
+void SemanticAnalyzer::error(const Token& tok, const std::string& msg) {
+    ctx.de.report(DiagnosticLevel::ERROR, msg, tok.column, tok.row);
+}
+
+Type SemanticAnalyzer::analyzeExpr(const Expr* expr) {
+    ExprInfo* saved = current;
+
+    // unordered_map keeps element references stable, so children may insert freely
+    ExprInfo& slot = info.exprs[expr];
+    slot.type = TypeSystem::Int64;
+    current = &slot;
+
+    expr->accept(*this);
+
+    slot.converted_type = slot.type;
+    current = saved;
+    return slot.type;
+}
+
+void SemanticAnalyzer::convertTo(const Expr* expr, const Type& target) {
+    ExprInfo& slot = info.exprs.at(expr);
+    slot.conversion = conversion_between(slot.type, target);
+    slot.converted_type = (slot.conversion == ConversionKind::NONE) ? slot.type : target;
+
+    // Integers already sit sign/zero-extended in x0, only the width they are read back at changes
+    if (slot.conversion == ConversionKind::NONE && slot.type.kind == TypeKind::PRIMITIVE &&
+        target.kind == TypeKind::PRIMITIVE && !slot.type.is_float && !target.is_float)
+        slot.converted_type = target;
+}
+
+void SemanticAnalyzer::analyzeAs(const Expr* expr, const Type& target) {
+    analyzeExpr(expr);
+    convertTo(expr, target);
+}
+
+void SemanticAnalyzer::analyzePlace(const IdentifierExpr* ident) {
+    ExprInfo& slot = info.exprs[ident];
+    slot.type = ident->type;
+    slot.converted_type = ident->type;
+    slot.frame_offset = ident->offset;
+}
+
+void SemanticAnalyzer::analyzeStmt(const Stmt* stmt) {
+    if (stmt)
+        stmt->accept(*this);
+}
+
+// Expression Visitors
+
+void SemanticAnalyzer::visitLiteralExpr(const LiteralExpr* expr) {
+    if (std::holds_alternative<double>(expr->token.fd))
+        current->type = TypeSystem::Float64;
+    else if (std::holds_alternative<std::string>(expr->token.fd))
+        current->type = TypeSystem::StringLiteral;
+    else
+        current->type = TypeSystem::Int64;
+}
+
+void SemanticAnalyzer::visitIdentifierExpr(const IdentifierExpr* expr) {
+    current->type = expr->type;
+    current->frame_offset = expr->offset;
+
+    if (expr->type.kind == TypeKind::CLASS) {
+        error(expr->token, "Class values cannot be used directly, Use field access or pointers. ");
+    }
+}
+
+void SemanticAnalyzer::visitUnaryExpr(const UnaryExpr* expr) {
+    ExprInfo& self = *current;
+
+    switch (expr->op.type) {
+    case TokenType::OPERATOR_MINUS: {
+        Type operand = analyzeExpr(expr->right.get());
+        self.type = operand.is_float ? operand : TypeSystem::Int64;
+        break;
+    }
+    case TokenType::EXCLAMATION:
+        analyzeExpr(expr->right.get());
+        self.type = TypeSystem::Int64;
+        break;
+    case TokenType::OPERATOR_ASTERISK: {
+        Type operand = analyzeExpr(expr->right.get());
+        if (operand.kind != TypeKind::POINTER) {
+            error(expr->op, "Semantic Error: Cannot dereference a non-pointer type.");
+            break;
+        }
+        self.type = *operand.baseType;
+        break;
+    }
+    case TokenType::OPERATOR_AMPERSAND: {
+        auto* ident = dynamic_cast<const IdentifierExpr*>(expr->right.get());
+        if (!ident) {
+            error(expr->op, "Semantic Error: '&' operator requires a variable identifier.");
+            break;
+        }
+        analyzePlace(ident);
+        self.type = TypeSystem::createPointer(ident->type);
+        self.frame_offset = ident->offset;
+        break;
+    }
+    default:
+        error(expr->op, "Unknown unary operator");
+    }
+}
+
+void SemanticAnalyzer::visitGroupingExpr(const GroupingExpr* expr) {
+    current->type = analyzeExpr(expr->expr.get());
+}
+
+void SemanticAnalyzer::visitBinaryExpr(const BinaryExpr* expr) {
+    if (expr->op.type == TokenType::OPERATOR_ASSIGNMENT) {
+        analyzeAssignment(expr);
+        return;
+    }
+
+    ExprInfo& self = *current;
+
+    Type leftType = analyzeExpr(expr->left.get());
+    Type rightType = analyzeExpr(expr->right.get());
+
+    bool is_comparison = false;
+    switch (expr->op.type) {
+    case TokenType::OPERATOR_LESS:
+    case TokenType::OPERATOR_LESS_EQUALS:
+    case TokenType::OPERATOR_GREATER:
+    case TokenType::OPERATOR_GREATER_EQUALS:
+    case TokenType::OPERATOR_EQUALITY:
+    case TokenType::EXCL_EQUAL:
+        is_comparison = true;
+        break;
+    default:
+        break;
+    }
+
+    if (leftType.is_float || rightType.is_float) {
+        // Integers are promoted to float64, and float32 only survives if both sides are float32
+        bool single = leftType.is_float && rightType.is_float && leftType.size_bytes == 4 &&
+                      rightType.size_bytes == 4;
+        self.operand_type = single ? TypeSystem::Float32 : TypeSystem::Float64;
+        convertTo(expr->left.get(), self.operand_type);
+        convertTo(expr->right.get(), self.operand_type);
+    } else {
+        // Integer math runs in 64-bit registers. Division is unsigned if either side is
+        // unsigned, comparisons only if both are (mixed comparisons fall back to signed).
+        self.operand_type = TypeSystem::Int64;
+        if (is_comparison)
+            self.unsigned_op = !leftType.is_signed && !rightType.is_signed;
+        else
+            self.unsigned_op = !leftType.is_signed || !rightType.is_signed;
+    }
+
+    self.type = is_comparison ? TypeSystem::Int64 : self.operand_type;
+}
+
+void SemanticAnalyzer::analyzeAssignment(const BinaryExpr* expr) {
+    ExprInfo& self = *current;
+
+    if (auto* ident = dynamic_cast<const IdentifierExpr*>(expr->left.get())) {
+        analyzePlace(ident);
+        if (ident->type.kind == TypeKind::CLASS) {
+            error(expr->op, "Class assignment by value is not supported.");
+        }
+        self.type = ident->type;
+        self.frame_offset = ident->offset;
+    } else if (auto* unary = dynamic_cast<const UnaryExpr*>(expr->left.get())) {
+        if (unary->op.type != TokenType::OPERATOR_ASTERISK) {
+            error(expr->op, "Invalid assignment target. Expected variable or pointer dereference.");
+            return;
+        }
+        self.type = analyzeExpr(unary);
+    } else if (dynamic_cast<const ArrayAccessExpr*>(expr->left.get()) ||
+               dynamic_cast<const PropertyAccessExpr*>(expr->left.get())) {
+        self.type = analyzeExpr(expr->left.get());
+    } else {
+        error(expr->op, "Invalid assignment target.");
+        return;
+    }
+
+    analyzeAs(expr->right.get(), self.type);
+}
+
+void SemanticAnalyzer::visitFunctionCallExpr(const FunctionCallExpr* expr) {
+    ExprInfo& self = *current;
+
+    for (size_t i = 0; i < expr->args.size(); i++) {
+        if (i < expr->param_types.size())
+            analyzeAs(expr->args[i].get(), expr->param_types[i]);
+        else
+            analyzeExpr(expr->args[i].get());
+    }
+
+    self.type = expr->return_type;
+}
+
+void SemanticAnalyzer::visitArrayAccessExpr(const ArrayAccessExpr* expr) {
+    ExprInfo& self = *current;
+
+    auto* ident = dynamic_cast<const IdentifierExpr*>(expr->array.get());
+    if (!ident) {
+        error(expr->bracket_token, "Only direct array identifiers are supported in MVP.");
+        return;
+    }
+    analyzePlace(ident);
+
+    Type indexType = analyzeExpr(expr->idx.get());
+    if (indexType.is_float) {
+        convertTo(expr->idx.get(), TypeSystem::Int64);
+    }
+
+    if (ident->type.kind != TypeKind::ARRAY) {
+        error(ident->token, "Subscripted value '" + ident->name + "' is not an array.");
+        return;
+    }
+
+    self.type = *ident->type.baseType;
+    self.frame_offset = ident->offset;
+}
+
+void SemanticAnalyzer::visitArrayLiteralExpr(const ArrayLiteralExpr* expr) {
+    for (const auto& e : expr->elements) {
+        analyzeExpr(e.get());
+    }
+
+    ctx.de.report(DiagnosticLevel::ERROR,
+                  "Array literals are currently only supported in variable declarations.", 0, 0);
+}
+
+void SemanticAnalyzer::visitPropertyAccessExpr(const PropertyAccessExpr* expr) {
+    ExprInfo& self = *current;
+
+    auto* ident = dynamic_cast<const IdentifierExpr*>(expr->object.get());
+    if (!ident) {
+        error(expr->property_name,
+              "Only direct object identifiers are supported for field access.");
+        return;
+    }
+    analyzePlace(ident);
+
+    if (expr->type.kind == TypeKind::CLASS) {
+        error(expr->property_name, "Class field access by value is not supported.");
+    }
+
+    self.type = expr->type;
+    self.frame_offset = ident->offset;
+}
+
+// Statement Visitors
+
+void SemanticAnalyzer::visitExprStmt(const ExprStmt* stmt) {
+    analyzeExpr(stmt->expr.get());
+}
+
+void SemanticAnalyzer::visitVariableDeclStmt(const VariableDeclStmt* stmt) {
+    DeclInfo& decl = info.decls[stmt];
+    decl.type = stmt->type;
+    decl.frame_offset = stmt->offset;
+
+    if (!current_function) {
+        error(stmt->type_token, "Global variables are not supported.");
+    }
+
+    if (!stmt->initializer)
+        return;
+
+    const Expr* init = stmt->initializer.value().get();
+
+    if (auto* arrayLit = dynamic_cast<const ArrayLiteralExpr*>(init)) {
+        ExprInfo& slot = info.exprs[arrayLit];
+        slot.type = stmt->type;
+        slot.converted_type = stmt->type;
+
+        if (stmt->type.kind != TypeKind::ARRAY) {
+            error(stmt->type_token, "Cannot assign an array literal to a non-array type.");
+            return;
+        }
+        if (arrayLit->elements.size() > static_cast<size_t>(stmt->type.array_length)) {
+            error(stmt->type_token, "Too many initializers for array bounds.");
+        }
+
+        for (const auto& e : arrayLit->elements) {
+            analyzeAs(e.get(), *stmt->type.baseType);
+        }
+        return;
+    }
+
+    if (stmt->type.kind == TypeKind::ARRAY) {
+        error(stmt->type_token, "Arrays can only be initialized with an array literal.");
+    }
+
+    analyzeAs(init, stmt->type);
+}
+
+void SemanticAnalyzer::visitBlockStmt(const BlockStmt* stmt) {
+    for (const auto& s : stmt->statements) {
+        analyzeStmt(s.get());
+    }
+}
+
+void SemanticAnalyzer::visitIfStmt(const IfStmt* stmt) {
+    analyzeExpr(stmt->condition.get());
+    analyzeStmt(stmt->then_branch.get());
+    if (stmt->else_branch) {
+        analyzeStmt(stmt->else_branch.value().get());
+    }
+}
+
+void SemanticAnalyzer::visitWhileStmt(const WhileStmt* stmt) {
+    analyzeExpr(stmt->condition.get());
+    analyzeStmt(stmt->body.get());
+}
+
+void SemanticAnalyzer::visitForStmt(const ForStmt* stmt) {
+    if (stmt->initializer) {
+        analyzeStmt(stmt->initializer.value().get());
+    }
+    if (stmt->condition) {
+        analyzeExpr(stmt->condition.value().get());
+    }
+    if (stmt->increment) {
+        analyzeExpr(stmt->increment.value().get());
+    }
+    analyzeStmt(stmt->body.get());
+}
+
+void SemanticAnalyzer::visitReturnStmt(const ReturnStmt* stmt) {
+    if (!stmt->value)
+        return;
+
+    const Expr* value = stmt->value.value().get();
+    if (current_function && current_function->return_type.kind != TypeKind::VOID)
+        analyzeAs(value, current_function->return_type);
+    else
+        analyzeExpr(value);
+}
+
+void SemanticAnalyzer::visitFunctionParameterStmt(const FunctionParameterStmt* stmt) {
+    DeclInfo& decl = info.decls[stmt];
+
+    auto typeOpt = TypeSystem::from_string(stmt->type_token.lexeme);
+    if (!typeOpt.has_value()) {
+        error(stmt->type_token, "Unknown type '" + stmt->type_token.lexeme + "'");
+        decl.type = TypeSystem::Int64;
+    } else {
+        decl.type = typeOpt.value();
+    }
+
+    decl.frame_offset = stmt->offset;
+    decl.param_index = current_param_index;
+}
+
+void SemanticAnalyzer::visitFunctionDeclStmt(const FunctionDeclStmt* stmt) {
+    const FunctionDeclStmt* saved_function = current_function;
+    current_function = stmt;
+    info.return_types[stmt] = stmt->return_type;
+
+    current_param_index = 0;
+    for (const auto& param : stmt->params) {
+        analyzeStmt(param.get());
+        current_param_index++;
+    }
+
+    analyzeStmt(stmt->body.get());
+
+    current_function = saved_function;
+}
+
+void SemanticAnalyzer::visitClassDeclStmt(const ClassDeclStmt* stmt) {
+    for (const auto& method : stmt->methods) {
+        analyzeStmt(method.get());
+    }
+}
@@ -0,0 +1,98 @@
+#include "StrengthReduction.h"
+
+#include <bit>
+
+std::optional<int> exact_log2(uint64_t v) {
+    if (!std::has_single_bit(v))
+        return std::nullopt;
+    return std::countr_zero(v);
+}
+
+std::optional<ShiftAddMultiply> shift_add_multiply(int64_t c) {
+    using Form = ShiftAddMultiply::Form;
+    // Wrapping arithmetic, INT64_MIN is 1 << 63 like any other power of two
+    uint64_t u = static_cast<uint64_t>(c);
+    uint64_t minus_u = 0 - u;
+    if (u == 0 || u == 1)
+        return std::nullopt;
+
+    if (std::optional<int> k = exact_log2(u))
+        return ShiftAddMultiply{Form::SHIFT, *k};
+    if (std::optional<int> k = exact_log2(minus_u))
+        return ShiftAddMultiply{Form::NEGATE, *k};
+
+    int post = std::countr_zero(u);
+    if (std::optional<int> k = exact_log2((u >> post) - 1))
+        return ShiftAddMultiply{Form::ADD, *k, post};
+    if (std::optional<int> k = exact_log2(u + 1))
+        return ShiftAddMultiply{Form::SUB, *k};
+    if (std::optional<int> k = exact_log2(minus_u + 1))
+        return ShiftAddMultiply{Form::REVERSE_SUB, *k};
+    return std::nullopt;
+}
+
+SignedDivisionMagic signed_division_magic(int64_t d) {
+    const uint64_t two63 = uint64_t(1) << 63;
+    uint64_t ad = d < 0 ? 0 - static_cast<uint64_t>(d) : static_cast<uint64_t>(d);
+    uint64_t t = two63 + (static_cast<uint64_t>(d) >> 63);
+    uint64_t anc = t - 1 - t % ad; // Absolute value of nc
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    uint64_t multiplier = q2 + 1;
+    if (d < 0)
+        multiplier = 0 - multiplier;
+    return {static_cast<int64_t>(multiplier), p - 64};
+}
+
+UnsignedDivisionMagic unsigned_division_magic(uint64_t d) {
+    const uint64_t two63 = uint64_t(1) << 63;
+    bool add = false;
+    uint64_t nc = UINT64_MAX - (0 - d) % d;
+    int p = 63;
+    uint64_t q1 = two63 / nc, r1 = two63 - q1 * nc;
+    uint64_t q2 = (two63 - 1) / d, r2 = (two63 - 1) - q2 * d;
+    uint64_t delta;
+    do {
+        p++;
+        if (r1 >= nc - r1) {
+            q1 = 2 * q1 + 1;
+            r1 = 2 * r1 - nc;
+        } else {
+            q1 = 2 * q1;
+            r1 = 2 * r1;
+        }
+        if (r2 + 1 >= d - r2) {
+            if (q2 >= two63 - 1)
+                add = true;
+            q2 = 2 * q2 + 1;
+            r2 = 2 * r2 + 1 - d;
+        } else {
+            if (q2 >= two63)
+                add = true;
+            q2 = 2 * q2;
+            r2 = 2 * r2 + 1;
+        }
+        delta = d - 1 - r2;
+    } while (p < 128 && (q1 < delta || (q1 == delta && r1 == 0)));
+
+    return {q2 + 1, p - 64, add};
+}
@@ -1,18 +1,37 @@
 #include "SymbolTable.h"
 
+#include <algorithm>
 #include <iostream>
 #include <optional>
 
+// Arrays align like their elements and objects like their widest possible field, so a
+// 40-byte array no longer rounds the stack up to a multiple of 40
+static int alignment_of(const Type& type) {
+    int align = type.size_bytes;
+    if (type.kind == TypeKind::ARRAY)
+        align = type.baseType->size_bytes;
+    else if (type.kind == TypeKind::CLASS)
+        align = 8;
+    return std::clamp(align, 1, 8);
+}
+
+static int align_to(int value, int align) {
+    return (value + align - 1) / align * align;
+}
+
 SymbolTable::SymbolTable() {
     scopes.emplace_back();
 }
 
 void SymbolTable::enter_scope() {
     scopes.emplace_back();
+    scopes.back().stack_offset = current_stack_offset;
 }
 
+// The variables of a closed scope are dead, the next sibling scope reuses their space
 void SymbolTable::exit_scope() {
     if (scopes.size() > 1) {
+        current_stack_offset = scopes.back().stack_offset;
         scopes.pop_back();
     } else {
         std::cerr << "Compiler Error: Compiler is trying to exit global scope\n";
@@ -21,6 +40,8 @@ void SymbolTable::exit_scope() {
 
 void SymbolTable::reset_local_offset() {
     current_stack_offset = 0;
+    max_stack_offset = 0;
+    unshared_stack_offset = 0;
 }
 
 void SymbolTable::dump() const {
@@ -75,11 +96,11 @@ bool SymbolTable::declare(const std::string& name, const Type& type) {
         return false;
 
     // Calculate offset
-    int alignment = (type.size_bytes > 0) ? type.size_bytes : 1;
-    while (current_stack_offset % alignment != 0) {
-        current_stack_offset++;
-    }
-    current_stack_offset += type.size_bytes;
+    int alignment = alignment_of(type);
+    // Offsets count down from x29, aligning the end aligns the start address
+    current_stack_offset = align_to(current_stack_offset + type.size_bytes, alignment);
+    max_stack_offset = std::max(max_stack_offset, current_stack_offset);
+    unshared_stack_offset = align_to(unshared_stack_offset + type.size_bytes, alignment);
 
     Symbol s = {.name = name,
                 .type = type,
@@ -125,11 +146,17 @@ std::optional<Symbol> SymbolTable::lookup(const std::string& name) const {
 }
 
 int SymbolTable::getMaxStackSize() const {
-    return current_stack_offset;
+    return max_stack_offset;
+}
+
+int SymbolTable::getUnsharedStackSize() const {
+    return unshared_stack_offset;
 }
 
 void SymbolTable::reset() {
     scopes.clear();
     scopes.emplace_back();
     current_stack_offset = 0;
+    max_stack_offset = 0;
+    unshared_stack_offset = 0;
 }
@@ -0,0 +1,208 @@
+#include "ConstantFold.h"
+#include "Passes.h"
+
+#include <algorithm>
+#include <iostream>
+
+// Integer operations that can collect the pending work of a recursive call: associative
+// and commutative, so `x op f(...)` may be evaluated as `acc op x` on the way down
+static bool is_accumulator_op(Opcode op) {
+    switch (op) {
+    case Opcode::ADD:
+    case Opcode::MUL:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int64_t identity_of(Opcode op) {
+    switch (op) {
+    case Opcode::MUL:
+        return 1;
+    case Opcode::AND:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+namespace {
+
+// A self call whose result is returned, possibly re-extended and combined with a value
+// computed independently of the call
+struct TailSite {
+    BasicBlock* block;
+    Instruction* call;
+    Instruction* accumulate = nullptr; // The `op` in `ret x op f(...)`
+    Value* operand = nullptr;          // Its `x`
+};
+
+} // namespace
+
+static Instruction* previous(Instruction* inst) {
+    BasicBlock* bb = inst->parent;
+    auto it = bb->find(inst);
+    return it == bb->insts.begin() ? nullptr : std::prev(it)->get();
+}
+
+// `inst` is only used by `user`
+static bool feeds_only(Function& fn, Instruction* inst, Instruction* user) {
+    return fn.countUses(inst) == 1 &&
+           std::find(user->operands.begin(), user->operands.end(), inst) != user->operands.end();
+}
+
+// Matches the block ending in `ret` against `call [ext] [op] ret`, each instruction used
+// only by the next one
+static bool match_site(Function& fn, BasicBlock* bb, TailSite& site) {
+    Instruction* ret = bb->terminator();
+    if (!ret || ret->op != Opcode::RET)
+        return false;
+
+    Instruction* inst = previous(ret);
+    if (inst && is_accumulator_op(inst->op) && feeds_only(fn, inst, ret)) {
+        site.accumulate = inst;
+        inst = previous(inst);
+    }
+    Instruction* user = site.accumulate ? site.accumulate : ret;
+
+    Instruction* ext = nullptr;
+    if (inst && (inst->op == Opcode::SEXT || inst->op == Opcode::ZEXT) &&
+        feeds_only(fn, inst, user)) {
+        ext = inst;
+        inst = previous(inst);
+    }
+
+    if (!inst || inst->op != Opcode::CALL || inst->callee != fn.name ||
+        inst->operands.size() != fn.args.size())
+        return false;
+
+    // The value flowing out of the call has to reach the return and nothing else
+    Instruction* result = ext ? ext : inst;
+    if (ext && !feeds_only(fn, inst, ext))
+        return false;
+    if (ret->operands.empty() ? fn.countUses(inst) != 0 : !feeds_only(fn, result, user))
+        return false;
+
+    if (site.accumulate) {
+        Value* lhs = site.accumulate->operands[0];
+        site.operand = lhs == result ? site.accumulate->operands[1] : lhs;
+    }
+    site.block = bb;
+    site.call = inst;
+    return true;
+}
+
+bool TailRecursionPass::runOnFunction(Function& fn) {
+    // Arguments past the eighth are not passed, so a call cannot hand them on
+    if (fn.blocks.empty() || fn.args.size() > 8)
+        return false;
+    fn.rebuildCFG();
+
+    std::vector<TailSite> sites;
+    Opcode op = Opcode::ADD;
+    bool accumulates = false;
+    for (auto& bb : fn.blocks) {
+        TailSite site;
+        if (!match_site(fn, bb.get(), site))
+            continue;
+        if (site.accumulate) {
+            if (accumulates && site.accumulate->op != op)
+                continue;
+            op = site.accumulate->op;
+            accumulates = true;
+        }
+        sites.push_back(site);
+    }
+    if (sites.empty())
+        return false;
+
+    // A new entry block falls into the old one, which becomes the loop header
+    BasicBlock* header = fn.entry();
+    BasicBlock* entry = fn.createBlock("tailrec");
+    std::rotate(fn.blocks.begin(), fn.blocks.end() - 1, fn.blocks.end());
+    auto br = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+    br->blocks.push_back(header);
+    entry->append(std::move(br));
+
+    std::vector<Instruction*> params;
+    for (auto it = fn.args.rbegin(); it != fn.args.rend(); ++it) {
+        Argument* arg = it->get();
+        Instruction* phi =
+            header->insertAtFront(std::make_unique<Instruction>(Opcode::PHI, arg->type));
+        fn.replaceAllUses(arg, phi);
+        phi->operands.push_back(arg);
+        phi->blocks.push_back(entry);
+        params.insert(params.begin(), phi);
+
+        for (TailSite& site : sites) {
+            if (site.operand == arg)
+                site.operand = phi;
+        }
+    }
+
+    Instruction* acc = nullptr;
+    if (accumulates) {
+        acc = header->insertAtFront(std::make_unique<Instruction>(Opcode::PHI, fn.return_type));
+        acc->operands.push_back(fn.parent->constInt(identity_of(op)));
+        acc->blocks.push_back(entry);
+    }
+
+    for (TailSite& site : sites) {
+        BasicBlock* bb = site.block;
+        for (size_t i = 0; i < params.size(); i++) {
+            params[i]->operands.push_back(site.call->operands[i]);
+            params[i]->blocks.push_back(bb);
+        }
+
+        // Everything from the call to the return goes, the block loops back instead
+        Instruction* call = site.call;
+        while (bb->insts.back().get() != call)
+            bb->erase(bb->insts.back().get());
+        bb->erase(call);
+
+        if (acc) {
+            Value* next = acc;
+            if (site.accumulate) {
+                auto combine = std::make_unique<Instruction>(
+                    op, fn.return_type, std::vector<Value*>{acc, site.operand});
+                Value* same = fold_identity(*combine);
+                next = same ? same : bb->append(std::move(combine));
+            }
+            acc->operands.push_back(next);
+            acc->blocks.push_back(bb);
+        }
+
+        auto loop = std::make_unique<Instruction>(Opcode::BR, IRType::VOID);
+        loop->blocks.push_back(header);
+        bb->append(std::move(loop));
+    }
+
+    // The remaining returns end the recursion and apply the collected work
+    if (acc) {
+        for (auto& bb : fn.blocks) {
+            Instruction* ret = bb->terminator();
+            if (!ret || ret->op != Opcode::RET)
+                continue;
+            auto combine = std::make_unique<Instruction>(
+                op, fn.return_type, std::vector<Value*>{acc, ret->operands[0]});
+            // A base case returning the identity hands back the accumulator as is
+            Value* same = fold_identity(*combine);
+            ret->operands[0] = same ? same : bb->insertBefore(ret, std::move(combine));
+        }
+    }
+
+    fn.rebuildCFG();
+
+    if (ctx.options.tail_call_report) {
+        std::cout << "turned recursion in '" << fn.name << "' into a loop: " << sites.size()
+                  << " tail call" << (sites.size() == 1 ? "" : "s");
+        if (accumulates)
+            std::cout << ", accumulating with " << opcode_name(op);
+        std::cout << "\n";
+    }
+    return true;
+}
@@ -97,6 +97,11 @@ inline std::string token_type_to_string(TokenType type) {
     case TokenType::PUNCTUATION_DOT:
         return "PUNCTUATION_DOT";
 
+    case TokenType::KEYWORD_INLINE:
+        return "KEYWORD_INLINE";
+    case TokenType::KEYWORD_NOINLINE:
+        return "KEYWORD_NOINLINE";
+
         // Operators
     case TokenType::OPERATOR_EQUALITY:
         return "OPERATOR_EQUALITY";
@@ -319,7 +324,10 @@ std::unordered_map<std::string, TokenType> keywords = {{"if", TokenType::KEYWORD
                                                        {"float64", TokenType::KEYWORD_TYPE_FLOAT64},
                                                        {"float32", TokenType::KEYWORD_TYPE_FLOAT32},
                                                        {"void", TokenType::KEYWORD_TYPE_VOID},
-                                                       {"class", TokenType::KEYWORD_CLASS}};
+                                                       {"class", TokenType::KEYWORD_CLASS},
+
+                                                       {"inline", TokenType::KEYWORD_INLINE},
+                                                       {"noinline", TokenType::KEYWORD_NOINLINE}};
 
 Token Tokenizer::identifier() {
     while ((isalnum(peek()) || peek() == '_') && !isAtEnd())
@@ -0,0 +1,407 @@
+#include "Verifier.h"
+
+#include "Dominators.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+
+static bool is_float(IRType t) {
+    return t == IRType::F32 || t == IRType::F64;
+}
+
+// Number of value operands an opcode takes, -1 if variable
+static int operand_count(Opcode op) {
+    switch (op) {
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::SDIV:
+    case Opcode::UDIV:
+    case Opcode::SHL:
+    case Opcode::LSHR:
+    case Opcode::ASHR:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+    case Opcode::FADD:
+    case Opcode::FSUB:
+    case Opcode::FMUL:
+    case Opcode::FDIV:
+    case Opcode::FMIN:
+    case Opcode::FMAX:
+    case Opcode::ICMP:
+    case Opcode::FCMP:
+    case Opcode::STORE:
+    case Opcode::VSTORE:
+        return 2;
+    case Opcode::NEG:
+    case Opcode::ABS:
+    case Opcode::FNEG:
+    case Opcode::FABS:
+    case Opcode::FSQRT:
+    case Opcode::FFLOOR:
+    case Opcode::FCEIL:
+    case Opcode::FROUND:
+    case Opcode::SEXT:
+    case Opcode::ZEXT:
+    case Opcode::SITOFP:
+    case Opcode::FPTOSI:
+    case Opcode::FPEXT:
+    case Opcode::FPTRUNC:
+    case Opcode::LOAD:
+    case Opcode::BOUNDS_CHECK:
+    case Opcode::COND_BR:
+    case Opcode::VLOAD:
+    case Opcode::VSPLAT:
+    case Opcode::VREDUCE:
+    case Opcode::VWIDEN:
+        return 1;
+    case Opcode::FRAME_ADDR:
+    case Opcode::PROFILE_INC:
+    case Opcode::BR:
+    case Opcode::UNREACHABLE:
+        return 0;
+    case Opcode::CALL:
+    case Opcode::PHI:
+    case Opcode::RET:
+        return -1;
+    }
+    return -1;
+}
+
+static std::string describe(Function& fn, const BasicBlock* bb, const Instruction* inst) {
+    std::ostringstream oss;
+    oss << "in @" << fn.name << ", block ^" << bb->name;
+    if (inst) {
+        oss << ", " << opcode_name(inst->op);
+        if (inst->id >= 0)
+            oss << " %" << inst->id;
+    }
+    return oss.str();
+}
+
+// Lane-wise arithmetic on v128 values, and the instructions moving between scalars,
+// memory and vectors
+static void check_vector_types(const Instruction& inst, std::vector<std::string>& errors,
+                               const std::string& where) {
+    auto fail = [&](const std::string& msg) { errors.push_back(where + ": " + msg); };
+    auto operand = [&](size_t i) { return inst.operands[i]->type; };
+
+    if (inst.mem.size != 4 && inst.mem.size != 8)
+        fail("vector lanes must be 32 or 64 bits wide");
+    IRType lane = inst.mem.is_float ? (inst.mem.size == 4 ? IRType::F32 : IRType::F64) : IRType::I64;
+
+    switch (inst.op) {
+    case Opcode::VLOAD:
+        if (operand(0) != IRType::I64)
+            fail("vload address must be i64");
+        break;
+    case Opcode::VSTORE:
+        if (operand(0) != IRType::V128 || operand(1) != IRType::I64)
+            fail("vstore needs a vector and an i64 address");
+        break;
+    case Opcode::VSPLAT:
+        if (operand(0) != lane)
+            fail("vsplat of a scalar that does not match the lane type");
+        break;
+    case Opcode::VREDUCE:
+        if (operand(0) != IRType::V128 || inst.type != lane)
+            fail("vreduce must turn a vector into its lane type");
+        break;
+    case Opcode::VWIDEN:
+        if (operand(0) != IRType::V128 || inst.mem.size != 4 || inst.mem.is_float)
+            fail("vwiden takes a vector of 32-bit integer lanes");
+        break;
+    case Opcode::PHI:
+        for (const Value* v : inst.operands) {
+            if (v->type != IRType::V128)
+                fail("phi input type does not match the phi");
+        }
+        break;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+    case Opcode::FADD:
+    case Opcode::FSUB:
+    case Opcode::FMUL:
+    case Opcode::FDIV:
+        if (operand(0) != IRType::V128 || operand(1) != IRType::V128)
+            fail("vector operation on non-vector operands");
+        break;
+    case Opcode::NEG:
+    case Opcode::FNEG:
+        if (operand(0) != IRType::V128)
+            fail("vector operation on a non-vector operand");
+        break;
+    case Opcode::SHL:
+        if (operand(0) != IRType::V128 || inst.operands[1]->kind != ValueKind::CONSTANT_INT)
+            fail("vector shift needs a vector and a constant amount");
+        break;
+    default:
+        fail("opcode has no vector form");
+        break;
+    }
+}
+
+static void check_types(const Instruction& inst, Function& fn, std::vector<std::string>& errors,
+                        const std::string& where) {
+    auto fail = [&](const std::string& msg) { errors.push_back(where + ": " + msg); };
+    auto operand = [&](size_t i) { return inst.operands[i]->type; };
+
+    if (inst.type == IRType::V128 || inst.op == Opcode::VSTORE || inst.op == Opcode::VREDUCE) {
+        check_vector_types(inst, errors, where);
+        return;
+    }
+
+    switch (inst.op) {
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::SDIV:
+    case Opcode::UDIV:
+    case Opcode::SHL:
+    case Opcode::LSHR:
+    case Opcode::ASHR:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+    case Opcode::ICMP:
+        if (operand(0) != IRType::I64 || operand(1) != IRType::I64)
+            fail("integer operation on non-i64 operands");
+        if (inst.type != IRType::I64)
+            fail("integer operation must produce i64");
+        break;
+    case Opcode::NEG:
+    case Opcode::ABS:
+    case Opcode::SEXT:
+    case Opcode::ZEXT:
+    case Opcode::SITOFP:
+        if (operand(0) != IRType::I64)
+            fail("expected an i64 operand");
+        break;
+    case Opcode::FADD:
+    case Opcode::FSUB:
+    case Opcode::FMUL:
+    case Opcode::FDIV:
+    case Opcode::FMIN:
+    case Opcode::FMAX:
+        if (!is_float(inst.type) || operand(0) != inst.type || operand(1) != inst.type)
+            fail("float operation with mismatched types");
+        break;
+    case Opcode::FCMP:
+        if (!is_float(operand(0)) || operand(0) != operand(1))
+            fail("fcmp on mismatched or non-float operands");
+        break;
+    case Opcode::FNEG:
+    case Opcode::FABS:
+    case Opcode::FSQRT:
+    case Opcode::FFLOOR:
+    case Opcode::FCEIL:
+    case Opcode::FROUND:
+        if (!is_float(inst.type) || operand(0) != inst.type)
+            fail(std::string(opcode_name(inst.op)) + " with mismatched types");
+        break;
+    case Opcode::FPTOSI:
+        if (!is_float(operand(0)))
+            fail("fptosi of a non-float");
+        break;
+    case Opcode::FPEXT:
+        if (operand(0) != IRType::F32 || inst.type != IRType::F64)
+            fail("fpext must go from f32 to f64");
+        break;
+    case Opcode::FPTRUNC:
+        if (operand(0) != IRType::F64 || inst.type != IRType::F32)
+            fail("fptrunc must go from f64 to f32");
+        break;
+    case Opcode::FRAME_ADDR:
+        if (!inst.slot ||
+            std::none_of(fn.slots.begin(), fn.slots.end(),
+                         [&](const auto& s) { return s.get() == inst.slot; }))
+            fail("frame_addr of a slot that does not belong to the function");
+        break;
+    case Opcode::LOAD:
+        if (operand(0) != IRType::I64)
+            fail("load address must be i64");
+        if (inst.mem.is_float != is_float(inst.type))
+            fail("load width does not match the result type");
+        break;
+    case Opcode::STORE:
+        if (operand(1) != IRType::I64)
+            fail("store address must be i64");
+        if (inst.mem.is_float != is_float(operand(0)))
+            fail("store width does not match the value type");
+        break;
+    case Opcode::COND_BR:
+        if (operand(0) != IRType::I64)
+            fail("branch condition must be i64");
+        break;
+    case Opcode::RET:
+        if (fn.return_type == IRType::VOID ? !inst.operands.empty()
+                                           : inst.operands.size() != 1 ||
+                                                 operand(0) != fn.return_type)
+            fail("return value does not match the function's return type");
+        break;
+    case Opcode::PHI:
+        for (const Value* v : inst.operands) {
+            if (v->type != inst.type)
+                fail("phi input type does not match the phi");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+std::vector<std::string> verify_function(Function& fn) {
+    std::vector<std::string> errors;
+
+    if (fn.blocks.empty()) {
+        errors.push_back("@" + fn.name + " has no blocks");
+        return errors;
+    }
+
+    fn.renumber();
+
+    std::unordered_set<const BasicBlock*> own_blocks;
+    std::unordered_set<const Value*> own_values;
+    for (const auto& arg : fn.args)
+        own_values.insert(arg.get());
+    for (const auto& bb : fn.blocks) {
+        own_blocks.insert(bb.get());
+        for (const auto& inst : bb->insts)
+            own_values.insert(inst.get());
+    }
+
+    // Check predecessor lists against the terminators before trusting them for dominance
+    std::vector<std::vector<BasicBlock*>> recorded;
+    for (const auto& bb : fn.blocks)
+        recorded.push_back(bb->preds);
+    fn.rebuildCFG();
+    for (size_t i = 0; i < fn.blocks.size(); i++) {
+        auto expected = fn.blocks[i]->preds;
+        auto actual = recorded[i];
+        std::sort(expected.begin(), expected.end());
+        std::sort(actual.begin(), actual.end());
+        if (expected != actual)
+            errors.push_back(describe(fn, fn.blocks[i].get(), nullptr) +
+                             ": stale predecessor list");
+    }
+
+    if (!fn.entry()->preds.empty())
+        errors.push_back("@" + fn.name + ": the entry block must not have predecessors");
+
+    DominatorTree dom(fn);
+
+    for (const auto& bb : fn.blocks) {
+        bool seen_non_phi = false;
+
+        for (auto it = bb->insts.begin(); it != bb->insts.end(); ++it) {
+            const Instruction& inst = **it;
+            std::string where = describe(fn, bb.get(), &inst);
+
+            if (inst.parent != bb.get())
+                errors.push_back(where + ": wrong parent block");
+
+            if (inst.isTerminator() != (std::next(it) == bb->insts.end()))
+                errors.push_back(where + ": blocks must end in exactly one terminator");
+
+            if (inst.op == Opcode::PHI) {
+                if (seen_non_phi)
+                    errors.push_back(where + ": phi after a non-phi instruction");
+            } else {
+                seen_non_phi = true;
+            }
+
+            int expected = operand_count(inst.op);
+            if (expected >= 0 && static_cast<int>(inst.operands.size()) != expected) {
+                errors.push_back(where + ": wrong number of operands");
+                continue;
+            }
+
+            for (BasicBlock* target : inst.blocks) {
+                if (!own_blocks.count(target))
+                    errors.push_back(where + ": reference to a block of another function");
+            }
+
+            if ((inst.op == Opcode::BR && inst.blocks.size() != 1) ||
+                (inst.op == Opcode::COND_BR && inst.blocks.size() != 2))
+                errors.push_back(where + ": wrong number of branch targets");
+
+            bool bad_operand = false;
+            for (size_t i = 0; i < inst.operands.size(); i++) {
+                const Value* v = inst.operands[i];
+                if (!v) {
+                    errors.push_back(where + ": null operand");
+                    bad_operand = true;
+                    continue;
+                }
+                if ((v->kind == ValueKind::INSTRUCTION || v->kind == ValueKind::ARGUMENT) &&
+                    !own_values.count(v)) {
+                    errors.push_back(where + ": operand defined outside the function");
+                    bad_operand = true;
+                    continue;
+                }
+                if (v->type == IRType::VOID) {
+                    errors.push_back(where + ": void value used as an operand");
+                    bad_operand = true;
+                    continue;
+                }
+
+                // Definitions must dominate their uses, phi inputs at the end of the edge
+                if (v->kind != ValueKind::INSTRUCTION || !dom.isReachable(bb.get()))
+                    continue;
+                const auto* def = static_cast<const Instruction*>(v);
+                if (inst.op == Opcode::PHI) {
+                    BasicBlock* incoming = inst.blocks[i];
+                    if (dom.isReachable(incoming) && !dom.dominates(def->parent, incoming))
+                        errors.push_back(where + ": phi input does not dominate its edge");
+                } else if (!dom.dominates(def, &inst)) {
+                    errors.push_back(where + ": operand does not dominate its use");
+                }
+            }
+            if (bad_operand)
+                continue;
+
+            if (inst.op == Opcode::PHI) {
+                if (inst.blocks.size() != inst.operands.size()) {
+                    errors.push_back(where + ": phi inputs and blocks differ in count");
+                    continue;
+                }
+                auto incoming = inst.blocks;
+                auto preds = bb->preds;
+                std::sort(incoming.begin(), incoming.end());
+                std::sort(preds.begin(), preds.end());
+                if (incoming != preds)
+                    errors.push_back(where + ": phi inputs do not match the predecessors");
+            }
+
+            check_types(inst, fn, errors, where);
+        }
+
+        if (!bb->terminator())
+            errors.push_back(describe(fn, bb.get(), nullptr) + ": missing terminator");
+    }
+
+    return errors;
+}
+
+void verify_module(Module& mod, const std::string& stage) {
+    for (const auto& fn : mod.functions) {
+        std::vector<std::string> errors = verify_function(*fn);
+        if (errors.empty())
+            continue;
+
+        std::ostringstream oss;
+        oss << "IR verification failed after " << stage << ":";
+        for (const auto& e : errors)
+            oss << "\n  " << e;
+        oss << "\n";
+        print_function(oss, *fn);
+        throw std::logic_error(oss.str());
+    }
+}
@@ -1,12 +1,18 @@
 #include "AbstractSyntaxTree.h"
+#include "Backend.h"
 #include "CodeGen.h"
 #include "CompilerContext.h"
 #include "DebugVisitor.h"
+#include "IRGen.h"
 #include "Parser.h"
+#include "PassManager.h"
+#include "Peephole.h"
+#include "SemanticAnalyzer.h"
 #include "Token.h"
 #include "utils.h"
 #include "version.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -15,7 +21,12 @@ int main(int argc, char* argv[]) {
     CompilerContext ctx;
 
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <file.capp> [-o <output_binary>] [--tokens] [--ast]"
+        std::cerr << "Usage: " << argv[0] << " <file.capp> [-o <output_binary>] [-O<level>] [--tokens] [--ast] [--dump-ir]"
+                  << " [--no-peephole[=<rule>]] [--peephole-stats]"
+                  << " [--bounds=full|hoisted|trap|off] [--bounds-report]"
+                  << " [--fast-math] [--vectorize-report] [--tail-call-report]"
+                  << " [--pure-call-report] [--frame-pointer] [--frame-report]"
+                  << " [--profile-generate[=<file>]] [--profile-use=<file>]"
                   << std::endl;
         return 1;
     }
@@ -30,6 +41,57 @@ int main(int argc, char* argv[]) {
             ctx.options.show_ast = true;
         } else if (arg == "--till_ast") {
             ctx.options.stop_at_ast = true;
+        } else if (arg == "--dump-ir") {
+            ctx.options.dump_ir = true;
+        } else if (arg == "--no-peephole") {
+            ctx.options.peephole = false;
+        } else if (arg.rfind("--no-peephole=", 0) == 0) {
+            std::string rule = arg.substr(14);
+            const auto& rules = peephole_rules();
+            if (std::none_of(rules.begin(), rules.end(),
+                             [&](const PeepholeRule& r) { return rule == r.name; })) {
+                std::cerr << "Error: unknown peephole rule '" << rule << "'." << std::endl;
+                return 1;
+            }
+            ctx.options.disabled_peepholes.push_back(rule);
+        } else if (arg == "--peephole-stats") {
+            ctx.options.peephole_stats = true;
+        } else if (arg.rfind("--bounds=", 0) == 0) {
+            std::string mode = arg.substr(9);
+            if (mode == "full") {
+                ctx.options.bounds_mode = BoundsMode::FULL;
+            } else if (mode == "hoisted") {
+                ctx.options.bounds_mode = BoundsMode::HOISTED;
+            } else if (mode == "trap") {
+                ctx.options.bounds_mode = BoundsMode::TRAP;
+            } else if (mode == "off") {
+                ctx.options.bounds_mode = BoundsMode::OFF;
+            } else {
+                std::cerr << "Error: unknown bounds checking mode '" << mode << "'." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--bounds-report") {
+            ctx.options.bounds_report = true;
+        } else if (arg == "--fast-math") {
+            ctx.options.fast_math = true;
+        } else if (arg == "--vectorize-report") {
+            ctx.options.vectorize_report = true;
+        } else if (arg == "--tail-call-report") {
+            ctx.options.tail_call_report = true;
+        } else if (arg == "--pure-call-report") {
+            ctx.options.pure_call_report = true;
+        } else if (arg == "--frame-pointer") {
+            ctx.options.keep_frame_pointer = true;
+        } else if (arg == "--frame-report") {
+            ctx.options.frame_report = true;
+        } else if (arg == "--profile-generate") {
+            ctx.options.profile_generate = DEFAULT_PROFILE_NAME;
+        } else if (arg.rfind("--profile-generate=", 0) == 0) {
+            ctx.options.profile_generate = arg.substr(19);
+        } else if (arg.rfind("--profile-use=", 0) == 0) {
+            ctx.options.profile_use = arg.substr(14);
+        } else if (arg == "-O0" || arg == "-O1" || arg == "-O2" || arg == "-O3") {
+            ctx.options.optimization_level = arg[2] - '0';
         } else if (arg == "--version" || arg == "-v") {
             std::cout << "Cappuccino Compiler v" << VERSION_STRING << std::endl;
             std::cout << PROJECT_DESCRIPTION << std::endl;
@@ -53,6 +115,20 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    bool profiling = !ctx.options.profile_generate.empty() || !ctx.options.profile_use.empty();
+    if (profiling && ctx.options.optimization_level == 0) {
+        std::cerr << "Error: profile-guided optimization requires -O1 or higher." << std::endl;
+        return 1;
+    }
+    if (!ctx.options.profile_generate.empty() && !ctx.options.profile_use.empty()) {
+        std::cerr << "Error: --profile-generate and --profile-use cannot be combined." << std::endl;
+        return 1;
+    }
+    if (!ctx.options.profile_use.empty() && !ctx.profile.read(ctx.options.profile_use)) {
+        std::cerr << "Error: cannot read profile '" << ctx.options.profile_use << "'." << std::endl;
+        return 1;
+    }
+
     std::string source_path = ctx.options.source_files[0];
 
     if (source_path.length() < 5 || source_path.substr(source_path.length() - 5) != ".capp") {
@@ -100,14 +176,41 @@ int main(int argc, char* argv[]) {
             return 0;
     }
 
+    SemanticAnalyzer analyzer(ctx);
+    SemanticInfo sema = analyzer.analyze(prog);
+
+    if (ctx.de.hasErrors()) {
+        ctx.de.printDiagnostics();
+        return 1;
+    }
+
     try {
         std::ofstream asmFile("output.s");
         if (!asmFile.is_open()) {
             std::cerr << "Failed to write assembly file." << std::endl;
             return 1;
         }
-        CodeGen generator(prog, asmFile, ctx);
-        generator.generate();
+
+        std::unique_ptr<Module> mod;
+        if (ctx.options.optimization_level > 0 || ctx.options.dump_ir) {
+            IRGen irgen(sema, ctx);
+            mod = irgen.generate(prog);
+
+            PassManager pm(ctx);
+            pm.addStandardPipeline(ctx.options.optimization_level);
+            pm.run(*mod);
+
+            if (ctx.options.dump_ir)
+                print_module(std::cout, *mod);
+        }
+
+        if (ctx.options.optimization_level > 0) {
+            Backend backend(*mod, asmFile, ctx);
+            backend.generate();
+        } else {
+            CodeGen generator(prog, sema, asmFile, ctx);
+            generator.generate();
+        }
         asmFile.close();
     } catch (const std::exception& e) {
         std::cerr << "\n\033[1;31m[Internal Compiler Bug]\033[0m: " << e.what() << "\n";
@@ -130,7 +233,7 @@ int main(int argc, char* argv[]) {
     std::cout << "Linking..." << std::endl;
     std::string ld_cmd = "ld -o " + ctx.options.output_name +
                          " output.o -lSystem -syslibroot `xcrun -sdk macosx "
-                         "--show-sdk-path` -e  _main -arch arm64";
+                         "--show-sdk-path` -e  _main -arch arm64 -dead_strip";
     int ld_ret = std::system(ld_cmd.c_str());
     if (ld_ret != 0) {
         std::cerr << "Linker failed. Check linker errors above." << std::endl;
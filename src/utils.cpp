@@ -4,8 +4,13 @@
 
 #include "utils.h"
 
+#include "capp_stdlib.h"
+
+#include <algorithm>
+#include <cctype>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <optional>
 #include <sstream>
 
@@ -47,8 +52,108 @@ std::string mangle_method(const std::string& class_name, const std::string& meth
            std::to_string(method_name.length()) + method_name + "E";
 }
 
+std::string symbol_name(const std::string& function_name) {
+    if (function_name == "sin_f" || function_name == "cos_f" || function_name == "tan_f")
+        return "_" + function_name.substr(0, function_name.size() - 2);
+    return "_" + function_name;
+}
+
 std::string to_unicode(uint32_t codepoint) {
     std::ostringstream oss;
     oss << std::uppercase << std::hex << std::setw(4) << std::setfill('0') << codepoint;
     return oss.str();
 }
+
+// Bytes the assembler makes of the first `length` characters of `text`, if they end on
+// the boundary of an escape. Numeric escapes are not sized, they stop the merge.
+static std::optional<size_t> escaped_byte_count(const std::string& text, size_t length) {
+    size_t bytes = 0;
+    size_t i = 0;
+    while (i < length) {
+        if (text[i] == '\\') {
+            if (i + 1 >= text.size() || std::isdigit(static_cast<unsigned char>(text[i + 1])) ||
+                text[i + 1] == 'x')
+                return std::nullopt;
+            i += 2;
+        } else {
+            i++;
+        }
+        bytes++;
+    }
+    if (i != length)
+        return std::nullopt;
+    return bytes;
+}
+
+void emit_cstrings(std::ostream& out,
+                   const std::vector<std::pair<std::string, std::string>>& literals) {
+    if (literals.empty())
+        return;
+
+    // Texts that end another one sort right before it once reversed. Walking them
+    // backwards, the next text is either unrelated or already knows where its bytes are.
+    std::map<std::string, std::string> label_of; // Reversed text -> first label
+    for (const auto& [label, text] : literals)
+        label_of.try_emplace(std::string(text.rbegin(), text.rend()), label);
+    std::map<std::string, std::pair<std::string, size_t>> placed; // Label -> (owner, offset)
+    std::map<std::string, std::string> owner_text;
+    for (auto it = label_of.rbegin(); it != label_of.rend(); ++it) {
+        const std::string& label = it->second;
+        std::string text(it->first.rbegin(), it->first.rend());
+        placed[label] = {label, 0};
+        owner_text[label] = text;
+        if (it == label_of.rbegin())
+            continue;
+        auto next = std::prev(it);
+        if (next->first.compare(0, it->first.size(), it->first) != 0)
+            continue;
+        const std::string& owner = placed.at(next->second).first;
+        const std::string& longer = owner_text.at(owner);
+        if (auto bytes = escaped_byte_count(longer, longer.size() - text.size()))
+            placed[label] = {owner, *bytes};
+    }
+
+    out << "\n.section __TEXT,__cstring,cstring_literals\n";
+    for (const auto& [label, text] : literals) {
+        if (label_of.at(std::string(text.rbegin(), text.rend())) != label ||
+            placed.at(label).first != label)
+            continue;
+        out << label << ":\n";
+        out << "\t.asciz \"" << text << "\"\n";
+    }
+    // Repeated and tail-merged literals are aliases of bytes emitted above
+    for (const auto& [label, text] : literals) {
+        const std::string& first = label_of.at(std::string(text.rbegin(), text.rend()));
+        auto [owner, offset] = placed.at(first);
+        if (owner == label)
+            continue;
+        out << label << " = " << owner;
+        if (offset)
+            out << " + " << offset;
+        out << "\n";
+    }
+}
+
+void emit_stdlib(std::ostream& out, const std::set<std::string>& called) {
+    std::vector<const StdlibRoutine*> used;
+    for (const StdlibRoutine& routine : STDLIB_ROUTINES) {
+        if (called.count(routine.symbol))
+            used.push_back(&routine);
+    }
+    if (used.empty())
+        return;
+
+    out << "\n.section __TEXT,__text,regular,pure_instructions\n";
+    for (const StdlibRoutine* routine : used)
+        out << routine->code;
+
+    bool header = false;
+    for (const StdlibRoutine* routine : used) {
+        if (routine->format.empty())
+            continue;
+        if (!header)
+            out << "\n.section __TEXT,__cstring,cstring_literals\n";
+        header = true;
+        out << routine->format << "\n";
+    }
+}